@@ -0,0 +1,2 @@
+gcc bench/microbench.c (Get-ChildItem src/*.c -Exclude main.c).FullName -o build/microbench.exe -I./include -L./lib -lraylib -lopengl32 -lgdi32 -lwinmm -lpthread -lws2_32 -O2
+./build/microbench.exe $args
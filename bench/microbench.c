@@ -0,0 +1,549 @@
+#include "../include/cpukernels.h"
+#include "../include/cputracer.h"
+#include "../include/hdrwriter.h"
+#include "../include/helpers.h"
+#include "../include/platform.h"
+#include "../include/pngwriter.h"
+#include "../include/rng.h"
+#include "raylib.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "raymath.h"
+
+/*
+ * Standalone timings of the hot pieces, away from the renderers around them.
+ * Every benchmark is sized once so a batch takes MICROBENCH_BATCH_SECONDS,
+ * warmed up, then timed over --repetitions batches. Results are the median
+ * time per operation and its median absolute deviation, which one slow batch
+ * from the scheduler cannot drag around like a mean.
+ *
+ * Built on its own from bench.ps1, linked against everything in src but main.c.
+ */
+
+#define MICROBENCH_SPHERES 512
+#define MICROBENCH_RAYS 4096
+#define MICROBENCH_IMAGE_WIDTH 640
+#define MICROBENCH_IMAGE_HEIGHT 360
+#define MICROBENCH_WARMUP_SECONDS 0.2
+#define MICROBENCH_BATCH_SECONDS 0.01
+#define MICROBENCH_MAX_REPETITIONS 1001
+#define MICROBENCH_MAX_RESULTS 64
+#define MICROBENCH_NOISE_MADS 3.0       // Slowdowns within this many of the run's MADs are noise, whatever the threshold
+
+typedef struct BenchFixture {
+    char *toml;
+    size_t tomlLength;
+    toml_result_t parsed;
+    char names[MICROBENCH_SPHERES][16];
+
+    Scene scene;
+    CpuScene cpuScene;
+
+    Ray rays[MICROBENCH_RAYS];
+    HitRecord hits[MICROBENCH_RAYS];
+    Rng rng;
+
+    unsigned char *rgba;
+    float *rgb;
+
+    float sink;     // Read after every run so the work cannot be optimised away
+} BenchFixture;
+
+typedef void (*BenchFunction)(BenchFixture *fixture, long long iterations);
+
+typedef struct BenchResult {
+    char name[64];
+    double medianNs;
+    double madNs;
+    long long iterations;   // Operations per batch
+} BenchResult;
+
+typedef struct MicrobenchOptions {
+    const char *savePath;
+    const char *baselinePath;
+    const char *filter;
+    float threshold;        // Percent slower than the baseline that fails the run
+    int repetitions;
+} MicrobenchOptions;
+
+static float RandomRange(Rng *rng, float min, float max) {
+    return min + RngFloat(rng) * (max - min);
+}
+
+// A scene file written the way configs/ are, one material per sphere
+static void BuildSceneToml(BenchFixture *fixture) {
+    size_t capacity = MICROBENCH_SPHERES * 256 + 64 + MICROBENCH_SPHERES * 20;
+    char *text = malloc(capacity);
+    size_t length = 0;
+
+    if (!text) {
+        error("Out of memory building benchmark scene.");
+    }
+
+    Rng rng = InitRng(1, 0, 0);
+
+    length += snprintf(text + length, capacity - length, "[data]\nobjects = [");
+
+    for (int i = 0; i < MICROBENCH_SPHERES; i++) {
+        snprintf(fixture->names[i], sizeof(fixture->names[i]), "s%d", i);
+        length += snprintf(text + length, capacity - length, "%s\"%s\"", i > 0 ? ", " : "", fixture->names[i]);
+    }
+
+    length += snprintf(text + length, capacity - length, "]\n");
+
+    for (int i = 0; i < MICROBENCH_SPHERES; i++) {
+        length += snprintf(text + length, capacity - length,
+            "\n[s%d]\nposition = [%.3f, %.3f, %.3f]\nradius = %.3f\nmaterial = \"m%d\"\n"
+            "\n[m%d]\ntype = %d\nalbedo = [%.3f, %.3f, %.3f]\nroughness = %.3f\nior = %.3f\n",
+            i, RandomRange(&rng, -20.0f, 20.0f), RandomRange(&rng, -1.0f, 4.0f), RandomRange(&rng, -40.0f, -2.0f),
+            RandomRange(&rng, 0.2f, 1.0f), i,
+            i, i % 3, RngFloat(&rng), RngFloat(&rng), RngFloat(&rng), RandomRange(&rng, 0.0f, 0.5f), 1.5f);
+    }
+
+    fixture->toml = text;
+    fixture->tomlLength = length;
+}
+
+static BenchFixture *CreateFixture(void) {
+    BenchFixture *fixture = calloc(1, sizeof(BenchFixture));
+    if (!fixture) {
+        error("Out of memory allocating benchmark fixture.");
+    }
+
+    BuildSceneToml(fixture);
+
+    fixture->parsed = toml_parse(fixture->toml, (int)fixture->tomlLength);
+    if (!fixture->parsed.ok) {
+        error("Benchmark scene failed to parse.");
+    }
+
+    fixture->scene = ParseSceneText(fixture->toml, fixture->tomlLength);
+    fixture->cpuScene = BuildCpuScene(fixture->scene);
+
+    // Rays from around the camera into the field of spheres, and hits on every material type
+    Rng rng = InitRng(2, 0, 0);
+
+    for (int i = 0; i < MICROBENCH_RAYS; i++) {
+        Vector3 direction = { RandomRange(&rng, -0.5f, 0.5f), RandomRange(&rng, -0.3f, 0.3f), -1.0f };
+        fixture->rays[i] = (Ray){ { 0.0f, 0.0f, 2.0f }, direction };
+
+        Vector3 normal = Vector3Normalize((Vector3){ RandomRange(&rng, -1.0f, 1.0f), 1.0f, RandomRange(&rng, -1.0f, 1.0f) });
+
+        fixture->hits[i] = (HitRecord){
+            .pos = { 0.0f, -0.5f, -1.0f },
+            .normal = normal,
+            .material = fixture->scene.objects[i % MICROBENCH_SPHERES].material,
+            .t = 1.0f,
+            .frontFace = true,
+            .object = i % MICROBENCH_SPHERES
+        };
+    }
+
+    fixture->rng = InitRng(3, 0, 0);
+
+    // A smooth gradient with noise on top, closer to a render than random bytes
+    size_t pixelCount = (size_t)MICROBENCH_IMAGE_WIDTH * MICROBENCH_IMAGE_HEIGHT;
+    fixture->rgba = malloc(pixelCount * 4);
+    fixture->rgb = malloc(pixelCount * 3 * sizeof(float));
+
+    if (!fixture->rgba || !fixture->rgb) {
+        error("Out of memory allocating benchmark image.");
+    }
+
+    for (size_t i = 0; i < pixelCount; i++) {
+        float x = (float)(i % MICROBENCH_IMAGE_WIDTH) / MICROBENCH_IMAGE_WIDTH;
+        float y = (float)(i / MICROBENCH_IMAGE_WIDTH) / MICROBENCH_IMAGE_HEIGHT;
+        float values[3] = { x, y, 0.5f * (x + y) };
+
+        for (int c = 0; c < 3; c++) {
+            float value = values[c] + RandomRange(&rng, -0.05f, 0.05f);
+
+            fixture->rgb[i * 3 + c] = value;
+            fixture->rgba[i * 4 + c] = GammaByte(value);
+        }
+
+        fixture->rgba[i * 4 + 3] = 255;
+    }
+
+    return fixture;
+}
+
+static void FreeFixture(BenchFixture *fixture) {
+    toml_free(fixture->parsed);
+    free(fixture->toml);
+    CpuSceneFree(&fixture->cpuScene);
+    SceneFree(&fixture->scene);
+    free(fixture->rgba);
+    free(fixture->rgb);
+    free(fixture);
+}
+
+static void BenchTomlParse(BenchFixture *fixture, long long iterations) {
+    for (long long i = 0; i < iterations; i++) {
+        toml_result_t result = toml_parse(fixture->toml, (int)fixture->tomlLength);
+
+        fixture->sink += result.ok;
+        toml_free(result);
+    }
+}
+
+// One operation is a single object and its material
+static void BenchObjectParams(BenchFixture *fixture, long long iterations) {
+    for (long long i = 0; i < iterations; i++) {
+        Sphere sphere = GetObjectParams(fixture->parsed, fixture->names[i % MICROBENCH_SPHERES]);
+        fixture->sink += sphere.radius;
+    }
+}
+
+static void BenchSpherePack(BenchFixture *fixture, long long iterations) {
+    for (long long i = 0; i < iterations; i++) {
+        float *data = PackSphereData(fixture->scene.objects, fixture->scene.objCount);
+
+        fixture->sink += data[i % (fixture->scene.objCount * DATA_WIDTH * 4)];
+        free(data);
+    }
+}
+
+static void BenchBvhBuild(BenchFixture *fixture, long long iterations) {
+    for (long long i = 0; i < iterations; i++) {
+        CpuScene scene = BuildCpuScene(fixture->scene);
+
+        fixture->sink += (float)scene.nodeCount;
+        CpuSceneFree(&scene);
+    }
+}
+
+// One operation is a ray against one leaf's worth of spheres, as the BVH walk calls it
+static void BenchNearestSphere(BenchFixture *fixture, long long iterations) {
+    const SphereLanes *lanes = &fixture->cpuScene.lanes;
+    int leaves = MICROBENCH_SPHERES / BVH_LEAF_SIZE;
+
+    for (long long i = 0; i < iterations; i++) {
+        float t;
+        int hit = cpuKernels.nearestSphere(lanes, (int)(i % leaves) * BVH_LEAF_SIZE, BVH_LEAF_SIZE,
+            fixture->rays[i % MICROBENCH_RAYS], 0.0001f, POS_INFINITY, &t);
+
+        fixture->sink += (float)hit;
+    }
+}
+
+static void BenchAnySphere(BenchFixture *fixture, long long iterations) {
+    const SphereLanes *lanes = &fixture->cpuScene.lanes;
+    int leaves = MICROBENCH_SPHERES / BVH_LEAF_SIZE;
+
+    for (long long i = 0; i < iterations; i++) {
+        bool hit = cpuKernels.anySphere(lanes, (int)(i % leaves) * BVH_LEAF_SIZE, BVH_LEAF_SIZE,
+            fixture->rays[i % MICROBENCH_RAYS], 0.0001f, POS_INFINITY);
+
+        fixture->sink += hit;
+    }
+}
+
+static void BenchScatter(BenchFixture *fixture, long long iterations, int type) {
+    for (long long i = 0; i < iterations; i++) {
+        int index = (int)(i % MICROBENCH_RAYS);
+        HitRecord rec = fixture->hits[index];
+        rec.material.type = type;
+
+        Ray scattered;
+        Vector3 attenuation;
+
+        if (Scatter(rec.material, fixture->rays[index], rec, &fixture->rng, &attenuation, &scattered)) {
+            fixture->sink += scattered.direction.x;
+        }
+    }
+}
+
+static void BenchScatterLambertian(BenchFixture *fixture, long long iterations) {
+    BenchScatter(fixture, iterations, LAMBERTIAN);
+}
+
+static void BenchScatterMetal(BenchFixture *fixture, long long iterations) {
+    BenchScatter(fixture, iterations, METAL);
+}
+
+static void BenchScatterDielectric(BenchFixture *fixture, long long iterations) {
+    BenchScatter(fixture, iterations, DIELECTRIC);
+}
+
+// Encoders on one thread so the numbers do not depend on the core count, file writes included
+static void BenchEncodePng(BenchFixture *fixture, long long iterations) {
+    for (long long i = 0; i < iterations; i++) {
+        if (!WritePng("microbench.png", fixture->rgba, MICROBENCH_IMAGE_WIDTH, MICROBENCH_IMAGE_HEIGHT, false, 1)) {
+            error("Failed to write benchmark PNG.");
+        }
+    }
+}
+
+static void BenchEncodeExr(BenchFixture *fixture, long long iterations) {
+    HdrImage image = { fixture->rgb, MICROBENCH_IMAGE_WIDTH, MICROBENCH_IMAGE_HEIGHT, 3, false };
+
+    for (long long i = 0; i < iterations; i++) {
+        if (!WriteExr("microbench.exr", image, EXR_COMPRESSION_ZIP, 1)) {
+            error("Failed to write benchmark EXR.");
+        }
+    }
+}
+
+static int CompareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double Median(double *values, int count) {
+    qsort(values, count, sizeof(double), CompareDoubles);
+
+    return count % 2 ? values[count / 2] : 0.5 * (values[count / 2 - 1] + values[count / 2]);
+}
+
+static BenchResult RunBenchmark(const char *name, BenchFunction function, BenchFixture *fixture, int repetitions) {
+    BenchResult result = { .iterations = 1 };
+    snprintf(result.name, sizeof(result.name), "%s", name);
+
+    // Double the batch until it is long enough to time, which also starts the warm up
+    double start = Now();
+
+    for (;;) {
+        double batchStart = Now();
+        function(fixture, result.iterations);
+
+        if (Now() - batchStart >= MICROBENCH_BATCH_SECONDS) break;
+        result.iterations *= 2;
+    }
+
+    while (Now() - start < MICROBENCH_WARMUP_SECONDS) {
+        function(fixture, result.iterations);
+    }
+
+    double samples[MICROBENCH_MAX_REPETITIONS];
+
+    for (int i = 0; i < repetitions; i++) {
+        double batchStart = Now();
+        function(fixture, result.iterations);
+        samples[i] = (Now() - batchStart) * 1e9 / result.iterations;
+    }
+
+    result.medianNs = Median(samples, repetitions);
+
+    for (int i = 0; i < repetitions; i++) {
+        samples[i] = fabs(samples[i] - result.medianNs);
+    }
+
+    result.madNs = Median(samples, repetitions);
+
+    return result;
+}
+
+static bool SaveResults(const char *path, const BenchResult *results, int count) {
+    FILE *file = fopen(path, "w");
+    if (!file) return false;
+
+    fprintf(file, "{\n  \"kernels\": \"%s\",\n  \"benchmarks\": [\n", cpuKernels.name);
+
+    for (int i = 0; i < count; i++) {
+        fprintf(file, "    {\"name\": \"%s\", \"median_ns\": %.3f, \"mad_ns\": %.3f, \"iterations\": %lld}%s\n",
+            results[i].name, results[i].medianNs, results[i].madNs, results[i].iterations, i + 1 < count ? "," : "");
+    }
+
+    fprintf(file, "  ]\n}\n");
+
+    return fclose(file) == 0;
+}
+
+// Reads the files SaveResults writes, one benchmark per line
+static int LoadResults(const char *path, BenchResult *results, int maxResults) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        error("Failed to open baseline JSON.");
+    }
+
+    char line[512];
+    int count = 0;
+
+    while (count < maxResults && fgets(line, sizeof(line), file)) {
+        BenchResult *result = &results[count];
+
+        if (sscanf(line, " {\"name\": \"%63[^\"]\", \"median_ns\": %lf, \"mad_ns\": %lf, \"iterations\": %lld",
+            result->name, &result->medianNs, &result->madNs, &result->iterations) == 4) {
+            count++;
+        }
+    }
+
+    fclose(file);
+    return count;
+}
+
+// Returns the number of regressions
+static int CompareResults(const BenchResult *results, int count, const BenchResult *baseline, int baselineCount, float threshold) {
+    int regressions = 0;
+
+    printf("\n%-28s %12s %12s %9s  %s\n", "benchmark", "baseline ns", "ns/op", "change", "status");
+
+    for (int i = 0; i < count; i++) {
+        const BenchResult *base = NULL;
+
+        for (int j = 0; j < baselineCount; j++) {
+            if (strcmp(baseline[j].name, results[i].name) == 0) base = &baseline[j];
+        }
+
+        if (!base) {
+            printf("%-28s %12s %12.1f %9s  new\n", results[i].name, "-", results[i].medianNs, "-");
+            continue;
+        }
+
+        double change = (results[i].medianNs - base->medianNs) / base->medianNs * 100.0;
+        double noise = MICROBENCH_NOISE_MADS * fmax(results[i].madNs, base->madNs);
+        bool regressed = change > threshold && results[i].medianNs - base->medianNs > noise;
+
+        printf("%-28s %12.1f %12.1f %+8.1f%%  %s\n", results[i].name, base->medianNs, results[i].medianNs, change,
+            regressed ? "REGRESSED" : change < -threshold ? "faster" : "ok");
+
+        regressions += regressed;
+    }
+
+    return regressions;
+}
+
+static MicrobenchOptions ParseMicrobenchArgs(int argc, char **argv) {
+    MicrobenchOptions options = {
+        .savePath = NULL,
+        .baselinePath = NULL,
+        .filter = NULL,
+        .threshold = 10.0f,
+        .repetitions = 21
+    };
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+
+        if (i + 1 >= argc) {
+            char errMsg[128];
+            snprintf(errMsg, sizeof(errMsg), "Unknown or incomplete argument \"%s\"", arg);
+
+            error(errMsg);
+        }
+
+        const char *value = argv[++i];
+
+        if (strcmp(arg, "--save") == 0) {
+            options.savePath = value;
+        } else if (strcmp(arg, "--baseline") == 0) {
+            options.baselinePath = value;
+        } else if (strcmp(arg, "--filter") == 0) {
+            options.filter = value;
+        } else if (strcmp(arg, "--threshold") == 0) {
+            options.threshold = strtof(value, NULL);
+
+            if (options.threshold <= 0.0f) error("--threshold must be a positive percentage.");
+        } else if (strcmp(arg, "--repetitions") == 0) {
+            options.repetitions = atoi(value);
+
+            if (options.repetitions < 3 || options.repetitions > MICROBENCH_MAX_REPETITIONS) {
+                error("--repetitions must be between 3 and 1001.");
+            }
+        } else {
+            char errMsg[128];
+            snprintf(errMsg, sizeof(errMsg), "Unknown argument \"%s\"", arg);
+
+            error(errMsg);
+        }
+    }
+
+    return options;
+}
+
+typedef struct Benchmark {
+    const char *name;
+    BenchFunction function;
+    bool perIsa;    // Run once for every kernel set the CPU supports
+} Benchmark;
+
+static const Benchmark benchmarks[] = {
+    { "toml_parse", BenchTomlParse, false },
+    { "object_params", BenchObjectParams, false },
+    { "sphere_pack", BenchSpherePack, false },
+    { "bvh_build", BenchBvhBuild, false },
+    { "nearest_sphere", BenchNearestSphere, true },
+    { "any_sphere", BenchAnySphere, true },
+    { "scatter_lambertian", BenchScatterLambertian, false },
+    { "scatter_metal", BenchScatterMetal, false },
+    { "scatter_dielectric", BenchScatterDielectric, false },
+    { "encode_png", BenchEncodePng, false },
+    { "encode_exr_zip", BenchEncodeExr, false }
+};
+
+int main(int argc, char **argv) {
+    MicrobenchOptions options = ParseMicrobenchArgs(argc, argv);
+
+    CpuIsa best = DetectCpuIsa();
+    SelectCpuKernels(best);
+
+    BenchFixture *fixture = CreateFixture();
+    BenchResult results[MICROBENCH_MAX_RESULTS];
+    int count = 0;
+
+    printf("Microbenchmarks, %d spheres, %dx%d images, %d repetitions, %s kernels\n",
+        MICROBENCH_SPHERES, MICROBENCH_IMAGE_WIDTH, MICROBENCH_IMAGE_HEIGHT, options.repetitions, cpuKernels.name);
+    printf("%-28s %12s %10s %8s %12s\n", "benchmark", "ns/op", "MAD ns", "MAD %", "ops/batch");
+
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+        const Benchmark *benchmark = &benchmarks[i];
+
+        for (int isa = benchmark->perIsa ? CPU_ISA_SCALAR : (int)best; isa <= (int)best; isa++) {
+            SelectCpuKernels((CpuIsa)isa);
+
+            // Builds without a kernel set keep the previous one, which was already measured
+            if ((int)cpuKernels.isa != isa) continue;
+
+            char name[64];
+            if (benchmark->perIsa) {
+                snprintf(name, sizeof(name), "%s/%s", benchmark->name, cpuKernels.name);
+            } else {
+                snprintf(name, sizeof(name), "%s", benchmark->name);
+            }
+
+            if (options.filter && !strstr(name, options.filter)) continue;
+            if (count == MICROBENCH_MAX_RESULTS) error("Too many benchmarks.");
+
+            BenchResult *result = &results[count++];
+            *result = RunBenchmark(name, benchmark->function, fixture, options.repetitions);
+
+            printf("%-28s %12.1f %10.2f %7.2f%% %12lld\n",
+                result->name, result->medianNs, result->madNs, result->madNs / result->medianNs * 100.0, result->iterations);
+        }
+
+        SelectCpuKernels(best);
+    }
+
+    remove("microbench.png");
+    remove("microbench.exr");
+
+    // Printed so the optimiser has to keep every result
+    printf("(checksum %g)\n", fixture->sink);
+    FreeFixture(fixture);
+
+    if (options.savePath) {
+        if (!SaveResults(options.savePath, results, count)) {
+            error("Failed to write benchmark JSON.");
+        }
+
+        printf("Saved %s\n", options.savePath);
+    }
+
+    if (options.baselinePath) {
+        BenchResult baseline[MICROBENCH_MAX_RESULTS];
+        int baselineCount = LoadResults(options.baselinePath, baseline, MICROBENCH_MAX_RESULTS);
+
+        int regressions = CompareResults(results, count, baseline, baselineCount, options.threshold);
+
+        if (regressions > 0) {
+            printf("%d benchmark(s) more than %.1f%% slower than %s\n", regressions, options.threshold, options.baselinePath);
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,40 @@
+#ifndef ACCUMBUFFER_H
+#define ACCUMBUFFER_H
+
+#include "raylib.h"
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define ACCUM_CHANNELS 4    // r, g, b, sample weight
+
+/*
+ * Float accumulation store that any thread can splat into. Adds go straight
+ * to the shared pixels with a compare-and-swap, or into a per-thread shard
+ * that AccumBufferReduce() folds in while nobody is splatting.
+ */
+typedef struct AccumBuffer {
+    int width;
+    int height;
+
+    atomic_uint *pixels;    // Float bit patterns, ACCUM_CHANNELS per pixel
+
+    int shardCount;
+    float **shards;         // Plain per-thread buffers, NULL without shards
+} AccumBuffer;
+
+AccumBuffer AllocAccumBuffer(int width, int height, int shardCount);
+void AccumBufferFree(AccumBuffer *buffer);
+void AccumBufferClear(AccumBuffer *buffer);
+void AccumBufferClearRange(AccumBuffer *buffer, size_t firstPixel, size_t pixelCount);
+
+void AccumBufferAdd(AccumBuffer *buffer, int index, Vector3 colour, float weight);
+void AccumBufferAddShard(AccumBuffer *buffer, int shard, int index, Vector3 colour, float weight);
+void AccumBufferReduce(AccumBuffer *buffer);
+
+Vector4 AccumBufferGet(const AccumBuffer *buffer, int index);
+void AccumBufferResolve(const AccumBuffer *buffer, unsigned char *rgba);
+void AccumBufferResolveLinear(const AccumBuffer *buffer, float *rgba);
+
+void BenchmarkAccumBuffer(void);
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include "raylib.h"
+#include "../include/helpers.h"
+
+// Frames covered by the scene's keyframes, 0 when it has none
+int AnimationFrameCount(const Scene *scene);
+
+// Linear interpolation between keyframes, held at either end, the fallback without keyframes
+Camera CameraAtFrame(const Scene *scene, int frame, Camera fallback);
+
+// Renders every frame to options.animationOutput, sharing one scene and BVH between frames
+void RenderAnimation(Scene scene, Camera camera, CliOptions options);
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "../include/helpers.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define CHECKPOINT_MAGIC "RTCKPT01"
+#define CHECKPOINT_VERSION 1
+
+// Everything the GPU viewer needs to carry on accumulating where it stopped
+typedef struct Checkpoint {
+    uint64_t sceneHash;
+    unsigned int seed;
+    int width;
+    int height;
+
+    int frame;
+    int accumulatedSamples;
+    float position[3];
+    float focalLength;
+
+    int aaEnabled;
+    int denoiseEnabled;
+    int denoiseIterations;
+
+    float *pixels;      // Running mean as RGBA32F, rows bottom up like the texture
+} Checkpoint;
+
+/*
+ * Saves run on their own thread from a private copy of the pixels, so a
+ * checkpoint costs the render loop one memcpy. A save that comes up while
+ * the previous one is still writing is skipped.
+ */
+typedef struct CheckpointWriter {
+    const char *path;
+    Checkpoint checkpoint;
+    size_t capacity;        // Floats allocated for checkpoint.pixels
+
+    pthread_t thread;
+    bool started;
+    atomic_bool busy;
+} CheckpointWriter;
+
+uint64_t SceneHash(const Scene *scene);
+
+bool WriteCheckpoint(const char *path, const Checkpoint *checkpoint);  // Temporary file, sync, then rename over the old one
+bool ReadCheckpoint(const char *path, Checkpoint *checkpoint);         // False when missing or damaged
+void CheckpointFree(Checkpoint *checkpoint);
+
+bool SaveCheckpointAsync(CheckpointWriter *writer, const Checkpoint *checkpoint);
+void CheckpointWriterFinish(CheckpointWriter *writer);      // Waits for the save in progress, frees the copy
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef CONVERGENCE_H
+#define CONVERGENCE_H
+
+#include "raylib.h"
+#include "../include/helpers.h"
+
+#define CONVERGENCE_CACHE_VERSION 1     // Part of the reference's key, bump it when the CPU tracer's output changes
+#define CONVERGENCE_FIRST_SECONDS 0.25  // First wall-clock checkpoint, doubled until the run reaches --spp
+#define CONVERGENCE_REL_EPSILON 0.01f   // Keeps relMSE finite on black reference pixels
+
+/*
+ * Error against time for the CPU tracer. A --reference-spp render of the scene
+ * is made once and cached under --cache-dir, then each sampler and estimator
+ * renders progressively up to --spp, stopping at every power of two samples
+ * and every doubling of wall-clock time from CONVERGENCE_FIRST_SECONDS to
+ * measure RMSE and relMSE, raw and after the A-trous filter. Workers are paused
+ * while an image is measured, so the clock only counts rendering. Rows go to a
+ * CSV file.
+ */
+void BenchmarkConvergence(Scene scene, Camera camera, CliOptions options);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef CPUKERNELS_H
+#define CPUKERNELS_H
+
+#include "../include/cputracer.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+#define CPU_KERNEL_MAX_LANES 16     // Padding behind SphereLanes, the widest vector
+
+typedef enum CpuIsa {
+    CPU_ISA_SCALAR,
+    CPU_ISA_SSE42,
+    CPU_ISA_AVX2,
+    CPU_ISA_AVX512
+} CpuIsa;
+
+/*
+ * Hot CPU loops built for several instruction sets, picked once at startup.
+ * Every path avoids FMA and approximate reciprocals, so they all produce the
+ * same bits as the scalar code and golden images hold across machines.
+ */
+typedef struct CpuKernels {
+    CpuIsa isa;
+    const char *name;
+    int lanes;      // Floats per vector
+
+    // Closest sphere in [first, first + count) with a root in (tMin, tMax), -1 on a miss
+    int (*nearestSphere)(const SphereLanes *lanes, int first, int count, Ray ray, float tMin, float tMax, float *t);
+
+    // Shadow test over the same range, true at the first blocker
+    bool (*anySphere)(const SphereLanes *lanes, int first, int count, Ray ray, float tMin, float tMax);
+
+    // Divides summed rgb by the weight and applies the sqrt gamma, rgbw in, RGBA8 out
+    void (*tonemap)(const float *rgbw, size_t pixelCount, unsigned char *rgba);
+
+    // Two rows of RGBA8 to BT.601 limited range luma for each and 2x2 averaged chroma, any width
+    void (*rgbaToYuv420)(const unsigned char *row0, const unsigned char *row1, int width,
+        unsigned char *y0, unsigned char *y1, unsigned char *u, unsigned char *v);
+} CpuKernels;
+
+extern CpuKernels cpuKernels;
+
+CpuIsa DetectCpuIsa(void);
+CpuIsa CpuIsaFromName(const char *name);
+void SelectCpuKernels(CpuIsa isa);
+
+#endif
@@ -0,0 +1,131 @@
+#ifndef CPUTRACER_H
+#define CPUTRACER_H
+
+#include "raylib.h"
+#include "../include/hdrwriter.h"
+#include "../include/helpers.h"
+#include "../include/rng.h"
+#include <stddef.h>
+
+// Material types and the miss distance, the same values as raytracing.frag
+#define LAMBERTIAN 0
+#define METAL 1
+#define DIELECTRIC 2
+#define EMISSIVE 3
+
+#define POS_INFINITY 100000000.0f
+
+#define CPU_MAX_DEPTH 5
+#define BVH_LEAF_SIZE 16    // One AVX-512 vector, fixed so every kernel path walks the same BVH
+
+typedef struct BvhNode {
+    Vector3 min;
+    Vector3 max;
+    int first;      // First child for inner nodes, first sphere for leaves
+    int count;      // Number of spheres, 0 for inner nodes
+} BvhNode;
+
+// Sphere centers and squared radii split by component for the SIMD kernels, in BVH order
+typedef struct SphereLanes {
+    float *x;
+    float *y;
+    float *z;
+    float *radiusSq;
+} SphereLanes;
+
+typedef struct CpuScene {
+    Sphere *spheres;    // Stored in BVH leaf order
+    size_t sphereCount;
+
+    SphereLanes lanes;
+
+    BvhNode *nodes;
+    int nodeCount;
+
+    int *lights;        // Emissive spheres, indexed in BVH order
+    int lightCount;
+    bool lightSampling; // Next event estimation with MIS, false leaves lights to the BSDF samples
+} CpuScene;
+
+typedef struct CpuCamera {
+    Vector3 position;
+    float focalLength;
+    int width;
+    int height;
+
+    Vector3 pixel00Loc;
+    Vector3 pixelDeltaU;
+    Vector3 pixelDeltaV;
+} CpuCamera;
+
+typedef struct HitRecord {
+    Vector3 pos;
+    Vector3 normal;
+    ShaderMaterial material;
+    float t;
+    bool frontFace;
+    int object;
+} HitRecord;
+
+// Radiance of one path plus the G-buffer guides of its first hit
+typedef struct PixelSample {
+    Vector3 colour;
+    Vector3 normal;
+    float depth;        // -1 when the primary ray escapes
+    Vector3 albedo;
+} PixelSample;
+
+#define RAY_STATS_MATERIALS 4  // Lambertian, metal, dielectric, emissive
+
+/*
+ * Work done tracing paths. Each thread counts into its own copy and the
+ * copies are merged once its share of the frame is done, so the hot loops
+ * never touch shared memory.
+ */
+typedef struct RayStats {
+    long long paths;
+    long long rays;             // Closest hit queries, one per bounce
+    long long shadowRays;       // Any hit queries from light sampling
+    long long nodesVisited;     // BVH nodes popped by either query
+    long long spheresTested;
+
+    long long depth[CPU_MAX_DEPTH + 1];     // Paths by the number of surfaces they hit
+    long long skyEnds;
+    long long materialEnds[RAY_STATS_MATERIALS];    // Paths ended by a light or an absorbed scatter, by the material hit
+    long long depthLimited;
+} RayStats;
+
+// Linear colour and guides for a whole frame, rows stored top to bottom
+typedef struct CpuFrame {
+    int width;
+    int height;
+
+    Vector3 *colour;
+    Vector3 *normal;
+    float *depth;
+    Vector3 *albedo;
+} CpuFrame;
+
+CpuScene BuildCpuScene(Scene scene);
+CpuScene CloneCpuScene(const CpuScene *scene);
+void CpuSceneFree(CpuScene *scene);
+
+CpuCamera InitCpuCamera(Vector3 position, float focalLength, int width, int height);
+bool Scatter(ShaderMaterial mat, Ray ray, HitRecord rec, Rng *rng, Vector3 *attenuation, Ray *scattered);    // False when the path is absorbed
+PixelSample TracePixel(const CpuScene *scene, const CpuCamera *camera, int x, int y, bool jitter, Rng *rng, RayStats *stats);
+
+void RayStatsMerge(RayStats *into, const RayStats *from);
+void PrintRayStats(const RayStats *stats, double seconds);
+
+CpuFrame AllocCpuFrame(int width, int height);
+void CpuFrameFree(CpuFrame *frame);
+unsigned char GammaByte(float linear);
+Image CpuFrameToImage(const CpuFrame *frame);
+bool ExportCpuFrame(const CpuFrame *frame, const char *path, ExrCompression compression, int threads);  // Linear float for .exr and .pfm
+
+// Stats may be NULL when nobody reads them
+void TraceFrame(const CpuScene *scene, const CpuCamera *camera, CpuFrame *frame, int originX, int originY, int samples, unsigned int seed, RayStats *stats);
+
+void RenderOffline(Scene scene, Camera camera, CliOptions options);
+
+#endif
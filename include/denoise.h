@@ -0,0 +1,23 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include "../include/cputracer.h"
+
+// Edge-stopping strengths shared by atrous.frag and the CPU filter
+#define ATROUS_COLOUR_PHI 0.5f
+#define ATROUS_NORMAL_PHI 64.0f
+#define ATROUS_DEPTH_PHI 0.1f
+#define ATROUS_ALBEDO_PHI 0.1f
+
+typedef struct AtrousParams {
+    int iterations;
+    float colourPhi;    // Halved every iteration
+    float normalPhi;
+    float depthPhi;     // Scaled by the step width
+    float albedoPhi;
+} AtrousParams;
+
+AtrousParams DefaultAtrousParams(int iterations);
+void AtrousFilter(CpuFrame *frame, AtrousParams params);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include "raylib.h"
+#include "../include/helpers.h"
+
+#define DIST_PROTOCOL_VERSION 1
+#define DIST_HEARTBEAT_MS 1000      // Workers report in this often even while a tile is still tracing
+#define DIST_TIMEOUT_MS 10000       // Silence after which a worker is dropped and its tiles requeued
+#define DIST_CONNECT_SECONDS 10     // Workers may start before the coordinator is listening
+
+// Offline render split into tiles across worker processes, merged and denoised here
+void RunCoordinator(Scene scene, Camera camera, CliOptions options);
+
+// Connects to a coordinator at "host:port", traces the tiles it is handed and exits when the job ends
+void RunWorker(CliOptions options);
+
+#endif
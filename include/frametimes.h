@@ -0,0 +1,64 @@
+#ifndef FRAMETIMES_H
+#define FRAMETIMES_H
+
+#include "raylib.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define FRAME_TIME_BUCKETS 1024
+#define FRAME_TIME_MIN_MS 0.01      // Log spaced buckets from here to FRAME_TIME_MAX_MS, each about 1.4% wide
+#define FRAME_TIME_MAX_MS 10000.0
+#define FRAME_TIME_QUERIES 4        // GPU timer queries in flight, a frame whose slot is still busy goes untimed
+
+typedef struct FrameTimeHistogram {
+    long long counts[FRAME_TIME_BUCKETS];
+    long long total;
+    double sum;
+    double max;
+} FrameTimeHistogram;
+
+typedef struct FrameTimeSample {
+    float cpuMs;
+    float gpuMs;    // -1 while the query is in flight, or when the frame was not timed
+    bool reset;     // Accumulation restarted this frame
+} FrameTimeSample;
+
+/*
+ * Every frame's CPU and GPU time. The CPU time is the wall time between
+ * presents, which is what a stutter looks like from the chair. The GPU time
+ * comes from a timer query around the frame's passes, read back a few frames
+ * later so it never stalls the pipeline. Both go into histograms for the
+ * overlay's percentiles, and every frame is kept for the dump on exit.
+ */
+typedef struct FrameTimes {
+    FrameTimeHistogram cpu;
+    FrameTimeHistogram gpu;
+
+    FrameTimeSample *samples;
+    long long sampleCount;
+    long long sampleCapacity;
+
+    double lastPresent;
+
+    bool gpuTimer;      // GL 3.3 timer queries are loaded
+    bool gpuActive;     // A query is open for the current frame
+    unsigned int queries[FRAME_TIME_QUERIES];
+    long long queryFrames[FRAME_TIME_QUERIES];  // Frame each query is timing, -1 when free
+    int nextQuery;
+} FrameTimes;
+
+FrameTimes *FrameTimesCreate(bool gpu);     // Needs the window's GL context when gpu is set
+void FrameTimesFinish(FrameTimes *times);   // Waits for the queries still in flight and deletes them, before the window closes
+void FrameTimesFree(FrameTimes *times);
+
+void FrameTimesBeginGpu(FrameTimes *times);
+void FrameTimesEndGpu(FrameTimes *times);
+void FrameTimesEndFrame(FrameTimes *times, bool reset);    // Once per frame, after the swap
+
+double FrameTimePercentile(const FrameTimeHistogram *histogram, double percentile);
+void DrawFrameTimes(const FrameTimes *times, int x, int y);
+
+// Raw samples to path as CSV, and exact percentiles to <path stem>_summary.csv
+bool FrameTimesWrite(FrameTimes *times, const char *path, const char *scenePath, int width, int height);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef GLEXT_H
+#define GLEXT_H
+
+#include <stdbool.h>
+
+// GL entry points rlgl does not wrap, fetched through the GLFW that raylib links in
+
+#ifdef _WIN32
+    #define GL_CALL __stdcall
+#else
+    #define GL_CALL
+#endif
+
+typedef void (*GlProc)(void);
+
+bool GlCoreContext(void);       // GL 3.3 or later, where buffer objects, fences and timer queries are core
+GlProc GlGetProc(const char *name);
+
+// Casts the generic pointer to the function pointer's own type, which C allows and type punning does not
+#define GL_LOAD(function, name) ((function) = (__typeof__(function))GlGetProc(name))
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef HDRWRITER_H
+#define HDRWRITER_H
+
+#include <stdbool.h>
+
+#define EXR_ZIP_LINES 16    // Scanlines per ZIP chunk, fixed by the format
+
+typedef enum ExrCompression {
+    EXR_COMPRESSION_NONE = 0,
+    EXR_COMPRESSION_ZIP = 3
+} ExrCompression;
+
+// Linear float pixels, 3 or 4 channels interleaved (alpha is dropped)
+typedef struct HdrImage {
+    const float *pixels;
+    int width;
+    int height;
+    int channels;
+    bool bottomUp;      // Rows stored bottom first, as GL reads them back
+} HdrImage;
+
+ExrCompression ExrCompressionFromName(const char *name);
+bool IsHdrPath(const char *path);   // .exr or .pfm
+
+bool WritePfm(const char *path, HdrImage image);
+bool WriteExr(const char *path, HdrImage image, ExrCompression compression, int threads);
+bool WriteHdrImage(const char *path, HdrImage image, ExrCompression compression, int threads);
+
+#endif
@@ -3,13 +3,20 @@
 
 #include "raylib.h"
 #include "../include/tomlc17.h"
+#include <setjmp.h>
 #include <stddef.h>
+#include <stdint.h>
+
+#define DATA_WIDTH 4    // Texels per sphere in the data texture
+#define SPHERE_WORDS 11 // Floats per sphere in PackSphereWords' layout
+#define MAX_OBJECTS 4   // Spheres raytracing.frag holds, the rest of the scene is CPU only
 
 typedef struct ShaderMaterial {
     int type;
     float albedo[3];
     float roughness;
     float ior;
+    float emission;     // Radiance scale for emissive materials, albedo is the light colour
 } ShaderMaterial;
 
 typedef struct Sphere {
@@ -18,39 +25,157 @@ typedef struct Sphere {
     ShaderMaterial material;
 } Sphere;
 
+typedef struct CameraKeyframe {
+    int frame;
+    float position[3];
+    float focalLength;
+} CameraKeyframe;
+
 typedef struct Scene {
     Sphere *objects;
     size_t objCount;
+
+    int *lights;        // Indices of the emissive objects
+    size_t lightCount;
+
+    CameraKeyframe *keyframes;  // Sorted by frame, empty without a [camera] section
+    size_t keyframeCount;
 } Scene;
 
+// Per pixel work the viewers can show instead of radiance, cycled with the '3' key
+typedef enum HeatmapMode {
+    HEATMAP_OFF,
+    HEATMAP_TESTS,      // Sphere intersection tests, shadow rays included
+    HEATMAP_STEPS,      // BVH nodes visited on the CPU, ray queries over the object list on the GPU
+    HEATMAP_BOUNCES,    // Surfaces hit
+    HEATMAP_MODES
+} HeatmapMode;
+
 typedef struct RenderSettings {
     int aaEnabled;
+    int denoiseEnabled;
+    int heatmap;        // HeatmapMode
+    int denoiseIterations;
     int width;
     int height;
 } RenderSettings;
 
+typedef struct CliOptions {
+    const char *programPath;    // argv[0], used to start local workers
+    const char *scenePath;
+    const char *offlineOutput;  // Render on the CPU to this file instead of opening a window, .exr and .pfm keep linear floats
+    const char *exrCompression; // none or zip
+    const char *captureFormat;  // exr or pfm, for the accumulation buffer captures taken with H
+    bool streamOutput;          // Write the offline render tile by tile as a tiled TIFF
+    int width;
+    int height;
+    int samples;
+    int denoiseIterations;
+    float targetFrameMs;
+
+    unsigned int seed;      // Random number key, the CPU paths always use it
+    bool deterministic;     // --seed was given, the GPU path drops per-run randomness too
+
+    bool cpuViewer;     // Interactive window driven by the CPU tile renderer
+    int threads;        // 0 uses every core
+    int tileSize;
+    const char *tileOrder;
+
+    const char *isa;    // CPU kernel instruction set, NULL picks the best one cpuid reports
+    bool numa;          // Pin CPU workers per NUMA node with node local scene and framebuffer
+    bool benchAccum;    // Run the accumulation buffer contention benchmark and exit
+    bool benchTiles;    // Run the tile renderer thread scaling benchmark and exit
+    bool benchPng;      // Time PNG encoding of a --width x --height render, ExportImage against the strip encoder
+    const char *benchConvergence;   // Write error against time for each sampler, estimator and denoiser to this CSV and exit
+    int referenceSamples;           // Samples per pixel of the cached reference it measures against
+    bool rayStats;      // Count rays, BVH work and path ends, printed after renders and shown in the viewers
+
+    int coordinatorPort;        // Hand the offline render's tiles to workers connecting on this port
+    int localWorkers;           // Worker processes the coordinator starts on this machine
+    const char *workerAddress;  // host:port of a coordinator to render tiles for
+
+    const char *animationOutput;    // printf pattern for the camera animation's frames, e.g. out/frame_%04d.png
+    int frameProcesses;             // Split the frames over this many child processes instead of threads
+    int frameSlice;                 // This process renders frames frameSlice, frameSlice + frameSlices, ...
+    int frameSlices;
+
+    const char *shmName;    // Publish every presented frame to this shared memory ring
+    const char *shmFormat;  // rgba8 or float
+    int shmSlots;
+
+    const char *videoOutput;    // Record the shown or animated frames to this file or "|command"
+    const char *videoFormat;    // y4m or rgb, NULL picks by extension
+    int videoFps;
+
+    const char *checkpointPath;     // Save the GPU viewer's accumulation here every checkpointSeconds and on exit
+    float checkpointSeconds;
+    bool resume;                    // Continue from checkpointPath when it was saved for the same scene
+
+    int servePort;          // Run the render service on 127.0.0.1 at this port instead of rendering one scene
+    int sceneCacheSize;     // Parsed scenes and BVHs the service keeps warm
+    int imageCacheMb;       // Disk budget for the service's finished images
+    const char *cacheDir;   // Where those images live, kept between runs
+
+    int tileStreamPort;         // Render progressively and stream changed tiles to viewers on this port
+    int streamKbps;             // Bandwidth cap per viewer
+    const char *viewAddress;    // host:port of a tile stream to show
+
+    const char *timelinePath;   // Record instrumentation zones and write them here as Chrome trace JSON on exit and with T
+    const char *frameTimesPath; // Write every viewer frame's CPU and GPU time here on exit, with a percentile summary beside it
+} CliOptions;
+
+// Adjusts the samples traced per frame so frames land near a target time
+typedef struct FrameBudget {
+    float targetMs;
+    int samplesPerPixel;
+
+    int windowFrames;       // Frames measured since the last adjustment
+    double windowTime;
+    double windowSamples;   // Pixel samples traced over the window
+
+    double avgFrameMs;
+    double samplesPerSecond;
+} FrameBudget;
+
+// Ray traced frame plus the first hit guides used by the denoiser
+typedef struct GBuffer {
+    RenderTexture2D target;     // Colour in attachment 0
+    Texture2D normalDepth;      // xyz = normal, w = hit distance
+    Texture2D albedo;
+    Texture2D rayStats;         // Per pixel work counts of the RAY_STATS shader variant
+} GBuffer;
+
 typedef struct RaytracerShaderValues {
-    float time;
+    unsigned int seed;
+    int sampleIndex;
     float *resolution;
     float focalLength;
     float *cameraCenter;
     int antiAliasing;
+    int samplesPerPixel;
     int dataSize;
+    int *lights;
+    int lightCount;
 } RaytracerShaderValues;
 
 typedef struct RaytracerShaderLocations {
-    int time;
+    int seed;
+    int sampleIndex;
     int resolution;
     int focalLength;
     int cameraCenter;
     int antiAliasing;
+    int samplesPerPixel;
     int dataSize;
+    int lights;
+    int lightCount;
 } RaytracerShaderLocations;
 
 typedef struct DenoiserShaderValues {
     float *resolution;
     int changed;
     int frame;
+    float frameWeight;
 } DenoiserShaderValues;
 
 typedef struct DenoiserShaderLocations {
@@ -59,14 +184,58 @@ typedef struct DenoiserShaderLocations {
     int accRender;
     int changed;
     int frame;
+    int frameWeight;
 } DenoiserShaderLocations;
 
+typedef struct AtrousShaderValues {
+    float *resolution;
+    int stepWidth;
+    float colourPhi;
+    float normalPhi;
+    float depthPhi;
+    float albedoPhi;
+} AtrousShaderValues;
+
+typedef struct AtrousShaderLocations {
+    int resolution;
+    int colour;
+    int normalDepth;
+    int albedo;
+    int stepWidth;
+    int colourPhi;
+    int normalPhi;
+    int depthPhi;
+    int albedoPhi;
+} AtrousShaderLocations;
+
+/*
+ * error() normally prints and exits. A thread that sets a trap gets a
+ * longjmp back to its setjmp instead, with the message copied out, so a
+ * long running service can turn a bad request into a reply. Whatever the
+ * failed call had allocated is leaked.
+ */
+typedef struct ErrorTrap {
+    jmp_buf jump;
+    char message[256];
+} ErrorTrap;
+
 void error(const char *msg);
+ErrorTrap *SetErrorTrap(ErrorTrap *trap);   // Per thread, NULL goes back to exiting. Returns the trap it replaces, so traps nest
+CliOptions ParseArgs(int argc, char **argv);
+uint64_t HashBytes(const void *bytes, size_t size);
+uint32_t Adler32(const void *data, size_t size);
+bool PathHasExtension(const char *path, const char *extension);
+Scene ParseSceneConfig(const char *filename);
+Scene ParseSceneText(const char *text, size_t length);
 void SceneFree(Scene *scene);
+float *PackSphereData(const Sphere spheres[], size_t len);  // DATA_WIDTH RGBA32F texels per sphere, the layout raytracing.frag reads
+void PackSphereWords(const Sphere *sphere, float words[SPHERE_WORDS]);  // Position, radius, material type, albedo, roughness, ior, emission
 
 toml_datum_t GetConfigParam(toml_result_t table, char *section, char *item, toml_type_t type);
+float GetOptionalConfigFloat(toml_result_t table, char *section, char *item, float fallback);
 void GetConfigVec3(toml_result_t table, float *vec, char *section, char *item);
 Sphere GetObjectParams(toml_result_t table, char *name);
+CameraKeyframe GetKeyframeParams(toml_result_t table, char *name);
 
 RaytracerShaderLocations GetRaytracerLocations(Shader shader);
 void SetRaytracerValues(Shader shader, RaytracerShaderLocations locs, RaytracerShaderValues values);
@@ -74,15 +243,28 @@ void SetRaytracerValues(Shader shader, RaytracerShaderLocations locs, RaytracerS
 DenoiserShaderLocations GetDenoiserLocations(Shader shader);
 void SetDenoiserValues(Shader shader, DenoiserShaderLocations locs, DenoiserShaderValues values);
 
+AtrousShaderLocations GetAtrousLocations(Shader shader);
+void SetAtrousValues(Shader shader, AtrousShaderLocations locs, AtrousShaderValues values);
+
 float Clampf(float value, float min, float max);
 
 bool Movement(Camera *camera);
 bool Zoom(Camera *camera);
 
 bool Settings(RenderSettings *settings);
-void DrawInfo(Camera camera, RenderSettings settings, int frame);
+const char *HeatmapName(int mode);
+Color HeatmapColour(float t);     // t from 0 to 1, blue through green to red
+FrameBudget InitFrameBudget(float targetMs);
+void UpdateFrameBudget(FrameBudget *budget, float frameTime, int pixelCount);
+
+void DrawInfo(Camera camera, RenderSettings settings, FrameBudget budget, int frame);
 
 void CopyTexture(RenderTexture source, RenderTexture target, float resolution[2]);
 void ClearTexture(RenderTexture tex);
 
+RenderTexture LoadFloatRenderTexture(int width, int height);
+Shader LoadShaderVariant(const char *fsFileName, const char *define);
+GBuffer LoadGBuffer(int width, int height);
+void UnloadGBuffer(GBuffer gbuffer);
+
 #endif
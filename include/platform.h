@@ -0,0 +1,65 @@
+#ifndef PLATFORM_H
+#define PLATFORM_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// OS specific helpers, kept out of the raylib headers because windows.h clashes with them
+
+int CpuCount(void);
+
+// NUMA topology from sysfs, a single node everywhere else
+int NumaNodeCount(void);
+int NumaNodeCpus(int node, int *cpus, int maxCpus);
+bool PinCurrentThread(const int *cpus, int count);
+
+// Blocking TCP over BSD sockets or winsock, sends and receives move the whole buffer or fail
+typedef long long NetSocket;
+#define NET_INVALID_SOCKET (-1LL)
+
+bool NetInit(void);
+NetSocket NetListen(int port, bool loopback);     // Loopback only accepts connections from this machine
+NetSocket NetAccept(NetSocket server);
+NetSocket NetConnect(const char *host, int port);
+void NetSetTimeout(NetSocket socket, int milliseconds);   // 0 blocks forever
+bool NetSend(NetSocket socket, const void *data, size_t size);
+bool NetRecv(NetSocket socket, void *data, size_t size);
+void NetClose(NetSocket socket);    // Also wakes threads blocked on the socket
+
+void SleepMs(int milliseconds);
+double Now(void);   // Seconds on a monotonic clock that never jumps with the wall clock, only differences between calls mean anything
+
+// Starts another copy of a program without waiting for it, argv ends with NULL
+typedef long long ProcessHandle;
+#define INVALID_PROCESS (-1LL)
+
+ProcessHandle SpawnProcess(const char *path, char *const argv[]);
+int WaitProcess(ProcessHandle process);     // Exit code, -1 if it crashed or cannot be waited on
+
+// Binary writes into a shell command's stdin. A reader that exits makes writes fail instead of raising SIGPIPE
+FILE *OpenPipe(const char *command);
+int ClosePipe(FILE *pipe);      // Exit code of the command
+
+// Durable writes: flush a file through to the disk, then move it over another in one step
+bool SyncFile(FILE *file);
+bool ReplaceFileAtomic(const char *from, const char *to);
+
+// Named memory other processes can map, POSIX shm or a Windows file mapping
+typedef struct SharedMemory {
+    void *data;
+    size_t size;
+    long long handle;
+    char name[128];
+} SharedMemory;
+
+bool SharedMemoryCreate(SharedMemory *memory, const char *name, size_t size);
+bool SharedMemoryOpen(SharedMemory *memory, const char *name);
+void SharedMemoryClose(SharedMemory *memory, bool unlink);
+
+// Cross process wait on a word in shared memory, a futex on Linux and a short poll elsewhere
+bool FutexWait(atomic_uint *word, unsigned int expected, int timeoutMs);
+void FutexWakeAll(atomic_uint *word);
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef PNGWRITER_H
+#define PNGWRITER_H
+
+#include "raylib.h"
+#include "../include/helpers.h"
+#include <stdbool.h>
+
+#define PNG_STRIP_BYTES (1 << 20)   // Filtered bytes per strip, each strip is deflated on its own
+
+// RGBA8 rows top to bottom, written as 8-bit RGB unless alpha is kept
+bool WritePng(const char *path, const unsigned char *rgba, int width, int height, bool alpha, int threads);
+
+void BenchmarkPngWriter(Scene scene, Camera camera, CliOptions options);
+
+#endif
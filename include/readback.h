@@ -0,0 +1,55 @@
+#ifndef READBACK_H
+#define READBACK_H
+
+#include "raylib.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+#define READBACK_BUFFERS 3      // Frames in flight before queueing waits on the oldest copy
+#define READBACK_MAX_SINKS 4
+
+// A finished copy, valid only during the sink call. Rows run bottom up like the texture
+typedef struct ReadbackFrame {
+    const void *pixels;
+    int width;
+    int height;
+    int format;         // PIXELFORMAT_UNCOMPRESSED_R8G8B8A8 or PIXELFORMAT_UNCOMPRESSED_R32G32B32A32
+    long long index;
+} ReadbackFrame;
+
+typedef struct ReadbackSink {
+    void (*deliver)(void *user, const ReadbackFrame *frame);
+    void *user;
+} ReadbackSink;
+
+/*
+ * Texture copies land in a ring of pixel buffer objects with a fence each,
+ * and are handed to the sinks a frame or two later once the fence has
+ * passed, so the CPU never waits on the GPU mid frame. Without GL 3.3 it
+ * falls back to a synchronous read.
+ */
+typedef struct ReadbackRing {
+    bool async;
+    int width;
+    int height;
+
+    unsigned int buffers[READBACK_BUFFERS];
+    size_t sizes[READBACK_BUFFERS];     // Grown to float frames only once one is queued
+    void *fences[READBACK_BUFFERS];
+    int formats[READBACK_BUFFERS];
+    long long indices[READBACK_BUFFERS];
+
+    int head;       // Oldest copy in flight
+    int pending;
+
+    ReadbackSink sinks[READBACK_MAX_SINKS];
+    int sinkCount;
+} ReadbackRing;
+
+ReadbackRing *ReadbackCreate(int width, int height);
+void ReadbackAddSink(ReadbackRing *ring, ReadbackSink sink);
+void ReadbackQueue(ReadbackRing *ring, Texture2D texture, long long index);
+void ReadbackPoll(ReadbackRing *ring, bool wait);   // Delivers finished copies, wait drains them all
+void ReadbackFree(ReadbackRing *ring);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef RNG_H
+#define RNG_H
+
+/*
+ * Counter based random numbers (Philox4x32-10). Every draw is a pure function
+ * of the seed, pixel, sample, bounce and draw index, so results do not depend
+ * on which thread traced a sample or in what order. raytracing.frag runs the
+ * same generator, keyed the same way.
+ */
+typedef struct Rng {
+    unsigned int key[2];
+    unsigned int counter[4];    // pixel, sample, bounce, block
+    unsigned int block[4];      // Outputs of the current counter
+    int used;                   // Outputs of the block already handed out
+} Rng;
+
+void Philox4x32(const unsigned int counter[4], const unsigned int key[2], unsigned int out[4]);
+
+Rng InitRng(unsigned int seed, unsigned int pixel, unsigned int sample);
+void RngSetBounce(Rng *rng, unsigned int bounce);
+float RngFloat(Rng *rng);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef SERVICE_H
+#define SERVICE_H
+
+#include "raylib.h"
+#include "../include/helpers.h"
+
+#define SERVICE_CACHE_VERSION 1         // Part of every image key, bump it when the renderer's output changes
+#define SERVICE_QUEUE 64                // Renders waiting for a worker, past this requests get a 503
+#define SERVICE_MAX_CONNECTIONS 64      // Requests being read at once, each on its own thread, past this clients get a 503
+#define SERVICE_MAX_HEADER 8192
+#define SERVICE_MAX_SCENE (1 << 20)     // Largest scene body accepted
+#define SERVICE_MAX_SIDE 8192
+#define SERVICE_MAX_SPP 65536
+#define SERVICE_TIMEOUT_MS 10000        // A client that stalls this long mid request is dropped
+
+/*
+ * Long running render service on http://127.0.0.1:<port>. Clients POST a
+ * scene's TOML to /render with the camera and settings in the query and get
+ * the image back. Parsed scenes and their BVHs stay in an LRU keyed by the
+ * scene text, and finished images are kept on disk under the hash of
+ * everything that decides their pixels, so an identical request is answered
+ * without tracing a ray.
+ */
+void RunService(CliOptions options);
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include "raylib.h"
+#include "../include/platform.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SHM_RING_MAGIC 0x47525452u     // "RTRG"
+#define SHM_RING_VERSION 1
+#define SHM_RING_ALIGN 4096            // Slots start on page boundaries
+#define SHM_RING_MAX_SLOTS 64
+
+typedef enum ShmFormat {
+    SHM_FORMAT_RGBA8 = 1,       // sRGB-ish gamma, same bytes as the window shows
+    SHM_FORMAT_RGBA32F = 2      // Linear radiance, alpha is 1
+} ShmFormat;
+
+/*
+ * Layout of the mapping, shared with consumers in other processes:
+ *      ShmRingHeader, then slotCount ShmSlotHeaders, then the slots from
+ *      firstSlot on, slotSize bytes apart. Frame n lives in slot
+ *      n % slotCount, rows top to bottom.
+ *
+ * Each slot is a seqlock. Its sequence is 2n + 1 while frame n is written
+ * and 2n + 2 once it is complete. A consumer reads the sequence, uses the
+ * pixels in place and checks the sequence again; a change means the
+ * producer lapped it and the frame has to be dropped. The producer never
+ * waits for consumers.
+ */
+typedef struct ShmSlotHeader {
+    atomic_ullong sequence;
+    double time;            // Seconds since the ring was created
+} ShmSlotHeader;
+
+typedef struct ShmRingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;        // Bytes per row
+    uint32_t slotCount;
+    uint32_t reserved;
+    uint64_t slotSize;
+    uint64_t firstSlot;     // Offset of slot 0 from the start of the mapping
+
+    atomic_ullong published;    // Frames completed so far
+    atomic_uint notify;         // Bumped after every frame, consumers futex wait on it
+    atomic_uint closed;         // Set when the producer exits
+
+    ShmSlotHeader slots[];
+} ShmRingHeader;
+
+typedef struct ShmRing {
+    SharedMemory memory;
+    ShmRingHeader *header;
+    bool producer;
+    double created;
+} ShmRing;
+
+ShmFormat ShmFormatFromName(const char *name);
+
+// Producer side
+ShmRing *ShmRingCreate(const char *name, int width, int height, ShmFormat format, int slots);
+void *ShmRingBegin(ShmRing *ring);      // Pixels of the slot the next frame is written to
+void ShmRingPublish(ShmRing *ring);
+void ShmRingPublishTexture(ShmRing *ring, const void *pixels, int pixelFormat);    // Gamma RGBA8 or linear RGBA32F, rows bottom up
+void ShmRingDestroy(ShmRing *ring);
+
+// Consumer side
+ShmRing *ShmRingOpen(const char *name);
+const void *ShmRingAcquire(ShmRing *ring, uint64_t next, uint64_t *frame, int timeoutMs);
+bool ShmRingStillValid(const ShmRing *ring, uint64_t frame);
+
+#endif
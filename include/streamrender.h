@@ -0,0 +1,12 @@
+#ifndef STREAMRENDER_H
+#define STREAMRENDER_H
+
+#include "raylib.h"
+#include "../include/helpers.h"
+
+#define STREAM_MIN_TILE 256     // Keeps the denoiser's apron a fraction of each tile
+
+// Offline render of any size, tiles go straight to a tiled TIFF and are freed
+void RenderStreamed(Scene scene, Camera camera, CliOptions options);
+
+#endif
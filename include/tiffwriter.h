@@ -0,0 +1,38 @@
+#ifndef TIFFWRITER_H
+#define TIFFWRITER_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#define TIFF_TILE_ALIGN 16  // TIFF tile edges must be multiples of 16
+
+/*
+ * Uncompressed RGB8 tiled TIFF that accepts tiles in any order from any
+ * thread. Tiles are appended as they arrive and the directory with their
+ * offsets goes at the end, so nothing but the offset table stays in memory.
+ * Switches to BigTIFF when the pixel data passes 4 GiB.
+ */
+typedef struct TiffWriter {
+    FILE *file;
+    bool big;
+
+    int width;
+    int height;
+    int tileSize;
+    int tilesX;
+    int tilesY;
+
+    unsigned long long *offsets;    // Per tile, row major
+    unsigned long long end;         // Bytes written so far
+
+    pthread_mutex_t lock;
+} TiffWriter;
+
+TiffWriter *TiffWriterOpen(const char *path, int width, int height, int tileSize);
+
+// rgb holds tileSize * tileSize pixels, edge tiles padded past the image
+void TiffWriteTile(TiffWriter *writer, int tileX, int tileY, const unsigned char *rgb);
+void TiffWriterClose(TiffWriter *writer);
+
+#endif
@@ -0,0 +1,122 @@
+#ifndef TILERENDER_H
+#define TILERENDER_H
+
+#include "../include/accumbuffer.h"
+#include "../include/cputracer.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define DEFAULT_TILE_SIZE 32
+#define NUMA_MAX_CPUS 1024
+#define COST_CHANNELS 3     // Sphere tests, BVH nodes and surfaces hit per pixel, in HeatmapMode order
+
+typedef enum TileOrder {
+    TILE_ORDER_SPIRAL,      // Outwards from the center tile
+    TILE_ORDER_HILBERT,     // Along a Hilbert curve, keeps neighbouring tiles close in time
+    TILE_ORDER_VARIANCE     // Noisiest tiles first, spiral until there is an estimate
+} TileOrder;
+
+typedef struct Tile {
+    int x;
+    int y;
+    int width;
+    int height;
+    int passes;     // Samples per pixel completed for the whole tile
+} Tile;
+
+/*
+ * Workers pinned to one NUMA node. Tiles in the node's band of rows are queued
+ * for it first and its pages of the framebuffer are first touched by it.
+ */
+typedef struct TileNode {
+    const CpuScene *scene;  // The shared scene, or replica when pinned
+    CpuScene replica;
+
+    int *cpus;
+    int cpuCount;
+
+    int *queue;         // This pass's tiles in the band, in schedule order
+    int queueLength;
+    int nextTile;
+
+    int firstRow;       // Band of tile rows
+    int rowCount;
+} TileNode;
+
+typedef struct TileWorkerContext {
+    struct TileRenderer *renderer;
+    int node;
+    bool first;         // Sets the node up before rendering
+} TileWorkerContext;
+
+/*
+ * Progressive CPU renderer. Workers take tiles in the scheduled order and add
+ * one sample per pixel per pass. A camera change bumps the generation, which
+ * workers check every tile row, so in-flight tiles are abandoned within a row
+ * while the thread pool keeps running.
+ */
+typedef struct TileRenderer {
+    const CpuScene *scene;
+    CpuCamera camera;
+    bool jitter;
+    unsigned int seed;
+
+    int width;
+    int height;
+
+    Tile *tiles;
+    int *schedule;  // Tile indices in render order
+    int tileCount;
+    int tilesX;
+    int tilesY;
+    TileOrder order;
+
+    AccumBuffer accum;  // Linear radiance and sample count summed over passes
+    float *lumaSq;      // Summed squared luminance, for the variance order
+    atomic_uint *cost;  // COST_CHANNELS counts per pixel summed over passes, for the heatmap, read while workers add
+    float *heatmap;     // Mean cost per sample, scratch for TileRendererResolveHeatmap
+
+    bool numa;
+    TileNode *nodes;
+    int nodeCount;
+    int readyNodes;
+
+    pthread_t *workers;
+    TileWorkerContext *contexts;
+    int workerCount;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;    // Work is available
+    pthread_cond_t idle;    // A worker finished a tile
+
+    atomic_uint generation;
+    atomic_llong samplesTraced;
+
+    int nextTile;       // Tiles handed out this pass
+    int finishedTiles;  // Tiles completed this pass
+    int activeWorkers;
+    int pass;
+    int passLimit;      // Workers go idle after this many passes, 0 renders until the next reset forever
+    RayStats stats;     // Finished tiles since the last reset
+    bool resetting;
+    bool paused;        // Workers finish their tiles and take no more until resumed
+    bool quit;
+} TileRenderer;
+
+TileOrder TileOrderFromName(const char *name);
+
+TileRenderer *TileRendererCreate(const CpuScene *scene, int width, int height, int tileSize, int threadCount, TileOrder order, bool numa, unsigned int seed);
+void TileRendererFree(TileRenderer *renderer);
+
+void TileRendererReset(TileRenderer *renderer, CpuCamera camera, bool jitter);
+void TileRendererResolve(TileRenderer *renderer, unsigned char *rgba);
+float TileRendererResolveHeatmap(TileRenderer *renderer, unsigned char *rgba, HeatmapMode mode);   // Returns the mean cost per sample drawn as red
+void TileRendererWaitPasses(TileRenderer *renderer, int passes);
+int TileRendererPasses(TileRenderer *renderer);     // Passes finished since the last reset
+void TileRendererSetPassLimit(TileRenderer *renderer, int passLimit);   // Raising it continues a render that stopped at the old limit
+void TileRendererPause(TileRenderer *renderer, bool paused);    // Returns once no tile is in flight
+RayStats TileRendererStats(TileRenderer *renderer);
+
+void BenchmarkTileRenderer(Scene scene, Camera camera, CliOptions options);
+
+#endif
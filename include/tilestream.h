@@ -0,0 +1,25 @@
+#ifndef TILESTREAM_H
+#define TILESTREAM_H
+
+#include "raylib.h"
+#include "../include/helpers.h"
+
+#define TILE_STREAM_VERSION 1
+#define TILE_STREAM_INTERVAL_MS 50      // How often each viewer's copy is compared against the render
+#define TILE_STREAM_MIN_CHANGE 0.5f     // Mean change per channel (of 255) a tile needs to be resent, until the render is done
+#define TILE_STREAM_BURST 0.25          // Seconds of bandwidth a quiet viewer can save up
+
+/*
+ * Progressive render streamed to remote viewers over TCP. Each viewer has its
+ * own thread that keeps a copy of what the viewer shows, and every interval
+ * resends the tiles that have moved furthest from it as byte deltas, most
+ * visible change first, within the viewer's bandwidth. Once the render stops
+ * at --spp passes every remaining difference is sent, so the viewer ends on
+ * the exact final image.
+ */
+void RunTileStreamServer(Scene scene, Camera camera, CliOptions options);
+
+// Connects to a stream at "host:port" and shows it in a window
+void RunTileStreamViewer(CliOptions options);
+
+#endif
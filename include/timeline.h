@@ -0,0 +1,57 @@
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#define TIMELINE_RING_EVENTS 16384      // Zones kept per thread, the oldest are overwritten once it wraps
+#define TIMELINE_MAX_THREADS 256        // Threads alive at once past this record nothing
+#define TIMELINE_RING_LIVES 64          // Threads a reused ring remembers, older ones are dropped with their zones
+
+// An open zone, closed with TimelineEnd on the thread that began it
+typedef struct TimelineZone {
+    const char *name;   // String literal, only the pointer is kept
+    double start;
+    int arg;
+} TimelineZone;
+
+typedef struct TimelineEvent {
+    const char *name;
+    double start;
+    double end;
+    int arg;            // Tile, pass or frame index, -1 for none
+} TimelineEvent;
+
+// One thread's use of a ring, its events run from firstEvent to the next life's
+typedef struct TimelineLife {
+    long long firstEvent;
+    int tid;
+    char threadName[32];
+} TimelineLife;
+
+// Events are written only by the ring's current thread and read by whoever dumps the timeline.
+// The lives are guarded by the timeline's ring lock
+typedef struct TimelineRing {
+    atomic_llong head;  // Events ever recorded, published after the event is written
+    TimelineLife lives[TIMELINE_RING_LIVES];
+    long long lifeCount;
+    TimelineEvent events[TIMELINE_RING_EVENTS];
+} TimelineRing;
+
+/*
+ * Scoped instrumentation zones written as Chrome trace event JSON for
+ * chrome://tracing or Perfetto. Each thread records into its own ring with
+ * plain stores and one release store, so workers never contend; the dump
+ * reads the rings while they are still being written and skips any event
+ * a writer lapped mid copy. Without TimelineStart a zone only checks a flag.
+ */
+void TimelineStart(const char *path);   // Also dumps on exit
+bool TimelineEnabled(void);
+void TimelineThreadName(const char *name);
+
+TimelineZone TimelineBegin(const char *name, int arg);
+void TimelineEnd(TimelineZone zone);
+
+bool TimelineWrite(void);   // Everything recorded so far, safe while other threads keep recording
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef VIDEOSINK_H
+#define VIDEOSINK_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#define VIDEO_SINK_SLOTS 4      // Frames buffered ahead of the writer thread
+
+typedef enum VideoFormat {
+    VIDEO_FORMAT_Y4M,   // YUV4MPEG2, 4:2:0 BT.601 limited range with centred chroma
+    VIDEO_FORMAT_RGB    // Headerless RGB24 frames, top row first
+} VideoFormat;
+
+typedef enum VideoSlotState {
+    VIDEO_SLOT_FREE,
+    VIDEO_SLOT_FILLING,
+    VIDEO_SLOT_READY,
+    VIDEO_SLOT_WRITING
+} VideoSlotState;
+
+/*
+ * Streams frames to a file or to a "|command" pipe such as an encoder.
+ * Submitting only copies the RGBA8 frame into a slot; a writer thread does
+ * the YUV conversion and the writes, so neither the render loop nor the
+ * readback path waits on the disk or the reader. Frame n uses slot
+ * n % VIDEO_SINK_SLOTS and frames come out in index order.
+ */
+typedef struct VideoSink {
+    FILE *file;
+    const char *path;
+    bool pipe;
+    VideoFormat format;
+    int width;
+    int height;
+    int fps;
+
+    unsigned char *slots[VIDEO_SINK_SLOTS];     // RGBA8, rows top to bottom
+    VideoSlotState states[VIDEO_SINK_SLOTS];
+    long long indices[VIDEO_SINK_SLOTS];
+    unsigned char *converted;   // Y, U and V planes or RGB24, only touched by the writer
+
+    long long next;         // Frame the writer waits for
+    long long submitted;    // Next index given to frames submitted without one
+    long long written;
+    long long dropped;
+    bool closing;
+    bool failed;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t writer;
+} VideoSink;
+
+VideoFormat VideoFormatFromName(const char *name, const char *path);   // NULL picks by extension, .rgb and .raw are raw
+VideoSink *VideoSinkOpen(const char *path, VideoFormat format, int width, int height, int fps);
+
+// A negative index takes the next frame and drops it if the writer is a full ring behind,
+// an explicit index blocks until its slot is free so every frame is kept
+bool VideoSinkSubmit(VideoSink *sink, long long index, const unsigned char *rgba, bool bottomUp);
+void VideoSinkClose(VideoSink *sink);   // Writes what is queued, then closes the file or waits for the command
+
+#endif
@@ -1,2 +1,2 @@
-gcc src/*.c -o build/main.exe -I./include -L./lib -lraylib -lopengl32 -lgdi32 -lwinmm -g
+gcc src/*.c -o build/main.exe -I./include -L./lib -lraylib -lopengl32 -lgdi32 -lwinmm -lpthread -lws2_32 -g
 ./build/main.exe
@@ -0,0 +1,302 @@
+#include "../include/accumbuffer.h"
+#include "../include/cpukernels.h"
+#include "../include/helpers.h"
+#include "../include/platform.h"
+#include "raylib.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_WIDTH 256
+#define BENCH_HEIGHT 256
+#define BENCH_SPLATS (1 << 24)  // Split across the threads of each run
+#define BENCH_HOT_SIZE 8        // Edge of the pixel block every thread hits in the hot pattern
+
+#define RESOLVE_CHUNK 1024      // Pixels staged on the stack per tonemap call
+
+static float BitsToFloat(unsigned int bits) {
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+
+    return value;
+}
+
+static unsigned int FloatToBits(float value) {
+    unsigned int bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    return bits;
+}
+
+// No hardware float add is atomic, so retry until nobody else wrote in between
+static void AtomicAddFloat(atomic_uint *target, float value) {
+    unsigned int expected = atomic_load_explicit(target, memory_order_relaxed);
+
+    while (!atomic_compare_exchange_weak_explicit(target, &expected, FloatToBits(BitsToFloat(expected) + value),
+            memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+AccumBuffer AllocAccumBuffer(int width, int height, int shardCount) {
+    size_t valueCount = (size_t)width * height * ACCUM_CHANNELS;
+
+    AccumBuffer buffer = {
+        .width = width,
+        .height = height,
+        .pixels = calloc(valueCount, sizeof(atomic_uint)),
+        .shardCount = shardCount,
+        .shards = NULL
+    };
+
+    if (!buffer.pixels) {
+        error("Out of memory allocating accumulation buffer.");
+    }
+
+    if (shardCount > 0) {
+        buffer.shards = malloc(shardCount * sizeof(float *));
+
+        for (int i = 0; i < shardCount; i++) {
+            buffer.shards[i] = calloc(valueCount, sizeof(float));
+
+            if (!buffer.shards[i]) {
+                error("Out of memory allocating accumulation shards.");
+            }
+        }
+    }
+
+    // Zero float bits are 0.0f, and leaving the pages untouched lets the first writer place them
+    return buffer;
+}
+
+void AccumBufferFree(AccumBuffer *buffer) {
+    if (!buffer) return;
+
+    for (int i = 0; i < buffer->shardCount; i++) {
+        free(buffer->shards[i]);
+    }
+
+    free(buffer->shards);
+    free(buffer->pixels);
+}
+
+// Not safe against concurrent adds, callers stop their writers first
+void AccumBufferClear(AccumBuffer *buffer) {
+    size_t valueCount = (size_t)buffer->width * buffer->height * ACCUM_CHANNELS;
+
+    for (size_t i = 0; i < valueCount; i++) {
+        atomic_store_explicit(&buffer->pixels[i], FloatToBits(0.0f), memory_order_relaxed);
+    }
+
+    for (int i = 0; i < buffer->shardCount; i++) {
+        memset(buffer->shards[i], 0, valueCount * sizeof(float));
+    }
+}
+
+void AccumBufferClearRange(AccumBuffer *buffer, size_t firstPixel, size_t pixelCount) {
+    size_t first = firstPixel * ACCUM_CHANNELS;
+    size_t end = (firstPixel + pixelCount) * ACCUM_CHANNELS;
+
+    for (size_t i = first; i < end; i++) {
+        atomic_store_explicit(&buffer->pixels[i], FloatToBits(0.0f), memory_order_relaxed);
+    }
+}
+
+void AccumBufferAdd(AccumBuffer *buffer, int index, Vector3 colour, float weight) {
+    atomic_uint *pixel = &buffer->pixels[(size_t)index * ACCUM_CHANNELS];
+
+    AtomicAddFloat(&pixel[0], colour.x);
+    AtomicAddFloat(&pixel[1], colour.y);
+    AtomicAddFloat(&pixel[2], colour.z);
+    AtomicAddFloat(&pixel[3], weight);
+}
+
+// shard must only ever be written by one thread
+void AccumBufferAddShard(AccumBuffer *buffer, int shard, int index, Vector3 colour, float weight) {
+    float *pixel = &buffer->shards[shard][(size_t)index * ACCUM_CHANNELS];
+
+    pixel[0] += colour.x;
+    pixel[1] += colour.y;
+    pixel[2] += colour.z;
+    pixel[3] += weight;
+}
+
+// Folds every shard into the shared pixels and empties them, call while no thread is splatting
+void AccumBufferReduce(AccumBuffer *buffer) {
+    size_t valueCount = (size_t)buffer->width * buffer->height * ACCUM_CHANNELS;
+
+    for (int s = 0; s < buffer->shardCount; s++) {
+        float *shard = buffer->shards[s];
+
+        for (size_t i = 0; i < valueCount; i++) {
+            if (shard[i] == 0.0f) continue;
+
+            float sum = BitsToFloat(atomic_load_explicit(&buffer->pixels[i], memory_order_relaxed)) + shard[i];
+            atomic_store_explicit(&buffer->pixels[i], FloatToBits(sum), memory_order_relaxed);
+            shard[i] = 0.0f;
+        }
+    }
+}
+
+Vector4 AccumBufferGet(const AccumBuffer *buffer, int index) {
+    atomic_uint *pixel = &buffer->pixels[(size_t)index * ACCUM_CHANNELS];
+
+    Vector4 value = {
+        BitsToFloat(atomic_load_explicit(&pixel[0], memory_order_relaxed)),
+        BitsToFloat(atomic_load_explicit(&pixel[1], memory_order_relaxed)),
+        BitsToFloat(atomic_load_explicit(&pixel[2], memory_order_relaxed)),
+        BitsToFloat(atomic_load_explicit(&pixel[3], memory_order_relaxed))
+    };
+
+    return value;
+}
+
+// Weighted mean as RGBA8 with the shader's sqrt gamma, empty pixels stay black. The live buffer is
+// copied out a chunk at a time with relaxed loads, so the kernels only ever see plain floats
+void AccumBufferResolve(const AccumBuffer *buffer, unsigned char *rgba) {
+    size_t pixelCount = (size_t)buffer->width * buffer->height;
+    float staged[RESOLVE_CHUNK * ACCUM_CHANNELS];
+
+    for (size_t first = 0; first < pixelCount; first += RESOLVE_CHUNK) {
+        size_t count = pixelCount - first < RESOLVE_CHUNK ? pixelCount - first : RESOLVE_CHUNK;
+        const atomic_uint *pixels = &buffer->pixels[first * ACCUM_CHANNELS];
+
+        for (size_t i = 0; i < count * ACCUM_CHANNELS; i++) {
+            staged[i] = BitsToFloat(atomic_load_explicit(&pixels[i], memory_order_relaxed));
+        }
+
+        cpuKernels.tonemap(staged, count, &rgba[first * 4]);
+    }
+}
+
+// Averaged linear radiance, alpha 1, for consumers that tonemap themselves
+void AccumBufferResolveLinear(const AccumBuffer *buffer, float *rgba) {
+    size_t pixelCount = (size_t)buffer->width * buffer->height;
+
+    for (size_t i = 0; i < pixelCount; i++) {
+        Vector4 sum = AccumBufferGet(buffer, (int)i);
+        float scale = sum.w > 0.0f ? 1.0f / sum.w : 0.0f;
+
+        rgba[i * 4 + 0] = sum.x * scale;
+        rgba[i * 4 + 1] = sum.y * scale;
+        rgba[i * 4 + 2] = sum.z * scale;
+        rgba[i * 4 + 3] = 1.0f;
+    }
+}
+
+typedef enum BenchMode {
+    BENCH_MUTEX,
+    BENCH_ATOMIC,
+    BENCH_SHARDED
+} BenchMode;
+
+typedef struct BenchWorker {
+    pthread_t thread;
+    AccumBuffer *buffer;
+    pthread_mutex_t *lock;
+    float *lockedPixels;    // Plain buffer behind the single mutex
+
+    BenchMode mode;
+    bool hot;
+    int shard;
+    int splats;
+} BenchWorker;
+
+static void *BenchSplat(void *arg) {
+    BenchWorker *worker = arg;
+    unsigned int rng = 0x9e3779b9u * (worker->shard + 1);
+    Vector3 colour = { 0.25f, 0.5f, 0.75f };
+
+    for (int i = 0; i < worker->splats; i++) {
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+
+        int index = worker->hot
+            ? (int)((rng >> 8) % BENCH_HOT_SIZE) * BENCH_WIDTH + (int)(rng % BENCH_HOT_SIZE)
+            : (int)(rng % (BENCH_WIDTH * BENCH_HEIGHT));
+
+        if (worker->mode == BENCH_ATOMIC) {
+            AccumBufferAdd(worker->buffer, index, colour, 1.0f);
+        } else if (worker->mode == BENCH_SHARDED) {
+            AccumBufferAddShard(worker->buffer, worker->shard, index, colour, 1.0f);
+        } else {
+            pthread_mutex_lock(worker->lock);
+            float *pixel = &worker->lockedPixels[index * ACCUM_CHANNELS];
+            pixel[0] += colour.x;
+            pixel[1] += colour.y;
+            pixel[2] += colour.z;
+            pixel[3] += 1.0f;
+            pthread_mutex_unlock(worker->lock);
+        }
+    }
+
+    return NULL;
+}
+
+// Returns millions of splats per second, reduction time included for shards
+static double BenchRun(BenchMode mode, int threads, bool hot) {
+    AccumBuffer buffer = AllocAccumBuffer(BENCH_WIDTH, BENCH_HEIGHT, mode == BENCH_SHARDED ? threads : 0);
+    float *lockedPixels = calloc((size_t)BENCH_WIDTH * BENCH_HEIGHT * ACCUM_CHANNELS, sizeof(float));
+    BenchWorker *workers = malloc(threads * sizeof(BenchWorker));
+
+    pthread_mutex_t lock;
+    pthread_mutex_init(&lock, NULL);
+
+    double start = Now();
+
+    for (int i = 0; i < threads; i++) {
+        workers[i] = (BenchWorker){
+            .buffer = &buffer,
+            .lock = &lock,
+            .lockedPixels = lockedPixels,
+            .mode = mode,
+            .hot = hot,
+            .shard = i,
+            .splats = BENCH_SPLATS / threads
+        };
+
+        pthread_create(&workers[i].thread, NULL, BenchSplat, &workers[i]);
+    }
+
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    if (mode == BENCH_SHARDED) {
+        AccumBufferReduce(&buffer);
+    }
+
+    double elapsed = Now() - start;
+
+    pthread_mutex_destroy(&lock);
+    free(workers);
+    free(lockedPixels);
+    AccumBufferFree(&buffer);
+
+    return (BENCH_SPLATS / threads) * (double)threads / elapsed / 1e6;
+}
+
+void BenchmarkAccumBuffer(void) {
+    const int threadCounts[] = { 8, 32, 64 };
+
+    printf("Accumulation buffer contention, %dx%d frame, %d splats per run (Msplats/s)\n",
+        BENCH_WIDTH, BENCH_HEIGHT, BENCH_SPLATS);
+    printf("%-8s %-8s %10s %10s %10s %14s\n", "threads", "pattern", "mutex", "atomic", "sharded", "shard memory");
+
+    for (int t = 0; t < 3; t++) {
+        for (int hot = 0; hot <= 1; hot++) {
+            int threads = threadCounts[t];
+            double shardMb = (double)threads * BENCH_WIDTH * BENCH_HEIGHT * ACCUM_CHANNELS * sizeof(float) / (1024.0 * 1024.0);
+
+            printf("%-8d %-8s %10.1f %10.1f %10.1f %11.1f MB\n",
+                threads,
+                hot ? "hot" : "spread",
+                BenchRun(BENCH_MUTEX, threads, hot),
+                BenchRun(BENCH_ATOMIC, threads, hot),
+                BenchRun(BENCH_SHARDED, threads, hot),
+                shardMb);
+        }
+    }
+}
@@ -0,0 +1,293 @@
+#include "../include/animation.h"
+#include "../include/cpukernels.h"
+#include "../include/cputracer.h"
+#include "../include/denoise.h"
+#include "../include/platform.h"
+#include "../include/timeline.h"
+#include "../include/videosink.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RAYMATH_STATIC_INLINE
+#include "raymath.h"
+
+/*
+ * Each worker thread renders whole frames, so frames run concurrently
+ * without any locking inside a frame. The scene and BVH are built once
+ * and shared read only, and every worker reuses its frame buffers.
+ */
+typedef struct AnimationJob {
+    const Scene *scene;
+    const CpuScene *cpuScene;
+    Camera fallback;
+    CliOptions options;
+    VideoSink *video;       // Frames are also recorded in order when set
+
+    int frameCount;
+    atomic_int nextFrame;   // Counts this process's frames, not scene frames
+    atomic_int written;
+    double start;
+
+    pthread_mutex_t statsLock;
+    RayStats stats;         // Every worker's counts, merged as it exits
+} AnimationJob;
+
+int AnimationFrameCount(const Scene *scene) {
+    return scene->keyframeCount > 0 ? scene->keyframes[scene->keyframeCount - 1].frame + 1 : 0;
+}
+
+Camera CameraAtFrame(const Scene *scene, int frame, Camera fallback) {
+    if (scene->keyframeCount == 0) return fallback;
+
+    const CameraKeyframe *keys = scene->keyframes;
+    size_t last = scene->keyframeCount - 1;
+
+    const CameraKeyframe *from = &keys[0];
+    const CameraKeyframe *to = &keys[0];
+
+    if (frame >= keys[last].frame) {
+        from = to = &keys[last];
+    } else if (frame > keys[0].frame) {
+        size_t next = 1;
+        while (keys[next].frame <= frame) next++;
+
+        from = &keys[next - 1];
+        to = &keys[next];
+    }
+
+    float t = to->frame > from->frame ? (float)(frame - from->frame) / (float)(to->frame - from->frame) : 0.0f;
+
+    Camera camera = fallback;
+    camera.position = Vector3Lerp(
+        (Vector3){ from->position[0], from->position[1], from->position[2] },
+        (Vector3){ to->position[0], to->position[1], to->position[2] }, t);
+    camera.fovy = Lerp(from->focalLength, to->focalLength, t);
+
+    return camera;
+}
+
+// The pattern must hold exactly one integer conversion such as %d or %04d
+static bool ValidFramePattern(const char *pattern) {
+    int conversions = 0;
+
+    for (const char *c = pattern; *c; c++) {
+        if (*c != '%') continue;
+
+        if (c[1] == '%') {
+            c++;
+            continue;
+        }
+
+        c++;
+        while (*c >= '0' && *c <= '9') c++;
+
+        if (*c != 'd') return false;
+        conversions++;
+    }
+
+    return conversions == 1;
+}
+
+static void *AnimationWorker(void *arg) {
+    AnimationJob *job = arg;
+    const CliOptions *options = &job->options;
+
+    TimelineThreadName("animation worker");
+
+    CpuFrame frame = AllocCpuFrame(options->width, options->height);
+    RayStats stats = { 0 };
+    char path[1024];
+
+    for (;;) {
+        int index = atomic_fetch_add(&job->nextFrame, 1);
+        int frameNumber = options->frameSlice + index * options->frameSlices;
+        if (frameNumber >= job->frameCount) break;
+
+        TimelineZone zone = TimelineBegin("animation frame", frameNumber);
+
+        Camera camera = CameraAtFrame(job->scene, frameNumber, job->fallback);
+        CpuCamera cpuCamera = InitCpuCamera(camera.position, camera.fovy, options->width, options->height);
+
+        // Each frame gets its own key so the noise does not sit still on screen
+        TraceFrame(job->cpuScene, &cpuCamera, &frame, 0, 0, options->samples, options->seed + (unsigned int)frameNumber, &stats);
+        AtrousFilter(&frame, DefaultAtrousParams(options->denoiseIterations));
+
+        snprintf(path, sizeof(path), options->animationOutput, frameNumber);
+
+        // Frames already run one per thread, so each is written on its own thread too
+        if (!ExportCpuFrame(&frame, path, ExrCompressionFromName(options->exrCompression), 1)) {
+            error("Failed to write animation frame.");
+        }
+
+        // Blocks while the writer is a ring of frames behind, so threads that run ahead wait their turn
+        if (job->video) {
+            Image image = CpuFrameToImage(&frame);
+            VideoSinkSubmit(job->video, frameNumber, image.data, false);
+
+            free(image.data);
+        }
+
+        TimelineEnd(zone);
+
+        int written = atomic_fetch_add(&job->written, 1) + 1;
+        printf("Frame %d written to %s (%d done, %.2fs)\n", frameNumber, path, written, Now() - job->start);
+    }
+
+    pthread_mutex_lock(&job->statsLock);
+    RayStatsMerge(&job->stats, &stats);
+    pthread_mutex_unlock(&job->statsLock);
+
+    CpuFrameFree(&frame);
+
+    return NULL;
+}
+
+// Hands each child process an interleaved slice of the frames, each loads the scene once
+static void RenderAnimationProcesses(CliOptions options) {
+    int processes = options.frameProcesses;
+    int threads = options.threads > 0 ? options.threads : CpuCount() / processes;
+    threads = threads > 0 ? threads : 1;
+
+    char width[16], height[16], samples[16], denoise[16], seed[16], threadArg[16], slice[32];
+    snprintf(width, sizeof(width), "%d", options.width);
+    snprintf(height, sizeof(height), "%d", options.height);
+    snprintf(samples, sizeof(samples), "%d", options.samples);
+    snprintf(denoise, sizeof(denoise), "%d", options.denoiseIterations);
+    snprintf(seed, sizeof(seed), "%u", options.seed);
+    snprintf(threadArg, sizeof(threadArg), "%d", threads);
+
+    char *argv[32] = {
+        (char *)options.programPath, "--scene", (char *)options.scenePath, "--animation", (char *)options.animationOutput,
+        "--width", width, "--height", height, "--spp", samples, "--denoise", denoise, "--seed", seed,
+        "--threads", threadArg, "--frame-slice", slice, "--exr-compression", (char *)options.exrCompression
+    };
+    int argc = 21;
+
+    if (options.isa) {
+        argv[argc++] = "--isa";
+        argv[argc++] = (char *)options.isa;
+    }
+
+    if (options.rayStats) {
+        argv[argc++] = "--ray-stats";
+    }
+
+    if (options.numa) {
+        argv[argc++] = "--numa";
+    }
+
+    // Each child writes its own timeline, timeline.json gives timeline_0.json, timeline_1.json and so on
+    char timeline[1024];
+
+    if (options.timelinePath) {
+        argv[argc++] = "--timeline";
+        argv[argc++] = timeline;
+    }
+
+    argv[argc] = NULL;
+
+    ProcessHandle *children = malloc(processes * sizeof(ProcessHandle));
+
+    for (int i = 0; i < processes; i++) {
+        snprintf(slice, sizeof(slice), "%d/%d", i, processes);
+
+        if (options.timelinePath) {
+            const char *path = options.timelinePath;
+            const char *extension = strrchr(path, '.');
+            const char *separator = strrchr(path, '/');
+
+            if (!extension || (separator && extension < separator)) {
+                extension = path + strlen(path);
+            }
+
+            snprintf(timeline, sizeof(timeline), "%.*s_%d%s", (int)(extension - path), path, i, extension);
+        }
+
+        children[i] = SpawnProcess(options.programPath, argv);
+        if (children[i] == INVALID_PROCESS) {
+            error("Failed to start a frame process.");
+        }
+    }
+
+    int failed = 0;
+    for (int i = 0; i < processes; i++) {
+        if (WaitProcess(children[i]) != 0) failed++;
+    }
+
+    free(children);
+
+    if (failed > 0) {
+        error("A frame process failed.");
+    }
+}
+
+void RenderAnimation(Scene scene, Camera camera, CliOptions options) {
+    int frameCount = AnimationFrameCount(&scene);
+
+    if (frameCount == 0) {
+        error("--animation needs [camera] keyframes in the scene.");
+    }
+
+    if (!ValidFramePattern(options.animationOutput)) {
+        error("--animation expects one frame number conversion, e.g. frames/frame_%04d.png.");
+    }
+
+    double start = Now();
+
+    if (options.frameProcesses > 0) {
+        RenderAnimationProcesses(options);
+        printf("Rendered %d frames in %d processes in %.2fs\n", frameCount, options.frameProcesses, Now() - start);
+
+        return;
+    }
+
+    int sliceFrames = (frameCount - options.frameSlice + options.frameSlices - 1) / options.frameSlices;
+    int threads = options.threads > 0 ? options.threads : CpuCount();
+    threads = threads < sliceFrames ? threads : sliceFrames;
+
+    CpuScene cpuScene = BuildCpuScene(scene);
+
+    AnimationJob job = {
+        .scene = &scene,
+        .cpuScene = &cpuScene,
+        .fallback = camera,
+        .options = options,
+        .frameCount = frameCount,
+        .start = start
+    };
+
+    if (options.videoOutput) {
+        job.video = VideoSinkOpen(options.videoOutput, VideoFormatFromName(options.videoFormat, options.videoOutput),
+            options.width, options.height, options.videoFps);
+    }
+
+    atomic_init(&job.nextFrame, 0);
+    atomic_init(&job.written, 0);
+    pthread_mutex_init(&job.statsLock, NULL);
+
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&workers[i], NULL, AnimationWorker, &job);
+    }
+
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    printf("Rendered %d frames at %dx%d, %d spp, %d at a time in %.2fs (%s kernels)\n",
+        sliceFrames, options.width, options.height, options.samples, threads, Now() - start, cpuKernels.name);
+
+    if (options.rayStats) {
+        PrintRayStats(&job.stats, Now() - start);
+    }
+
+    VideoSinkClose(job.video);
+
+    pthread_mutex_destroy(&job.statsLock);
+    free(workers);
+    CpuSceneFree(&cpuScene);
+}
@@ -0,0 +1,203 @@
+#include "../include/checkpoint.h"
+#include "../include/platform.h"
+#include "../include/timeline.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// On disk layout, every field 4 or 8 bytes so there is no padding. Pixels follow it
+typedef struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t seed;
+    uint64_t sceneHash;
+
+    int32_t frame;
+    int32_t accumulatedSamples;
+    float position[3];
+    float focalLength;
+
+    int32_t aaEnabled;
+    int32_t denoiseEnabled;
+    int32_t denoiseIterations;
+    uint32_t reserved;
+} CheckpointHeader;
+
+// Geometry and materials only, the camera is part of the checkpoint itself
+uint64_t SceneHash(const Scene *scene) {
+    size_t count = scene->objCount * SPHERE_WORDS;
+    float *words = malloc((count > 0 ? count : 1) * sizeof(float));
+
+    if (!words) {
+        error("Out of memory hashing scene.");
+    }
+
+    for (size_t i = 0; i < scene->objCount; i++) {
+        PackSphereWords(&scene->objects[i], &words[i * SPHERE_WORDS]);
+    }
+
+    uint64_t hash = HashBytes(words, count * sizeof(float));
+    free(words);
+
+    return hash;
+}
+
+static size_t PixelCount(const Checkpoint *checkpoint) {
+    return (size_t)checkpoint->width * checkpoint->height * 4;
+}
+
+bool WriteCheckpoint(const char *path, const Checkpoint *checkpoint) {
+    CheckpointHeader header = {
+        .version = CHECKPOINT_VERSION,
+        .width = (uint32_t)checkpoint->width,
+        .height = (uint32_t)checkpoint->height,
+        .seed = checkpoint->seed,
+        .sceneHash = checkpoint->sceneHash,
+        .frame = checkpoint->frame,
+        .accumulatedSamples = checkpoint->accumulatedSamples,
+        .position = { checkpoint->position[0], checkpoint->position[1], checkpoint->position[2] },
+        .focalLength = checkpoint->focalLength,
+        .aaEnabled = checkpoint->aaEnabled,
+        .denoiseEnabled = checkpoint->denoiseEnabled,
+        .denoiseIterations = checkpoint->denoiseIterations
+    };
+
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+
+    char temporary[1024];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+
+    FILE *file = fopen(temporary, "wb");
+    if (!file) return false;
+
+    size_t count = PixelCount(checkpoint);
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+        fwrite(checkpoint->pixels, sizeof(float), count, file) == count &&
+        SyncFile(file);
+
+    ok = fclose(file) == 0 && ok;
+
+    // Until the rename the previous checkpoint stays whole, a crash mid write only leaves the temporary behind
+    if (!ok || !ReplaceFileAtomic(temporary, path)) {
+        remove(temporary);
+        return false;
+    }
+
+    return true;
+}
+
+bool ReadCheckpoint(const char *path, Checkpoint *checkpoint) {
+    FILE *file = fopen(path, "rb");
+    if (!file) return false;
+
+    CheckpointHeader header;
+
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != CHECKPOINT_VERSION || header.width == 0 || header.height == 0) {
+        fclose(file);
+        return false;
+    }
+
+    *checkpoint = (Checkpoint){
+        .sceneHash = header.sceneHash,
+        .seed = header.seed,
+        .width = (int)header.width,
+        .height = (int)header.height,
+        .frame = header.frame,
+        .accumulatedSamples = header.accumulatedSamples,
+        .position = { header.position[0], header.position[1], header.position[2] },
+        .focalLength = header.focalLength,
+        .aaEnabled = header.aaEnabled,
+        .denoiseEnabled = header.denoiseEnabled,
+        .denoiseIterations = header.denoiseIterations
+    };
+
+    size_t count = PixelCount(checkpoint);
+    checkpoint->pixels = malloc(count * sizeof(float));
+
+    // A short file means it was cut off, which the rename should make impossible
+    bool ok = checkpoint->pixels && fread(checkpoint->pixels, sizeof(float), count, file) == count;
+    fclose(file);
+
+    if (!ok) {
+        CheckpointFree(checkpoint);
+    }
+
+    return ok;
+}
+
+void CheckpointFree(Checkpoint *checkpoint) {
+    free(checkpoint->pixels);
+    checkpoint->pixels = NULL;
+}
+
+static void *WriteCheckpointThread(void *arg) {
+    CheckpointWriter *writer = arg;
+    double start = Now();
+
+    TimelineThreadName("checkpoint writer");
+    TimelineZone zone = TimelineBegin("checkpoint write", writer->checkpoint.accumulatedSamples);
+    bool ok = WriteCheckpoint(writer->path, &writer->checkpoint);
+    TimelineEnd(zone);
+
+    if (ok) {
+        printf("Checkpoint saved to %s at %d samples (%.0f ms)\n",
+            writer->path, writer->checkpoint.accumulatedSamples, (Now() - start) * 1000.0);
+    } else {
+        fprintf(stderr, "Checkpoint: failed to write %s\n", writer->path);
+    }
+
+    atomic_store(&writer->busy, false);
+
+    return NULL;
+}
+
+bool SaveCheckpointAsync(CheckpointWriter *writer, const Checkpoint *checkpoint) {
+    if (atomic_load(&writer->busy)) return false;
+
+    if (writer->started) {
+        pthread_join(writer->thread, NULL);
+    }
+
+    size_t count = PixelCount(checkpoint);
+
+    if (writer->capacity < count) {
+        free(writer->checkpoint.pixels);
+
+        writer->checkpoint.pixels = malloc(count * sizeof(float));
+        writer->capacity = count;
+
+        if (!writer->checkpoint.pixels) {
+            error("Out of memory copying checkpoint.");
+        }
+    }
+
+    float *pixels = writer->checkpoint.pixels;
+    writer->checkpoint = *checkpoint;
+    writer->checkpoint.pixels = pixels;
+
+    memcpy(pixels, checkpoint->pixels, count * sizeof(float));
+
+    atomic_store(&writer->busy, true);
+    writer->started = pthread_create(&writer->thread, NULL, WriteCheckpointThread, writer) == 0;
+
+    if (!writer->started) {
+        atomic_store(&writer->busy, false);
+    }
+
+    return writer->started;
+}
+
+void CheckpointWriterFinish(CheckpointWriter *writer) {
+    if (writer->started) {
+        pthread_join(writer->thread, NULL);
+        writer->started = false;
+    }
+
+    free(writer->checkpoint.pixels);
+    writer->checkpoint.pixels = NULL;
+    writer->capacity = 0;
+}
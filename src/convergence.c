@@ -0,0 +1,297 @@
+#include "../include/convergence.h"
+#include "../include/checkpoint.h"
+#include "../include/cpukernels.h"
+#include "../include/cputracer.h"
+#include "../include/denoise.h"
+#include "../include/hdrwriter.h"
+#include "../include/platform.h"
+#include "../include/tilerender.h"
+#include "raylib.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct ConvergenceRun {
+    const char *sampler;
+    const char *estimator;
+    bool jitter;
+    bool lightSampling;
+} ConvergenceRun;
+
+static const ConvergenceRun convergenceRuns[] = {
+    { "jitter", "nee_mis", true, true },
+    { "jitter", "bsdf", true, false },
+    { "center", "nee_mis", false, true },
+    { "center", "bsdf", false, false }
+};
+
+// Everything that decides the reference's pixels, zeroed first so padding hashes the same
+typedef struct ReferenceKey {
+    uint64_t sceneHash;
+    float position[3];
+    float fovy;
+    int32_t width;
+    int32_t height;
+    int32_t samples;
+    uint32_t seed;
+    int32_t maxDepth;
+    int32_t version;
+} ReferenceKey;
+
+typedef struct ErrorMetrics {
+    double rmse;
+    double relMse;
+} ErrorMetrics;
+
+// Reads back what WritePfm wrote, RGB rows top to bottom
+static float *ReadPfm(const char *path, int width, int height) {
+    FILE *file = fopen(path, "rb");
+    if (!file) return NULL;
+
+    int fileWidth, fileHeight;
+    float scale;
+    float *pixels = NULL;
+
+    if (fscanf(file, "PF %d %d %f", &fileWidth, &fileHeight, &scale) == 3 &&
+        fgetc(file) == '\n' && fileWidth == width && fileHeight == height && scale < 0.0f) {
+        size_t rowFloats = (size_t)width * 3;
+        pixels = malloc(rowFloats * height * sizeof(float));
+
+        for (int y = height - 1; pixels && y >= 0; y--) {
+            if (fread(&pixels[y * rowFloats], sizeof(float), rowFloats, file) != rowFloats) {
+                free(pixels);
+                pixels = NULL;
+            }
+        }
+    }
+
+    fclose(file);
+    return pixels;
+}
+
+// Progressive render to a fixed pass count, resolved to linear RGB
+static float *RenderReference(const CpuScene *scene, CpuCamera camera, CliOptions options, unsigned int seed, int samples) {
+    int threads = options.threads > 0 ? options.threads : CpuCount();
+    size_t pixelCount = (size_t)camera.width * camera.height;
+
+    TileRenderer *renderer = TileRendererCreate(scene, camera.width, camera.height, options.tileSize, threads,
+        TILE_ORDER_SPIRAL, options.numa, seed);
+    TileRendererSetPassLimit(renderer, samples);
+
+    TileRendererReset(renderer, camera, true);
+    TileRendererWaitPasses(renderer, samples);
+
+    float *rgba = malloc(pixelCount * 4 * sizeof(float));
+    float *rgb = malloc(pixelCount * 3 * sizeof(float));
+
+    if (!rgba || !rgb) {
+        error("Out of memory allocating reference image.");
+    }
+
+    AccumBufferResolveLinear(&renderer->accum, rgba);
+    TileRendererFree(renderer);
+
+    for (size_t i = 0; i < pixelCount; i++) {
+        memcpy(&rgb[i * 3], &rgba[i * 4], 3 * sizeof(float));
+    }
+
+    free(rgba);
+    return rgb;
+}
+
+static float *LoadReference(const CpuScene *scene, Scene sceneDesc, Camera camera, CpuCamera cpuCamera, CliOptions options) {
+    ReferenceKey key;
+    memset(&key, 0, sizeof(key));
+
+    // A different key from the measured runs, so their samples are not part of the reference
+    unsigned int seed = ~options.seed;
+
+    key.sceneHash = SceneHash(&sceneDesc);
+    key.position[0] = camera.position.x;
+    key.position[1] = camera.position.y;
+    key.position[2] = camera.position.z;
+    key.fovy = camera.fovy;
+    key.width = cpuCamera.width;
+    key.height = cpuCamera.height;
+    key.samples = options.referenceSamples;
+    key.seed = seed;
+    key.maxDepth = CPU_MAX_DEPTH;
+    key.version = CONVERGENCE_CACHE_VERSION;
+
+    if (MakeDirectory(options.cacheDir) != 0) {
+        error("Failed to create cache directory.");
+    }
+
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/reference_%016llx.pfm", options.cacheDir, (unsigned long long)HashBytes(&key, sizeof(key)));
+
+    float *reference = ReadPfm(path, cpuCamera.width, cpuCamera.height);
+
+    if (reference) {
+        printf("Reference %s\n", path);
+        return reference;
+    }
+
+    printf("Rendering %d spp reference to %s\n", options.referenceSamples, path);
+
+    double start = Now();
+    reference = RenderReference(scene, cpuCamera, options, seed, options.referenceSamples);
+
+    HdrImage image = { .pixels = reference, .width = cpuCamera.width, .height = cpuCamera.height, .channels = 3, .bottomUp = false };
+
+    if (!WritePfm(path, image)) {
+        error("Failed to write reference image.");
+    }
+
+    printf("Reference took %.2fs\n", Now() - start);
+
+    return reference;
+}
+
+static ErrorMetrics MeasureError(const Vector3 *image, const float *reference, size_t pixelCount) {
+    double squared = 0.0;
+    double relative = 0.0;
+
+    for (size_t i = 0; i < pixelCount; i++) {
+        float values[3] = { image[i].x, image[i].y, image[i].z };
+
+        for (int c = 0; c < 3; c++) {
+            double expected = reference[i * 3 + c];
+            double difference = values[c] - expected;
+
+            squared += difference * difference;
+            relative += difference * difference / (expected * expected + CONVERGENCE_REL_EPSILON);
+        }
+    }
+
+    return (ErrorMetrics){
+        .rmse = sqrt(squared / (pixelCount * 3)),
+        .relMse = relative / (pixelCount * 3)
+    };
+}
+
+// Scores the current estimate raw and denoised, with the guides' first hits from a noise free center sample
+static void WriteCheckpointRows(FILE *csv, const ConvergenceRun *run, const char *checkpoint, TileRenderer *renderer,
+    CpuFrame *frame, const float *reference, int denoiseIterations, double seconds) {
+    size_t pixelCount = (size_t)frame->width * frame->height;
+    double samples = 0.0;
+
+    for (size_t i = 0; i < pixelCount; i++) {
+        Vector4 sum = AccumBufferGet(&renderer->accum, (int)i);
+        float scale = sum.w > 0.0f ? 1.0f / sum.w : 0.0f;
+
+        frame->colour[i] = (Vector3){ sum.x * scale, sum.y * scale, sum.z * scale };
+        samples += sum.w;
+    }
+
+    samples /= pixelCount;
+
+    ErrorMetrics raw = MeasureError(frame->colour, reference, pixelCount);
+
+    double start = Now();
+    AtrousFilter(frame, DefaultAtrousParams(denoiseIterations));
+    double denoiseMs = (Now() - start) * 1000.0;
+
+    ErrorMetrics denoised = MeasureError(frame->colour, reference, pixelCount);
+
+    fprintf(csv, "%s,%s,none,%s,%.3f,%.4f,0.000,%.6g,%.6g\n",
+        run->sampler, run->estimator, checkpoint, samples, seconds, raw.rmse, raw.relMse);
+    fprintf(csv, "%s,%s,atrous,%s,%.3f,%.4f,%.3f,%.6g,%.6g\n",
+        run->sampler, run->estimator, checkpoint, samples, seconds, denoiseMs, denoised.rmse, denoised.relMse);
+
+    printf("%-8s %-8s %-8s %9.2f %9.3f %12.5f %12.5f %12.5f %12.5f\n",
+        run->sampler, run->estimator, checkpoint, samples, seconds, raw.rmse, raw.relMse, denoised.rmse, denoised.relMse);
+}
+
+static void MeasureRun(FILE *csv, const ConvergenceRun *run, const CpuScene *scene, CpuCamera camera, CliOptions options,
+    CpuFrame *frame, const float *reference) {
+    int threads = options.threads > 0 ? options.threads : CpuCount();
+
+    CpuScene runScene = *scene;
+    runScene.lightSampling = run->lightSampling;
+
+    TileRenderer *renderer = TileRendererCreate(&runScene, camera.width, camera.height, options.tileSize, threads,
+        TileOrderFromName(options.tileOrder), options.numa, options.seed);
+
+    int nextSamples = 1;
+    double nextSeconds = CONVERGENCE_FIRST_SECONDS;
+    double rendered = 0.0;
+
+    TileRendererSetPassLimit(renderer, nextSamples);
+    TileRendererReset(renderer, camera, run->jitter);
+
+    double resumed = Now();
+
+    for (;;) {
+        int passes = TileRendererPasses(renderer);
+        double seconds = rendered + Now() - resumed;
+
+        bool sampleCheckpoint = passes >= nextSamples;
+        bool timeCheckpoint = seconds >= nextSeconds;
+
+        if (!sampleCheckpoint && !timeCheckpoint) {
+            SleepMs(1);
+            continue;
+        }
+
+        // Measuring neither takes the workers' cores nor counts as their time
+        TileRendererPause(renderer, true);
+        rendered += Now() - resumed;
+
+        if (sampleCheckpoint) {
+            WriteCheckpointRows(csv, run, "samples", renderer, frame, reference, options.denoiseIterations, rendered);
+            nextSamples = nextSamples * 2 < options.samples ? nextSamples * 2 : options.samples;
+        }
+
+        if (timeCheckpoint) {
+            WriteCheckpointRows(csv, run, "seconds", renderer, frame, reference, options.denoiseIterations, rendered);
+
+            // A slow render can pass several at once, they would all score the same image
+            while (nextSeconds <= rendered) nextSeconds *= 2.0;
+        }
+
+        if (passes >= options.samples) break;
+
+        TileRendererSetPassLimit(renderer, nextSamples);
+
+        resumed = Now();
+        TileRendererPause(renderer, false);
+    }
+
+    fflush(csv);
+    TileRendererFree(renderer);
+}
+
+void BenchmarkConvergence(Scene scene, Camera camera, CliOptions options) {
+    CpuScene cpuScene = BuildCpuScene(scene);
+    CpuCamera cpuCamera = InitCpuCamera(camera.position, camera.fovy, options.width, options.height);
+
+    float *reference = LoadReference(&cpuScene, scene, camera, cpuCamera, options);
+
+    // One unjittered sample gives the denoiser the same guides for every run
+    CpuFrame frame = AllocCpuFrame(options.width, options.height);
+    TraceFrame(&cpuScene, &cpuCamera, &frame, 0, 0, 1, options.seed, NULL);
+
+    FILE *csv = fopen(options.benchConvergence, "w");
+    if (!csv) {
+        error("Failed to open convergence CSV.");
+    }
+
+    fprintf(csv, "sampler,estimator,denoiser,checkpoint,spp,seconds,denoise_ms,rmse,relmse\n");
+
+    printf("Convergence, %dx%d, up to %d spp against %d spp, %s kernels\n",
+        options.width, options.height, options.samples, options.referenceSamples, cpuKernels.name);
+    printf("%-8s %-8s %-8s %9s %9s %12s %12s %12s %12s\n",
+        "sampler", "estimator", "at", "spp", "seconds", "rmse", "relmse", "atrous rmse", "atrous rel");
+
+    for (size_t i = 0; i < sizeof(convergenceRuns) / sizeof(convergenceRuns[0]); i++) {
+        MeasureRun(csv, &convergenceRuns[i], &cpuScene, cpuCamera, options, &frame, reference);
+    }
+
+    fclose(csv);
+    CpuFrameFree(&frame);
+    free(reference);
+    CpuSceneFree(&cpuScene);
+}
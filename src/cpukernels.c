@@ -0,0 +1,626 @@
+#include "../include/cpukernels.h"
+#include "../include/helpers.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #define CPU_KERNELS_X86
+    #include <cpuid.h>
+    #include <immintrin.h>
+#endif
+
+// A fused multiply-add rounds once instead of twice, which would break bit equality with the scalar path
+#pragma GCC optimize("fp-contract=off")
+
+static const char *isaNames[] = { "scalar", "sse4.2", "avx2", "avx512" };
+
+// Shared by every path: first lane with the smallest root wins, ties keep the lower index like the scalar loop
+static void PickNearest(const float *roots, unsigned int mask, int base, float *closest, int *best) {
+    for (int lane = 0; mask != 0; lane++, mask >>= 1) {
+        if ((mask & 1) && roots[lane] < *closest) {
+            *closest = roots[lane];
+            *best = base + lane;
+        }
+    }
+}
+
+static unsigned int LaneMask(int lanes, int remaining) {
+    return remaining >= lanes ? (1u << lanes) - 1 : (1u << remaining) - 1;
+}
+
+static int NearestSphereScalar(const SphereLanes *lanes, int first, int count, Ray ray, float tMin, float tMax, float *t) {
+    float a = ray.direction.x * ray.direction.x + ray.direction.y * ray.direction.y + ray.direction.z * ray.direction.z;
+    float closest = tMax;
+    int best = -1;
+
+    for (int i = first; i < first + count; i++) {
+        float ocx = lanes->x[i] - ray.position.x;
+        float ocy = lanes->y[i] - ray.position.y;
+        float ocz = lanes->z[i] - ray.position.z;
+
+        float h = ray.direction.x * ocx + ray.direction.y * ocy + ray.direction.z * ocz;
+        float c = (ocx * ocx + ocy * ocy + ocz * ocz) - lanes->radiusSq[i];
+
+        float discriminant = h * h - a * c;
+        if (discriminant < 0) continue;
+
+        float sqrtd = sqrtf(discriminant);
+
+        float root = (h - sqrtd) / a;
+        if (root <= tMin || root >= closest) {
+            root = (h + sqrtd) / a;
+            if (root <= tMin || root >= closest) continue;
+        }
+
+        closest = root;
+        best = i;
+    }
+
+    *t = closest;
+    return best;
+}
+
+static bool AnySphereScalar(const SphereLanes *lanes, int first, int count, Ray ray, float tMin, float tMax) {
+    float a = ray.direction.x * ray.direction.x + ray.direction.y * ray.direction.y + ray.direction.z * ray.direction.z;
+
+    for (int i = first; i < first + count; i++) {
+        float ocx = lanes->x[i] - ray.position.x;
+        float ocy = lanes->y[i] - ray.position.y;
+        float ocz = lanes->z[i] - ray.position.z;
+
+        float h = ray.direction.x * ocx + ray.direction.y * ocy + ray.direction.z * ocz;
+        float c = (ocx * ocx + ocy * ocy + ocz * ocz) - lanes->radiusSq[i];
+
+        float discriminant = h * h - a * c;
+        if (discriminant < 0) continue;
+
+        float sqrtd = sqrtf(discriminant);
+        float near = (h - sqrtd) / a;
+        float far = (h + sqrtd) / a;
+
+        if ((near > tMin && near < tMax) || (far > tMin && far < tMax)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void TonemapScalar(const float *rgbw, size_t pixelCount, unsigned char *rgba) {
+    for (size_t i = 0; i < pixelCount; i++) {
+        const float *value = &rgbw[i * 4];
+        float scale = value[3] > 0.0f ? 1.0f / value[3] : 0.0f;
+
+        for (int channel = 0; channel < 3; channel++) {
+            float colour = fminf(sqrtf(fmaxf(value[channel] * scale, 0.0f)), 1.0f);
+            rgba[i * 4 + channel] = (unsigned char)(colour * 255.0f + 0.5f);
+        }
+
+        rgba[i * 4 + 3] = 255;
+    }
+}
+
+static unsigned char LumaBt601(const unsigned char *p) {
+    return (unsigned char)(((66 * p[0] + 129 * p[1] + 25 * p[2] + 128) >> 8) + 16);
+}
+
+// Integer BT.601, the SIMD paths do the same multiplies and shifts so every ISA writes the same video
+static void RgbaToYuv420Scalar(const unsigned char *row0, const unsigned char *row1, int width,
+    unsigned char *y0, unsigned char *y1, unsigned char *u, unsigned char *v) {
+    for (int x = 0; x < width; x += 2) {
+        int x1 = x + 1 < width ? x + 1 : x;     // Odd widths repeat the last column
+
+        const unsigned char *p00 = row0 + x * 4, *p01 = row0 + x1 * 4;
+        const unsigned char *p10 = row1 + x * 4, *p11 = row1 + x1 * 4;
+
+        y0[x] = LumaBt601(p00);
+        y0[x1] = LumaBt601(p01);
+        y1[x] = LumaBt601(p10);
+        y1[x1] = LumaBt601(p11);
+
+        int r = p00[0] + p01[0] + p10[0] + p11[0];
+        int g = p00[1] + p01[1] + p10[1] + p11[1];
+        int b = p00[2] + p01[2] + p10[2] + p11[2];
+
+        u[x / 2] = (unsigned char)(((-38 * r - 74 * g + 112 * b + 512) >> 10) + 128);
+        v[x / 2] = (unsigned char)(((112 * r - 94 * g - 18 * b + 512) >> 10) + 128);
+    }
+}
+
+#ifdef CPU_KERNELS_X86
+
+static unsigned long long ReadXcr0(void) {
+    unsigned int eax, edx;
+    __asm__ volatile ("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+
+    return ((unsigned long long)edx << 32) | eax;
+}
+
+// SSE4.2: four spheres or one pixel per vector
+
+__attribute__((target("sse4.2")))
+static int NearestSphereSse(const SphereLanes *lanes, int first, int count, Ray ray, float tMin, float tMax, float *t) {
+    __m128 ox = _mm_set1_ps(ray.position.x), oy = _mm_set1_ps(ray.position.y), oz = _mm_set1_ps(ray.position.z);
+    __m128 dx = _mm_set1_ps(ray.direction.x), dy = _mm_set1_ps(ray.direction.y), dz = _mm_set1_ps(ray.direction.z);
+    __m128 a = _mm_set1_ps(ray.direction.x * ray.direction.x + ray.direction.y * ray.direction.y + ray.direction.z * ray.direction.z);
+    __m128 lo = _mm_set1_ps(tMin), hi = _mm_set1_ps(tMax), zero = _mm_setzero_ps();
+
+    float closest = tMax;
+    int best = -1;
+
+    for (int i = 0; i < count; i += 4) {
+        __m128 ocx = _mm_sub_ps(_mm_loadu_ps(lanes->x + first + i), ox);
+        __m128 ocy = _mm_sub_ps(_mm_loadu_ps(lanes->y + first + i), oy);
+        __m128 ocz = _mm_sub_ps(_mm_loadu_ps(lanes->z + first + i), oz);
+
+        __m128 h = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, ocx), _mm_mul_ps(dy, ocy)), _mm_mul_ps(dz, ocz));
+        __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)),
+            _mm_loadu_ps(lanes->radiusSq + first + i));
+
+        __m128 discriminant = _mm_sub_ps(_mm_mul_ps(h, h), _mm_mul_ps(a, c));
+        __m128 sqrtd = _mm_sqrt_ps(discriminant);
+        __m128 near = _mm_div_ps(_mm_sub_ps(h, sqrtd), a);
+        __m128 far = _mm_div_ps(_mm_add_ps(h, sqrtd), a);
+
+        __m128 nearOk = _mm_and_ps(_mm_cmpnle_ps(near, lo), _mm_cmpnge_ps(near, hi));
+        __m128 farOk = _mm_and_ps(_mm_cmpnle_ps(far, lo), _mm_cmpnge_ps(far, hi));
+        __m128 hit = _mm_and_ps(_mm_cmpnlt_ps(discriminant, zero), _mm_or_ps(nearOk, farOk));
+
+        unsigned int mask = (unsigned int)_mm_movemask_ps(hit) & LaneMask(4, count - i);
+        if (mask == 0) continue;
+
+        float roots[4];
+        _mm_storeu_ps(roots, _mm_blendv_ps(far, near, nearOk));
+        PickNearest(roots, mask, first + i, &closest, &best);
+    }
+
+    *t = closest;
+    return best;
+}
+
+__attribute__((target("sse4.2")))
+static bool AnySphereSse(const SphereLanes *lanes, int first, int count, Ray ray, float tMin, float tMax) {
+    __m128 ox = _mm_set1_ps(ray.position.x), oy = _mm_set1_ps(ray.position.y), oz = _mm_set1_ps(ray.position.z);
+    __m128 dx = _mm_set1_ps(ray.direction.x), dy = _mm_set1_ps(ray.direction.y), dz = _mm_set1_ps(ray.direction.z);
+    __m128 a = _mm_set1_ps(ray.direction.x * ray.direction.x + ray.direction.y * ray.direction.y + ray.direction.z * ray.direction.z);
+    __m128 lo = _mm_set1_ps(tMin), hi = _mm_set1_ps(tMax), zero = _mm_setzero_ps();
+
+    for (int i = 0; i < count; i += 4) {
+        __m128 ocx = _mm_sub_ps(_mm_loadu_ps(lanes->x + first + i), ox);
+        __m128 ocy = _mm_sub_ps(_mm_loadu_ps(lanes->y + first + i), oy);
+        __m128 ocz = _mm_sub_ps(_mm_loadu_ps(lanes->z + first + i), oz);
+
+        __m128 h = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, ocx), _mm_mul_ps(dy, ocy)), _mm_mul_ps(dz, ocz));
+        __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)),
+            _mm_loadu_ps(lanes->radiusSq + first + i));
+
+        __m128 discriminant = _mm_sub_ps(_mm_mul_ps(h, h), _mm_mul_ps(a, c));
+        __m128 sqrtd = _mm_sqrt_ps(discriminant);
+        __m128 near = _mm_div_ps(_mm_sub_ps(h, sqrtd), a);
+        __m128 far = _mm_div_ps(_mm_add_ps(h, sqrtd), a);
+
+        __m128 nearOk = _mm_and_ps(_mm_cmpgt_ps(near, lo), _mm_cmplt_ps(near, hi));
+        __m128 farOk = _mm_and_ps(_mm_cmpgt_ps(far, lo), _mm_cmplt_ps(far, hi));
+        __m128 hit = _mm_and_ps(_mm_cmpnlt_ps(discriminant, zero), _mm_or_ps(nearOk, farOk));
+
+        if ((unsigned int)_mm_movemask_ps(hit) & LaneMask(4, count - i)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+__attribute__((target("sse4.2")))
+static __m128i TonemapPixelSse(const float *rgbw) {
+    __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+
+    __m128 value = _mm_loadu_ps(rgbw);
+    __m128 weight = _mm_shuffle_ps(value, value, _MM_SHUFFLE(3, 3, 3, 3));
+    __m128 scale = _mm_and_ps(_mm_div_ps(one, weight), _mm_cmpgt_ps(weight, zero));
+
+    __m128 colour = _mm_min_ps(_mm_sqrt_ps(_mm_max_ps(_mm_mul_ps(value, scale), zero)), one);
+
+    return _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(colour, _mm_set1_ps(255.0f)), _mm_set1_ps(0.5f)));
+}
+
+__attribute__((target("sse4.2")))
+static void TonemapSse(const float *rgbw, size_t pixelCount, unsigned char *rgba) {
+    __m128i alpha = _mm_set1_epi32((int)0xFF000000u);
+    size_t i = 0;
+
+    // Four pixels fill one 16 byte store
+    for (; i + 4 <= pixelCount; i += 4) {
+        __m128i p01 = _mm_packs_epi32(TonemapPixelSse(rgbw + i * 4), TonemapPixelSse(rgbw + i * 4 + 4));
+        __m128i p23 = _mm_packs_epi32(TonemapPixelSse(rgbw + i * 4 + 8), TonemapPixelSse(rgbw + i * 4 + 12));
+
+        _mm_storeu_si128((__m128i *)(rgba + i * 4), _mm_or_si128(_mm_packus_epi16(p01, p23), alpha));
+    }
+
+    TonemapScalar(rgbw + i * 4, pixelCount - i, rgba + i * 4);
+}
+
+// Luma of four pixels widened to 16 bits, two per register, as 32-bit lanes
+__attribute__((target("sse4.2")))
+static __m128i LumaSse(__m128i pixels01, __m128i pixels23) {
+    __m128i weights = _mm_setr_epi16(66, 129, 25, 0, 66, 129, 25, 0);
+    __m128i luma = _mm_hadd_epi32(_mm_madd_epi16(pixels01, weights), _mm_madd_epi16(pixels23, weights));
+
+    return _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(luma, _mm_set1_epi32(128)), 8), _mm_set1_epi32(16));
+}
+
+// Chroma of 2x2 block sums, two blocks per register, as U0 U1 V0 V1
+__attribute__((target("sse4.2")))
+static __m128i ChromaSse(__m128i blocks) {
+    __m128i u = _mm_madd_epi16(blocks, _mm_setr_epi16(-38, -74, 112, 0, -38, -74, 112, 0));
+    __m128i v = _mm_madd_epi16(blocks, _mm_setr_epi16(112, -94, -18, 0, 112, -94, -18, 0));
+    __m128i chroma = _mm_hadd_epi32(u, v);
+
+    return _mm_add_epi32(_mm_srai_epi32(_mm_add_epi32(chroma, _mm_set1_epi32(512)), 10), _mm_set1_epi32(128));
+}
+
+__attribute__((target("sse4.2")))
+static void RgbaToYuv420Sse(const unsigned char *row0, const unsigned char *row1, int width,
+    unsigned char *y0, unsigned char *y1, unsigned char *u, unsigned char *v) {
+    __m128i zero = _mm_setzero_si128();
+    int x = 0;
+
+    // Eight pixels of each row give eight luma bytes per row and four of each chroma
+    for (; x + 8 <= width; x += 8) {
+        __m128i a0 = _mm_loadu_si128((const __m128i *)(row0 + x * 4));
+        __m128i b0 = _mm_loadu_si128((const __m128i *)(row0 + x * 4 + 16));
+        __m128i a1 = _mm_loadu_si128((const __m128i *)(row1 + x * 4));
+        __m128i b1 = _mm_loadu_si128((const __m128i *)(row1 + x * 4 + 16));
+
+        __m128i top[4] = { _mm_cvtepu8_epi16(a0), _mm_unpackhi_epi8(a0, zero), _mm_cvtepu8_epi16(b0), _mm_unpackhi_epi8(b0, zero) };
+        __m128i bottom[4] = { _mm_cvtepu8_epi16(a1), _mm_unpackhi_epi8(a1, zero), _mm_cvtepu8_epi16(b1), _mm_unpackhi_epi8(b1, zero) };
+
+        __m128i luma = _mm_packus_epi16(
+            _mm_packs_epi32(LumaSse(top[0], top[1]), LumaSse(top[2], top[3])),
+            _mm_packs_epi32(LumaSse(bottom[0], bottom[1]), LumaSse(bottom[2], bottom[3])));
+
+        _mm_storel_epi64((__m128i *)(y0 + x), luma);
+        _mm_storel_epi64((__m128i *)(y1 + x), _mm_unpackhi_epi64(luma, luma));
+
+        // Column pairs summed over both rows, the sums stay below 1024 so 16 bits hold them
+        __m128i chroma[2];
+        for (int half = 0; half < 2; half++) {
+            __m128i left = _mm_add_epi16(top[half * 2], bottom[half * 2]);
+            __m128i right = _mm_add_epi16(top[half * 2 + 1], bottom[half * 2 + 1]);
+
+            chroma[half] = ChromaSse(_mm_add_epi16(_mm_unpacklo_epi64(left, right), _mm_unpackhi_epi64(left, right)));
+        }
+
+        __m128i packed = _mm_packus_epi16(_mm_packs_epi32(
+            _mm_unpacklo_epi64(chroma[0], chroma[1]), _mm_unpackhi_epi64(chroma[0], chroma[1])), zero);
+
+        int us = _mm_cvtsi128_si32(packed), vs = _mm_extract_epi32(packed, 1);
+        memcpy(u + x / 2, &us, 4);
+        memcpy(v + x / 2, &vs, 4);
+    }
+
+    RgbaToYuv420Scalar(row0 + x * 4, row1 + x * 4, width - x, y0 + x, y1 + x, u + x / 2, v + x / 2);
+}
+
+// AVX2: eight spheres or two pixels per vector
+
+__attribute__((target("avx2")))
+static int NearestSphereAvx2(const SphereLanes *lanes, int first, int count, Ray ray, float tMin, float tMax, float *t) {
+    __m256 ox = _mm256_set1_ps(ray.position.x), oy = _mm256_set1_ps(ray.position.y), oz = _mm256_set1_ps(ray.position.z);
+    __m256 dx = _mm256_set1_ps(ray.direction.x), dy = _mm256_set1_ps(ray.direction.y), dz = _mm256_set1_ps(ray.direction.z);
+    __m256 a = _mm256_set1_ps(ray.direction.x * ray.direction.x + ray.direction.y * ray.direction.y + ray.direction.z * ray.direction.z);
+    __m256 lo = _mm256_set1_ps(tMin), hi = _mm256_set1_ps(tMax), zero = _mm256_setzero_ps();
+
+    float closest = tMax;
+    int best = -1;
+
+    for (int i = 0; i < count; i += 8) {
+        __m256 ocx = _mm256_sub_ps(_mm256_loadu_ps(lanes->x + first + i), ox);
+        __m256 ocy = _mm256_sub_ps(_mm256_loadu_ps(lanes->y + first + i), oy);
+        __m256 ocz = _mm256_sub_ps(_mm256_loadu_ps(lanes->z + first + i), oz);
+
+        __m256 h = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, ocx), _mm256_mul_ps(dy, ocy)), _mm256_mul_ps(dz, ocz));
+        __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)),
+            _mm256_loadu_ps(lanes->radiusSq + first + i));
+
+        __m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(h, h), _mm256_mul_ps(a, c));
+        __m256 sqrtd = _mm256_sqrt_ps(discriminant);
+        __m256 near = _mm256_div_ps(_mm256_sub_ps(h, sqrtd), a);
+        __m256 far = _mm256_div_ps(_mm256_add_ps(h, sqrtd), a);
+
+        __m256 nearOk = _mm256_and_ps(_mm256_cmp_ps(near, lo, _CMP_NLE_UQ), _mm256_cmp_ps(near, hi, _CMP_NGE_UQ));
+        __m256 farOk = _mm256_and_ps(_mm256_cmp_ps(far, lo, _CMP_NLE_UQ), _mm256_cmp_ps(far, hi, _CMP_NGE_UQ));
+        __m256 hit = _mm256_and_ps(_mm256_cmp_ps(discriminant, zero, _CMP_NLT_UQ), _mm256_or_ps(nearOk, farOk));
+
+        unsigned int mask = (unsigned int)_mm256_movemask_ps(hit) & LaneMask(8, count - i);
+        if (mask == 0) continue;
+
+        float roots[8];
+        _mm256_storeu_ps(roots, _mm256_blendv_ps(far, near, nearOk));
+        PickNearest(roots, mask, first + i, &closest, &best);
+    }
+
+    *t = closest;
+    return best;
+}
+
+__attribute__((target("avx2")))
+static bool AnySphereAvx2(const SphereLanes *lanes, int first, int count, Ray ray, float tMin, float tMax) {
+    __m256 ox = _mm256_set1_ps(ray.position.x), oy = _mm256_set1_ps(ray.position.y), oz = _mm256_set1_ps(ray.position.z);
+    __m256 dx = _mm256_set1_ps(ray.direction.x), dy = _mm256_set1_ps(ray.direction.y), dz = _mm256_set1_ps(ray.direction.z);
+    __m256 a = _mm256_set1_ps(ray.direction.x * ray.direction.x + ray.direction.y * ray.direction.y + ray.direction.z * ray.direction.z);
+    __m256 lo = _mm256_set1_ps(tMin), hi = _mm256_set1_ps(tMax), zero = _mm256_setzero_ps();
+
+    for (int i = 0; i < count; i += 8) {
+        __m256 ocx = _mm256_sub_ps(_mm256_loadu_ps(lanes->x + first + i), ox);
+        __m256 ocy = _mm256_sub_ps(_mm256_loadu_ps(lanes->y + first + i), oy);
+        __m256 ocz = _mm256_sub_ps(_mm256_loadu_ps(lanes->z + first + i), oz);
+
+        __m256 h = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, ocx), _mm256_mul_ps(dy, ocy)), _mm256_mul_ps(dz, ocz));
+        __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)),
+            _mm256_loadu_ps(lanes->radiusSq + first + i));
+
+        __m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(h, h), _mm256_mul_ps(a, c));
+        __m256 sqrtd = _mm256_sqrt_ps(discriminant);
+        __m256 near = _mm256_div_ps(_mm256_sub_ps(h, sqrtd), a);
+        __m256 far = _mm256_div_ps(_mm256_add_ps(h, sqrtd), a);
+
+        __m256 nearOk = _mm256_and_ps(_mm256_cmp_ps(near, lo, _CMP_GT_OQ), _mm256_cmp_ps(near, hi, _CMP_LT_OQ));
+        __m256 farOk = _mm256_and_ps(_mm256_cmp_ps(far, lo, _CMP_GT_OQ), _mm256_cmp_ps(far, hi, _CMP_LT_OQ));
+        __m256 hit = _mm256_and_ps(_mm256_cmp_ps(discriminant, zero, _CMP_NLT_UQ), _mm256_or_ps(nearOk, farOk));
+
+        if ((unsigned int)_mm256_movemask_ps(hit) & LaneMask(8, count - i)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+__attribute__((target("avx2")))
+static __m256i TonemapPairAvx2(const float *rgbw) {
+    __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+
+    __m256 value = _mm256_loadu_ps(rgbw);
+    __m256 weight = _mm256_shuffle_ps(value, value, _MM_SHUFFLE(3, 3, 3, 3));
+    __m256 scale = _mm256_and_ps(_mm256_div_ps(one, weight), _mm256_cmp_ps(weight, zero, _CMP_GT_OQ));
+
+    __m256 colour = _mm256_min_ps(_mm256_sqrt_ps(_mm256_max_ps(_mm256_mul_ps(value, scale), zero)), one);
+
+    return _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(colour, _mm256_set1_ps(255.0f)), _mm256_set1_ps(0.5f)));
+}
+
+__attribute__((target("avx2")))
+static void TonemapAvx2(const float *rgbw, size_t pixelCount, unsigned char *rgba) {
+    __m256i alpha = _mm256_set1_epi32((int)0xFF000000u);
+
+    // The packs work per 128 bit half, this puts the pixels back in order
+    __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    size_t i = 0;
+
+    for (; i + 8 <= pixelCount; i += 8) {
+        __m256i p0 = _mm256_packs_epi32(TonemapPairAvx2(rgbw + i * 4), TonemapPairAvx2(rgbw + i * 4 + 8));
+        __m256i p1 = _mm256_packs_epi32(TonemapPairAvx2(rgbw + i * 4 + 16), TonemapPairAvx2(rgbw + i * 4 + 24));
+        __m256i bytes = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(p0, p1), order);
+
+        _mm256_storeu_si256((__m256i *)(rgba + i * 4), _mm256_or_si256(bytes, alpha));
+    }
+
+    TonemapScalar(rgbw + i * 4, pixelCount - i, rgba + i * 4);
+}
+
+// Same sums as the SSE path over eight pixels, with the 128-bit lanes put back in pixel order afterwards
+__attribute__((target("avx2")))
+static void RgbaToYuv420Avx2(const unsigned char *row0, const unsigned char *row1, int width,
+    unsigned char *y0, unsigned char *y1, unsigned char *u, unsigned char *v) {
+    __m256i lumaWeights = _mm256_setr_epi16(66, 129, 25, 0, 66, 129, 25, 0, 66, 129, 25, 0, 66, 129, 25, 0);
+    __m256i uWeights = _mm256_setr_epi16(-38, -74, 112, 0, -38, -74, 112, 0, -38, -74, 112, 0, -38, -74, 112, 0);
+    __m256i vWeights = _mm256_setr_epi16(112, -94, -18, 0, 112, -94, -18, 0, 112, -94, -18, 0, 112, -94, -18, 0);
+    __m256i lumaOrder = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+    __m256i chromaOrder = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    int x = 0;
+
+    for (; x + 8 <= width; x += 8) {
+        // Pixels 0-3 and 4-7, each lane holds two widened pixels
+        __m256i top0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(row0 + x * 4)));
+        __m256i top1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(row0 + x * 4 + 16)));
+        __m256i bottom0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(row1 + x * 4)));
+        __m256i bottom1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(row1 + x * 4 + 16)));
+
+        __m256i lumaTop = _mm256_hadd_epi32(_mm256_madd_epi16(top0, lumaWeights), _mm256_madd_epi16(top1, lumaWeights));
+        __m256i lumaBottom = _mm256_hadd_epi32(_mm256_madd_epi16(bottom0, lumaWeights), _mm256_madd_epi16(bottom1, lumaWeights));
+
+        lumaTop = _mm256_permutevar8x32_epi32(lumaTop, lumaOrder);
+        lumaBottom = _mm256_permutevar8x32_epi32(lumaBottom, lumaOrder);
+
+        lumaTop = _mm256_add_epi32(_mm256_srai_epi32(_mm256_add_epi32(lumaTop, _mm256_set1_epi32(128)), 8), _mm256_set1_epi32(16));
+        lumaBottom = _mm256_add_epi32(_mm256_srai_epi32(_mm256_add_epi32(lumaBottom, _mm256_set1_epi32(128)), 8), _mm256_set1_epi32(16));
+
+        __m128i luma = _mm_packus_epi16(
+            _mm_packs_epi32(_mm256_castsi256_si128(lumaTop), _mm256_extracti128_si256(lumaTop, 1)),
+            _mm_packs_epi32(_mm256_castsi256_si128(lumaBottom), _mm256_extracti128_si256(lumaBottom, 1)));
+
+        _mm_storel_epi64((__m128i *)(y0 + x), luma);
+        _mm_storel_epi64((__m128i *)(y1 + x), _mm_unpackhi_epi64(luma, luma));
+
+        __m256i left = _mm256_add_epi16(top0, bottom0);
+        __m256i right = _mm256_add_epi16(top1, bottom1);
+        __m256i blocks = _mm256_add_epi16(_mm256_unpacklo_epi64(left, right), _mm256_unpackhi_epi64(left, right));
+
+        __m256i chroma = _mm256_hadd_epi32(_mm256_madd_epi16(blocks, uWeights), _mm256_madd_epi16(blocks, vWeights));
+        chroma = _mm256_permutevar8x32_epi32(chroma, chromaOrder);
+        chroma = _mm256_add_epi32(_mm256_srai_epi32(_mm256_add_epi32(chroma, _mm256_set1_epi32(512)), 10), _mm256_set1_epi32(128));
+
+        __m128i packed = _mm_packus_epi16(
+            _mm_packs_epi32(_mm256_castsi256_si128(chroma), _mm256_extracti128_si256(chroma, 1)), _mm_setzero_si128());
+
+        int us = _mm_cvtsi128_si32(packed), vs = _mm_extract_epi32(packed, 1);
+        memcpy(u + x / 2, &us, 4);
+        memcpy(v + x / 2, &vs, 4);
+    }
+
+    RgbaToYuv420Scalar(row0 + x * 4, row1 + x * 4, width - x, y0 + x, y1 + x, u + x / 2, v + x / 2);
+}
+
+// AVX-512: sixteen spheres or four pixels per vector
+
+__attribute__((target("avx512f")))
+static int NearestSphereAvx512(const SphereLanes *lanes, int first, int count, Ray ray, float tMin, float tMax, float *t) {
+    __m512 ox = _mm512_set1_ps(ray.position.x), oy = _mm512_set1_ps(ray.position.y), oz = _mm512_set1_ps(ray.position.z);
+    __m512 dx = _mm512_set1_ps(ray.direction.x), dy = _mm512_set1_ps(ray.direction.y), dz = _mm512_set1_ps(ray.direction.z);
+    __m512 a = _mm512_set1_ps(ray.direction.x * ray.direction.x + ray.direction.y * ray.direction.y + ray.direction.z * ray.direction.z);
+    __m512 lo = _mm512_set1_ps(tMin), hi = _mm512_set1_ps(tMax), zero = _mm512_setzero_ps();
+
+    float closest = tMax;
+    int best = -1;
+
+    for (int i = 0; i < count; i += 16) {
+        __m512 ocx = _mm512_sub_ps(_mm512_loadu_ps(lanes->x + first + i), ox);
+        __m512 ocy = _mm512_sub_ps(_mm512_loadu_ps(lanes->y + first + i), oy);
+        __m512 ocz = _mm512_sub_ps(_mm512_loadu_ps(lanes->z + first + i), oz);
+
+        __m512 h = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, ocx), _mm512_mul_ps(dy, ocy)), _mm512_mul_ps(dz, ocz));
+        __m512 c = _mm512_sub_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(ocx, ocx), _mm512_mul_ps(ocy, ocy)), _mm512_mul_ps(ocz, ocz)),
+            _mm512_loadu_ps(lanes->radiusSq + first + i));
+
+        __m512 discriminant = _mm512_sub_ps(_mm512_mul_ps(h, h), _mm512_mul_ps(a, c));
+        __m512 sqrtd = _mm512_sqrt_ps(discriminant);
+        __m512 near = _mm512_div_ps(_mm512_sub_ps(h, sqrtd), a);
+        __m512 far = _mm512_div_ps(_mm512_add_ps(h, sqrtd), a);
+
+        __mmask16 nearOk = _mm512_cmp_ps_mask(near, lo, _CMP_NLE_UQ) & _mm512_cmp_ps_mask(near, hi, _CMP_NGE_UQ);
+        __mmask16 farOk = _mm512_cmp_ps_mask(far, lo, _CMP_NLE_UQ) & _mm512_cmp_ps_mask(far, hi, _CMP_NGE_UQ);
+        __mmask16 hit = _mm512_cmp_ps_mask(discriminant, zero, _CMP_NLT_UQ) & (nearOk | farOk);
+
+        unsigned int mask = (unsigned int)hit & LaneMask(16, count - i);
+        if (mask == 0) continue;
+
+        float roots[16];
+        _mm512_storeu_ps(roots, _mm512_mask_blend_ps(nearOk, far, near));
+        PickNearest(roots, mask, first + i, &closest, &best);
+    }
+
+    *t = closest;
+    return best;
+}
+
+__attribute__((target("avx512f")))
+static bool AnySphereAvx512(const SphereLanes *lanes, int first, int count, Ray ray, float tMin, float tMax) {
+    __m512 ox = _mm512_set1_ps(ray.position.x), oy = _mm512_set1_ps(ray.position.y), oz = _mm512_set1_ps(ray.position.z);
+    __m512 dx = _mm512_set1_ps(ray.direction.x), dy = _mm512_set1_ps(ray.direction.y), dz = _mm512_set1_ps(ray.direction.z);
+    __m512 a = _mm512_set1_ps(ray.direction.x * ray.direction.x + ray.direction.y * ray.direction.y + ray.direction.z * ray.direction.z);
+    __m512 lo = _mm512_set1_ps(tMin), hi = _mm512_set1_ps(tMax), zero = _mm512_setzero_ps();
+
+    for (int i = 0; i < count; i += 16) {
+        __m512 ocx = _mm512_sub_ps(_mm512_loadu_ps(lanes->x + first + i), ox);
+        __m512 ocy = _mm512_sub_ps(_mm512_loadu_ps(lanes->y + first + i), oy);
+        __m512 ocz = _mm512_sub_ps(_mm512_loadu_ps(lanes->z + first + i), oz);
+
+        __m512 h = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, ocx), _mm512_mul_ps(dy, ocy)), _mm512_mul_ps(dz, ocz));
+        __m512 c = _mm512_sub_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(ocx, ocx), _mm512_mul_ps(ocy, ocy)), _mm512_mul_ps(ocz, ocz)),
+            _mm512_loadu_ps(lanes->radiusSq + first + i));
+
+        __m512 discriminant = _mm512_sub_ps(_mm512_mul_ps(h, h), _mm512_mul_ps(a, c));
+        __m512 sqrtd = _mm512_sqrt_ps(discriminant);
+        __m512 near = _mm512_div_ps(_mm512_sub_ps(h, sqrtd), a);
+        __m512 far = _mm512_div_ps(_mm512_add_ps(h, sqrtd), a);
+
+        __mmask16 nearOk = _mm512_cmp_ps_mask(near, lo, _CMP_GT_OQ) & _mm512_cmp_ps_mask(near, hi, _CMP_LT_OQ);
+        __mmask16 farOk = _mm512_cmp_ps_mask(far, lo, _CMP_GT_OQ) & _mm512_cmp_ps_mask(far, hi, _CMP_LT_OQ);
+        __mmask16 hit = _mm512_cmp_ps_mask(discriminant, zero, _CMP_NLT_UQ) & (nearOk | farOk);
+
+        if ((unsigned int)hit & LaneMask(16, count - i)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+__attribute__((target("avx512f")))
+static void TonemapAvx512(const float *rgbw, size_t pixelCount, unsigned char *rgba) {
+    __m512 zero = _mm512_setzero_ps(), one = _mm512_set1_ps(1.0f);
+    __m128i alpha = _mm_set1_epi32((int)0xFF000000u);
+    size_t i = 0;
+
+    for (; i + 4 <= pixelCount; i += 4) {
+        __m512 value = _mm512_loadu_ps(rgbw + i * 4);
+        __m512 weight = _mm512_shuffle_ps(value, value, _MM_SHUFFLE(3, 3, 3, 3));
+        __m512 scale = _mm512_maskz_div_ps(_mm512_cmp_ps_mask(weight, zero, _CMP_GT_OQ), one, weight);
+
+        __m512 colour = _mm512_min_ps(_mm512_sqrt_ps(_mm512_max_ps(_mm512_mul_ps(value, scale), zero)), one);
+        __m512i quantised = _mm512_cvttps_epi32(_mm512_add_ps(_mm512_mul_ps(colour, _mm512_set1_ps(255.0f)), _mm512_set1_ps(0.5f)));
+
+        _mm_storeu_si128((__m128i *)(rgba + i * 4), _mm_or_si128(_mm512_cvtusepi32_epi8(quantised), alpha));
+    }
+
+    TonemapScalar(rgbw + i * 4, pixelCount - i, rgba + i * 4);
+}
+
+#endif
+
+static const CpuKernels kernelTable[] = {
+    { CPU_ISA_SCALAR, "scalar", 1, NearestSphereScalar, AnySphereScalar, TonemapScalar, RgbaToYuv420Scalar },
+#ifdef CPU_KERNELS_X86
+    { CPU_ISA_SSE42, "sse4.2", 4, NearestSphereSse, AnySphereSse, TonemapSse, RgbaToYuv420Sse },
+    { CPU_ISA_AVX2, "avx2", 8, NearestSphereAvx2, AnySphereAvx2, TonemapAvx2, RgbaToYuv420Avx2 },
+    // 16-bit integer ops at 512 bits need AVX-512BW, which the avx512 level does not check for
+    { CPU_ISA_AVX512, "avx512", 16, NearestSphereAvx512, AnySphereAvx512, TonemapAvx512, RgbaToYuv420Avx2 },
+#endif
+};
+
+CpuKernels cpuKernels = { CPU_ISA_SCALAR, "scalar", 1, NearestSphereScalar, AnySphereScalar, TonemapScalar, RgbaToYuv420Scalar };
+
+// Highest level both the CPU and the OS support, the OS has to save the wider registers on a context switch
+CpuIsa DetectCpuIsa(void) {
+#ifdef CPU_KERNELS_X86
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return CPU_ISA_SCALAR;
+
+    bool sse42 = (ecx & bit_SSE4_2) != 0;
+    bool avx = (ecx & bit_AVX) != 0 && (ecx & bit_OSXSAVE) != 0;
+
+    unsigned long long xcr0 = avx ? ReadXcr0() : 0;
+    bool ymmSaved = (xcr0 & 0x06) == 0x06;
+    bool zmmSaved = (xcr0 & 0xE6) == 0xE6;
+
+    unsigned int leaf7 = 0;
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        leaf7 = ebx;
+    }
+
+    if (avx && zmmSaved && (leaf7 & bit_AVX512F)) return CPU_ISA_AVX512;
+    if (avx && ymmSaved && (leaf7 & bit_AVX2)) return CPU_ISA_AVX2;
+    if (sse42) return CPU_ISA_SSE42;
+#endif
+
+    return CPU_ISA_SCALAR;
+}
+
+CpuIsa CpuIsaFromName(const char *name) {
+    for (int i = 0; i < (int)(sizeof(isaNames) / sizeof(isaNames[0])); i++) {
+        if (strcmp(name, isaNames[i]) == 0) return (CpuIsa)i;
+    }
+
+    char errMsg[128];
+    snprintf(errMsg, sizeof(errMsg), "Unknown instruction set \"%s\" (scalar, sse4.2, avx2 or avx512)", name);
+
+    error(errMsg);
+    return CPU_ISA_SCALAR;
+}
+
+void SelectCpuKernels(CpuIsa isa) {
+    if (isa > DetectCpuIsa()) {
+        char errMsg[128];
+        snprintf(errMsg, sizeof(errMsg), "This CPU or OS does not support the %s kernels", isaNames[isa]);
+
+        error(errMsg);
+    }
+
+    for (int i = 0; i < (int)(sizeof(kernelTable) / sizeof(kernelTable[0])); i++) {
+        if (kernelTable[i].isa == isa) {
+            cpuKernels = kernelTable[i];
+        }
+    }
+}
@@ -0,0 +1,831 @@
+#include "../include/cputracer.h"
+#include "../include/cpukernels.h"
+#include "../include/denoise.h"
+#include "../include/helpers.h"
+#include "../include/platform.h"
+#include "../include/pngwriter.h"
+#include "../include/rng.h"
+#include "../include/timeline.h"
+#include "raylib.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RAYMATH_STATIC_INLINE
+#include "raymath.h"
+
+#define SKY_DEPTH 10000.0f
+#define BVH_STACK_SIZE 64
+
+/*
+ * CPU port of raytracing.frag. The scatter functions are kept line for line
+ * with the shader (including its quirks) so both backends converge to the
+ * same image.
+ */
+
+static Vector3 RandomUnitVec3(Rng *rng) {
+    for (int i = 0; i < 16; i++) {
+        Vector3 p = {
+            RngFloat(rng) * 2.0f - 1.0f,
+            RngFloat(rng) * 2.0f - 1.0f,
+            RngFloat(rng) * 2.0f - 1.0f
+        };
+        float lensq = Vector3LengthSqr(p);
+
+        if (lensq <= 1 && lensq > 1e-45f) {
+            return Vector3Scale(p, 1.0f / sqrtf(lensq));
+        }
+    }
+
+    return (Vector3){ 1.0f, 0.0f, 0.0f };
+}
+
+static Vector3 ShaderReflect(Vector3 v, Vector3 n) {
+    return Vector3Subtract(v, Vector3Scale(n, 2 * Vector3DotProduct(v, n)));
+}
+
+static Vector3 ShaderRefract(Vector3 uv, Vector3 n, float etaIOverEtaT) {
+    float cosTheta = fminf(Vector3DotProduct(Vector3Negate(uv), n), 1.0f);
+    Vector3 rOutPerp = Vector3Scale(Vector3Add(uv, Vector3Scale(n, cosTheta)), etaIOverEtaT);
+    Vector3 rOutParallel = Vector3Scale(n, -sqrtf(fabsf(1.0f - Vector3LengthSqr(rOutPerp))));
+
+    return Vector3Add(rOutPerp, rOutParallel);
+}
+
+static float Reflectance(float cosine, float ior) {
+    float r0 = (1.0f - ior) / (1.0f + ior);
+    r0 = r0 * r0;
+
+    return r0 + (1.0f - r0) * powf(1.0f - cosine, 5);
+}
+
+static bool NearZero(Vector3 a) {
+    float s = 1e-8f;
+    return (fabsf(a.x) < s) && (fabsf(a.y) < s) && (fabsf(a.z) < s);
+}
+
+static bool LambertianScatter(ShaderMaterial mat, HitRecord rec, Rng *rng, Vector3 *attenuation, Ray *scattered) {
+    Vector3 scatterDirection = Vector3Add(rec.normal, RandomUnitVec3(rng));
+
+    if (NearZero(scatterDirection)) {
+        scatterDirection = rec.normal;
+    }
+
+    *scattered = (Ray){ rec.pos, scatterDirection };
+    *attenuation = (Vector3){ mat.albedo[0], mat.albedo[1], mat.albedo[2] };
+
+    return true;
+}
+
+static bool MetalScatter(ShaderMaterial mat, Ray ray, HitRecord rec, Rng *rng, Vector3 *attenuation, Ray *scattered) {
+    Vector3 reflected = ShaderReflect(ray.direction, rec.normal);
+    reflected = Vector3Add(Vector3Normalize(reflected), Vector3Scale(RandomUnitVec3(rng), mat.roughness));
+
+    *scattered = (Ray){ rec.pos, reflected };
+    *attenuation = (Vector3){ mat.albedo[0], mat.albedo[1], mat.albedo[2] };
+
+    return Vector3DotProduct(scattered->direction, rec.normal) > 0;
+}
+
+static bool DielectricScatter(ShaderMaterial mat, Ray ray, HitRecord rec, Rng *rng, Vector3 *attenuation, Ray *scattered) {
+    *attenuation = (Vector3){ 1.0f, 1.0f, 1.0f };
+
+    Vector3 unitDirection = Vector3Normalize(ray.direction);
+    float cosTheta = fminf(Vector3DotProduct(Vector3Negate(unitDirection), rec.normal), 1.0f);
+    float sinTheta = sqrtf(1.0f - cosTheta * cosTheta);
+
+    bool cannotRefract = mat.ior * sinTheta > 1.0f;
+    Vector3 direction;
+
+    if (cannotRefract || Reflectance(cosTheta, mat.ior) > RngFloat(rng)) {
+        direction = ShaderReflect(unitDirection, rec.normal);
+    } else {
+        direction = ShaderRefract(unitDirection, rec.normal, mat.ior);
+    }
+
+    *scattered = (Ray){ rec.pos, direction };
+    return true;
+}
+
+bool Scatter(ShaderMaterial mat, Ray ray, HitRecord rec, Rng *rng, Vector3 *attenuation, Ray *scattered) {
+    if (mat.type == LAMBERTIAN) return LambertianScatter(mat, rec, rng, attenuation, scattered);
+    if (mat.type == METAL) return MetalScatter(mat, ray, rec, rng, attenuation, scattered);
+    if (mat.type == DIELECTRIC) return DielectricScatter(mat, ray, rec, rng, attenuation, scattered);
+
+    return false;
+}
+
+// Fills the record for a root picked by the intersection kernel
+static void SphereRecord(const Sphere *sphere, Ray ray, float root, HitRecord *rec) {
+    Vector3 center = { sphere->pos[0], sphere->pos[1], sphere->pos[2] };
+
+    rec->t = root;
+    rec->pos = Vector3Add(ray.position, Vector3Scale(ray.direction, root));
+    rec->material = sphere->material;
+
+    Vector3 outwardNormal = Vector3Scale(Vector3Subtract(rec->pos, center), 1.0f / sphere->radius);
+    rec->frontFace = Vector3DotProduct(ray.direction, outwardNormal) < 0;
+    rec->normal = rec->frontFace ? outwardNormal : Vector3Negate(outwardNormal);
+}
+
+static bool HitBounds(const BvhNode *node, Vector3 origin, Vector3 invDir, float tMax) {
+    float t0x = (node->min.x - origin.x) * invDir.x;
+    float t1x = (node->max.x - origin.x) * invDir.x;
+    float t0y = (node->min.y - origin.y) * invDir.y;
+    float t1y = (node->max.y - origin.y) * invDir.y;
+    float t0z = (node->min.z - origin.z) * invDir.z;
+    float t1z = (node->max.z - origin.z) * invDir.z;
+
+    float tNear = fmaxf(fmaxf(fminf(t0x, t1x), fminf(t0y, t1y)), fminf(t0z, t1z));
+    float tFar = fminf(fminf(fmaxf(t0x, t1x), fmaxf(t0y, t1y)), fmaxf(t0z, t1z));
+
+    return tNear <= tFar && tFar > 0.0f && tNear < tMax;
+}
+
+static bool HitWorld(const CpuScene *scene, Ray ray, float tMin, float tMax, HitRecord *rec, RayStats *stats) {
+    stats->rays++;
+
+    if (scene->nodeCount == 0) return false;
+
+    Vector3 invDir = { 1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z };
+
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+
+    bool hit = false;
+    float closest = tMax;
+
+    while (stackSize > 0) {
+        const BvhNode *node = &scene->nodes[stack[--stackSize]];
+        stats->nodesVisited++;
+
+        if (!HitBounds(node, ray.position, invDir, closest)) continue;
+
+        if (node->count > 0) {
+            stats->spheresTested += node->count;
+
+            float t;
+            int nearest = cpuKernels.nearestSphere(&scene->lanes, node->first, node->count, ray, tMin, closest, &t);
+
+            if (nearest >= 0) {
+                SphereRecord(&scene->spheres[nearest], ray, t, rec);
+                rec->object = nearest;
+
+                hit = true;
+                closest = t;
+            }
+        } else {
+            stack[stackSize++] = node->first;
+            stack[stackSize++] = node->first + 1;
+        }
+    }
+
+    return hit;
+}
+
+// Shadow query, stops at the first blocker and skips building a hit record
+static bool HitAny(const CpuScene *scene, Ray ray, float tMin, float tMax, RayStats *stats) {
+    stats->shadowRays++;
+
+    if (scene->nodeCount == 0) return false;
+
+    Vector3 invDir = { 1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z };
+
+    int stack[BVH_STACK_SIZE];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0) {
+        const BvhNode *node = &scene->nodes[stack[--stackSize]];
+        stats->nodesVisited++;
+
+        if (!HitBounds(node, ray.position, invDir, tMax)) continue;
+
+        if (node->count == 0) {
+            stack[stackSize++] = node->first;
+            stack[stackSize++] = node->first + 1;
+            continue;
+        }
+
+        stats->spheresTested += node->count;
+
+        if (cpuKernels.anySphere(&scene->lanes, node->first, node->count, ray, tMin, tMax)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static float PowerHeuristic(float pdf, float otherPdf) {
+    return (pdf * pdf) / (pdf * pdf + otherPdf * otherPdf);
+}
+
+// 1 - cos of the half angle the sphere covers from pos, 0 when pos is inside it
+static float SphereCapSize(const Sphere *sphere, Vector3 pos) {
+    Vector3 toCenter = Vector3Subtract((Vector3){ sphere->pos[0], sphere->pos[1], sphere->pos[2] }, pos);
+    float sinThetaMaxSq = sphere->radius * sphere->radius / Vector3LengthSqr(toCenter);
+
+    if (sinThetaMaxSq >= 1.0f) {
+        return 0.0f;
+    }
+
+    // Same as 1 - sqrt(1 - x), without cancellation for small lights
+    return sinThetaMaxSq / (1.0f + sqrtf(1.0f - sinThetaMaxSq));
+}
+
+// Solid angle pdf of picking this light and sampling its spherical cap
+static float SphereLightPdf(const CpuScene *scene, const Sphere *sphere, Vector3 pos) {
+    float capSize = SphereCapSize(sphere, pos);
+
+    if (capSize <= 0.0f) {
+        return 0.0f;
+    }
+
+    return 1.0f / (2.0f * PI * capSize * scene->lightCount);
+}
+
+// Uniformly samples a direction inside the cone the sphere subtends
+static bool SampleSphereLight(const Sphere *sphere, Vector3 pos, float u0, float u1, Vector3 *direction, float *dist) {
+    float capSize = SphereCapSize(sphere, pos);
+
+    if (capSize <= 0.0f) {
+        return false;
+    }
+
+    Vector3 toCenter = Vector3Subtract((Vector3){ sphere->pos[0], sphere->pos[1], sphere->pos[2] }, pos);
+    float centerDist = Vector3Length(toCenter);
+    Vector3 w = Vector3Scale(toCenter, 1.0f / centerDist);
+
+    float cosTheta = 1.0f - u0 * capSize;
+    float sinTheta = sqrtf(fmaxf(0.0f, 1.0f - cosTheta * cosTheta));
+    float phi = 2.0f * PI * u1;
+
+    Vector3 helper = fabsf(w.x) > 0.9f ? (Vector3){ 0.0f, 1.0f, 0.0f } : (Vector3){ 1.0f, 0.0f, 0.0f };
+    Vector3 v = Vector3Normalize(Vector3CrossProduct(w, helper));
+    Vector3 t = Vector3CrossProduct(w, v);
+
+    *direction = Vector3Normalize(Vector3Add(
+        Vector3Add(Vector3Scale(t, cosf(phi) * sinTheta), Vector3Scale(v, sinf(phi) * sinTheta)),
+        Vector3Scale(w, cosTheta)
+    ));
+
+    // Distance to the near side of the light along the sampled direction
+    float b = Vector3DotProduct(*direction, toCenter);
+    float c = centerDist * centerDist - sphere->radius * sphere->radius;
+    *dist = b - sqrtf(fmaxf(b * b - c, 0.0f));
+
+    return true;
+}
+
+// Next event estimation for a Lambertian hit, MIS weighted against the BSDF sample
+static Vector3 SampleLights(const CpuScene *scene, HitRecord rec, Rng *rng, RayStats *stats) {
+    if (scene->lightCount == 0) {
+        return Vector3Zero();
+    }
+
+    float u0 = RngFloat(rng);
+    float u1 = RngFloat(rng);
+    float u2 = RngFloat(rng);
+
+    int light = (int)(u0 * scene->lightCount);
+    const Sphere *emitter = &scene->spheres[scene->lights[light < scene->lightCount ? light : scene->lightCount - 1]];
+
+    Vector3 direction;
+    float dist;
+
+    if (!SampleSphereLight(emitter, rec.pos, u1, u2, &direction, &dist)) {
+        return Vector3Zero();
+    }
+
+    float cosine = Vector3DotProduct(rec.normal, direction);
+    if (cosine <= 0.0f) {
+        return Vector3Zero();
+    }
+
+    if (HitAny(scene, (Ray){ rec.pos, direction }, 0.0001f, dist * 0.999f, stats)) {
+        return Vector3Zero();
+    }
+
+    float lightPdf = SphereLightPdf(scene, emitter, rec.pos);
+    float bsdfPdf = cosine / PI;
+
+    float scale = emitter->material.emission * cosine / (PI * lightPdf) * PowerHeuristic(lightPdf, bsdfPdf);
+
+    return (Vector3){
+        rec.material.albedo[0] * emitter->material.albedo[0] * scale,
+        rec.material.albedo[1] * emitter->material.albedo[1] * scale,
+        rec.material.albedo[2] * emitter->material.albedo[2] * scale
+    };
+}
+
+// Records how a path ended, bounces is the number of surfaces it hit
+static void EndPath(RayStats *stats, int bounces, int material) {
+    stats->depth[bounces]++;
+
+    if (material >= 0 && material < RAY_STATS_MATERIALS) {
+        stats->materialEnds[material]++;
+    }
+}
+
+static Vector3 RayColour(const CpuScene *scene, Ray ray, Rng *rng, PixelSample *sample, RayStats *stats) {
+    Vector3 attenuationAccum = { 1.0f, 1.0f, 1.0f };
+    Vector3 radiance = Vector3Zero();
+    Ray currentRay = ray;
+
+    // BSDF pdf of the last bounce, 0 when it came from the camera or a specular surface
+    float lastBsdfPdf = 0.0f;
+    Vector3 lastPos = ray.position;
+
+    // Escaped rays face the camera and sit far away, so the sky filters as one surface
+    sample->normal = Vector3Negate(Vector3Normalize(ray.direction));
+    sample->depth = SKY_DEPTH;
+    sample->albedo = (Vector3){ 1.0f, 1.0f, 1.0f };
+
+    stats->paths++;
+
+    for (int i = 0; i < CPU_MAX_DEPTH; i++) {
+        HitRecord rec;
+        RngSetBounce(rng, i + 1);
+
+        if (HitWorld(scene, currentRay, 0.0001f, POS_INFINITY, &rec, stats)) {
+            if (i == 0) {
+                sample->normal = rec.normal;
+                sample->depth = rec.t * Vector3Length(ray.direction);
+                sample->albedo = rec.material.type == DIELECTRIC
+                    ? (Vector3){ 1.0f, 1.0f, 1.0f }
+                    : (Vector3){ rec.material.albedo[0], rec.material.albedo[1], rec.material.albedo[2] };
+            }
+
+            if (rec.material.type == EMISSIVE) {
+                float weight = 1.0f;
+
+                // Lights were already sampled directly from Lambertian hits
+                if (lastBsdfPdf > 0.0f) {
+                    weight = PowerHeuristic(lastBsdfPdf, SphereLightPdf(scene, &scene->spheres[rec.object], lastPos));
+                }
+
+                Vector3 emitted = Vector3Scale(
+                    (Vector3){ rec.material.albedo[0], rec.material.albedo[1], rec.material.albedo[2] },
+                    rec.material.emission * weight
+                );
+
+                EndPath(stats, i + 1, rec.material.type);
+                return Vector3Add(radiance, Vector3Multiply(attenuationAccum, emitted));
+            }
+
+            Ray scattered;
+            Vector3 attenuation;
+            bool sampleLights = rec.material.type == LAMBERTIAN && scene->lightSampling;
+
+            if (sampleLights) {
+                radiance = Vector3Add(radiance, Vector3Multiply(attenuationAccum, SampleLights(scene, rec, rng, stats)));
+            }
+
+            bool didScatter = Scatter(rec.material, currentRay, rec, rng, &attenuation, &scattered);
+
+            // Without light samples a light hit by the bounce keeps its full weight
+            lastBsdfPdf = sampleLights
+                ? fmaxf(Vector3DotProduct(rec.normal, Vector3Normalize(scattered.direction)), 0.0f) / PI
+                : 0.0f;
+
+            if (!didScatter) {
+                EndPath(stats, i + 1, rec.material.type);
+                return radiance;
+            }
+
+            attenuationAccum = Vector3Multiply(attenuationAccum, attenuation);
+            lastPos = rec.pos;
+            currentRay = scattered;
+        } else {
+            // The shader shades the sky from the primary ray direction
+            Vector3 unitDirection = Vector3Normalize(ray.direction);
+            float a = 0.5f * (unitDirection.y + 1.0f);
+
+            Vector3 sky = Vector3Lerp((Vector3){ 1.0f, 1.0f, 1.0f }, (Vector3){ 0.5f, 0.7f, 1.0f }, a);
+
+            stats->skyEnds++;
+            EndPath(stats, i, -1);
+            return Vector3Add(radiance, Vector3Multiply(attenuationAccum, sky));
+        }
+    }
+
+    stats->depthLimited++;
+    EndPath(stats, CPU_MAX_DEPTH, -1);
+    return radiance;
+}
+
+static Vector3 SphereMin(const Sphere *s) {
+    return (Vector3){ s->pos[0] - s->radius, s->pos[1] - s->radius, s->pos[2] - s->radius };
+}
+
+static Vector3 SphereMax(const Sphere *s) {
+    return (Vector3){ s->pos[0] + s->radius, s->pos[1] + s->radius, s->pos[2] + s->radius };
+}
+
+static int CompareX(const void *a, const void *b) {
+    float d = ((const Sphere *)a)->pos[0] - ((const Sphere *)b)->pos[0];
+    return (d > 0) - (d < 0);
+}
+
+static int CompareY(const void *a, const void *b) {
+    float d = ((const Sphere *)a)->pos[1] - ((const Sphere *)b)->pos[1];
+    return (d > 0) - (d < 0);
+}
+
+static int CompareZ(const void *a, const void *b) {
+    float d = ((const Sphere *)a)->pos[2] - ((const Sphere *)b)->pos[2];
+    return (d > 0) - (d < 0);
+}
+
+// Median split on the widest centroid axis, children are always stored side by side
+static void BuildNode(CpuScene *scene, int nodeIndex, int first, int count) {
+    BvhNode *node = &scene->nodes[nodeIndex];
+    Sphere *spheres = scene->spheres + first;
+
+    node->min = SphereMin(&spheres[0]);
+    node->max = SphereMax(&spheres[0]);
+
+    Vector3 centroidMin = { spheres[0].pos[0], spheres[0].pos[1], spheres[0].pos[2] };
+    Vector3 centroidMax = centroidMin;
+
+    for (int i = 1; i < count; i++) {
+        Vector3 centroid = { spheres[i].pos[0], spheres[i].pos[1], spheres[i].pos[2] };
+
+        node->min = Vector3Min(node->min, SphereMin(&spheres[i]));
+        node->max = Vector3Max(node->max, SphereMax(&spheres[i]));
+        centroidMin = Vector3Min(centroidMin, centroid);
+        centroidMax = Vector3Max(centroidMax, centroid);
+    }
+
+    if (count <= BVH_LEAF_SIZE) {
+        node->first = first;
+        node->count = count;
+        return;
+    }
+
+    Vector3 extent = Vector3Subtract(centroidMax, centroidMin);
+
+    if (extent.x >= extent.y && extent.x >= extent.z) {
+        qsort(spheres, count, sizeof(Sphere), CompareX);
+    } else if (extent.y >= extent.z) {
+        qsort(spheres, count, sizeof(Sphere), CompareY);
+    } else {
+        qsort(spheres, count, sizeof(Sphere), CompareZ);
+    }
+
+    int left = scene->nodeCount;
+    scene->nodeCount += 2;
+
+    node->first = left;
+    node->count = 0;
+
+    int half = count / 2;
+    BuildNode(scene, left, first, half);
+    BuildNode(scene, left + 1, first + half, count - half);
+}
+
+// Padded so a kernel can load a full vector starting at any sphere
+static SphereLanes BuildSphereLanes(const Sphere *spheres, size_t count) {
+    size_t padded = count + CPU_KERNEL_MAX_LANES;
+
+    SphereLanes lanes = {
+        .x = calloc(padded, sizeof(float)),
+        .y = calloc(padded, sizeof(float)),
+        .z = calloc(padded, sizeof(float)),
+        .radiusSq = calloc(padded, sizeof(float))
+    };
+
+    if (!lanes.x || !lanes.y || !lanes.z || !lanes.radiusSq) {
+        error("Out of memory allocating sphere lanes.");
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        lanes.x[i] = spheres[i].pos[0];
+        lanes.y[i] = spheres[i].pos[1];
+        lanes.z[i] = spheres[i].pos[2];
+        lanes.radiusSq[i] = spheres[i].radius * spheres[i].radius;
+    }
+
+    return lanes;
+}
+
+static void SphereLanesFree(SphereLanes *lanes) {
+    free(lanes->x);
+    free(lanes->y);
+    free(lanes->z);
+    free(lanes->radiusSq);
+}
+
+CpuScene BuildCpuScene(Scene scene) {
+    CpuScene cpuScene = {
+        .spheres = malloc(scene.objCount * sizeof(Sphere)),
+        .sphereCount = scene.objCount,
+        .nodes = malloc((2 * scene.objCount + 1) * sizeof(BvhNode)),
+        .nodeCount = 0,
+        .lights = malloc((scene.objCount + 1) * sizeof(int)),
+        .lightCount = 0,
+        .lightSampling = true
+    };
+
+    memcpy(cpuScene.spheres, scene.objects, scene.objCount * sizeof(Sphere));
+
+    if (scene.objCount > 0) {
+        cpuScene.nodeCount = 1;
+        BuildNode(&cpuScene, 0, 0, (int)scene.objCount);
+    }
+
+    // The BVH build reorders spheres, so the light list is rebuilt from the new order
+    for (size_t i = 0; i < cpuScene.sphereCount; i++) {
+        if (cpuScene.spheres[i].material.type == EMISSIVE) {
+            cpuScene.lights[cpuScene.lightCount++] = (int)i;
+        }
+    }
+
+    cpuScene.lanes = BuildSphereLanes(cpuScene.spheres, cpuScene.sphereCount);
+
+    return cpuScene;
+}
+
+// Deep copy, the pages land on the node of whichever thread calls this
+CpuScene CloneCpuScene(const CpuScene *scene) {
+    CpuScene clone = *scene;
+
+    clone.spheres = malloc(scene->sphereCount * sizeof(Sphere));
+    clone.nodes = malloc(scene->nodeCount * sizeof(BvhNode));
+    clone.lights = malloc((scene->lightCount > 0 ? scene->lightCount : 1) * sizeof(int));
+
+    if (!clone.spheres || !clone.nodes || !clone.lights) {
+        error("Out of memory cloning CPU scene.");
+    }
+
+    memcpy(clone.spheres, scene->spheres, scene->sphereCount * sizeof(Sphere));
+    memcpy(clone.nodes, scene->nodes, scene->nodeCount * sizeof(BvhNode));
+    memcpy(clone.lights, scene->lights, scene->lightCount * sizeof(int));
+
+    clone.lanes = BuildSphereLanes(clone.spheres, clone.sphereCount);
+
+    return clone;
+}
+
+void CpuSceneFree(CpuScene *scene) {
+    if (!scene) return;
+
+    free(scene->spheres);
+    free(scene->nodes);
+    free(scene->lights);
+    SphereLanesFree(&scene->lanes);
+}
+
+CpuCamera InitCpuCamera(Vector3 position, float focalLength, int width, int height) {
+    CpuCamera camera = {
+        .position = position,
+        .focalLength = focalLength,
+        .width = width,
+        .height = height
+    };
+
+    float viewportHeight = 2.0f;
+    float viewportWidth = viewportHeight * ((float)width / height);
+
+    Vector3 viewportU = { viewportWidth, 0.0f, 0.0f };
+    Vector3 viewportV = { 0.0f, viewportHeight, 0.0f };
+
+    camera.pixelDeltaU = Vector3Scale(viewportU, 1.0f / width);
+    camera.pixelDeltaV = Vector3Scale(viewportV, 1.0f / height);
+
+    // Same as the shader, pixel (0, 0) is the bottom left corner
+    Vector3 viewportCorner = Vector3Subtract(position, (Vector3){ 0.0f, 0.0f, focalLength });
+    viewportCorner = Vector3Subtract(viewportCorner, Vector3Scale(viewportU, 0.5f));
+    viewportCorner = Vector3Subtract(viewportCorner, Vector3Scale(viewportV, 0.5f));
+
+    camera.pixel00Loc = Vector3Add(viewportCorner, Vector3Scale(Vector3Add(camera.pixelDeltaU, camera.pixelDeltaV), 0.5f));
+
+    return camera;
+}
+
+// x and y are image coordinates with row 0 at the top
+PixelSample TracePixel(const CpuScene *scene, const CpuCamera *camera, int x, int y, bool jitter, Rng *rng, RayStats *stats) {
+    float px = (float)x;
+    float py = (float)(camera->height - 1 - y);
+
+    if (jitter) {
+        px += RngFloat(rng) - 0.5f;
+        py += RngFloat(rng) - 0.5f;
+    }
+
+    Vector3 pixelSample = Vector3Add(
+        camera->pixel00Loc,
+        Vector3Add(Vector3Scale(camera->pixelDeltaU, px), Vector3Scale(camera->pixelDeltaV, py))
+    );
+
+    Ray ray = { camera->position, Vector3Subtract(pixelSample, camera->position) };
+
+    PixelSample sample;
+    sample.colour = RayColour(scene, ray, rng, &sample, stats);
+
+    return sample;
+}
+
+void RayStatsMerge(RayStats *into, const RayStats *from) {
+    into->paths += from->paths;
+    into->rays += from->rays;
+    into->shadowRays += from->shadowRays;
+    into->nodesVisited += from->nodesVisited;
+    into->spheresTested += from->spheresTested;
+    into->skyEnds += from->skyEnds;
+    into->depthLimited += from->depthLimited;
+
+    for (int i = 0; i <= CPU_MAX_DEPTH; i++) {
+        into->depth[i] += from->depth[i];
+    }
+
+    for (int i = 0; i < RAY_STATS_MATERIALS; i++) {
+        into->materialEnds[i] += from->materialEnds[i];
+    }
+}
+
+// Seconds is the time spent tracing, 0 leaves out the ray rate
+void PrintRayStats(const RayStats *stats, double seconds) {
+    static const char *materials[RAY_STATS_MATERIALS] = { "lambertian", "metal", "dielectric", "emissive" };
+
+    long long queries = stats->rays + stats->shadowRays;
+    double perQuery = queries > 0 ? 1.0 / queries : 0.0;
+    double perPath = stats->paths > 0 ? 1.0 / stats->paths : 0.0;
+
+    printf("Ray stats: %lld paths, %lld rays, %lld shadow rays", stats->paths, stats->rays, stats->shadowRays);
+    if (seconds > 0.0) {
+        printf(" (%.2f Mrays/s)", queries / seconds / 1e6);
+    }
+    printf("\n");
+    printf("  per ray: %.1f BVH nodes, %.1f spheres tested, per path: %.2f bounces\n",
+        stats->nodesVisited * perQuery, stats->spheresTested * perQuery, stats->rays * perPath);
+
+    printf("  depth:");
+    for (int i = 0; i <= CPU_MAX_DEPTH; i++) {
+        printf(" %d=%.1f%%", i, 100.0 * stats->depth[i] * perPath);
+    }
+    printf("\n");
+
+    printf("  ended: sky %.1f%%", 100.0 * stats->skyEnds * perPath);
+    for (int i = 0; i < RAY_STATS_MATERIALS; i++) {
+        printf(", %s %.1f%%", materials[i], 100.0 * stats->materialEnds[i] * perPath);
+    }
+    printf(", depth limit %.1f%%\n", 100.0 * stats->depthLimited * perPath);
+}
+
+CpuFrame AllocCpuFrame(int width, int height) {
+    size_t pixelCount = (size_t)width * height;
+
+    CpuFrame frame = {
+        .width = width,
+        .height = height,
+        .colour = calloc(pixelCount, sizeof(Vector3)),
+        .normal = calloc(pixelCount, sizeof(Vector3)),
+        .depth = calloc(pixelCount, sizeof(float)),
+        .albedo = calloc(pixelCount, sizeof(Vector3))
+    };
+
+    if (!frame.colour || !frame.normal || !frame.depth || !frame.albedo) {
+        error("Out of memory allocating CPU frame.");
+    }
+
+    return frame;
+}
+
+void CpuFrameFree(CpuFrame *frame) {
+    if (!frame) return;
+
+    free(frame->colour);
+    free(frame->normal);
+    free(frame->depth);
+    free(frame->albedo);
+}
+
+// Same sqrt gamma as LinearToGamma in the shader
+unsigned char GammaByte(float linear) {
+    return (unsigned char)(Clampf(sqrtf(fmaxf(linear, 0.0f)), 0.0f, 1.0f) * 255.0f + 0.5f);
+}
+
+Image CpuFrameToImage(const CpuFrame *frame) {
+    size_t pixelCount = (size_t)frame->width * frame->height;
+    unsigned char *pixels = malloc(pixelCount * 4);
+
+    for (size_t i = 0; i < pixelCount; i++) {
+        Vector3 c = frame->colour[i];
+
+        pixels[i * 4 + 0] = GammaByte(c.x);
+        pixels[i * 4 + 1] = GammaByte(c.y);
+        pixels[i * 4 + 2] = GammaByte(c.z);
+        pixels[i * 4 + 3] = 255;
+    }
+
+    Image image = {
+        .data = pixels,
+        .width = frame->width,
+        .height = frame->height,
+        .mipmaps = 1,
+        .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8
+    };
+
+    return image;
+}
+
+// Writes the frame's colour by extension: linear float for .exr and .pfm, gamma corrected 8-bit for the rest
+bool ExportCpuFrame(const CpuFrame *frame, const char *path, ExrCompression compression, int threads) {
+    if (IsHdrPath(path)) {
+        HdrImage image = {
+            .pixels = (const float *)frame->colour,
+            .width = frame->width,
+            .height = frame->height,
+            .channels = 3,
+            .bottomUp = false
+        };
+
+        return WriteHdrImage(path, image, compression, threads);
+    }
+
+    Image image = CpuFrameToImage(frame);
+
+    // Renders are opaque, so PNGs drop the alpha channel and are encoded in strips on every thread
+    bool ok = PathHasExtension(path, "png") ? WritePng(path, image.data, image.width, image.height, false, threads) : ExportImage(image, path);
+
+    free(image.data);
+    return ok;
+}
+
+// Fills the frame with the region of the camera's image whose top left pixel is (originX, originY).
+// Pixels keep their whole-image index as the RNG key, so a region matches the same pixels of a full render
+void TraceFrame(const CpuScene *scene, const CpuCamera *camera, CpuFrame *frame, int originX, int originY, int samples, unsigned int seed, RayStats *stats) {
+    RayStats discarded = { 0 };
+    if (!stats) stats = &discarded;
+
+    // Jitter only pays off with more than one sample, matching the AA toggle
+    bool jitter = samples > 1;
+
+    for (int y = 0; y < frame->height; y++) {
+        for (int x = 0; x < frame->width; x++) {
+            int index = y * frame->width + x;
+            unsigned int pixel = (unsigned int)((size_t)(originY + y) * camera->width + originX + x);
+
+            Vector3 colour = Vector3Zero();
+
+            for (int s = 0; s < samples; s++) {
+                Rng rng = InitRng(seed, pixel, s);
+                PixelSample sample = TracePixel(scene, camera, originX + x, originY + y, jitter, &rng, stats);
+                colour = Vector3Add(colour, sample.colour);
+
+                if (s == 0) {
+                    frame->normal[index] = sample.normal;
+                    frame->depth[index] = sample.depth;
+                    frame->albedo[index] = sample.albedo;
+                }
+            }
+
+            frame->colour[index] = Vector3Scale(colour, 1.0f / samples);
+        }
+    }
+}
+
+void RenderOffline(Scene scene, Camera camera, CliOptions options) {
+    double start = Now();
+
+    CpuScene cpuScene = BuildCpuScene(scene);
+    CpuCamera cpuCamera = InitCpuCamera(camera.position, camera.fovy, options.width, options.height);
+    CpuFrame frame = AllocCpuFrame(options.width, options.height);
+
+    RayStats stats = { 0 };
+
+    TimelineZone zone = TimelineBegin("trace frame", -1);
+    TraceFrame(&cpuScene, &cpuCamera, &frame, 0, 0, options.samples, options.seed, &stats);
+    TimelineEnd(zone);
+
+    double traced = Now();
+
+    zone = TimelineBegin("denoise", -1);
+    AtrousFilter(&frame, DefaultAtrousParams(options.denoiseIterations));
+    TimelineEnd(zone);
+
+    double denoised = Now();
+    int threads = options.threads > 0 ? options.threads : CpuCount();
+
+    zone = TimelineBegin("export", -1);
+
+    if (!ExportCpuFrame(&frame, options.offlineOutput, ExrCompressionFromName(options.exrCompression), threads)) {
+        error("Failed to write offline render.");
+    }
+
+    TimelineEnd(zone);
+
+    printf("Rendered %dx%d at %d spp in %.2fs (denoise %.2fs, export %.2fs, %s kernels)\n",
+        frame.width, frame.height, options.samples, traced - start, denoised - traced, Now() - denoised, cpuKernels.name);
+
+    if (options.rayStats) {
+        PrintRayStats(&stats, traced - start);
+    }
+
+    CpuFrameFree(&frame);
+    CpuSceneFree(&cpuScene);
+}
@@ -0,0 +1,87 @@
+#include "../include/denoise.h"
+#include "raylib.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RAYMATH_STATIC_INLINE
+#include "raymath.h"
+
+// 1D B3-spline taps indexed by distance from the center
+static const float kernel[3] = { 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+AtrousParams DefaultAtrousParams(int iterations) {
+    AtrousParams params = {
+        .iterations = iterations,
+        .colourPhi = ATROUS_COLOUR_PHI,
+        .normalPhi = ATROUS_NORMAL_PHI,
+        .depthPhi = ATROUS_DEPTH_PHI,
+        .albedoPhi = ATROUS_ALBEDO_PHI
+    };
+
+    return params;
+}
+
+static int ClampIndex(int value, int max) {
+    return value < 0 ? 0 : (value > max ? max : value);
+}
+
+// Mirrors atrous.frag, so both backends filter a frame the same way
+static void AtrousIteration(const CpuFrame *frame, const Vector3 *in, Vector3 *out, int stepWidth, float colourPhi, AtrousParams params) {
+    for (int y = 0; y < frame->height; y++) {
+        for (int x = 0; x < frame->width; x++) {
+            int p = y * frame->width + x;
+
+            Vector3 sum = { 0 };
+            float weightSum = 0.0f;
+
+            for (int dy = -2; dy <= 2; dy++) {
+                for (int dx = -2; dx <= 2; dx++) {
+                    int qx = ClampIndex(x + dx * stepWidth, frame->width - 1);
+                    int qy = ClampIndex(y + dy * stepWidth, frame->height - 1);
+                    int q = qy * frame->width + qx;
+
+                    Vector3 colourDiff = Vector3Subtract(in[q], in[p]);
+                    Vector3 albedoDiff = Vector3Subtract(frame->albedo[q], frame->albedo[p]);
+
+                    float colourWeight = expf(-Vector3DotProduct(colourDiff, colourDiff) / colourPhi);
+                    float normalWeight = powf(fmaxf(Vector3DotProduct(frame->normal[p], frame->normal[q]), 0.0f), params.normalPhi);
+                    float depthWeight = expf(-fabsf(frame->depth[q] - frame->depth[p]) / (params.depthPhi * stepWidth));
+                    float albedoWeight = expf(-Vector3DotProduct(albedoDiff, albedoDiff) / params.albedoPhi);
+
+                    float weight = kernel[abs(dx)] * kernel[abs(dy)] * colourWeight * normalWeight * depthWeight * albedoWeight;
+
+                    sum = Vector3Add(sum, Vector3Scale(in[q], weight));
+                    weightSum += weight;
+                }
+            }
+
+            out[p] = Vector3Scale(sum, 1.0f / weightSum);
+        }
+    }
+}
+
+void AtrousFilter(CpuFrame *frame, AtrousParams params) {
+    if (params.iterations <= 0) return;
+
+    size_t pixelCount = (size_t)frame->width * frame->height;
+    Vector3 *scratch = malloc(pixelCount * sizeof(Vector3));
+
+    Vector3 *in = frame->colour;
+    Vector3 *out = scratch;
+
+    for (int i = 0; i < params.iterations; i++) {
+        AtrousIteration(frame, in, out, 1 << i, params.colourPhi / (float)(1 << i), params);
+
+        Vector3 *temp = in;
+        in = out;
+        out = temp;
+    }
+
+    // An odd number of iterations leaves the result in the scratch buffer
+    if (in != frame->colour) {
+        memcpy(frame->colour, in, pixelCount * sizeof(Vector3));
+    }
+
+    free(scratch);
+}
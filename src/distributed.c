@@ -0,0 +1,866 @@
+#include "../include/distributed.h"
+#include "../include/cpukernels.h"
+#include "../include/cputracer.h"
+#include "../include/denoise.h"
+#include "../include/platform.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Wire format, every integer and float little endian:
+ *      header:     u32 type, u32 payload bytes
+ *      HELLO:      u32 protocol version, u32 tiles the worker wants queued
+ *      SCENE:      u64 hash of the rest, u32 width, height, samples, seed,
+ *                  f32 camera xyz, focal length, u32 sphere count,
+ *                  11 words per sphere (pos xyz, radius, type, albedo rgb, roughness, ior, emission)
+ *      TILE:       u32 id, x, y, width, height
+ *      RESULT:     u32 id, then 10 f32 per pixel (colour rgb, normal xyz, depth, albedo rgb)
+ *      HEARTBEAT, DONE: empty
+ */
+typedef enum DistMessage {
+    DIST_HELLO = 1,
+    DIST_SCENE,
+    DIST_TILE,
+    DIST_RESULT,
+    DIST_HEARTBEAT,
+    DIST_DONE
+} DistMessage;
+
+#define DIST_HEADER_SIZE 8
+#define DIST_SCENE_HEADER_WORDS 11
+#define DIST_PIXEL_WORDS 10
+#define DIST_MAX_SPHERES (1 << 24)
+
+typedef enum TileState {
+    TILE_PENDING,
+    TILE_ASSIGNED,
+    TILE_DONE
+} TileState;
+
+typedef struct DistTile {
+    int x;
+    int y;
+    int width;
+    int height;
+    TileState state;
+} DistTile;
+
+typedef struct Coordinator {
+    CpuFrame frame;
+
+    DistTile *tiles;
+    int tileCount;
+    int doneCount;
+
+    unsigned char *scene;   // Serialized SCENE payload, sent to every worker as is
+    size_t sceneSize;
+
+    NetSocket server;
+    bool finished;
+
+    pthread_t *handlers;
+    int handlerCount;
+    int handlerCapacity;
+    int liveWorkers;
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} Coordinator;
+
+typedef struct WorkerHandler {
+    Coordinator *coordinator;
+    NetSocket socket;
+    int id;
+} WorkerHandler;
+
+static void PutU32(unsigned char *bytes, uint32_t value) {
+    bytes[0] = (unsigned char)value;
+    bytes[1] = (unsigned char)(value >> 8);
+    bytes[2] = (unsigned char)(value >> 16);
+    bytes[3] = (unsigned char)(value >> 24);
+}
+
+static uint32_t GetU32(const unsigned char *bytes) {
+    return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 | (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+static void PutFloat(unsigned char *bytes, float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    PutU32(bytes, bits);
+}
+
+static float GetFloat(const unsigned char *bytes) {
+    uint32_t bits = GetU32(bytes);
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+
+    return value;
+}
+
+static bool SendMessage(NetSocket socket, DistMessage type, const void *payload, size_t size) {
+    unsigned char header[DIST_HEADER_SIZE];
+    PutU32(header, type);
+    PutU32(header + 4, (uint32_t)size);
+
+    return NetSend(socket, header, sizeof(header)) && (size == 0 || NetSend(socket, payload, size));
+}
+
+static bool RecvHeader(NetSocket socket, DistMessage *type, size_t *size) {
+    unsigned char header[DIST_HEADER_SIZE];
+    if (!NetRecv(socket, header, sizeof(header))) return false;
+
+    *type = (DistMessage)GetU32(header);
+    *size = GetU32(header + 4);
+
+    return true;
+}
+
+static unsigned char *SerializeScene(Scene scene, Camera camera, CliOptions options, size_t *size) {
+    *size = 8 + (DIST_SCENE_HEADER_WORDS + scene.objCount * SPHERE_WORDS) * 4;
+
+    unsigned char *payload = malloc(*size);
+    if (!payload) {
+        error("Out of memory serializing scene.");
+    }
+
+    unsigned char *word = payload + 8;
+
+    PutU32(word, options.width); word += 4;
+    PutU32(word, options.height); word += 4;
+    PutU32(word, options.samples); word += 4;
+    PutU32(word, options.seed); word += 4;
+    PutFloat(word, camera.position.x); word += 4;
+    PutFloat(word, camera.position.y); word += 4;
+    PutFloat(word, camera.position.z); word += 4;
+    PutFloat(word, camera.fovy); word += 4;
+    PutU32(word, (uint32_t)scene.objCount); word += 4;
+    PutU32(word, 0); word += 4;     // Reserved
+    PutU32(word, 0); word += 4;
+
+    for (size_t i = 0; i < scene.objCount; i++) {
+        float values[SPHERE_WORDS];
+        PackSphereWords(&scene.objects[i], values);
+
+        for (int j = 0; j < SPHERE_WORDS; j++) {
+            PutFloat(word + j * 4, values[j]);
+        }
+
+        // The material type goes over the wire as an integer
+        PutU32(word + 4 * 4, (uint32_t)scene.objects[i].material.type);
+        word += SPHERE_WORDS * 4;
+    }
+
+    uint64_t hash = HashBytes(payload + 8, *size - 8);
+    PutU32(payload, (uint32_t)hash);
+    PutU32(payload + 4, (uint32_t)(hash >> 32));
+
+    return payload;
+}
+
+// Rebuilds the scene a coordinator sent, false if it is malformed or the hash does not match
+static bool DeserializeScene(const unsigned char *payload, size_t size, Scene *scene, Camera *camera, CliOptions *options, uint64_t *hash) {
+    if (size < 8 + DIST_SCENE_HEADER_WORDS * 4) return false;
+
+    *hash = (uint64_t)GetU32(payload) | (uint64_t)GetU32(payload + 4) << 32;
+    if (HashBytes(payload + 8, size - 8) != *hash) return false;
+
+    const unsigned char *word = payload + 8;
+
+    options->width = (int)GetU32(word);
+    options->height = (int)GetU32(word + 4);
+    options->samples = (int)GetU32(word + 8);
+    options->seed = GetU32(word + 12);
+    camera->position = (Vector3){ GetFloat(word + 16), GetFloat(word + 20), GetFloat(word + 24) };
+    camera->fovy = GetFloat(word + 28);
+
+    size_t count = GetU32(word + 32);
+    word += DIST_SCENE_HEADER_WORDS * 4;
+
+    if (count > DIST_MAX_SPHERES || size != 8 + (DIST_SCENE_HEADER_WORDS + count * SPHERE_WORDS) * 4) return false;
+    if (options->width <= 0 || options->height <= 0 || options->samples <= 0) return false;
+
+    *scene = (Scene){
+        .objects = malloc((count > 0 ? count : 1) * sizeof(Sphere)),
+        .objCount = count,
+        .lights = NULL,
+        .lightCount = 0
+    };
+
+    if (!scene->objects) {
+        error("Out of memory receiving scene.");
+    }
+
+    for (size_t i = 0; i < count; i++, word += SPHERE_WORDS * 4) {
+        scene->objects[i] = (Sphere){
+            .pos = { GetFloat(word), GetFloat(word + 4), GetFloat(word + 8) },
+            .radius = GetFloat(word + 12),
+            .material = {
+                .type = (int)GetU32(word + 16),
+                .albedo = { GetFloat(word + 20), GetFloat(word + 24), GetFloat(word + 28) },
+                .roughness = GetFloat(word + 32),
+                .ior = GetFloat(word + 36),
+                .emission = GetFloat(word + 40)
+            }
+        };
+    }
+
+    return true;
+}
+
+// Puts the tile's pixels back where the worker found them and marks it done, ignoring repeats
+static bool MergeResult(Coordinator *coordinator, const unsigned char *payload, size_t size, int *tileId) {
+    if (size < 4) return false;
+
+    uint32_t id = GetU32(payload);
+    if (id >= (uint32_t)coordinator->tileCount) return false;
+
+    const DistTile *tile = &coordinator->tiles[id];
+    if (size != 4 + (size_t)tile->width * tile->height * DIST_PIXEL_WORDS * 4) return false;
+
+    *tileId = (int)id;
+
+    CpuFrame *frame = &coordinator->frame;
+    const unsigned char *word = payload + 4;
+
+    pthread_mutex_lock(&coordinator->lock);
+
+    if (tile->state != TILE_DONE) {
+        for (int y = 0; y < tile->height; y++) {
+            for (int x = 0; x < tile->width; x++, word += DIST_PIXEL_WORDS * 4) {
+                size_t index = (size_t)(tile->y + y) * frame->width + tile->x + x;
+
+                frame->colour[index] = (Vector3){ GetFloat(word), GetFloat(word + 4), GetFloat(word + 8) };
+                frame->normal[index] = (Vector3){ GetFloat(word + 12), GetFloat(word + 16), GetFloat(word + 20) };
+                frame->depth[index] = GetFloat(word + 24);
+                frame->albedo[index] = (Vector3){ GetFloat(word + 28), GetFloat(word + 32), GetFloat(word + 36) };
+            }
+        }
+
+        coordinator->tiles[id].state = TILE_DONE;
+        coordinator->doneCount++;
+        pthread_cond_broadcast(&coordinator->changed);
+    }
+
+    pthread_mutex_unlock(&coordinator->lock);
+
+    return true;
+}
+
+static void *HandleWorker(void *arg) {
+    WorkerHandler *handler = arg;
+    Coordinator *coordinator = handler->coordinator;
+    NetSocket socket = handler->socket;
+
+    NetSetTimeout(socket, DIST_TIMEOUT_MS);
+
+    DistMessage type;
+    size_t size;
+    unsigned char hello[8];
+
+    int credits = 0;
+    int *outstanding = NULL;
+    int outstandingCount = 0;
+    unsigned char *payload = NULL;
+    size_t payloadCapacity = 0;
+
+    if (!RecvHeader(socket, &type, &size) || type != DIST_HELLO || size != sizeof(hello) ||
+        !NetRecv(socket, hello, sizeof(hello)) || GetU32(hello) != DIST_PROTOCOL_VERSION) {
+        printf("Worker %d rejected: bad handshake\n", handler->id);
+        goto disconnect;
+    }
+
+    credits = (int)GetU32(hello + 4);
+    credits = credits < 1 ? 1 : credits > 256 ? 256 : credits;
+    outstanding = malloc(credits * sizeof(int));
+
+    if (!SendMessage(socket, DIST_SCENE, coordinator->scene, coordinator->sceneSize)) goto disconnect;
+
+    pthread_mutex_lock(&coordinator->lock);
+    coordinator->liveWorkers++;
+    printf("Worker %d joined with %d queued tiles (%d live)\n", handler->id, credits, coordinator->liveWorkers);
+    pthread_mutex_unlock(&coordinator->lock);
+
+    for (;;) {
+        int assigned[256];
+        int assignedCount = 0;
+
+        pthread_mutex_lock(&coordinator->lock);
+
+        // An idle worker sleeps until a tile is requeued or the job ends
+        while (outstandingCount == 0 && coordinator->doneCount < coordinator->tileCount) {
+            for (int i = 0; i < coordinator->tileCount && outstandingCount + assignedCount < credits; i++) {
+                if (coordinator->tiles[i].state == TILE_PENDING) {
+                    coordinator->tiles[i].state = TILE_ASSIGNED;
+                    assigned[assignedCount++] = i;
+                }
+            }
+
+            if (assignedCount > 0) break;
+
+            pthread_cond_wait(&coordinator->changed, &coordinator->lock);
+        }
+
+        // Top the worker's queue back up while it is busy
+        for (int i = 0; i < coordinator->tileCount && outstandingCount + assignedCount < credits; i++) {
+            if (coordinator->tiles[i].state == TILE_PENDING) {
+                coordinator->tiles[i].state = TILE_ASSIGNED;
+                assigned[assignedCount++] = i;
+            }
+        }
+
+        bool jobDone = outstandingCount == 0 && assignedCount == 0;
+        pthread_mutex_unlock(&coordinator->lock);
+
+        if (jobDone) {
+            SendMessage(socket, DIST_DONE, NULL, 0);
+            break;
+        }
+
+        for (int i = 0; i < assignedCount; i++) {
+            outstanding[outstandingCount++] = assigned[i];
+
+            const DistTile *tile = &coordinator->tiles[assigned[i]];
+            unsigned char message[20];
+
+            PutU32(message, (uint32_t)assigned[i]);
+            PutU32(message + 4, tile->x);
+            PutU32(message + 8, tile->y);
+            PutU32(message + 12, tile->width);
+            PutU32(message + 16, tile->height);
+
+            if (!SendMessage(socket, DIST_TILE, message, sizeof(message))) goto lost;
+        }
+
+        // Heartbeats keep the receive timeout from firing on long tiles
+        do {
+            if (!RecvHeader(socket, &type, &size)) goto lost;
+        } while (type == DIST_HEARTBEAT && size == 0);
+
+        if (type != DIST_RESULT || size > 4 + (size_t)coordinator->frame.width * coordinator->frame.height * DIST_PIXEL_WORDS * 4) {
+            printf("Worker %d sent an unexpected message %d\n", handler->id, (int)type);
+            goto lost;
+        }
+
+        if (size > payloadCapacity) {
+            free(payload);
+            payload = malloc(size);
+            payloadCapacity = size;
+
+            if (!payload) {
+                error("Out of memory receiving tile.");
+            }
+        }
+
+        int tileId;
+        if (!NetRecv(socket, payload, size) || !MergeResult(coordinator, payload, size, &tileId)) goto lost;
+
+        for (int i = 0; i < outstandingCount; i++) {
+            if (outstanding[i] == tileId) {
+                outstanding[i] = outstanding[--outstandingCount];
+                break;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&coordinator->lock);
+    coordinator->liveWorkers--;
+    pthread_mutex_unlock(&coordinator->lock);
+
+    goto disconnect;
+
+lost:
+    pthread_mutex_lock(&coordinator->lock);
+
+    int requeued = 0;
+    for (int i = 0; i < outstandingCount; i++) {
+        if (coordinator->tiles[outstanding[i]].state == TILE_ASSIGNED) {
+            coordinator->tiles[outstanding[i]].state = TILE_PENDING;
+            requeued++;
+        }
+    }
+
+    coordinator->liveWorkers--;
+    printf("Worker %d lost, %d tiles requeued (%d live)\n", handler->id, requeued, coordinator->liveWorkers);
+
+    pthread_cond_broadcast(&coordinator->changed);
+    pthread_mutex_unlock(&coordinator->lock);
+
+disconnect:
+    NetClose(socket);
+
+    free(payload);
+    free(outstanding);
+    free(handler);
+
+    return NULL;
+}
+
+static void *AcceptWorkers(void *arg) {
+    Coordinator *coordinator = arg;
+
+    for (int id = 0;; id++) {
+        NetSocket socket = NetAccept(coordinator->server);
+
+        pthread_mutex_lock(&coordinator->lock);
+        bool finished = coordinator->finished;
+        pthread_mutex_unlock(&coordinator->lock);
+
+        if (socket == NET_INVALID_SOCKET) {
+            if (finished) break;
+            continue;
+        }
+
+        if (finished) {
+            NetClose(socket);
+            break;
+        }
+
+        WorkerHandler *handler = malloc(sizeof(WorkerHandler));
+        *handler = (WorkerHandler){ coordinator, socket, id };
+
+        pthread_mutex_lock(&coordinator->lock);
+
+        if (coordinator->handlerCount == coordinator->handlerCapacity) {
+            coordinator->handlerCapacity = coordinator->handlerCapacity ? coordinator->handlerCapacity * 2 : 8;
+            coordinator->handlers = realloc(coordinator->handlers, coordinator->handlerCapacity * sizeof(pthread_t));
+        }
+
+        pthread_create(&coordinator->handlers[coordinator->handlerCount++], NULL, HandleWorker, handler);
+        pthread_mutex_unlock(&coordinator->lock);
+    }
+
+    return NULL;
+}
+
+// Starts workers on this machine, splitting the cores between them
+static ProcessHandle *SpawnLocalWorkers(CliOptions options) {
+    int threads = options.threads > 0 ? options.threads : CpuCount() / options.localWorkers;
+    threads = threads > 0 ? threads : 1;
+
+    char address[32];
+    char threadArg[16];
+    snprintf(address, sizeof(address), "127.0.0.1:%d", options.coordinatorPort);
+    snprintf(threadArg, sizeof(threadArg), "%d", threads);
+
+    char *argv[] = { (char *)options.programPath, "--worker", address, "--threads", threadArg, NULL, NULL, NULL };
+
+    if (options.isa) {
+        argv[5] = "--isa";
+        argv[6] = (char *)options.isa;
+    }
+
+    ProcessHandle *workers = malloc(options.localWorkers * sizeof(ProcessHandle));
+
+    for (int i = 0; i < options.localWorkers; i++) {
+        workers[i] = SpawnProcess(options.programPath, argv);
+
+        if (workers[i] == INVALID_PROCESS) {
+            error("Failed to start a local worker.");
+        }
+    }
+
+    return workers;
+}
+
+void RunCoordinator(Scene scene, Camera camera, CliOptions options) {
+    double start = Now();
+
+    if (!NetInit()) {
+        error("Failed to initialise sockets.");
+    }
+
+    Coordinator coordinator = {
+        .frame = AllocCpuFrame(options.width, options.height),
+        .server = NetListen(options.coordinatorPort, false)
+    };
+
+    if (coordinator.server == NET_INVALID_SOCKET) {
+        error("Failed to listen on the coordinator port.");
+    }
+
+    int tileSize = options.tileSize;
+    int tilesX = (options.width + tileSize - 1) / tileSize;
+    int tilesY = (options.height + tileSize - 1) / tileSize;
+
+    coordinator.tileCount = tilesX * tilesY;
+    coordinator.tiles = malloc(coordinator.tileCount * sizeof(DistTile));
+
+    for (int i = 0; i < coordinator.tileCount; i++) {
+        int x = (i % tilesX) * tileSize;
+        int y = (i / tilesX) * tileSize;
+
+        coordinator.tiles[i] = (DistTile){
+            .x = x,
+            .y = y,
+            .width = x + tileSize > options.width ? options.width - x : tileSize,
+            .height = y + tileSize > options.height ? options.height - y : tileSize,
+            .state = TILE_PENDING
+        };
+    }
+
+    coordinator.scene = SerializeScene(scene, camera, options, &coordinator.sceneSize);
+
+    pthread_mutex_init(&coordinator.lock, NULL);
+    pthread_cond_init(&coordinator.changed, NULL);
+
+    uint64_t hash = (uint64_t)GetU32(coordinator.scene) | (uint64_t)GetU32(coordinator.scene + 4) << 32;
+    printf("Coordinating %d tiles on port %d, scene %016llx\n", coordinator.tileCount, options.coordinatorPort, (unsigned long long)hash);
+
+    pthread_t acceptor;
+    pthread_create(&acceptor, NULL, AcceptWorkers, &coordinator);
+
+    ProcessHandle *localWorkers = options.localWorkers > 0 ? SpawnLocalWorkers(options) : NULL;
+
+    pthread_mutex_lock(&coordinator.lock);
+
+    // Whole lines so worker joins and losses stay readable between progress reports
+    int reportedTenth = 0;
+    while (coordinator.doneCount < coordinator.tileCount) {
+        pthread_cond_wait(&coordinator.changed, &coordinator.lock);
+
+        int tenth = coordinator.doneCount * 10 / coordinator.tileCount;
+        if (tenth > reportedTenth && tenth < 10) {
+            reportedTenth = tenth;
+            printf("Tiles %d/%d\n", coordinator.doneCount, coordinator.tileCount);
+        }
+    }
+
+    coordinator.finished = true;
+    pthread_cond_broadcast(&coordinator.changed);
+    pthread_mutex_unlock(&coordinator.lock);
+
+    // Closing the listener wakes the accept thread, handlers end once their worker is told it is done
+    NetClose(coordinator.server);
+    pthread_join(acceptor, NULL);
+
+    for (int i = 0; i < coordinator.handlerCount; i++) {
+        pthread_join(coordinator.handlers[i], NULL);
+    }
+
+    for (int i = 0; localWorkers && i < options.localWorkers; i++) {
+        WaitProcess(localWorkers[i]);
+    }
+
+    free(localWorkers);
+
+    double traced = Now();
+
+    AtrousFilter(&coordinator.frame, DefaultAtrousParams(options.denoiseIterations));
+
+    double denoised = Now();
+    int threads = options.threads > 0 ? options.threads : CpuCount();
+
+    if (!ExportCpuFrame(&coordinator.frame, options.offlineOutput, ExrCompressionFromName(options.exrCompression), threads)) {
+        error("Failed to write offline render.");
+    }
+
+    printf("Rendered %dx%d at %d spp across %d workers in %.2fs (denoise %.2fs, export %.2fs)\n",
+        options.width, options.height, options.samples, coordinator.handlerCount, traced - start, denoised - traced, Now() - denoised);
+
+    free(coordinator.scene);
+    free(coordinator.tiles);
+    free(coordinator.handlers);
+    CpuFrameFree(&coordinator.frame);
+
+    pthread_mutex_destroy(&coordinator.lock);
+    pthread_cond_destroy(&coordinator.changed);
+}
+
+/*
+ * Worker side: the connection thread queues incoming tiles, render threads
+ * trace them and send the results back, and a heartbeat thread keeps the
+ * coordinator from timing the worker out while a tile is in flight.
+ */
+typedef struct WorkerJob {
+    NetSocket socket;
+    CpuScene scene;
+    CpuCamera camera;
+    int samples;
+    unsigned int seed;
+    int tileCapacity;   // Largest tile side seen so far, render frames grow to match
+
+    uint32_t *queue;    // Five words per tile: id, x, y, width, height
+    int queueLength;
+    int queueCapacity;
+    bool stop;
+
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_mutex_t sendLock;
+} WorkerJob;
+
+static void StopWorker(WorkerJob *job) {
+    pthread_mutex_lock(&job->lock);
+    job->stop = true;
+    pthread_cond_broadcast(&job->changed);
+    pthread_mutex_unlock(&job->lock);
+}
+
+static void *RenderTiles(void *arg) {
+    WorkerJob *job = arg;
+
+    CpuFrame frame = {0};
+    int frameSide = 0;
+    unsigned char *payload = NULL;
+
+    for (;;) {
+        uint32_t tile[5];
+
+        pthread_mutex_lock(&job->lock);
+
+        while (job->queueLength == 0 && !job->stop) {
+            pthread_cond_wait(&job->changed, &job->lock);
+        }
+
+        if (job->stop) {
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+
+        memcpy(tile, job->queue, sizeof(tile));
+        memmove(job->queue, job->queue + 5, (size_t)(--job->queueLength) * sizeof(tile));
+
+        pthread_mutex_unlock(&job->lock);
+
+        int width = (int)tile[3];
+        int height = (int)tile[4];
+        int side = width > height ? width : height;
+
+        if (side > frameSide) {
+            CpuFrameFree(&frame);
+            free(payload);
+
+            frame = AllocCpuFrame(side, side);
+            payload = malloc(4 + (size_t)side * side * DIST_PIXEL_WORDS * 4);
+            frameSide = side;
+
+            if (!payload) {
+                error("Out of memory allocating worker tile.");
+            }
+        }
+
+        frame.width = width;
+        frame.height = height;
+
+        TraceFrame(&job->scene, &job->camera, &frame, (int)tile[1], (int)tile[2], job->samples, job->seed, NULL);
+
+        unsigned char *word = payload;
+        PutU32(word, tile[0]);
+        word += 4;
+
+        for (int i = 0; i < width * height; i++, word += DIST_PIXEL_WORDS * 4) {
+            float values[DIST_PIXEL_WORDS] = {
+                frame.colour[i].x, frame.colour[i].y, frame.colour[i].z,
+                frame.normal[i].x, frame.normal[i].y, frame.normal[i].z,
+                frame.depth[i],
+                frame.albedo[i].x, frame.albedo[i].y, frame.albedo[i].z
+            };
+
+            for (int j = 0; j < DIST_PIXEL_WORDS; j++) {
+                PutFloat(word + j * 4, values[j]);
+            }
+        }
+
+        pthread_mutex_lock(&job->sendLock);
+        bool sent = SendMessage(job->socket, DIST_RESULT, payload, (size_t)(word - payload));
+        pthread_mutex_unlock(&job->sendLock);
+
+        if (!sent) {
+            StopWorker(job);
+        }
+    }
+
+    frame.width = frameSide;
+    frame.height = frameSide;
+    CpuFrameFree(&frame);
+    free(payload);
+
+    return NULL;
+}
+
+static void *SendHeartbeats(void *arg) {
+    WorkerJob *job = arg;
+
+    pthread_mutex_lock(&job->lock);
+
+    while (!job->stop) {
+        struct timespec deadline;
+        timespec_get(&deadline, TIME_UTC);
+
+        deadline.tv_sec += DIST_HEARTBEAT_MS / 1000;
+        deadline.tv_nsec += (long)(DIST_HEARTBEAT_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        if (pthread_cond_timedwait(&job->changed, &job->lock, &deadline) != ETIMEDOUT || job->stop) continue;
+
+        pthread_mutex_unlock(&job->lock);
+
+        pthread_mutex_lock(&job->sendLock);
+        bool sent = SendMessage(job->socket, DIST_HEARTBEAT, NULL, 0);
+        pthread_mutex_unlock(&job->sendLock);
+
+        pthread_mutex_lock(&job->lock);
+
+        if (!sent) {
+            job->stop = true;
+            pthread_cond_broadcast(&job->changed);
+        }
+    }
+
+    pthread_mutex_unlock(&job->lock);
+
+    return NULL;
+}
+
+static NetSocket ConnectToCoordinator(const char *address) {
+    char host[256];
+    const char *colon = strrchr(address, ':');
+
+    if (!colon || colon == address || (size_t)(colon - address) >= sizeof(host) || atoi(colon + 1) <= 0) {
+        error("--worker expects host:port.");
+    }
+
+    memcpy(host, address, colon - address);
+    host[colon - address] = '\0';
+
+    for (int attempt = 0; attempt < DIST_CONNECT_SECONDS * 10; attempt++) {
+        NetSocket socket = NetConnect(host, atoi(colon + 1));
+        if (socket != NET_INVALID_SOCKET) return socket;
+
+        SleepMs(100);
+    }
+
+    return NET_INVALID_SOCKET;
+}
+
+void RunWorker(CliOptions options) {
+    if (!NetInit()) {
+        error("Failed to initialise sockets.");
+    }
+
+    NetSocket socket = ConnectToCoordinator(options.workerAddress);
+    if (socket == NET_INVALID_SOCKET) {
+        error("Could not reach the coordinator.");
+    }
+
+    int threads = options.threads > 0 ? options.threads : CpuCount();
+
+    // Twice the threads keeps every core busy while results are in flight
+    unsigned char hello[8];
+    PutU32(hello, DIST_PROTOCOL_VERSION);
+    PutU32(hello + 4, threads * 2);
+
+    DistMessage type;
+    size_t size;
+
+    if (!SendMessage(socket, DIST_HELLO, hello, sizeof(hello)) || !RecvHeader(socket, &type, &size) || type != DIST_SCENE) {
+        error("Coordinator handshake failed.");
+    }
+
+    unsigned char *payload = malloc(size > 0 ? size : 1);
+    if (!payload) {
+        error("Out of memory receiving scene.");
+    }
+
+    Scene scene = { 0 };
+    Camera camera = { 0 };
+    CliOptions job = options;
+    uint64_t hash = 0;
+
+    if (!NetRecv(socket, payload, size) || !DeserializeScene(payload, size, &scene, &camera, &job, &hash)) {
+        error("Received a corrupt scene.");
+    }
+
+    free(payload);
+
+    WorkerJob worker = {
+        .socket = socket,
+        .scene = BuildCpuScene(scene),
+        .camera = InitCpuCamera(camera.position, camera.fovy, job.width, job.height),
+        .samples = job.samples,
+        .seed = job.seed,
+        .queueCapacity = threads * 2
+    };
+
+    worker.queue = malloc(worker.queueCapacity * 5 * sizeof(uint32_t));
+
+    pthread_mutex_init(&worker.lock, NULL);
+    pthread_cond_init(&worker.changed, NULL);
+    pthread_mutex_init(&worker.sendLock, NULL);
+
+    printf("Worker on %s: scene %016llx, %zu spheres, %dx%d at %d spp, %d threads\n",
+        options.workerAddress, (unsigned long long)hash, scene.objCount, job.width, job.height, job.samples, threads);
+
+    pthread_t *renderers = malloc(threads * sizeof(pthread_t));
+    pthread_t heartbeat;
+
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&renderers[i], NULL, RenderTiles, &worker);
+    }
+
+    pthread_create(&heartbeat, NULL, SendHeartbeats, &worker);
+
+    int tilesRendered = 0;
+
+    for (;;) {
+        unsigned char message[20];
+
+        if (!RecvHeader(socket, &type, &size) || type != DIST_TILE || size != sizeof(message) ||
+            !NetRecv(socket, message, sizeof(message))) {
+            break;  // DONE, or the coordinator went away
+        }
+
+        pthread_mutex_lock(&worker.lock);
+
+        if (worker.queueLength == worker.queueCapacity) {
+            worker.queueCapacity *= 2;
+            worker.queue = realloc(worker.queue, worker.queueCapacity * 5 * sizeof(uint32_t));
+        }
+
+        uint32_t *tile = worker.queue + worker.queueLength * 5;
+        for (int i = 0; i < 5; i++) {
+            tile[i] = GetU32(message + i * 4);
+        }
+
+        bool valid = tile[3] > 0 && tile[4] > 0 && tile[1] + tile[3] <= (uint32_t)job.width && tile[2] + tile[4] <= (uint32_t)job.height;
+        if (valid) {
+            worker.queueLength++;
+            tilesRendered++;
+            pthread_cond_broadcast(&worker.changed);    // The heartbeat thread waits on it too
+        }
+
+        pthread_mutex_unlock(&worker.lock);
+
+        if (!valid) break;
+    }
+
+    StopWorker(&worker);
+
+    for (int i = 0; i < threads; i++) {
+        pthread_join(renderers[i], NULL);
+    }
+
+    pthread_join(heartbeat, NULL);
+
+    printf("Worker finished after %d tiles\n", tilesRendered);
+
+    NetClose(socket);
+
+    free(renderers);
+    free(worker.queue);
+    CpuSceneFree(&worker.scene);
+    SceneFree(&scene);
+
+    pthread_mutex_destroy(&worker.lock);
+    pthread_cond_destroy(&worker.changed);
+    pthread_mutex_destroy(&worker.sendLock);
+}
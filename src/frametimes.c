@@ -0,0 +1,279 @@
+#include "../include/frametimes.h"
+#include "../include/glext.h"
+#include "../include/helpers.h"
+#include "raylib.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Timer queries are core in GL 3.3 but rlgl does not wrap them
+#define GL_TIME_ELAPSED 0x88BF
+#define GL_QUERY_RESULT 0x8866
+#define GL_QUERY_RESULT_AVAILABLE 0x8867
+
+static struct {
+    void (GL_CALL *GenQueries)(int count, unsigned int *ids);
+    void (GL_CALL *DeleteQueries)(int count, const unsigned int *ids);
+    void (GL_CALL *BeginQuery)(unsigned int target, unsigned int id);
+    void (GL_CALL *EndQuery)(unsigned int target);
+    void (GL_CALL *GetQueryObjectiv)(unsigned int id, unsigned int name, int *params);
+    void (GL_CALL *GetQueryObjectui64v)(unsigned int id, unsigned int name, uint64_t *params);
+} gl;
+
+static bool LoadGlFunctions(void) {
+    if (!GlCoreContext()) return false;
+
+    GL_LOAD(gl.GenQueries, "glGenQueries");
+    GL_LOAD(gl.DeleteQueries, "glDeleteQueries");
+    GL_LOAD(gl.BeginQuery, "glBeginQuery");
+    GL_LOAD(gl.EndQuery, "glEndQuery");
+    GL_LOAD(gl.GetQueryObjectiv, "glGetQueryObjectiv");
+    GL_LOAD(gl.GetQueryObjectui64v, "glGetQueryObjectui64v");
+
+    return gl.GenQueries && gl.DeleteQueries && gl.BeginQuery && gl.EndQuery && gl.GetQueryObjectiv && gl.GetQueryObjectui64v;
+}
+
+static void HistogramAdd(FrameTimeHistogram *histogram, double ms) {
+    double position = log(ms / FRAME_TIME_MIN_MS) / log(FRAME_TIME_MAX_MS / FRAME_TIME_MIN_MS) * FRAME_TIME_BUCKETS;
+    int bucket = position < 0.0 ? 0 : position >= FRAME_TIME_BUCKETS ? FRAME_TIME_BUCKETS - 1 : (int)position;
+
+    histogram->counts[bucket]++;
+    histogram->total++;
+    histogram->sum += ms;
+    histogram->max = fmax(histogram->max, ms);
+}
+
+// Upper edge of the bucket holding the percentile, so it never reads low
+double FrameTimePercentile(const FrameTimeHistogram *histogram, double percentile) {
+    if (histogram->total == 0) return 0.0;
+
+    long long rank = (long long)ceil(percentile / 100.0 * histogram->total);
+    long long seen = 0;
+
+    for (int i = 0; i < FRAME_TIME_BUCKETS; i++) {
+        seen += histogram->counts[i];
+
+        if (seen >= rank && seen > 0) {
+            double edge = FRAME_TIME_MIN_MS * pow(FRAME_TIME_MAX_MS / FRAME_TIME_MIN_MS, (double)(i + 1) / FRAME_TIME_BUCKETS);
+            return fmin(edge, histogram->max);
+        }
+    }
+
+    return histogram->max;
+}
+
+FrameTimes *FrameTimesCreate(bool gpu) {
+    FrameTimes *times = calloc(1, sizeof(FrameTimes));
+    if (!times) {
+        error("Out of memory allocating frame times.");
+    }
+
+    times->lastPresent = GetTime();
+    times->gpuTimer = gpu && LoadGlFunctions();
+
+    if (times->gpuTimer) {
+        gl.GenQueries(FRAME_TIME_QUERIES, times->queries);
+    } else if (gpu) {
+        printf("Frame times: no GL 3.3 timer queries, only CPU times are recorded\n");
+    }
+
+    for (int i = 0; i < FRAME_TIME_QUERIES; i++) {
+        times->queryFrames[i] = -1;
+    }
+
+    return times;
+}
+
+// Collects finished queries, waiting for them only when asked to
+static void CollectQueries(FrameTimes *times, bool wait) {
+    for (int i = 0; i < FRAME_TIME_QUERIES; i++) {
+        if (times->queryFrames[i] < 0) continue;
+
+        int available = 0;
+        if (!wait) {
+            gl.GetQueryObjectiv(times->queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available) continue;
+        }
+
+        uint64_t nanoseconds = 0;
+        gl.GetQueryObjectui64v(times->queries[i], GL_QUERY_RESULT, &nanoseconds);
+
+        double ms = nanoseconds / 1e6;
+        HistogramAdd(&times->gpu, ms);
+
+        // The frame's sample exists unless the query is collected before its frame ended
+        if (times->queryFrames[i] < times->sampleCount) {
+            times->samples[times->queryFrames[i]].gpuMs = (float)ms;
+        }
+
+        times->queryFrames[i] = -1;
+    }
+}
+
+void FrameTimesFinish(FrameTimes *times) {
+    if (!times || !times->gpuTimer) return;
+
+    if (times->gpuActive) {
+        FrameTimesEndGpu(times);
+    }
+
+    CollectQueries(times, true);
+    gl.DeleteQueries(FRAME_TIME_QUERIES, times->queries);
+
+    times->gpuTimer = false;
+}
+
+void FrameTimesFree(FrameTimes *times) {
+    if (!times) return;
+
+    free(times->samples);
+    free(times);
+}
+
+void FrameTimesBeginGpu(FrameTimes *times) {
+    if (!times->gpuTimer || times->gpuActive) return;
+
+    // Skipping a frame beats waiting on the GPU, the overlay would be timing its own stall
+    if (times->queryFrames[times->nextQuery] >= 0) return;
+
+    gl.BeginQuery(GL_TIME_ELAPSED, times->queries[times->nextQuery]);
+    times->queryFrames[times->nextQuery] = times->sampleCount;
+    times->gpuActive = true;
+}
+
+void FrameTimesEndGpu(FrameTimes *times) {
+    if (!times->gpuActive) return;
+
+    gl.EndQuery(GL_TIME_ELAPSED);
+    times->gpuActive = false;
+    times->nextQuery = (times->nextQuery + 1) % FRAME_TIME_QUERIES;
+}
+
+void FrameTimesEndFrame(FrameTimes *times, bool reset) {
+    double now = GetTime();
+    double ms = (now - times->lastPresent) * 1000.0;
+    times->lastPresent = now;
+
+    if (times->sampleCount == times->sampleCapacity) {
+        long long capacity = times->sampleCapacity > 0 ? times->sampleCapacity * 2 : 4096;
+        FrameTimeSample *samples = realloc(times->samples, capacity * sizeof(FrameTimeSample));
+
+        if (!samples) {
+            error("Out of memory recording frame times.");
+        }
+
+        times->samples = samples;
+        times->sampleCapacity = capacity;
+    }
+
+    times->samples[times->sampleCount++] = (FrameTimeSample){ (float)ms, -1.0f, reset };
+    HistogramAdd(&times->cpu, ms);
+
+    if (times->gpuTimer) {
+        CollectQueries(times, false);
+    }
+}
+
+void DrawFrameTimes(const FrameTimes *times, int x, int y) {
+    const FrameTimeHistogram *cpu = &times->cpu;
+    const FrameTimeHistogram *gpu = &times->gpu;
+
+    const char *text = TextFormat("CPU %.1f/%.1f/%.1f/%.1f ms",
+        FrameTimePercentile(cpu, 50.0), FrameTimePercentile(cpu, 95.0), FrameTimePercentile(cpu, 99.0), cpu->max);
+
+    if (gpu->total > 0) {
+        text = TextFormat("%s  GPU %.2f/%.2f/%.2f/%.2f ms", text,
+            FrameTimePercentile(gpu, 50.0), FrameTimePercentile(gpu, 95.0), FrameTimePercentile(gpu, 99.0), gpu->max);
+    }
+
+    DrawText(TextFormat("%s (p50/p95/p99/max)", text), x, y, 20, LIME);
+}
+
+static int CompareFloats(const void *a, const void *b) {
+    float x = *(const float *)a, y = *(const float *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest rank percentiles over the frames picked by gpu and onlyResets, one summary row
+static void WriteSummaryRow(FILE *file, const FrameTimes *times, const char *series, bool gpu, bool onlyResets,
+    const char *scenePath, int width, int height) {
+    float *values = malloc((times->sampleCount > 0 ? times->sampleCount : 1) * sizeof(float));
+    long long count = 0;
+    double sum = 0.0;
+
+    if (!values) {
+        error("Out of memory summarising frame times.");
+    }
+
+    for (long long i = 0; i < times->sampleCount; i++) {
+        const FrameTimeSample *sample = &times->samples[i];
+        float value = gpu ? sample->gpuMs : sample->cpuMs;
+
+        if (value < 0.0f || (onlyResets && !sample->reset)) continue;
+
+        values[count++] = value;
+        sum += value;
+    }
+
+    qsort(values, count, sizeof(float), CompareFloats);
+
+    double percentiles[3] = { 50.0, 95.0, 99.0 };
+    double results[3] = { 0.0, 0.0, 0.0 };
+
+    for (int i = 0; i < 3 && count > 0; i++) {
+        long long rank = (long long)ceil(percentiles[i] / 100.0 * count);
+        results[i] = values[rank > 0 ? rank - 1 : 0];
+    }
+
+    fprintf(file, "%s,%d,%d,%s,%lld,%.3f,%.3f,%.3f,%.3f,%.3f\n", scenePath, width, height, series, count,
+        count > 0 ? sum / count : 0.0, results[0], results[1], results[2], count > 0 ? values[count - 1] : 0.0);
+
+    printf("%-10s %8lld frames, mean %.2f ms, p50 %.2f, p95 %.2f, p99 %.2f, max %.2f\n", series, count,
+        count > 0 ? sum / count : 0.0, results[0], results[1], results[2], count > 0 ? values[count - 1] : 0.0);
+
+    free(values);
+}
+
+bool FrameTimesWrite(FrameTimes *times, const char *path, const char *scenePath, int width, int height) {
+    FILE *file = fopen(path, "w");
+    if (!file) return false;
+
+    fprintf(file, "frame,cpu_ms,gpu_ms,reset\n");
+
+    for (long long i = 0; i < times->sampleCount; i++) {
+        const FrameTimeSample *sample = &times->samples[i];
+
+        if (sample->gpuMs >= 0.0f) {
+            fprintf(file, "%lld,%.3f,%.3f,%d\n", i, sample->cpuMs, sample->gpuMs, sample->reset);
+        } else {
+            fprintf(file, "%lld,%.3f,,%d\n", i, sample->cpuMs, sample->reset);
+        }
+    }
+
+    bool ok = fclose(file) == 0;
+
+    // data/run.csv gives data/run_summary.csv
+    char summaryPath[1024];
+    const char *extension = strrchr(path, '.');
+    const char *separator = strrchr(path, '/');
+
+    if (!extension || (separator && extension < separator)) {
+        extension = path + strlen(path);
+    }
+
+    snprintf(summaryPath, sizeof(summaryPath), "%.*s_summary.csv", (int)(extension - path), path);
+
+    file = fopen(summaryPath, "w");
+    if (!file) return false;
+
+    fprintf(file, "scene,width,height,series,frames,mean_ms,p50_ms,p95_ms,p99_ms,max_ms\n");
+    printf("Frame times written to %s and %s\n", path, summaryPath);
+
+    WriteSummaryRow(file, times, "cpu", false, false, scenePath, width, height);
+    WriteSummaryRow(file, times, "gpu", true, false, scenePath, width, height);
+    WriteSummaryRow(file, times, "cpu_reset", false, true, scenePath, width, height);
+    WriteSummaryRow(file, times, "gpu_reset", true, true, scenePath, width, height);
+
+    return fclose(file) == 0 && ok;
+}
@@ -0,0 +1,12 @@
+#include "../include/glext.h"
+#include "rlgl.h"
+
+GlProc glfwGetProcAddress(const char *name);
+
+bool GlCoreContext(void) {
+    return rlGetVersion() == RL_OPENGL_33 || rlGetVersion() == RL_OPENGL_43;
+}
+
+GlProc GlGetProc(const char *name) {
+    return glfwGetProcAddress(name);
+}
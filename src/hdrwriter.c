@@ -0,0 +1,305 @@
+#include "../include/hdrwriter.h"
+#include "../include/helpers.h"
+#include "../include/timeline.h"
+#include "raylib.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define EXR_MAGIC 20000630
+#define EXR_PIXEL_FLOAT 2
+
+/*
+ * EXR output is single part scanline images with FLOAT B, G and R channels.
+ * Chunks (one scanline uncompressed, 16 with ZIP) are packed and compressed
+ * on a pool of threads, then written in order behind the offset table.
+ */
+typedef struct ExrJob {
+    HdrImage image;
+    ExrCompression compression;
+    int linesPerChunk;
+    int chunkCount;
+
+    unsigned char **chunks;     // Finished chunk payloads
+    int *chunkSizes;
+
+    atomic_int nextChunk;
+} ExrJob;
+
+ExrCompression ExrCompressionFromName(const char *name) {
+    if (strcmp(name, "none") == 0) return EXR_COMPRESSION_NONE;
+    if (strcmp(name, "zip") == 0) return EXR_COMPRESSION_ZIP;
+
+    error("Unknown EXR compression, expected none or zip.");
+    return EXR_COMPRESSION_ZIP;
+}
+
+bool IsHdrPath(const char *path) {
+    return PathHasExtension(path, "exr") || PathHasExtension(path, "pfm");
+}
+
+// Row y counted from the top
+static const float *ImageRow(const HdrImage *image, int y) {
+    int row = image->bottomUp ? image->height - 1 - y : y;
+
+    return image->pixels + (size_t)row * image->width * image->channels;
+}
+
+static void PutLe32(unsigned char *bytes, uint32_t value) {
+    for (int i = 0; i < 4; i++) bytes[i] = (unsigned char)(value >> (8 * i));
+}
+
+bool WritePfm(const char *path, HdrImage image) {
+    FILE *file = fopen(path, "wb");
+    if (!file) return false;
+
+    // Negative scale marks little endian, rows run bottom to top
+    fprintf(file, "PF\n%d %d\n-1.0\n", image.width, image.height);
+
+    unsigned char *row = malloc((size_t)image.width * 12);
+    bool ok = row != NULL;
+
+    for (int y = image.height - 1; ok && y >= 0; y--) {
+        const float *in = ImageRow(&image, y);
+
+        for (int x = 0; x < image.width; x++) {
+            for (int c = 0; c < 3; c++) {
+                uint32_t bits;
+                memcpy(&bits, &in[x * image.channels + c], sizeof(bits));
+                PutLe32(row + x * 12 + c * 4, bits);
+            }
+        }
+
+        ok = fwrite(row, 12, image.width, file) == (size_t)image.width;
+    }
+
+    free(row);
+    return fclose(file) == 0 && ok;
+}
+
+// Byte split and delta predictor from the EXR spec, then a zlib stream around raylib's deflate
+static unsigned char *ZipChunk(const unsigned char *raw, int size, int *compressedSize) {
+    unsigned char *split = malloc(size);
+    if (!split) return NULL;
+
+    int half = (size + 1) / 2;
+    for (int i = 0; i < size; i++) {
+        split[(i & 1) ? half + i / 2 : i / 2] = raw[i];
+    }
+
+    for (int i = size - 1; i > 0; i--) {
+        split[i] = (unsigned char)(split[i] - split[i - 1] + 128);
+    }
+
+    int deflatedSize = 0;
+    unsigned char *deflated = CompressData(split, size, &deflatedSize);
+    uint32_t adler = Adler32(split, size);
+    free(split);
+
+    if (!deflated) return NULL;
+
+    unsigned char *zlib = malloc(deflatedSize + 6);
+    if (zlib) {
+        zlib[0] = 0x78;
+        zlib[1] = 0x9c;
+        memcpy(zlib + 2, deflated, deflatedSize);
+
+        for (int i = 0; i < 4; i++) {
+            zlib[deflatedSize + 2 + i] = (unsigned char)(adler >> (24 - 8 * i));
+        }
+
+        *compressedSize = deflatedSize + 6;
+    }
+
+    MemFree(deflated);
+    return zlib;
+}
+
+static void *EncodeExrChunks(void *arg) {
+    ExrJob *job = arg;
+    const HdrImage *image = &job->image;
+
+    for (;;) {
+        int chunk = atomic_fetch_add(&job->nextChunk, 1);
+        if (chunk >= job->chunkCount) break;
+
+        TimelineZone zone = TimelineBegin("exr chunk", chunk);
+
+        int firstLine = chunk * job->linesPerChunk;
+        int lines = image->height - firstLine < job->linesPerChunk ? image->height - firstLine : job->linesPerChunk;
+        int size = lines * image->width * 12;
+
+        unsigned char *raw = malloc(size);
+        if (!raw) {
+            error("Out of memory encoding EXR.");
+        }
+
+        // Each scanline holds all of B, then G, then R, the channel names' alphabetical order
+        for (int line = 0; line < lines; line++) {
+            const float *in = ImageRow(image, firstLine + line);
+            unsigned char *out = raw + (size_t)line * image->width * 12;
+
+            for (int c = 0; c < 3; c++) {
+                for (int x = 0; x < image->width; x++) {
+                    uint32_t bits;
+                    memcpy(&bits, &in[x * image->channels + 2 - c], sizeof(bits));
+                    PutLe32(out + (c * image->width + x) * 4, bits);
+                }
+            }
+        }
+
+        int compressedSize = 0;
+        unsigned char *compressed = job->compression == EXR_COMPRESSION_ZIP ? ZipChunk(raw, size, &compressedSize) : NULL;
+
+        // Chunks that do not shrink are stored raw, readers spot them by their size
+        if (compressed && compressedSize < size) {
+            free(raw);
+            job->chunks[chunk] = compressed;
+            job->chunkSizes[chunk] = compressedSize;
+        } else {
+            free(compressed);
+            job->chunks[chunk] = raw;
+            job->chunkSizes[chunk] = size;
+        }
+
+        TimelineEnd(zone);
+    }
+
+    return NULL;
+}
+
+static void WriteAttribute(FILE *file, const char *name, const char *type, const void *value, int size) {
+    unsigned char length[4];
+    PutLe32(length, (uint32_t)size);
+
+    fwrite(name, 1, strlen(name) + 1, file);
+    fwrite(type, 1, strlen(type) + 1, file);
+    fwrite(length, 1, 4, file);
+    fwrite(value, 1, size, file);
+}
+
+static void WriteExrHeader(FILE *file, const HdrImage *image, ExrCompression compression) {
+    unsigned char header[8];
+    PutLe32(header, EXR_MAGIC);
+    PutLe32(header + 4, 2);     // Version 2, single part scanline
+    fwrite(header, 1, sizeof(header), file);
+
+    unsigned char channels[3 * 18 + 1] = {0};
+    const char *names = "BGR";
+
+    for (int c = 0; c < 3; c++) {
+        unsigned char *channel = channels + c * 18;
+
+        channel[0] = (unsigned char)names[c];
+        PutLe32(channel + 2, EXR_PIXEL_FLOAT);
+        PutLe32(channel + 10, 1);   // x and y sampling
+        PutLe32(channel + 14, 1);
+    }
+
+    unsigned char window[16];
+    PutLe32(window, 0);
+    PutLe32(window + 4, 0);
+    PutLe32(window + 8, (uint32_t)(image->width - 1));
+    PutLe32(window + 12, (uint32_t)(image->height - 1));
+
+    unsigned char compressionByte = (unsigned char)compression;
+    unsigned char lineOrder = 0;    // Increasing y
+    float one = 1.0f;
+    float center[2] = { 0.0f, 0.0f };
+
+    WriteAttribute(file, "channels", "chlist", channels, sizeof(channels));
+    WriteAttribute(file, "compression", "compression", &compressionByte, 1);
+    WriteAttribute(file, "dataWindow", "box2i", window, sizeof(window));
+    WriteAttribute(file, "displayWindow", "box2i", window, sizeof(window));
+    WriteAttribute(file, "lineOrder", "lineOrder", &lineOrder, 1);
+    WriteAttribute(file, "pixelAspectRatio", "float", &one, sizeof(one));
+    WriteAttribute(file, "screenWindowCenter", "v2f", center, sizeof(center));
+    WriteAttribute(file, "screenWindowWidth", "float", &one, sizeof(one));
+
+    fputc(0, file);
+}
+
+bool WriteExr(const char *path, HdrImage image, ExrCompression compression, int threads) {
+    int linesPerChunk = compression == EXR_COMPRESSION_ZIP ? EXR_ZIP_LINES : 1;
+
+    ExrJob job = {
+        .image = image,
+        .compression = compression,
+        .linesPerChunk = linesPerChunk,
+        .chunkCount = (image.height + linesPerChunk - 1) / linesPerChunk
+    };
+
+    job.chunks = calloc(job.chunkCount, sizeof(unsigned char *));
+    job.chunkSizes = calloc(job.chunkCount, sizeof(int));
+    atomic_init(&job.nextChunk, 0);
+
+    if (!job.chunks || !job.chunkSizes) {
+        error("Out of memory encoding EXR.");
+    }
+
+    threads = threads < 1 ? 1 : threads > job.chunkCount ? job.chunkCount : threads;
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+
+    for (int i = 1; i < threads; i++) {
+        pthread_create(&workers[i], NULL, EncodeExrChunks, &job);
+    }
+
+    EncodeExrChunks(&job);
+
+    for (int i = 1; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    free(workers);
+
+    FILE *file = fopen(path, "wb");
+    bool ok = file != NULL;
+
+    if (ok) {
+        WriteExrHeader(file, &image, compression);
+
+        // Offset table, then each chunk as (first line, size, data)
+        uint64_t offset = (uint64_t)ftell(file) + (uint64_t)job.chunkCount * 8;
+
+        for (int i = 0; i < job.chunkCount; i++) {
+            unsigned char entry[8];
+            PutLe32(entry, (uint32_t)offset);
+            PutLe32(entry + 4, (uint32_t)(offset >> 32));
+            fwrite(entry, 1, sizeof(entry), file);
+
+            offset += 8 + (uint64_t)job.chunkSizes[i];
+        }
+
+        for (int i = 0; i < job.chunkCount; i++) {
+            unsigned char chunkHeader[8];
+            PutLe32(chunkHeader, (uint32_t)(i * linesPerChunk));
+            PutLe32(chunkHeader + 4, (uint32_t)job.chunkSizes[i]);
+
+            fwrite(chunkHeader, 1, sizeof(chunkHeader), file);
+            fwrite(job.chunks[i], 1, job.chunkSizes[i], file);
+        }
+
+        ok = !ferror(file);
+        ok = fclose(file) == 0 && ok;
+    }
+
+    for (int i = 0; i < job.chunkCount; i++) {
+        free(job.chunks[i]);
+    }
+
+    free(job.chunks);
+    free(job.chunkSizes);
+
+    return ok;
+}
+
+bool WriteHdrImage(const char *path, HdrImage image, ExrCompression compression, int threads) {
+    if (PathHasExtension(path, "pfm")) {
+        return WritePfm(path, image);
+    }
+
+    return WriteExr(path, image, compression, threads);
+}
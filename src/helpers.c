@@ -1,6 +1,9 @@
 #include "../include/helpers.h"
+#include "../include/hdrwriter.h"
+#include "../include/videosink.h"
 #include "../include/tomlc17.h"
 #include "raylib.h"
+#include "rlgl.h"
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
@@ -9,19 +12,364 @@
 #define CAMERA_MOVE_SPEED 1.5
 #define CAMERA_ZOOM_SPEED 4
 
+#define BUDGET_WINDOW 8         // Frames averaged before each adjustment
+#define BUDGET_MAX_SPP 64
+#define BUDGET_MAX_STEP 2.0     // Largest factor spp can change by at once
+
+#define EMISSIVE 3
+
+static _Thread_local ErrorTrap *errorTrap;
+
 void error(const char *msg) {
+    if (errorTrap) {
+        snprintf(errorTrap->message, sizeof(errorTrap->message), "%s", msg);
+        longjmp(errorTrap->jump, 1);
+    }
+
     fprintf(stderr, "ERROR: %s\n", msg);
     exit(1);
 }
 
+ErrorTrap *SetErrorTrap(ErrorTrap *trap) {
+    ErrorTrap *previous = errorTrap;
+    errorTrap = trap;
+
+    return previous;
+}
+
+static int ParseIntArg(const char *name, const char *value, int min) {
+    char *end;
+    long parsed = strtol(value, &end, 10);
+
+    if (*end != '\0' || parsed < min) {
+        char errMsg[128];
+        snprintf(errMsg, sizeof(errMsg), "Invalid value \"%s\" for %s", value, name);
+
+        error(errMsg);
+    }
+
+    return (int)parsed;
+}
+
+static float ParseFloatArg(const char *name, const char *value, float min) {
+    char *end;
+    float parsed = strtof(value, &end);
+
+    if (*end != '\0' || parsed < min) {
+        char errMsg[128];
+        snprintf(errMsg, sizeof(errMsg), "Invalid value \"%s\" for %s", value, name);
+
+        error(errMsg);
+    }
+
+    return parsed;
+}
+
+CliOptions ParseArgs(int argc, char **argv) {
+    CliOptions options = {
+        .programPath = argv[0],
+        .scenePath = "./configs/scene.toml",
+        .offlineOutput = NULL,
+        .exrCompression = "zip",
+        .captureFormat = "exr",
+        .streamOutput = false,
+        .width = 1920,
+        .height = 0,
+        .samples = 64,
+        .denoiseIterations = 5,
+        .targetFrameMs = 1000.0f / 60.0f,
+        .seed = 0,
+        .deterministic = false,
+        .cpuViewer = false,
+        .threads = 0,
+        .tileSize = 32,
+        .tileOrder = "spiral",
+        .isa = NULL,
+        .numa = false,
+        .benchAccum = false,
+        .benchTiles = false,
+        .benchPng = false,
+        .benchConvergence = NULL,
+        .referenceSamples = 1024,
+        .rayStats = false,
+        .coordinatorPort = 0,
+        .localWorkers = 0,
+        .workerAddress = NULL,
+        .animationOutput = NULL,
+        .frameProcesses = 0,
+        .frameSlice = 0,
+        .frameSlices = 1,
+        .shmName = NULL,
+        .shmFormat = "rgba8",
+        .shmSlots = 4,
+        .videoOutput = NULL,
+        .videoFormat = NULL,
+        .videoFps = 30,
+        .checkpointPath = NULL,
+        .checkpointSeconds = 60.0f,
+        .resume = false,
+        .servePort = 0,
+        .sceneCacheSize = 8,
+        .imageCacheMb = 256,
+        .cacheDir = "render_cache",
+        .tileStreamPort = 0,
+        .streamKbps = 10000,
+        .viewAddress = NULL,
+        .timelinePath = NULL,
+        .frameTimesPath = NULL
+    };
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        // Switches without a value
+        if (strcmp(arg, "--cpu") == 0) {
+            options.cpuViewer = true;
+            continue;
+        } else if (strcmp(arg, "--stream") == 0) {
+            options.streamOutput = true;
+            continue;
+        } else if (strcmp(arg, "--numa") == 0) {
+            options.numa = true;
+            continue;
+        } else if (strcmp(arg, "--bench-accum") == 0) {
+            options.benchAccum = true;
+            continue;
+        } else if (strcmp(arg, "--bench-tiles") == 0) {
+            options.benchTiles = true;
+            continue;
+        } else if (strcmp(arg, "--bench-png") == 0) {
+            options.benchPng = true;
+            continue;
+        } else if (strcmp(arg, "--ray-stats") == 0) {
+            options.rayStats = true;
+            continue;
+        } else if (strcmp(arg, "--resume") == 0) {
+            options.resume = true;
+            continue;
+        }
+
+        if (value == NULL) {
+            char errMsg[128];
+            snprintf(errMsg, sizeof(errMsg), "Missing value for argument %s", arg);
+
+            error(errMsg);
+        }
+
+        if (strcmp(arg, "--scene") == 0) {
+            options.scenePath = value;
+        } else if (strcmp(arg, "--offline") == 0) {
+            options.offlineOutput = value;
+        } else if (strcmp(arg, "--exr-compression") == 0) {
+            options.exrCompression = value;
+        } else if (strcmp(arg, "--capture-format") == 0) {
+            options.captureFormat = value;
+        } else if (strcmp(arg, "--width") == 0) {
+            options.width = ParseIntArg(arg, value, 1);
+        } else if (strcmp(arg, "--height") == 0) {
+            options.height = ParseIntArg(arg, value, 1);
+        } else if (strcmp(arg, "--spp") == 0) {
+            options.samples = ParseIntArg(arg, value, 1);
+        } else if (strcmp(arg, "--denoise") == 0) {
+            options.denoiseIterations = ParseIntArg(arg, value, 0);
+        } else if (strcmp(arg, "--target-ms") == 0) {
+            options.targetFrameMs = ParseFloatArg(arg, value, 1.0f);
+        } else if (strcmp(arg, "--seed") == 0) {
+            options.seed = (unsigned int)ParseIntArg(arg, value, 0);
+            options.deterministic = true;
+        } else if (strcmp(arg, "--threads") == 0) {
+            options.threads = ParseIntArg(arg, value, 1);
+        } else if (strcmp(arg, "--tile-size") == 0) {
+            options.tileSize = ParseIntArg(arg, value, 1);
+        } else if (strcmp(arg, "--tile-order") == 0) {
+            options.tileOrder = value;
+        } else if (strcmp(arg, "--isa") == 0) {
+            options.isa = value;
+        } else if (strcmp(arg, "--coordinator") == 0) {
+            options.coordinatorPort = ParseIntArg(arg, value, 1);
+        } else if (strcmp(arg, "--local-workers") == 0) {
+            options.localWorkers = ParseIntArg(arg, value, 1);
+        } else if (strcmp(arg, "--worker") == 0) {
+            options.workerAddress = value;
+        } else if (strcmp(arg, "--animation") == 0) {
+            options.animationOutput = value;
+        } else if (strcmp(arg, "--frame-processes") == 0) {
+            options.frameProcesses = ParseIntArg(arg, value, 1);
+        } else if (strcmp(arg, "--shm") == 0) {
+            options.shmName = value;
+        } else if (strcmp(arg, "--shm-format") == 0) {
+            options.shmFormat = value;
+        } else if (strcmp(arg, "--shm-slots") == 0) {
+            options.shmSlots = ParseIntArg(arg, value, 2);
+        } else if (strcmp(arg, "--video") == 0) {
+            options.videoOutput = value;
+        } else if (strcmp(arg, "--video-format") == 0) {
+            options.videoFormat = value;
+        } else if (strcmp(arg, "--video-fps") == 0) {
+            options.videoFps = ParseIntArg(arg, value, 1);
+        } else if (strcmp(arg, "--checkpoint") == 0) {
+            options.checkpointPath = value;
+        } else if (strcmp(arg, "--checkpoint-seconds") == 0) {
+            options.checkpointSeconds = ParseFloatArg(arg, value, 1.0f);
+        } else if (strcmp(arg, "--serve") == 0) {
+            options.servePort = ParseIntArg(arg, value, 1);
+        } else if (strcmp(arg, "--scene-cache") == 0) {
+            options.sceneCacheSize = ParseIntArg(arg, value, 1);
+        } else if (strcmp(arg, "--image-cache-mb") == 0) {
+            options.imageCacheMb = ParseIntArg(arg, value, 0);
+        } else if (strcmp(arg, "--bench-convergence") == 0) {
+            options.benchConvergence = value;
+        } else if (strcmp(arg, "--reference-spp") == 0) {
+            options.referenceSamples = ParseIntArg(arg, value, 1);
+        } else if (strcmp(arg, "--cache-dir") == 0) {
+            options.cacheDir = value;
+        } else if (strcmp(arg, "--tile-stream") == 0) {
+            options.tileStreamPort = ParseIntArg(arg, value, 1);
+        } else if (strcmp(arg, "--stream-kbps") == 0) {
+            options.streamKbps = ParseIntArg(arg, value, 1);
+        } else if (strcmp(arg, "--view") == 0) {
+            options.viewAddress = value;
+        } else if (strcmp(arg, "--timeline") == 0) {
+            options.timelinePath = value;
+        } else if (strcmp(arg, "--frame-times") == 0) {
+            options.frameTimesPath = value;
+        } else if (strcmp(arg, "--frame-slice") == 0) {
+            if (sscanf(value, "%d/%d", &options.frameSlice, &options.frameSlices) != 2 ||
+                options.frameSlices < 1 || options.frameSlice < 0 || options.frameSlice >= options.frameSlices) {
+                error("--frame-slice expects index/count, e.g. 0/4.");
+            }
+        } else {
+            char errMsg[128];
+            snprintf(errMsg, sizeof(errMsg), "Unknown argument %s", arg);
+
+            error(errMsg);
+        }
+
+        i++;
+    }
+
+    if (options.streamOutput && options.offlineOutput == NULL) {
+        error("--stream needs an --offline output file.");
+    }
+
+    ExrCompressionFromName(options.exrCompression);
+
+    if (strcmp(options.captureFormat, "exr") != 0 && strcmp(options.captureFormat, "pfm") != 0) {
+        error("--capture-format expects exr or pfm.");
+    }
+
+    if (options.streamOutput && IsHdrPath(options.offlineOutput)) {
+        error("--stream writes a tiled TIFF, float output needs a normal --offline render.");
+    }
+
+    if (options.coordinatorPort && (options.offlineOutput == NULL || options.streamOutput)) {
+        error("--coordinator needs an --offline output file and does not stream.");
+    }
+
+    if (options.localWorkers && !options.coordinatorPort) {
+        error("--local-workers needs --coordinator.");
+    }
+
+    if (options.animationOutput && (options.offlineOutput || options.coordinatorPort)) {
+        error("--animation writes its own frames and cannot be combined with --offline.");
+    }
+
+    if (options.frameProcesses && options.animationOutput == NULL) {
+        error("--frame-processes needs --animation.");
+    }
+
+    if (options.videoOutput) {
+        VideoFormatFromName(options.videoFormat, options.videoOutput);
+
+        if (options.offlineOutput || options.coordinatorPort) {
+            error("--video records the viewer or an --animation, not an --offline render.");
+        }
+
+        if (options.frameProcesses || options.frameSlices > 1) {
+            error("--video needs every animation frame in one process, drop --frame-processes.");
+        }
+    }
+
+    if (options.resume && options.checkpointPath == NULL) {
+        error("--resume needs the --checkpoint file to continue from.");
+    }
+
+    if (options.checkpointPath && (options.offlineOutput || options.animationOutput || options.cpuViewer || options.workerAddress)) {
+        error("--checkpoint saves the GPU viewer's accumulation and only works there.");
+    }
+
+    if (options.servePort && (options.offlineOutput || options.animationOutput || options.coordinatorPort || options.workerAddress ||
+        options.cpuViewer || options.videoOutput || options.checkpointPath || options.shmName)) {
+        error("--serve renders the scenes its clients send and runs on its own.");
+    }
+
+    if (options.tileStreamPort && (options.offlineOutput || options.animationOutput || options.coordinatorPort || options.workerAddress ||
+        options.cpuViewer || options.videoOutput || options.checkpointPath || options.shmName || options.servePort)) {
+        error("--tile-stream renders headless for its viewers and runs on its own.");
+    }
+
+    // Keep the 16:9 window shape unless a height was given
+    if (options.height == 0) {
+        options.height = (int)(options.width / (16.0f / 9.0f));
+    }
+
+    return options;
+}
+
+// FNV-1a, enough to catch a truncated or mismatched scene
+uint64_t HashBytes(const void *bytes, size_t size) {
+    const unsigned char *data = bytes;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+uint32_t Adler32(const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    uint32_t a = 1, b = 0;
+
+    while (size > 0) {
+        size_t block = size < 5552 ? size : 5552;    // Largest run before the sums can overflow
+        size -= block;
+
+        while (block--) {
+            a += *bytes++;
+            b += a;
+        }
+
+        a %= 65521;
+        b %= 65521;
+    }
+
+    return b << 16 | a;
+}
+
+// Case insensitive, extension given without the dot
+bool PathHasExtension(const char *path, const char *extension) {
+    const char *dot = strrchr(path, '.');
+    const char *a = dot ? dot + 1 : "";
+
+    for (; *a && *extension; a++, extension++) {
+        if ((*a | 0x20) != *extension) return false;
+    }
+
+    return *a == '\0' && *extension == '\0';
+}
+
 toml_datum_t GetConfigParam(toml_result_t table, char *section, char *item, toml_type_t type) {
     char path[64];
-    sprintf(path, "%s.%s", section, item);
+    snprintf(path, sizeof(path), "%s.%s", section, item);
 
     toml_datum_t param = toml_seek(table.toptab, path);
     if (param.type != type) {
         char errMsg[128];
-        sprintf(errMsg, "Missing or invalid %s property", path);
+        snprintf(errMsg, sizeof(errMsg), "Missing or invalid %s property", path);
 
         error(errMsg);
     }
@@ -29,19 +377,38 @@ toml_datum_t GetConfigParam(toml_result_t table, char *section, char *item, toml
     return param;
 }
 
+float GetOptionalConfigFloat(toml_result_t table, char *section, char *item, float fallback) {
+    char path[64];
+    snprintf(path, sizeof(path), "%s.%s", section, item);
+
+    toml_datum_t param = toml_seek(table.toptab, path);
+    if (param.type == TOML_UNKNOWN) {
+        return fallback;
+    } else if (param.type == TOML_INT64) {
+        return (float) param.u.int64;
+    } else if (param.type != TOML_FP64) {
+        char errMsg[128];
+        snprintf(errMsg, sizeof(errMsg), "Invalid %s property", path);
+
+        error(errMsg);
+    }
+
+    return (float) param.u.fp64;
+}
+
 void GetConfigVec3(toml_result_t table, float *vec, char *section, char *item) {
     char path[64];
-    sprintf(path, "%s.%s", section, item);
+    snprintf(path, sizeof(path), "%s.%s", section, item);
 
     toml_datum_t param = toml_seek(table.toptab, path);
     if (param.type != TOML_ARRAY) {
         char errMsg[128];
-        sprintf(errMsg, "Missing or invalid %s property", path);
+        snprintf(errMsg, sizeof(errMsg), "Missing or invalid %s property", path);
 
         error(errMsg);
     } else if(param.u.arr.size != 3) {
         char errMsg[128];
-        sprintf(errMsg, "Wrong number of arguments (%d) for vec3 [%s]", param.u.arr.size, path);
+        snprintf(errMsg, sizeof(errMsg), "Wrong number of arguments (%d) for vec3 [%s]", param.u.arr.size, path);
 
         error(errMsg);
     }
@@ -74,7 +441,8 @@ Sphere GetObjectParams(toml_result_t table, char *name) {
     ShaderMaterial material = {
         .type = typeT.u.int64,
         .roughness = roughnessT.u.fp64,
-        .ior = iorT.u.fp64
+        .ior = iorT.u.fp64,
+        .emission = GetOptionalConfigFloat(table, matName, "emission", 0.0f)
     };
 
     memcpy(material.albedo, albedo, sizeof(albedo));
@@ -90,35 +458,237 @@ Sphere GetObjectParams(toml_result_t table, char *name) {
     return obj;
 }
 
+CameraKeyframe GetKeyframeParams(toml_result_t table, char *name) {
+    toml_datum_t frameT = GetConfigParam(table, name, "frame", TOML_INT64);
+
+    CameraKeyframe keyframe = {
+        .frame = (int)frameT.u.int64,
+        .focalLength = GetOptionalConfigFloat(table, name, "focal_length", 2.0f)
+    };
+
+    GetConfigVec3(table, keyframe.position, name, "position");
+
+    if (keyframe.frame < 0) {
+        char errMsg[128];
+        snprintf(errMsg, sizeof(errMsg), "Negative frame for keyframe %s", name);
+
+        error(errMsg);
+    }
+
+    return keyframe;
+}
+
+static int CompareKeyframes(const void *a, const void *b) {
+    return ((const CameraKeyframe *)a)->frame - ((const CameraKeyframe *)b)->frame;
+}
+
+static Scene ParseSceneToml(toml_result_t result) {
+    if (!result.ok) {
+        char errMsg[256];
+        snprintf(errMsg, sizeof(errMsg), "Config parse error: %s", result.errmsg);
+
+        error(errMsg);
+    }
+
+    // Get objects and materials
+    toml_datum_t objectsT = GetConfigParam(result, "data", "objects", TOML_ARRAY);
+
+    const size_t objCount = objectsT.u.arr.size;
+    Sphere *objects = malloc((objCount > 0 ? objCount : 1) * sizeof(Sphere));
+
+    for (size_t i = 0; i < objCount; i++) {
+        if (objectsT.u.arr.elem[i].type == TOML_STRING){
+            char *name = _strdup(objectsT.u.arr.elem[i].u.s);
+
+            objects[i] = GetObjectParams(result, name);
+            free(name);
+        } else {
+            error("Object name is not a string.");
+        }
+    }
+
+    // Light list for next event estimation
+    int *lights = malloc((objCount > 0 ? objCount : 1) * sizeof(int));
+    size_t lightCount = 0;
+
+    for (size_t i = 0; i < objCount; i++) {
+        if (objects[i].material.type == EMISSIVE) {
+            lights[lightCount++] = (int)i;
+        }
+    }
+
+    // Optional camera animation, keyframes are named like objects
+    CameraKeyframe *keyframes = NULL;
+    size_t keyframeCount = 0;
+
+    toml_datum_t keyframesT = toml_seek(result.toptab, "camera.keyframes");
+    if (keyframesT.type == TOML_ARRAY) {
+        keyframeCount = keyframesT.u.arr.size;
+        keyframes = malloc((keyframeCount > 0 ? keyframeCount : 1) * sizeof(CameraKeyframe));
+
+        for (size_t i = 0; i < keyframeCount; i++) {
+            if (keyframesT.u.arr.elem[i].type != TOML_STRING) {
+                error("Keyframe name is not a string.");
+            }
+
+            char *name = _strdup(keyframesT.u.arr.elem[i].u.s);
+            keyframes[i] = GetKeyframeParams(result, name);
+            free(name);
+        }
+
+        qsort(keyframes, keyframeCount, sizeof(CameraKeyframe), CompareKeyframes);
+
+        for (size_t i = 1; i < keyframeCount; i++) {
+            if (keyframes[i].frame == keyframes[i - 1].frame) {
+                error("Two camera keyframes share a frame.");
+            }
+        }
+    } else if (keyframesT.type != TOML_UNKNOWN) {
+        error("Missing or invalid camera.keyframes property");
+    }
+
+    Scene scene = {
+        .objCount = objCount,
+        .objects = objects,
+        .lights = lights,
+        .lightCount = lightCount,
+        .keyframes = keyframes,
+        .keyframeCount = keyframeCount
+    };
+
+    toml_free(result);
+
+    return scene;
+}
+
+Scene ParseSceneConfig(const char *filename) {
+    return ParseSceneToml(toml_parse_file_ex(filename));
+}
+
+// text must end in a NUL after length bytes, as toml_parse wants
+Scene ParseSceneText(const char *text, size_t length) {
+    return ParseSceneToml(toml_parse(text, (int)length));
+}
+
 void SceneFree(Scene *scene) {
     if (!scene) return;
 
     free(scene->objects);
+    free(scene->lights);
+    free(scene->keyframes);
+}
+
+// The flat per sphere layout scene hashes and the distributed scene message are built from
+void PackSphereWords(const Sphere *sphere, float words[SPHERE_WORDS]) {
+    const float values[SPHERE_WORDS] = {
+        sphere->pos[0], sphere->pos[1], sphere->pos[2], sphere->radius, (float)sphere->material.type,
+        sphere->material.albedo[0], sphere->material.albedo[1], sphere->material.albedo[2],
+        sphere->material.roughness, sphere->material.ior, sphere->material.emission
+    };
+
+    memcpy(words, values, sizeof(values));
+}
+
+/*
+ * Sphere Data Packing:
+ * Sphere 1 - width = 4
+ *      (0, 0):
+ *          r = type
+ *      (1, 0):
+ *          rgb = position
+ *          a = radius
+ *      (2, 0):
+ *          r = scatter type
+ *          gba = albedo
+ *      (3, 0):
+ *          r = roughness
+ *          g = ior
+ *          b = emission
+ */
+
+float *PackSphereData(const Sphere spheres[], size_t len) {
+    size_t dataSize = len * DATA_WIDTH * 4;
+    float *data = malloc((dataSize > 0 ? dataSize : 1) * sizeof(float));
+
+    if (!data) {
+        error("Out of memory packing sphere data.");
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        size_t base = i * DATA_WIDTH * 4;
+
+        // (0, 0)
+        data[base + 0] = 0; // Sphere type
+        data[base + 1] = 0.0f; // Empty (unused)
+        data[base + 2] = 0.0f;
+        data[base + 3] = 0.0f;
+
+        // (1, 0)
+        data[base + 4] = spheres[i].pos[0];
+        data[base + 5] = spheres[i].pos[1];
+        data[base + 6] = spheres[i].pos[2];
+        data[base + 7] = spheres[i].radius;
+
+        // (2, 0)
+        data[base + 8] = spheres[i].material.type;
+        data[base + 9] = spheres[i].material.albedo[0];
+        data[base + 10] = spheres[i].material.albedo[1];
+        data[base + 11] = spheres[i].material.albedo[2];
+
+        // (3, 0)
+        data[base + 12] = spheres[i].material.roughness;
+        data[base + 13] = spheres[i].material.ior;
+        data[base + 14] = spheres[i].material.emission;
+        data[base + 15] = 0.0f;
+    }
+
+    return data;
 }
 
 RaytracerShaderLocations GetRaytracerLocations(Shader shader) {
     RaytracerShaderLocations locs = {
-        .time = GetShaderLocation(shader, "time"),
+        .seed = GetShaderLocation(shader, "seed"),
+        .sampleIndex = GetShaderLocation(shader, "sampleIndex"),
         .resolution = GetShaderLocation(shader, "resolution"),
         .focalLength = GetShaderLocation(shader, "focalLength"),
         .cameraCenter = GetShaderLocation(shader, "cameraCenter"),
         .antiAliasing = GetShaderLocation(shader, "aaEnabled"),
-        .dataSize = GetShaderLocation(shader, "dataSize")
+        .samplesPerPixel = GetShaderLocation(shader, "samplesPerPixel"),
+        .dataSize = GetShaderLocation(shader, "dataSize"),
+        .lights = GetShaderLocation(shader, "lights"),
+        .lightCount = GetShaderLocation(shader, "lightCount")
     };
 
     return locs;
 }
 
 void SetRaytracerValues(Shader shader, RaytracerShaderLocations locs, RaytracerShaderValues values) {
-    SetShaderValue(shader, locs.time, &values.time, SHADER_UNIFORM_FLOAT);
+    SetShaderValue(shader, locs.seed, &values.seed, SHADER_UNIFORM_INT);
+    SetShaderValue(shader, locs.sampleIndex, &values.sampleIndex, SHADER_UNIFORM_INT);
     SetShaderValue(shader, locs.resolution, values.resolution, SHADER_UNIFORM_VEC2);
 
     SetShaderValue(shader, locs.dataSize, &values.dataSize, SHADER_UNIFORM_INT);
 
+    // Lights past the shader's objects cannot be sampled, and must not count towards the light pdf
+    int lights[MAX_OBJECTS];
+    int lightCount = 0;
+
+    for (int i = 0; i < values.lightCount && lightCount < MAX_OBJECTS; i++) {
+        if (values.lights[i] >= 0 && values.lights[i] < MAX_OBJECTS) {
+            lights[lightCount++] = values.lights[i];
+        }
+    }
+
+    SetShaderValue(shader, locs.lightCount, &lightCount, SHADER_UNIFORM_INT);
+    if (lightCount > 0) {
+        SetShaderValueV(shader, locs.lights, lights, SHADER_UNIFORM_INT, lightCount);
+    }
+
     SetShaderValue(shader, locs.focalLength, &values.focalLength, SHADER_UNIFORM_FLOAT);
     SetShaderValue(shader, locs.cameraCenter, values.cameraCenter, SHADER_UNIFORM_VEC3);
 
     SetShaderValue(shader, locs.antiAliasing, &values.antiAliasing, SHADER_UNIFORM_INT);
+    SetShaderValue(shader, locs.samplesPerPixel, &values.samplesPerPixel, SHADER_UNIFORM_INT);
 }
 
 DenoiserShaderLocations GetDenoiserLocations(Shader shader) {
@@ -127,7 +697,8 @@ DenoiserShaderLocations GetDenoiserLocations(Shader shader) {
         .prevFrame = GetShaderLocation(shader, "prevFrame"),
         .accRender = GetShaderLocation(shader, "accRender"),
         .changed = GetShaderLocation(shader, "changed"),
-        .frame = GetShaderLocation(shader, "frame")
+        .frame = GetShaderLocation(shader, "frame"),
+        .frameWeight = GetShaderLocation(shader, "frameWeight")
     };
 
     return locs;
@@ -137,6 +708,33 @@ void SetDenoiserValues(Shader shader, DenoiserShaderLocations locs, DenoiserShad
     SetShaderValue(shader, locs.resolution, values.resolution, SHADER_UNIFORM_VEC2);
     SetShaderValue(shader, locs.changed, &values.changed, SHADER_UNIFORM_INT);
     SetShaderValue(shader, locs.frame, &values.frame, SHADER_UNIFORM_INT);
+    SetShaderValue(shader, locs.frameWeight, &values.frameWeight, SHADER_UNIFORM_FLOAT);
+}
+
+AtrousShaderLocations GetAtrousLocations(Shader shader) {
+    AtrousShaderLocations locs = {
+        .resolution = GetShaderLocation(shader, "resolution"),
+        .colour = GetShaderLocation(shader, "colourTex"),
+        .normalDepth = GetShaderLocation(shader, "normalDepthTex"),
+        .albedo = GetShaderLocation(shader, "albedoTex"),
+        .stepWidth = GetShaderLocation(shader, "stepWidth"),
+        .colourPhi = GetShaderLocation(shader, "colourPhi"),
+        .normalPhi = GetShaderLocation(shader, "normalPhi"),
+        .depthPhi = GetShaderLocation(shader, "depthPhi"),
+        .albedoPhi = GetShaderLocation(shader, "albedoPhi")
+    };
+
+    return locs;
+}
+
+void SetAtrousValues(Shader shader, AtrousShaderLocations locs, AtrousShaderValues values) {
+    SetShaderValue(shader, locs.resolution, values.resolution, SHADER_UNIFORM_VEC2);
+    SetShaderValue(shader, locs.stepWidth, &values.stepWidth, SHADER_UNIFORM_INT);
+
+    SetShaderValue(shader, locs.colourPhi, &values.colourPhi, SHADER_UNIFORM_FLOAT);
+    SetShaderValue(shader, locs.normalPhi, &values.normalPhi, SHADER_UNIFORM_FLOAT);
+    SetShaderValue(shader, locs.depthPhi, &values.depthPhi, SHADER_UNIFORM_FLOAT);
+    SetShaderValue(shader, locs.albedoPhi, &values.albedoPhi, SHADER_UNIFORM_FLOAT);
 }
 
 float Clampf(float value, float min, float max) {
@@ -200,10 +798,82 @@ bool Settings(RenderSettings *settings) {
         return true;
     }
 
+    // The denoiser only filters what is presented, so the accumulation carries on
+    if (IsKeyPressed(KEY_TWO)) {
+        settings->denoiseEnabled = settings->denoiseEnabled == 1 ? 0 : 1;
+    }
+
+    // So does the heatmap, the cost is counted alongside the radiance
+    if (IsKeyPressed(KEY_THREE)) {
+        settings->heatmap = (settings->heatmap + 1) % HEATMAP_MODES;
+    }
+
     return false;
 }
 
-void DrawInfo(Camera camera, RenderSettings settings, int frame) {
+const char *HeatmapName(int mode) {
+    switch (mode) {
+        case HEATMAP_TESTS: return "sphere tests";
+        case HEATMAP_STEPS: return "traversal steps";
+        case HEATMAP_BOUNCES: return "bounces";
+        default: return "off";
+    }
+}
+
+// Same stops as Heat() in heatmap.frag
+Color HeatmapColour(float t) {
+    static const Color stops[5] = {
+        { 0, 0, 255, 255 },
+        { 0, 255, 255, 255 },
+        { 0, 255, 0, 255 },
+        { 255, 255, 0, 255 },
+        { 255, 0, 0, 255 }
+    };
+
+    float x = Clampf(t, 0.0f, 1.0f) * 4.0f;
+    int i = (int)x < 3 ? (int)x : 3;
+    float f = x - i;
+
+    return (Color){
+        (unsigned char)(stops[i].r + (stops[i + 1].r - stops[i].r) * f + 0.5f),
+        (unsigned char)(stops[i].g + (stops[i + 1].g - stops[i].g) * f + 0.5f),
+        (unsigned char)(stops[i].b + (stops[i + 1].b - stops[i].b) * f + 0.5f),
+        255
+    };
+}
+
+FrameBudget InitFrameBudget(float targetMs) {
+    FrameBudget budget = {
+        .targetMs = targetMs,
+        .samplesPerPixel = 1
+    };
+
+    return budget;
+}
+
+// frameTime is the duration of the frame that traced budget->samplesPerPixel samples
+void UpdateFrameBudget(FrameBudget *budget, float frameTime, int pixelCount) {
+    budget->windowFrames++;
+    budget->windowTime += frameTime;
+    budget->windowSamples += (double)budget->samplesPerPixel * pixelCount;
+
+    if (budget->windowFrames < BUDGET_WINDOW) return;
+
+    budget->avgFrameMs = budget->windowTime * 1000.0 / budget->windowFrames;
+    budget->samplesPerSecond = budget->windowSamples / budget->windowTime;
+
+    // Frame cost is close to linear in spp, so scale towards the target in one step
+    double scale = Clampf(budget->targetMs / budget->avgFrameMs, 1.0 / BUDGET_MAX_STEP, BUDGET_MAX_STEP);
+    int spp = (int)(budget->samplesPerPixel * scale + 0.5);
+
+    budget->samplesPerPixel = (int)Clampf(spp, 1, BUDGET_MAX_SPP);
+
+    budget->windowFrames = 0;
+    budget->windowTime = 0.0;
+    budget->windowSamples = 0.0;
+}
+
+void DrawInfo(Camera camera, RenderSettings settings, FrameBudget budget, int frame) {
     char frameInfo[16];
     sprintf(frameInfo, "Frame: %d", frame);
 
@@ -216,14 +886,27 @@ void DrawInfo(Camera camera, RenderSettings settings, int frame) {
     char aaInfo[64];
     sprintf(aaInfo, "Anti-Aliasing: %d", settings.aaEnabled);
 
+    char denoiseInfo[64];
+    sprintf(denoiseInfo, "Denoiser: %d", settings.denoiseEnabled);
+
+    char heatmapInfo[64];
+    sprintf(heatmapInfo, "Heatmap: %s", HeatmapName(settings.heatmap));
+
+    char budgetInfo[128];
+    sprintf(budgetInfo, "Samples/Frame: %d (%.1f ms, %.1f Msamples/s)",
+        budget.samplesPerPixel, budget.avgFrameMs, budget.samplesPerSecond / 1e6);
+
     DrawFPS(5, 5);
 
     DrawText(cameraPosInfo, 5, 50, 20, RED);
     DrawText(cameraFovyInfo, 5, 75, 20, RED);
 
+    DrawText(heatmapInfo, 5, 100, 20, YELLOW);
     DrawText(aaInfo, 5, 125, 20, YELLOW);
+    DrawText(denoiseInfo, 5, 150, 20, YELLOW);
 
     DrawText(frameInfo, 5, 175, 20, PURPLE);
+    DrawText(budgetInfo, 5, 200, 20, PURPLE);
 }
 
 void CopyTexture(RenderTexture source, RenderTexture target, float resolution[2]) {
@@ -242,3 +925,86 @@ void ClearTexture(RenderTexture tex) {
         ClearBackground(BLACK);
     EndTextureMode();
 }
+
+static Texture2D LoadFloatTexture(int width, int height) {
+    Texture2D tex = {
+        .id = rlLoadTexture(NULL, width, height, PIXELFORMAT_UNCOMPRESSED_R32G32B32A32, 1),
+        .width = width,
+        .height = height,
+        .mipmaps = 1,
+        .format = PIXELFORMAT_UNCOMPRESSED_R32G32B32A32
+    };
+
+    return tex;
+}
+
+// LoadRenderTexture() is always 8-bit, this keeps full float precision
+RenderTexture LoadFloatRenderTexture(int width, int height) {
+    RenderTexture target = { 0 };
+
+    target.id = rlLoadFramebuffer();
+    target.texture = LoadFloatTexture(width, height);
+
+    rlFramebufferAttach(target.id, target.texture.id, RL_ATTACHMENT_COLOR_CHANNEL0, RL_ATTACHMENT_TEXTURE2D, 0);
+
+    if (!rlFramebufferComplete(target.id)) {
+        error("Float render texture is incomplete.");
+    }
+
+    return target;
+}
+
+// Fragment shader with "#define <define>" inserted after its #version line, for debug variants
+Shader LoadShaderVariant(const char *fsFileName, const char *define) {
+    char *source = LoadFileText(fsFileName);
+
+    if (!source) {
+        error("Failed to read shader source.");
+    }
+
+    char *newline = strchr(source, '\n');
+    const char *body = newline ? newline + 1 : source + strlen(source);
+    int versionLength = (int)(body - source);
+
+    size_t size = strlen(source) + strlen(define) + 16;
+    char *variant = malloc(size);
+    snprintf(variant, size, "%.*s#define %s\n%s", versionLength, source, define, body);
+
+    Shader shader = LoadShaderFromMemory(NULL, variant);
+
+    free(variant);
+    UnloadFileText(source);
+
+    return shader;
+}
+
+GBuffer LoadGBuffer(int width, int height) {
+    GBuffer gbuffer = {
+        .target = LoadFloatRenderTexture(width, height),
+        .normalDepth = LoadFloatTexture(width, height),
+        .albedo = LoadFloatTexture(width, height),
+        .rayStats = LoadFloatTexture(width, height)     // Always attached so the viewer can switch to the stats variant at any frame
+    };
+
+    rlFramebufferAttach(gbuffer.target.id, gbuffer.normalDepth.id, RL_ATTACHMENT_COLOR_CHANNEL1, RL_ATTACHMENT_TEXTURE2D, 0);
+    rlFramebufferAttach(gbuffer.target.id, gbuffer.albedo.id, RL_ATTACHMENT_COLOR_CHANNEL2, RL_ATTACHMENT_TEXTURE2D, 0);
+    rlFramebufferAttach(gbuffer.target.id, gbuffer.rayStats.id, RL_ATTACHMENT_COLOR_CHANNEL3, RL_ATTACHMENT_TEXTURE2D, 0);
+
+    if (!rlFramebufferComplete(gbuffer.target.id)) {
+        error("G-buffer is incomplete.");
+    }
+
+    // Draw buffers are framebuffer state, so they only need to be set once
+    rlEnableFramebuffer(gbuffer.target.id);
+    rlActiveDrawBuffers(4);
+    rlDisableFramebuffer();
+
+    return gbuffer;
+}
+
+void UnloadGBuffer(GBuffer gbuffer) {
+    UnloadTexture(gbuffer.normalDepth);
+    UnloadTexture(gbuffer.albedo);
+    UnloadTexture(gbuffer.rayStats);
+    UnloadRenderTexture(gbuffer.target);
+}
@@ -1,13 +1,33 @@
 #include "../include/helpers.h"
+#include "../include/accumbuffer.h"
+#include "../include/animation.h"
+#include "../include/checkpoint.h"
+#include "../include/convergence.h"
+#include "../include/cpukernels.h"
+#include "../include/cputracer.h"
+#include "../include/denoise.h"
+#include "../include/distributed.h"
+#include "../include/frametimes.h"
+#include "../include/hdrwriter.h"
+#include "../include/platform.h"
+#include "../include/pngwriter.h"
+#include "../include/readback.h"
+#include "../include/service.h"
+#include "../include/shmring.h"
+#include "../include/videosink.h"
+#include "../include/streamrender.h"
+#include "../include/tilerender.h"
+#include "../include/tilestream.h"
+#include "../include/timeline.h"
 #include "raylib.h"
+#include "rlgl.h"
 #include "../include/tomlc17.h"
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-#define MAX_OBJECTS 4
-#define DATA_WIDTH 4
 
 // On Windows, target dedicated GPU with NVIDIA Optimus and AMD PowerXpress/Switchable Graphics
 #ifdef _WIN32
@@ -26,53 +46,8 @@
     #endif
 #endif
 
-/*
- * Sphere Data Packing:
- * Sphere 1 - width = 4
- *      (0, 0):
- *          r = type
- *      (1, 0):
- *          rgb = position
- *          a = radius
- *      (2, 0):
- *          r = scatter type
- *          gba = albedo
- *      (3, 0):
- *          r = roughness
- *          g = ior
- */
-
 Texture2D CreateSphereData(Sphere spheres[], size_t len) {
-    size_t dataSize = len * DATA_WIDTH * 4;
-    float *data = malloc(dataSize * sizeof(float));
-
-    for (int i = 0; i < len; i++) {
-        int base = i * DATA_WIDTH * 4;
-
-        // (0, 0)
-        data[base + 0] = 0; // Sphere type
-        data[base + 1] = 0.0f; // Empty (unused)
-        data[base + 2] = 0.0f;
-        data[base + 3] = 0.0f;
-
-        // (1, 0)
-        data[base + 4] = spheres[i].pos[0];
-        data[base + 5] = spheres[i].pos[1];
-        data[base + 6] = spheres[i].pos[2];
-        data[base + 7] = spheres[i].radius;
-
-        // (2, 0)
-        data[base + 8] = spheres[i].material.type;
-        data[base + 9] = spheres[i].material.albedo[0];
-        data[base + 10] = spheres[i].material.albedo[1];
-        data[base + 11] = spheres[i].material.albedo[2];
-
-        // (3, 0)
-        data[base + 12] = spheres[i].material.roughness;
-        data[base + 13] = spheres[i].material.ior;
-        data[base + 14] = 0.0f;
-        data[base + 15] = 0.0f;
-    }
+    float *data = PackSphereData(spheres, len);
 
     Image dataImage = {
         .data = data,
@@ -90,143 +65,746 @@ Texture2D CreateSphereData(Sphere spheres[], size_t len) {
     return dataTexture;
 }
 
-Scene ParseSceneConfig(const char *filename) {
-    toml_result_t result = toml_parse_file_ex(filename);
+// Runs the a-trous passes over the accumulated frame and returns the texture to present
+Texture2D DenoiseFrame(Shader shader, AtrousShaderLocations locs, Texture2D colour, GBuffer gbuffer, RenderTexture targets[2], int iterations, float res[2]) {
+    AtrousParams params = DefaultAtrousParams(iterations);
+    Texture2D source = colour;
+
+    for (int i = 0; i < params.iterations; i++) {
+        AtrousShaderValues values = {
+            .resolution = res,
+            .stepWidth = 1 << i,
+            .colourPhi = params.colourPhi / (float)(1 << i),
+            .normalPhi = params.normalPhi,
+            .depthPhi = params.depthPhi,
+            .albedoPhi = params.albedoPhi
+        };
 
-    if (!result.ok) {
-        error("Config parse error.");
+        SetAtrousValues(shader, locs, values);
+
+        BeginTextureMode(targets[i % 2]);
+            ClearBackground(BLACK);
+            BeginShaderMode(shader);
+                SetShaderValueTexture(shader, locs.colour, source);
+                SetShaderValueTexture(shader, locs.normalDepth, gbuffer.normalDepth);
+                SetShaderValueTexture(shader, locs.albedo, gbuffer.albedo);
+
+                DrawRectangle(0, 0, GetScreenWidth(), GetScreenHeight(), WHITE);
+            EndShaderMode();
+        EndTextureMode();
+
+        source = targets[i % 2].texture;
     }
 
-    // Get objects and materials
-    toml_datum_t objectsT = GetConfigParam(result, "data", "objects", TOML_ARRAY);
+    return source;
+}
 
-    const size_t objCount = objectsT.u.arr.size;
-    char *objNames[objCount];
+static void PublishToShmRing(void *user, const ReadbackFrame *frame) {
+    ShmRingPublishTexture(user, frame->pixels, frame->format);
+}
 
-    Sphere *objects = malloc(objCount * sizeof(Sphere));
+// Dropped rather than waited on when the writer falls behind, the window keeps its frame rate
+static void RecordVideoFrame(void *user, const ReadbackFrame *frame) {
+    VideoSinkSubmit(user, -1, frame->pixels, true);
+}
 
-    // Get the names of all the objects
-    for (int i = 0; i < objCount; i++) {
-        if (objectsT.u.arr.elem[i].type == TOML_STRING){
-            objNames[i] = _strdup(objectsT.u.arr.elem[i].u.s);
+static VideoSink *OpenVideoOutput(CliOptions options, int width, int height) {
+    if (options.videoOutput == NULL) return NULL;
 
-            objects[i] = GetObjectParams(result, objNames[i]);
-        } else {
-            error("Object name is not a string.");
+    return VideoSinkOpen(options.videoOutput, VideoFormatFromName(options.videoFormat, options.videoOutput),
+        width, height, options.videoFps);
+}
+
+// One shot, armed by the screenshot key, saves the frame without the overlay
+static void SaveScreenshot(void *user, const ReadbackFrame *frame) {
+    bool *pending = user;
+    if (!*pending) return;
+
+    Image image = GenImageColor(frame->width, frame->height, BLACK);
+    unsigned char *out = image.data;
+
+    // Frames are linear floats read bottom up
+    for (int y = 0; y < frame->height; y++) {
+        const float *in = (const float *)frame->pixels + (size_t)(frame->height - 1 - y) * frame->width * 4;
+
+        for (int i = 0; i < frame->width * 4; i++) {
+            out[(size_t)y * frame->width * 4 + i] = (i % 4 == 3) ? 255 : GammaByte(in[i]);
         }
     }
 
-    Scene scene = {
-        .objCount = objCount,
-        .objects = objects
-    };
+    char path[64];
+    snprintf(path, sizeof(path), "screenshot_%lld.png", frame->index);
+
+    if (ExportImage(image, path)) {
+        printf("Saved %s\n", path);
+    }
+
+    UnloadImage(image);
+    *pending = false;
+}
+
+typedef struct HdrCapture {
+    bool pending;
+    ExrCompression compression;
+    const char *format;
+} HdrCapture;
+
+static void WriteHdrCapture(const HdrCapture *capture, HdrImage image, long long index) {
+    char path[64];
+    snprintf(path, sizeof(path), "capture_%lld.%s", index, capture->format);
+
+    if (WriteHdrImage(path, image, capture->compression, CpuCount())) {
+        printf("Saved %s\n", path);
+    }
+}
+
+// The raw accumulation buffer, before the denoiser, as linear floats
+static void SaveHdrCapture(void *user, const ReadbackFrame *frame) {
+    HdrCapture *capture = user;
+    if (!capture->pending) return;
 
-    toml_free(result);
+    HdrImage image = { frame->pixels, frame->width, frame->height, 4, true };
+    WriteHdrCapture(capture, image, frame->index);
 
-    for (int i = 0; i < objCount; i++) {
-        free(objNames[i]);
+    capture->pending = false;
+}
+
+// Totals of the RAY_STATS shader variant's per pixel counts, summed as the readbacks land
+#define GPU_STATS_FRAMES 8     // More than READBACK_BUFFERS, so a frame's sample count is still there when its counts land
+
+typedef struct GpuRayStats {
+    double last[4];     // Newest frame: rays, shadow rays, spheres tested, surfaces hit
+    double total[4];
+    long long frames;
+    int samples[GPU_STATS_FRAMES];  // Samples per pixel of the frames in flight, by index
+} GpuRayStats;
+
+static void SumGpuRayStats(void *user, const ReadbackFrame *frame) {
+    GpuRayStats *stats = user;
+    const float *counts = frame->pixels;
+    size_t pixelCount = (size_t)frame->width * frame->height;
+
+    double sums[4] = { 0.0 };
+
+    for (size_t i = 0; i < pixelCount; i++) {
+        for (int c = 0; c < 4; c++) {
+            sums[c] += counts[i * 4 + c];
+        }
+    }
+
+    // The shader averages over the frame's samples
+    int samples = stats->samples[frame->index % GPU_STATS_FRAMES];
+
+    for (int c = 0; c < 4; c++) {
+        stats->last[c] = sums[c] * samples;
+        stats->total[c] += sums[c] * samples;
     }
 
-    return scene;
+    stats->frames++;
 }
 
-int main() {
-    Scene scene = ParseSceneConfig("./configs/scene.toml");
+// Counts the heatmap mode adds up, and the most a sample can cost since the shader walks every object for each query
+static float HeatmapRange(int mode, int objCount, Vector4 *weights) {
+    switch (mode) {
+        case HEATMAP_TESTS:
+            *weights = (Vector4){ 0.0f, 0.0f, 1.0f, 0.0f };
+            return 2.0f * CPU_MAX_DEPTH * objCount;
+        case HEATMAP_STEPS:
+            *weights = (Vector4){ 1.0f, 1.0f, 0.0f, 0.0f };
+            return 2.0f * CPU_MAX_DEPTH;
+        default:
+            *weights = (Vector4){ 0.0f, 0.0f, 0.0f, 1.0f };
+            return CPU_MAX_DEPTH;
+    }
+}
+
+typedef struct CheckpointCapture {
+    bool pending;
+    Checkpoint state;       // Taken when the copy is queued, the pixels arrive with the readback
+    CheckpointWriter writer;
+} CheckpointCapture;
+
+static Checkpoint CheckpointState(uint64_t sceneHash, unsigned int seed, Camera camera, RenderSettings settings, int nextFrame, int accumulatedSamples) {
+    return (Checkpoint){
+        .sceneHash = sceneHash,
+        .seed = seed,
+        .width = settings.width,
+        .height = settings.height,
+        .frame = nextFrame,
+        .accumulatedSamples = accumulatedSamples,
+        .position = { camera.position.x, camera.position.y, camera.position.z },
+        .focalLength = camera.fovy,
+        .aaEnabled = settings.aaEnabled,
+        .denoiseEnabled = settings.denoiseEnabled,
+        .denoiseIterations = settings.denoiseIterations
+    };
+}
+
+static void SaveCheckpoint(void *user, const ReadbackFrame *frame) {
+    CheckpointCapture *capture = user;
+    if (!capture->pending) return;
+
+    capture->state.pixels = (float *)frame->pixels;
+    SaveCheckpointAsync(&capture->writer, &capture->state);
+
+    capture->state.pixels = NULL;
+    capture->pending = false;
+}
 
+static void DumpTimeline(const char *path) {
+    if (TimelineWrite()) {
+        printf("Timeline written to %s\n", path);
+    } else {
+        fprintf(stderr, "Failed to write the timeline to %s\n", path);
+    }
+}
+
+// Drains the GPU timers while the context is still up, then writes the dump if one was asked for
+static void FinishFrameTimes(FrameTimes *times, CliOptions options) {
+    FrameTimesFinish(times);
+
+    if (options.frameTimesPath && !FrameTimesWrite(times, options.frameTimesPath, options.scenePath, options.width, options.height)) {
+        fprintf(stderr, "Failed to write frame times to %s\n", options.frameTimesPath);
+    }
+
+    FrameTimesFree(times);
+}
+
+// Interactive fallback that shows the CPU tile renderer converging
+void RunCpuViewer(Scene scene, Camera camera, CliOptions options) {
     RenderSettings settings = {
-        .aaEnabled = 0,
-        .width = 1920
+        .aaEnabled = 1,
+        .width = options.width,
+        .height = options.height
     };
 
-    const float aspectRatio = 16.0f / 9.0f;
+    InitWindow(settings.width, settings.height, "Simple Raytracer (CPU)");
+    SetTargetFPS(60);
 
-    const int screenWidth = settings.width;
-    const int screenHeight = (int)(screenWidth / aspectRatio);
+    CpuScene cpuScene = BuildCpuScene(scene);
 
-    SetConfigFlags(FLAG_FULLSCREEN_MODE);
+    int threads = options.threads > 0 ? options.threads : CpuCount();
+    TileRenderer *renderer = TileRendererCreate(&cpuScene, settings.width, settings.height,
+        options.tileSize, threads, TileOrderFromName(options.tileOrder), options.numa, options.seed);
 
-    InitWindow(screenWidth, screenHeight, "Simple Raytracer");
+    for (int i = 0; options.numa && i < renderer->nodeCount; i++) {
+        const TileNode *node = &renderer->nodes[i];
+        int workers = threads / renderer->nodeCount + (i < threads % renderer->nodeCount);
+
+        printf("NUMA node %d: %d workers on %d cpus, tile rows %d-%d\n",
+            i, workers, node->cpuCount, node->firstRow, node->firstRow + node->rowCount - 1);
+    }
+
+    TileRendererReset(renderer, InitCpuCamera(camera.position, camera.fovy, settings.width, settings.height), settings.aaEnabled == 1);
+
+    unsigned char *pixels = malloc((size_t)settings.width * settings.height * 4);
+    Image image = {
+        .data = pixels,
+        .width = settings.width,
+        .height = settings.height,
+        .mipmaps = 1,
+        .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8
+    };
+
+    Texture2D texture = LoadTextureFromImage(image);
+
+    ShmRing *ring = options.shmName ? ShmRingCreate(options.shmName, settings.width, settings.height,
+        ShmFormatFromName(options.shmFormat), options.shmSlots) : NULL;
+
+    HdrCapture capture = { false, ExrCompressionFromName(options.exrCompression), options.captureFormat };
+    long long captures = 0;
+
+    VideoSink *video = OpenVideoOutput(options, settings.width, settings.height);
+
+    FrameBudget stats = InitFrameBudget(0.0f);
+    long long lastSamples = 0;
+    double lastTime = GetTime();
+
+    // The tiles are traced off the render thread, so only the CPU side of a frame is timed
+    FrameTimes *frameTimes = FrameTimesCreate(false);
+
+    while (!WindowShouldClose()) {
+        bool reset = false;
+
+        if (Movement(&camera) || Zoom(&camera) || Settings(&settings)) {
+            CpuCamera cpuCamera = InitCpuCamera(camera.position, camera.fovy, settings.width, settings.height);
+            TileRendererReset(renderer, cpuCamera, settings.aaEnabled == 1);
+
+            reset = true;
+        }
+
+        // Partial passes are shown as they land. 8-bit frames are resolved straight into the ring slot
+        const unsigned char *shown = pixels;
+
+        if (ring && ring->header->format == SHM_FORMAT_RGBA8) {
+            unsigned char *slot = ShmRingBegin(ring);
+
+            TileRendererResolve(renderer, slot);
+            UpdateTexture(texture, slot);
+            ShmRingPublish(ring);
+
+            shown = slot;   // Only this process writes the slot, it stays intact until the next frame
+        } else {
+            TileRendererResolve(renderer, pixels);
+            UpdateTexture(texture, pixels);
+        }
+
+        // The pixels are already on the CPU, so they go straight to the writer
+        if (video) {
+            VideoSinkSubmit(video, -1, shown, false);
+        }
+
+        // Only the window shows the heatmap, the ring and the recording keep the radiance
+        float heatmapRange = 0.0f;
+
+        if (settings.heatmap != HEATMAP_OFF) {
+            heatmapRange = TileRendererResolveHeatmap(renderer, pixels, settings.heatmap);
+            UpdateTexture(texture, pixels);
+        }
+
+        if (ring && ring->header->format == SHM_FORMAT_RGBA32F) {
+            AccumBufferResolveLinear(&renderer->accum, ShmRingBegin(ring));
+            ShmRingPublish(ring);
+        }
+
+        if (IsKeyPressed(KEY_T) && options.timelinePath) {
+            DumpTimeline(options.timelinePath);
+        }
+
+        if (IsKeyPressed(KEY_H)) {
+            float *linear = malloc((size_t)settings.width * settings.height * 4 * sizeof(float));
+            AccumBufferResolveLinear(&renderer->accum, linear);
+
+            HdrImage hdr = { linear, settings.width, settings.height, 4, false };
+            WriteHdrCapture(&capture, hdr, captures++);
+
+            free(linear);
+        }
+
+        double now = GetTime();
+        if (now - lastTime >= 0.5) {
+            long long samples = atomic_load(&renderer->samplesTraced);
+
+            stats.samplesPerSecond = (samples - lastSamples) / (now - lastTime);
+            stats.avgFrameMs = GetFrameTime() * 1000.0;
+
+            lastSamples = samples;
+            lastTime = now;
+        }
+
+        BeginDrawing();
+            ClearBackground(BLACK);
+            DrawTexture(texture, 0, 0, WHITE);
+            DrawInfo(camera, settings, stats, renderer->pass);
+            DrawFrameTimes(frameTimes, 5, 27);
+            DrawText(TextFormat("Kernels: %s", cpuKernels.name), 5, 225, 20, PURPLE);
+
+            if (options.rayStats) {
+                RayStats rays = TileRendererStats(renderer);
+                double perPath = rays.paths > 0 ? 1.0 / rays.paths : 0.0;
+
+                DrawText(TextFormat("Rays/path: %.2f + %.2f shadow, %.1f nodes, %.1f spheres",
+                    rays.rays * perPath, rays.shadowRays * perPath, rays.nodesVisited * perPath, rays.spheresTested * perPath), 5, 250, 20, PURPLE);
+            }
+
+            if (settings.heatmap != HEATMAP_OFF) {
+                DrawText(TextFormat("Red: %.1f %s per sample", heatmapRange, HeatmapName(settings.heatmap)),
+                    5, options.rayStats ? 275 : 250, 20, YELLOW);
+            }
+        EndDrawing();
+
+        FrameTimesEndFrame(frameTimes, reset);
+    }
+
+    FinishFrameTimes(frameTimes, options);
+
+    if (options.rayStats) {
+        RayStats rays = TileRendererStats(renderer);
+        PrintRayStats(&rays, 0.0);
+    }
+
+    UnloadTexture(texture);
+    CloseWindow();
+
+    VideoSinkClose(video);
+    ShmRingDestroy(ring);
+    TileRendererFree(renderer);
+    CpuSceneFree(&cpuScene);
+    free(pixels);
+}
+
+int main(int argc, char **argv) {
+    CliOptions options = ParseArgs(argc, argv);
+
+    if (options.timelinePath) {
+        TimelineStart(options.timelinePath);
+    }
+
+    SelectCpuKernels(options.isa ? CpuIsaFromName(options.isa) : DetectCpuIsa());
+    printf("CPU kernels: %s\n", cpuKernels.name);
+
+    if (options.benchAccum) {
+        BenchmarkAccumBuffer();
+        return 0;
+    }
+
+    // Workers get their scene from the coordinator
+    if (options.workerAddress) {
+        RunWorker(options);
+        return 0;
+    }
+
+    // Viewers get everything they show from the stream
+    if (options.viewAddress) {
+        RunTileStreamViewer(options);
+        return 0;
+    }
+
+    // The service parses whatever scenes it is sent
+    if (options.servePort) {
+        RunService(options);
+        return 0;
+    }
+
+    TimelineZone zone = TimelineBegin("scene parse", -1);
+    Scene scene = ParseSceneConfig(options.scenePath);
+    TimelineEnd(zone);
 
     Camera camera = {
         .position = {0.0f, 0.0f, 2.0f},
         .fovy = 2.0f
     };
 
-    SetTargetFPS(100);
+    // Animated scenes open on their first keyframe
+    camera = CameraAtFrame(&scene, 0, camera);
+
+    if (options.benchTiles) {
+        BenchmarkTileRenderer(scene, camera, options);
+        SceneFree(&scene);
+
+        return 0;
+    }
+
+    if (options.tileStreamPort) {
+        RunTileStreamServer(scene, camera, options);
+        SceneFree(&scene);
+
+        return 0;
+    }
+
+    if (options.benchPng) {
+        BenchmarkPngWriter(scene, camera, options);
+        SceneFree(&scene);
+
+        return 0;
+    }
+
+    if (options.benchConvergence) {
+        BenchmarkConvergence(scene, camera, options);
+        SceneFree(&scene);
+
+        return 0;
+    }
+
+    if (options.animationOutput) {
+        RenderAnimation(scene, camera, options);
+        SceneFree(&scene);
+
+        return 0;
+    }
+
+    if (options.offlineOutput) {
+        if (options.coordinatorPort) {
+            RunCoordinator(scene, camera, options);
+        } else if (options.streamOutput) {
+            RenderStreamed(scene, camera, options);
+        } else {
+            RenderOffline(scene, camera, options);
+        }
+
+        SceneFree(&scene);
+
+        return 0;
+    }
+
+    if (options.cpuViewer) {
+        RunCpuViewer(scene, camera, options);
+        SceneFree(&scene);
+
+        return 0;
+    }
+
+    RenderSettings settings = {
+        .aaEnabled = 0,
+        .denoiseEnabled = 0,
+        .denoiseIterations = options.denoiseIterations,
+        .width = options.width,
+        .height = options.height
+    };
+
+    const int screenWidth = settings.width;
+    const int screenHeight = settings.height;
+
+    SetConfigFlags(FLAG_FULLSCREEN_MODE);
+
+    InitWindow(screenWidth, screenHeight, "Simple Raytracer");
+
+    // Frames are paced by the sample budget instead of an FPS cap
+    FrameBudget budget = InitFrameBudget(options.targetFrameMs);
 
+    // A fresh key per run unless a seed pins the noise for golden image comparisons
+    unsigned int seed = options.deterministic ? options.seed : (unsigned int)time(NULL);
+
+    zone = TimelineBegin("sphere data upload", -1);
     Texture2D data = CreateSphereData(scene.objects, scene.objCount);
+    TimelineEnd(zone);
+
+    zone = TimelineBegin("shader load", -1);
 
     Shader raytracing = LoadShader(0, "src/shaders/raytracing.frag");
     Shader denoiser = LoadShader(0, "src/shaders/denoise.frag");
+    Shader atrous = LoadShader(0, "src/shaders/atrous.frag");
+    Shader present = LoadShader(0, "src/shaders/present.frag");
+    Shader heatmap = LoadShader(0, "src/shaders/heatmap.frag");
+
+    // Also writes per pixel work counts to the fourth G-buffer target, used for --ray-stats and the heatmap
+    Shader raytracingStats = LoadShaderVariant("src/shaders/raytracing.frag", "RAY_STATS");
 
     DenoiserShaderLocations denoiserLocs = GetDenoiserLocations(denoiser);
     RaytracerShaderLocations raytracerLocs = GetRaytracerLocations(raytracing);
+    RaytracerShaderLocations statsLocs = GetRaytracerLocations(raytracingStats);
+    AtrousShaderLocations atrousLocs = GetAtrousLocations(atrous);
+
+    int heatmapWeightsLoc = GetShaderLocation(heatmap, "weights");
+    int heatmapRangeLoc = GetShaderLocation(heatmap, "range");
+
+    TimelineEnd(zone);
+
+    GBuffer gbuffer = LoadGBuffer(screenWidth, screenHeight);
+    // Linear float accumulation, gamma only happens in the present shader
+    RenderTexture accA = LoadFloatRenderTexture(screenWidth, screenHeight);
+    RenderTexture accB = LoadFloatRenderTexture(screenWidth, screenHeight);
+
+    RenderTexture filterTargets[2] = {
+        LoadFloatRenderTexture(screenWidth, screenHeight),
+        LoadFloatRenderTexture(screenWidth, screenHeight)
+    };
+
+    // The work counts are averaged over samples the same way as the radiance while the heatmap is up
+    RenderTexture heatTargets[2] = {
+        LoadFloatRenderTexture(screenWidth, screenHeight),
+        LoadFloatRenderTexture(screenWidth, screenHeight)
+    };
+    int heatIndex = 0;
+    int heatSamples = 0;
+    bool heatShown = false;
+
+    ShmRing *ring = options.shmName ? ShmRingCreate(options.shmName, screenWidth, screenHeight,
+        ShmFormatFromName(options.shmFormat), options.shmSlots) : NULL;
+
+    // Frames leave the GPU a couple of frames late instead of stalling it
+    ReadbackRing *readback = ReadbackCreate(screenWidth, screenHeight);
+    bool screenshotPending = false;
+
+    ReadbackAddSink(readback, (ReadbackSink){ SaveScreenshot, &screenshotPending });
+
+    // Captures read a different texture, so they get their own buffers
+    ReadbackRing *hdrReadback = ReadbackCreate(screenWidth, screenHeight);
+    HdrCapture hdrCapture = { false, ExrCompressionFromName(options.exrCompression), options.captureFormat };
+
+    ReadbackAddSink(hdrReadback, (ReadbackSink){ SaveHdrCapture, &hdrCapture });
+
+    if (ring) {
+        ReadbackAddSink(readback, (ReadbackSink){ PublishToShmRing, ring });
+    }
+
+    // Recording reads back the gamma corrected 8-bit frame, a quarter of the float copy
+    VideoSink *video = OpenVideoOutput(options, screenWidth, screenHeight);
+    RenderTexture videoTarget = { 0 };
+    ReadbackRing *videoReadback = NULL;
 
-    RenderTexture prevFrame = LoadRenderTexture(screenWidth, screenHeight);
-    RenderTexture accA = LoadRenderTexture(screenWidth, screenHeight);
-    RenderTexture accB = LoadRenderTexture(screenWidth, screenHeight);
+    if (video) {
+        videoTarget = LoadRenderTexture(screenWidth, screenHeight);
+        videoReadback = ReadbackCreate(screenWidth, screenHeight);
 
+        ReadbackAddSink(videoReadback, (ReadbackSink){ RecordVideoFrame, video });
+    }
+
+    GpuRayStats gpuRayStats = { 0 };
+    ReadbackRing *statsReadback = NULL;
+
+    if (options.rayStats) {
+        statsReadback = ReadbackCreate(screenWidth, screenHeight);
+        ReadbackAddSink(statsReadback, (ReadbackSink){ SumGpuRayStats, &gpuRayStats });
+    }
+
+    // Long renders survive a crash or a closed window, the accumulation goes to disk every so often
+    uint64_t sceneHash = SceneHash(&scene);
+    ReadbackRing *checkpointReadback = NULL;
+    CheckpointCapture checkpoint = { .writer = { .path = options.checkpointPath } };
+    double lastCheckpoint = GetTime();
+
+    if (options.checkpointPath) {
+        checkpointReadback = ReadbackCreate(screenWidth, screenHeight);
+        ReadbackAddSink(checkpointReadback, (ReadbackSink){ SaveCheckpoint, &checkpoint });
+    }
+
+    long long framesShown = 0;
     bool useA = true;
 
     int frame = 0;
+    int accumulatedSamples = 0;
+
+    if (options.resume) {
+        Checkpoint saved;
+
+        if (ReadCheckpoint(options.checkpointPath, &saved)) {
+            if (saved.sceneHash != sceneHash) {
+                error("The checkpoint was saved for a different scene.");
+            }
+
+            if (saved.width != screenWidth || saved.height != screenHeight) {
+                error("The checkpoint was saved at another size, pass the same --width and --height.");
+            }
+
+            // The next frame blends into accA like any other, so accumulation carries on with the same sample keys
+            UpdateTexture(accA.texture, saved.pixels);
+
+            camera.position = (Vector3){ saved.position[0], saved.position[1], saved.position[2] };
+            camera.fovy = saved.focalLength;
+            settings.aaEnabled = saved.aaEnabled;
+            settings.denoiseEnabled = saved.denoiseEnabled;
+            settings.denoiseIterations = saved.denoiseIterations;
+
+            seed = saved.seed;
+            frame = saved.frame;
+            accumulatedSamples = saved.accumulatedSamples;
+
+            printf("Resumed %s at %d samples per pixel\n", options.checkpointPath, accumulatedSamples);
+            CheckpointFree(&saved);
+        } else {
+            printf("No usable checkpoint at %s, starting fresh\n", options.checkpointPath);
+        }
+    }
+
+    Texture2D latest = accA.texture;
+    double samplesTraced = 0.0;
+    double renderStart = GetTime();
+
+    FrameTimes *frameTimes = FrameTimesCreate(true);
+
     while (!WindowShouldClose()) {    // Detect window close button or ESC key
         float res[2] = { (float)GetScreenWidth(), (float)GetScreenHeight() };
-        float time = GetTime();
+
+        // GetFrameTime() is the previous frame, which traced the current budget.
+        // Deterministic runs keep one sample per frame so frame n is always the same image
+        if (frame > 0 && !options.deterministic) {
+            UpdateFrameBudget(&budget, GetFrameTime(), screenWidth * screenHeight);
+        }
+
+        int spp = budget.samplesPerPixel;
 
         int changed = 0;
         if (Movement(&camera) || Zoom(&camera) || Settings(&settings)) {
             changed = 1;
         }
 
+        if (changed == 1) {
+            ClearTexture(accA);
+            ClearTexture(accB);
+
+            frame = 0;
+            accumulatedSamples = 0;
+            useA = true;
+        }
+
         float pos[3] = {camera.position.x, camera.position.y, camera.position.z};
 
         RaytracerShaderValues raytracerValues = {
-            .time = time,
+            .seed = seed,
+            .sampleIndex = accumulatedSamples,
             .resolution = res,
             .dataSize = scene.objCount,
+            .lights = scene.lights,
+            .lightCount = scene.lightCount,
             .focalLength = camera.fovy,
             .cameraCenter = pos,
-            .antiAliasing = settings.aaEnabled
+            .antiAliasing = settings.aaEnabled,
+            .samplesPerPixel = spp
         };
 
-        if (changed == 1) {
-            ClearTexture(accA);
-            ClearTexture(accB);
+        accumulatedSamples += spp;
+        samplesTraced += (double)spp * screenWidth * screenHeight;
 
-            frame = 0;
-            useA = true;
-        }
+        bool countWork = options.rayStats || settings.heatmap != HEATMAP_OFF;
+        Shader tracer = countWork ? raytracingStats : raytracing;
+
+        SetRaytracerValues(tracer, countWork ? statsLocs : raytracerLocs, raytracerValues);
 
-        SetRaytracerValues(raytracing, raytracerLocs, raytracerValues);
+        int dataLoc = GetShaderLocation(tracer, "data");
 
-        int dataLoc = GetShaderLocation(raytracing, "data");
+        // GL only queues the passes, so their zones are CPU time and the GPU's shows up in the present's swap
+        TimelineZone pass = TimelineBegin("trace pass", frame);
+        FrameTimesBeginGpu(frameTimes);
 
-        BeginTextureMode(prevFrame);
+        // The counts fill the alpha channel of the stats target, so nothing may be blended
+        BeginTextureMode(gbuffer.target);
             ClearBackground(BLACK);
-            BeginShaderMode(raytracing);
-                SetShaderValueTexture(raytracing, dataLoc, data);   // The data must be loaded here
+            rlDisableColorBlend();
+            BeginShaderMode(tracer);
+                SetShaderValueTexture(tracer, dataLoc, data);   // The data must be loaded here
                 DrawRectangle(0, 0, GetScreenWidth(), GetScreenHeight(), WHITE);
             EndShaderMode();
         EndTextureMode();
+        rlEnableColorBlend();
+
+        TimelineEnd(pass);
+
+        // Restarts whenever the view changed or the counts were not being averaged last frame
+        if (settings.heatmap != HEATMAP_OFF) {
+            pass = TimelineBegin("heatmap pass", frame);
+
+            bool restart = frame == 0 || !heatShown;
+            heatSamples = restart ? spp : heatSamples + spp;
+
+            DenoiserShaderValues heatValues = {
+                .resolution = res,
+                .changed = restart,
+                .frame = frame,
+                .frameWeight = (float)spp / heatSamples
+            };
+
+            SetDenoiserValues(denoiser, denoiserLocs, heatValues);
+
+            BeginTextureMode(heatTargets[1 - heatIndex]);
+                rlDisableColorBlend();
+                BeginShaderMode(denoiser);
+                    SetShaderValueTexture(denoiser, denoiserLocs.prevFrame, gbuffer.rayStats);
+                    SetShaderValueTexture(denoiser, denoiserLocs.accRender, heatTargets[heatIndex].texture);
+
+                    DrawRectangle(0, 0, GetScreenWidth(), GetScreenHeight(), WHITE);
+                EndShaderMode();
+            EndTextureMode();
+            rlEnableColorBlend();
+
+            heatIndex = 1 - heatIndex;
+            TimelineEnd(pass);
+        }
+
+        heatShown = settings.heatmap != HEATMAP_OFF;
+
+        RenderTexture accumulated;
+        pass = TimelineBegin("accumulate pass", frame);
 
         if (frame == 0) {
-            CopyTexture(prevFrame, accA, res);
-
-            BeginDrawing();
-                ClearBackground(WHITE);
-                DrawTextureRec(
-                    accA.texture,
-                    (Rectangle){ 0, 0, (float)screenWidth, -(float)screenHeight },
-                    (Vector2){ 0, 0 },
-                    WHITE
-                );
-                DrawInfo(camera, settings, frame);
-            EndDrawing();
+            CopyTexture(gbuffer.target, accA, res);
+            accumulated = accA;
         } else {
             DenoiserShaderValues denoiserValues = {
                 .resolution = res,
                 .changed = changed,
-                .frame = frame
+                .frame = frame,
+                .frameWeight = (float)spp / accumulatedSamples
             };
 
             SetDenoiserValues(denoiser, denoiserLocs, denoiserValues);
@@ -234,30 +812,194 @@ int main() {
             BeginTextureMode(useA ? accB : accA);
                 ClearBackground(BLACK);
                 BeginShaderMode(denoiser);
-                    SetShaderValueTexture(denoiser, denoiserLocs.prevFrame, prevFrame.texture);
+                    SetShaderValueTexture(denoiser, denoiserLocs.prevFrame, gbuffer.target.texture);
                     SetShaderValueTexture(denoiser, denoiserLocs.accRender, useA ? accA.texture : accB.texture);
 
                     DrawRectangle(0, 0, GetScreenWidth(), GetScreenHeight(), WHITE);
                 EndShaderMode();
             EndTextureMode();
 
-            BeginDrawing();
-                ClearBackground(WHITE);
-                DrawTextureRec(
-                    useA ? accB.texture : accA.texture,
-                    (Rectangle){ 0, 0, (float)screenWidth, -(float)screenHeight },
-                    (Vector2){ 0, 0 },
-                    WHITE
-                );
-                DrawInfo(camera, settings, frame);
-            EndDrawing();
-
+            accumulated = useA ? accB : accA;
             useA = !useA;
         }
 
+        TimelineEnd(pass);
+
+        Texture2D presented = accumulated.texture;
+        latest = accumulated.texture;
+
+        if (settings.denoiseEnabled == 1) {
+            pass = TimelineBegin("denoise pass", frame);
+            presented = DenoiseFrame(atrous, atrousLocs, accumulated.texture, gbuffer, filterTargets, settings.denoiseIterations, res);
+            TimelineEnd(pass);
+        }
+
+        ReadbackPoll(readback, false);
+        ReadbackPoll(hdrReadback, false);
+
+        if (video) {
+            ReadbackPoll(videoReadback, false);
+
+            BeginTextureMode(videoTarget);
+                BeginShaderMode(present);
+                    DrawTextureRec(
+                        presented,
+                        (Rectangle){ 0, 0, (float)screenWidth, -(float)screenHeight },
+                        (Vector2){ 0, 0 },
+                        WHITE
+                    );
+                EndShaderMode();
+            EndTextureMode();
+
+            ReadbackQueue(videoReadback, videoTarget.texture, framesShown);
+        }
+
+        if (IsKeyPressed(KEY_P)) {
+            screenshotPending = true;
+        }
+
+        if (IsKeyPressed(KEY_T) && options.timelinePath) {
+            DumpTimeline(options.timelinePath);
+        }
+
+        if (statsReadback) {
+            ReadbackPoll(statsReadback, false);
+
+            gpuRayStats.samples[framesShown % GPU_STATS_FRAMES] = spp;
+            ReadbackQueue(statsReadback, gbuffer.rayStats, framesShown);
+        }
+
+        if (checkpointReadback) {
+            ReadbackPoll(checkpointReadback, false);
+
+            if (!checkpoint.pending && GetTime() - lastCheckpoint >= options.checkpointSeconds) {
+                checkpoint.state = CheckpointState(sceneHash, seed, camera, settings, frame + 1, accumulatedSamples);
+                checkpoint.pending = true;
+
+                ReadbackQueue(checkpointReadback, accumulated.texture, framesShown);
+                lastCheckpoint = GetTime();
+            }
+        }
+
+        if (IsKeyPressed(KEY_H) && !hdrCapture.pending) {
+            hdrCapture.pending = true;
+            ReadbackQueue(hdrReadback, accumulated.texture, framesShown);
+        }
+
+        // Exactly what is about to be shown, without the overlay
+        if (ring || screenshotPending) {
+            ReadbackQueue(readback, presented, framesShown);
+        }
+
+        framesShown++;
+
+        // Only the window shows the heatmap, screenshots and readbacks keep the radiance
+        Vector4 heatmapWeights;
+        float heatmapRange = HeatmapRange(settings.heatmap, scene.objCount, &heatmapWeights);
+
+        pass = TimelineBegin("present", frame);
+
+        BeginDrawing();
+            ClearBackground(WHITE);
+
+            if (settings.heatmap != HEATMAP_OFF) {
+                BeginShaderMode(heatmap);
+                    SetShaderValue(heatmap, heatmapWeightsLoc, &heatmapWeights, SHADER_UNIFORM_VEC4);
+                    SetShaderValue(heatmap, heatmapRangeLoc, &heatmapRange, SHADER_UNIFORM_FLOAT);
+
+                    DrawTextureRec(
+                        heatTargets[heatIndex].texture,
+                        (Rectangle){ 0, 0, (float)screenWidth, -(float)screenHeight },
+                        (Vector2){ 0, 0 },
+                        WHITE
+                    );
+                EndShaderMode();
+            } else {
+                BeginShaderMode(present);
+                    DrawTextureRec(
+                        presented,
+                        (Rectangle){ 0, 0, (float)screenWidth, -(float)screenHeight },
+                        (Vector2){ 0, 0 },
+                        WHITE
+                    );
+                EndShaderMode();
+            }
+
+            // Ending the shader mode flushed the present, the overlay text is left out of the GPU time
+            FrameTimesEndGpu(frameTimes);
+
+            DrawInfo(camera, settings, budget, frame);
+            DrawFrameTimes(frameTimes, 5, 27);
+
+            if (statsReadback) {
+                double pixels = (double)screenWidth * screenHeight;
+
+                DrawText(TextFormat("Rays/frame: %.2fM + %.2fM shadow, %.1f sphere tests/px",
+                    gpuRayStats.last[0] / 1e6, gpuRayStats.last[1] / 1e6, gpuRayStats.last[2] / pixels), 5, 225, 20, PURPLE);
+            }
+
+            if (settings.heatmap != HEATMAP_OFF) {
+                DrawText(TextFormat("Red: %.0f %s per sample", heatmapRange, HeatmapName(settings.heatmap)),
+                    5, options.rayStats ? 250 : 225, 20, YELLOW);
+            }
+        EndDrawing();
+
+        TimelineEnd(pass);
+        FrameTimesEndFrame(frameTimes, changed == 1);
+
         frame++;
     }
 
+    FinishFrameTimes(frameTimes, options);
+
+    printf("Traced %.1f Msamples/s on average\n", samplesTraced / (GetTime() - renderStart) / 1e6);
+
+    if (statsReadback) {
+        ReadbackPoll(statsReadback, true);
+        ReadbackFree(statsReadback);
+
+        double queries = gpuRayStats.total[0] + gpuRayStats.total[1];
+        double perQuery = queries > 0.0 ? 1.0 / queries : 0.0;
+
+        printf("GPU ray stats over %lld frames: %.0f rays, %.0f shadow rays, %.1f spheres tested per ray, %.1f%% of rays hit\n",
+            gpuRayStats.frames, gpuRayStats.total[0], gpuRayStats.total[1], gpuRayStats.total[2] * perQuery,
+            100.0 * gpuRayStats.total[3] / (gpuRayStats.total[0] > 0.0 ? gpuRayStats.total[0] : 1.0));
+    }
+
+    // A final save of the newest frame, after the periodic one still in flight
+    if (checkpointReadback) {
+        ReadbackPoll(checkpointReadback, true);
+        CheckpointWriterFinish(&checkpoint.writer);
+
+        if (accumulatedSamples > 0) {
+            checkpoint.state = CheckpointState(sceneHash, seed, camera, settings, frame, accumulatedSamples);
+            checkpoint.pending = true;
+
+            ReadbackQueue(checkpointReadback, latest, framesShown);
+            ReadbackPoll(checkpointReadback, true);
+            CheckpointWriterFinish(&checkpoint.writer);
+        }
+
+        ReadbackFree(checkpointReadback);
+    }
+
+    UnloadGBuffer(gbuffer);
+    UnloadRenderTexture(accA);
+    UnloadRenderTexture(accB);
+    UnloadRenderTexture(filterTargets[0]);
+    UnloadRenderTexture(filterTargets[1]);
+    UnloadRenderTexture(heatTargets[0]);
+    UnloadRenderTexture(heatTargets[1]);
+
+    ReadbackFree(readback);
+    ReadbackFree(hdrReadback);
+    ShmRingDestroy(ring);
+
+    if (video) {
+        ReadbackFree(videoReadback);
+        UnloadRenderTexture(videoTarget);
+        VideoSinkClose(video);
+    }
     CloseWindow();
     SceneFree(&scene);
 
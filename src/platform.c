@@ -0,0 +1,481 @@
+#ifdef __linux__
+    #define _GNU_SOURCE
+#endif
+
+#include "../include/platform.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+    #include <winsock2.h>
+    #include <ws2tcpip.h>
+    #include <windows.h>
+    #include <process.h>
+    #include <io.h>
+#else
+    #include <unistd.h>
+    #include <netdb.h>
+    #include <netinet/in.h>
+    #include <netinet/tcp.h>
+    #include <spawn.h>
+    #include <sys/socket.h>
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <sys/time.h>
+    #include <sys/wait.h>
+    #include <errno.h>
+    #include <signal.h>
+    #include <time.h>
+#endif
+
+#ifdef __linux__
+    #include <sched.h>
+    #include <limits.h>
+    #include <linux/futex.h>
+    #include <sys/syscall.h>
+#endif
+
+int CpuCount(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+
+    return (int)info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return count > 0 ? (int)count : 1;
+#endif
+}
+
+int NumaNodeCount(void) {
+#ifdef __linux__
+    int count = 0;
+
+    // Node ids are contiguous on every kernel we care about
+    for (;;) {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", count);
+
+        FILE *file = fopen(path, "r");
+        if (!file) break;
+
+        fclose(file);
+        count++;
+    }
+
+    return count > 0 ? count : 1;
+#else
+    return 1;
+#endif
+}
+
+// Parses the node's cpulist ("0-7,16-23"), returns the number of cpus written
+int NumaNodeCpus(int node, int *cpus, int maxCpus) {
+#ifdef __linux__
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+
+    FILE *file = fopen(path, "r");
+    if (!file) return 0;
+
+    int count = 0;
+    int first, last;
+
+    while (fscanf(file, "%d", &first) == 1) {
+        last = first;
+
+        int separator = fgetc(file);
+        if (separator == '-') {
+            if (fscanf(file, "%d", &last) != 1) break;
+            separator = fgetc(file);
+        }
+
+        for (int cpu = first; cpu <= last && count < maxCpus; cpu++) {
+            cpus[count++] = cpu;
+        }
+
+        if (separator != ',') break;
+    }
+
+    fclose(file);
+    return count;
+#else
+    if (node != 0 || maxCpus <= 0) return 0;
+
+    int count = CpuCount() < maxCpus ? CpuCount() : maxCpus;
+    for (int i = 0; i < count; i++) {
+        cpus[i] = i;
+    }
+
+    return count;
+#endif
+}
+
+bool PinCurrentThread(const int *cpus, int count) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+
+    for (int i = 0; i < count; i++) {
+        CPU_SET(cpus[i], &set);
+    }
+
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    (void)cpus;
+    (void)count;
+
+    return false;
+#endif
+}
+
+#ifdef _WIN32
+    #define NET_SEND_FLAGS 0
+#elif defined(MSG_NOSIGNAL)
+    #define NET_SEND_FLAGS MSG_NOSIGNAL     // A dead peer returns an error instead of raising SIGPIPE
+#else
+    #define NET_SEND_FLAGS 0
+#endif
+
+bool NetInit(void) {
+#ifdef _WIN32
+    WSADATA data;
+
+    return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+#else
+    return true;
+#endif
+}
+
+NetSocket NetListen(int port, bool loopback) {
+    NetSocket server = (NetSocket)socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (server == NET_INVALID_SOCKET) return NET_INVALID_SOCKET;
+
+    int reuse = 1;
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse));
+
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(loopback ? INADDR_LOOPBACK : INADDR_ANY);
+    address.sin_port = htons((unsigned short)port);
+
+    if (bind(server, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(server, 16) != 0) {
+        NetClose(server);
+        return NET_INVALID_SOCKET;
+    }
+
+    return server;
+}
+
+NetSocket NetAccept(NetSocket server) {
+    NetSocket client = (NetSocket)accept(server, NULL, NULL);
+    if (client == NET_INVALID_SOCKET) return NET_INVALID_SOCKET;
+
+    // Tile requests are small and latency bound
+    int noDelay = 1;
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, (const char *)&noDelay, sizeof(noDelay));
+
+    return client;
+}
+
+NetSocket NetConnect(const char *host, int port) {
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *addresses;
+    if (getaddrinfo(host, service, &hints, &addresses) != 0) return NET_INVALID_SOCKET;
+
+    NetSocket client = NET_INVALID_SOCKET;
+
+    for (struct addrinfo *address = addresses; address; address = address->ai_next) {
+        client = (NetSocket)socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (client == NET_INVALID_SOCKET) continue;
+
+        if (connect(client, address->ai_addr, (int)address->ai_addrlen) == 0) break;
+
+        NetClose(client);
+        client = NET_INVALID_SOCKET;
+    }
+
+    freeaddrinfo(addresses);
+
+    if (client != NET_INVALID_SOCKET) {
+        int noDelay = 1;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, (const char *)&noDelay, sizeof(noDelay));
+    }
+
+    return client;
+}
+
+void NetSetTimeout(NetSocket socket, int milliseconds) {
+#ifdef _WIN32
+    DWORD timeout = (DWORD)milliseconds;
+#else
+    struct timeval timeout = { milliseconds / 1000, (milliseconds % 1000) * 1000 };
+#endif
+
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout));
+}
+
+bool NetSend(NetSocket socket, const void *data, size_t size) {
+    const char *bytes = data;
+
+    while (size > 0) {
+        int chunk = size > (1 << 30) ? (1 << 30) : (int)size;
+        int sent = send(socket, bytes, chunk, NET_SEND_FLAGS);
+        if (sent <= 0) return false;
+
+        bytes += sent;
+        size -= sent;
+    }
+
+    return true;
+}
+
+bool NetRecv(NetSocket socket, void *data, size_t size) {
+    char *bytes = data;
+
+    while (size > 0) {
+        int chunk = size > (1 << 30) ? (1 << 30) : (int)size;
+        int received = recv(socket, bytes, chunk, 0);
+        if (received <= 0) return false;    // Closed, reset or timed out
+
+        bytes += received;
+        size -= received;
+    }
+
+    return true;
+}
+
+void NetClose(NetSocket socket) {
+#ifdef _WIN32
+    shutdown(socket, SD_BOTH);
+    closesocket(socket);
+#else
+    shutdown(socket, SHUT_RDWR);
+    close(socket);
+#endif
+}
+
+void SleepMs(int milliseconds) {
+#ifdef _WIN32
+    Sleep((DWORD)milliseconds);
+#else
+    struct timespec wait = { milliseconds / 1000, (long)(milliseconds % 1000) * 1000000L };
+    nanosleep(&wait, NULL);
+#endif
+}
+
+double Now(void) {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+#endif
+}
+
+ProcessHandle SpawnProcess(const char *path, char *const argv[]) {
+#ifdef _WIN32
+    intptr_t process = _spawnv(_P_NOWAIT, path, (const char *const *)argv);
+
+    return process == -1 ? INVALID_PROCESS : (ProcessHandle)process;
+#else
+    extern char **environ;
+    pid_t pid;
+
+    return posix_spawn(&pid, path, NULL, NULL, argv, environ) == 0 ? (ProcessHandle)pid : INVALID_PROCESS;
+#endif
+}
+
+int WaitProcess(ProcessHandle process) {
+#ifdef _WIN32
+    int status;
+
+    return _cwait(&status, (intptr_t)process, 0) == -1 ? -1 : status;
+#else
+    int status;
+
+    while (waitpid((pid_t)process, &status, 0) == -1) {
+        if (errno != EINTR) return -1;
+    }
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+#endif
+}
+
+FILE *OpenPipe(const char *command) {
+#ifdef _WIN32
+    return _popen(command, "wb");
+#else
+    signal(SIGPIPE, SIG_IGN);
+
+    return popen(command, "w");
+#endif
+}
+
+int ClosePipe(FILE *pipe) {
+#ifdef _WIN32
+    return _pclose(pipe);
+#else
+    int status = pclose(pipe);
+
+    return status != -1 && WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+#endif
+}
+
+bool SyncFile(FILE *file) {
+    if (fflush(file) != 0) return false;
+
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+bool ReplaceFileAtomic(const char *from, const char *to) {
+#ifdef _WIN32
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return rename(from, to) == 0;
+#endif
+}
+
+bool SharedMemoryCreate(SharedMemory *memory, const char *name, size_t size) {
+    *memory = (SharedMemory){ .size = size };
+
+#ifdef _WIN32
+    snprintf(memory->name, sizeof(memory->name), "Local\\%s", name);
+
+    HANDLE mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+        (DWORD)((unsigned long long)size >> 32), (DWORD)size, memory->name);
+    if (!mapping) return false;
+
+    memory->data = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+    memory->handle = (long long)(intptr_t)mapping;
+#else
+    // POSIX names are a single path component starting with a slash
+    snprintf(memory->name, sizeof(memory->name), "/%s", name);
+
+    int fd = shm_open(memory->name, O_CREAT | O_RDWR | O_TRUNC, 0600);
+    if (fd < 0) return false;
+
+    if (ftruncate(fd, (off_t)size) != 0) {
+        close(fd);
+        shm_unlink(memory->name);
+        return false;
+    }
+
+    memory->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    memory->handle = fd;
+
+    if (memory->data == MAP_FAILED) {
+        memory->data = NULL;
+    }
+#endif
+
+    if (!memory->data) {
+        SharedMemoryClose(memory, true);
+        return false;
+    }
+
+    return true;
+}
+
+bool SharedMemoryOpen(SharedMemory *memory, const char *name) {
+    *memory = (SharedMemory){0};
+
+#ifdef _WIN32
+    snprintf(memory->name, sizeof(memory->name), "Local\\%s", name);
+
+    HANDLE mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, memory->name);
+    if (!mapping) return false;
+
+    memory->handle = (long long)(intptr_t)mapping;
+    memory->data = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+
+    MEMORY_BASIC_INFORMATION info;
+    if (memory->data && VirtualQuery(memory->data, &info, sizeof(info))) {
+        memory->size = info.RegionSize;
+    }
+#else
+    snprintf(memory->name, sizeof(memory->name), "/%s", name);
+
+    int fd = shm_open(memory->name, O_RDWR, 0);
+    if (fd < 0) return false;
+
+    struct stat info;
+    memory->handle = fd;
+
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        memory->size = (size_t)info.st_size;
+        memory->data = mmap(NULL, memory->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+        if (memory->data == MAP_FAILED) {
+            memory->data = NULL;
+        }
+    }
+#endif
+
+    if (!memory->data) {
+        SharedMemoryClose(memory, false);
+        return false;
+    }
+
+    return true;
+}
+
+void SharedMemoryClose(SharedMemory *memory, bool unlink) {
+#ifdef _WIN32
+    (void)unlink;     // The mapping goes away with its last handle
+
+    if (memory->data) UnmapViewOfFile(memory->data);
+    if (memory->handle) CloseHandle((HANDLE)(intptr_t)memory->handle);
+#else
+    if (memory->data) munmap(memory->data, memory->size);
+    if (memory->handle > 0) close((int)memory->handle);
+    if (unlink) shm_unlink(memory->name);
+#endif
+
+    memory->data = NULL;
+    memory->handle = 0;
+}
+
+bool FutexWait(atomic_uint *word, unsigned int expected, int timeoutMs) {
+#ifdef __linux__
+    struct timespec timeout = { timeoutMs / 1000, (long)(timeoutMs % 1000) * 1000000L };
+
+    // Not FUTEX_PRIVATE, the word is shared between processes
+    syscall(SYS_futex, (unsigned int *)word, FUTEX_WAIT, expected, timeoutMs >= 0 ? &timeout : NULL, NULL, 0);
+#else
+    // 1 ms polls, the producer side stays the same
+    for (int waited = 0; timeoutMs < 0 || waited < timeoutMs; waited++) {
+        if (atomic_load(word) != expected) break;
+        SleepMs(1);
+    }
+#endif
+
+    return atomic_load(word) != expected;
+}
+
+void FutexWakeAll(atomic_uint *word) {
+#ifdef __linux__
+    syscall(SYS_futex, (unsigned int *)word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#else
+    (void)word;
+#endif
+}
@@ -0,0 +1,551 @@
+#include "../include/pngwriter.h"
+#include "../include/cpukernels.h"
+#include "../include/platform.h"
+#include "../include/tilerender.h"
+#include "../include/timeline.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_FAR_MIN_MATCH 4096  // Furthest distance a minimum length match is used at
+#define DEFLATE_MAX_CHAIN 32    // Candidates tried per position, speed over the last few percent of size
+
+#define BENCH_PNG_PASSES 2
+
+/*
+ * Rows are cut into strips of about PNG_STRIP_BYTES. Each strip is filtered
+ * (the row above is still at hand in the source image) and deflated on a
+ * pool of threads with its own fixed Huffman block, closed with a sync flush
+ * so the strips join into one zlib stream. Every strip is its own IDAT
+ * chunk with its own CRC; only the Adler-32 spans strips, and it is
+ * combined from the per strip sums in order.
+ */
+typedef struct PngJob {
+    const unsigned char *rgba;
+    int width;
+    int height;
+    int channels;       // 3 or 4 written per pixel
+    int rowsPerStrip;
+    int stripCount;
+
+    unsigned char **chunks;     // Whole IDAT chunks, length to CRC
+    size_t *chunkSizes;
+    uint32_t *adlers;           // Of each strip's filtered bytes
+    size_t *filteredSizes;
+
+    atomic_int nextStrip;
+} PngJob;
+
+typedef struct BitWriter {
+    unsigned char *data;
+    size_t size;
+    uint64_t bits;
+    int count;
+} BitWriter;
+
+// Fixed Huffman codes stored bit reversed, deflate sends Huffman codes from the top bit down
+static uint16_t literalCodes[288];
+static uint8_t literalLengths[288];
+static uint8_t distanceCodes[30];
+static uint32_t crcTable[256];
+static pthread_once_t tablesOnce = PTHREAD_ONCE_INIT;
+
+static uint32_t ReverseBits(uint32_t code, int length) {
+    uint32_t reversed = 0;
+
+    for (int i = 0; i < length; i++) {
+        reversed = reversed << 1 | ((code >> i) & 1);
+    }
+
+    return reversed;
+}
+
+static void InitTables(void) {
+    for (int symbol = 0; symbol < 288; symbol++) {
+        int length = symbol < 144 ? 8 : symbol < 256 ? 9 : symbol < 280 ? 7 : 8;
+        uint32_t code = (uint32_t)(symbol < 144 ? 0x30 + symbol : symbol < 256 ? 0x190 + symbol - 144 :
+            symbol < 280 ? symbol - 256 : 0xC0 + symbol - 280);
+
+        literalCodes[symbol] = (uint16_t)ReverseBits(code, length);
+        literalLengths[symbol] = (uint8_t)length;
+    }
+
+    for (int code = 0; code < 30; code++) {
+        distanceCodes[code] = (uint8_t)ReverseBits(code, 5);
+    }
+
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crcTable[n] = c;
+    }
+}
+
+static uint32_t Crc32(uint32_t crc, const unsigned char *data, size_t size) {
+    crc = ~crc;
+
+    for (size_t i = 0; i < size; i++) {
+        crc = crcTable[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
+
+// Adler-32 of two runs joined, from the sums of each and the length of the second
+static uint32_t Adler32Combine(uint32_t first, uint32_t second, size_t secondSize) {
+    const uint32_t base = 65521;
+    uint32_t rem = (uint32_t)(secondSize % base);
+
+    uint32_t sum1 = first & 0xFFFF;
+    uint32_t sum2 = (uint32_t)((uint64_t)rem * sum1 % base);
+
+    sum1 += (second & 0xFFFF) + base - 1;
+    sum2 += (first >> 16) + (second >> 16) + base - rem;
+
+    if (sum1 >= base) sum1 -= base;
+    if (sum1 >= base) sum1 -= base;
+    if (sum2 >= base * 2) sum2 -= base * 2;
+    if (sum2 >= base) sum2 -= base;
+
+    return sum2 << 16 | sum1;
+}
+
+static void PutBits(BitWriter *writer, uint32_t value, int count) {
+    writer->bits |= (uint64_t)value << writer->count;
+    writer->count += count;
+
+    while (writer->count >= 8) {
+        writer->data[writer->size++] = (unsigned char)writer->bits;
+        writer->bits >>= 8;
+        writer->count -= 8;
+    }
+}
+
+static void AlignToByte(BitWriter *writer) {
+    if (writer->count > 0) PutBits(writer, 0, 8 - writer->count);
+}
+
+static void PutLiteral(BitWriter *writer, int symbol) {
+    PutBits(writer, literalCodes[symbol], literalLengths[symbol]);
+}
+
+static void PutMatch(BitWriter *writer, int length, int distance) {
+    // Lengths 3-10 and 258 have their own symbols, the rest four per power of two
+    int v = length - 3;
+
+    if (v < 8) {
+        PutLiteral(writer, 257 + v);
+    } else if (length == DEFLATE_MAX_MATCH) {
+        PutLiteral(writer, 285);
+    } else {
+        int bits = 31 - __builtin_clz((unsigned int)v);
+        int extra = bits - 2;
+
+        PutLiteral(writer, 257 + 4 * (bits - 1) + ((v >> extra) & 3));
+        PutBits(writer, v & ((1u << extra) - 1), extra);
+    }
+
+    // Distances 1-4 have their own codes, then two per power of two
+    int d = distance - 1;
+
+    if (d < 4) {
+        PutBits(writer, distanceCodes[d], 5);
+    } else {
+        int bits = 31 - __builtin_clz((unsigned int)d);
+        int extra = bits - 1;
+
+        PutBits(writer, distanceCodes[2 * bits + ((d >> extra) & 1)], 5);
+        PutBits(writer, d & ((1u << extra) - 1), extra);
+    }
+}
+
+static int MatchLength(const unsigned char *a, const unsigned char *b, int limit) {
+    int length = 0;
+
+    while (length + 8 <= limit) {
+        uint64_t x, y;
+        memcpy(&x, a + length, 8);
+        memcpy(&y, b + length, 8);
+
+        if (x != y) return length + __builtin_ctzll(x ^ y) / 8;
+        length += 8;
+    }
+
+    while (length < limit && a[length] == b[length]) length++;
+
+    return length;
+}
+
+static uint32_t Hash3(const unsigned char *data) {
+    uint32_t value = (uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16;
+
+    return (value * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+/*
+ * Greedy LZ77 over hash chains into one non-final fixed Huffman block, then
+ * an empty stored block: the sync flush that leaves the stream byte aligned
+ * so the next strip's block can follow it. head and prev are scratch.
+ */
+static size_t DeflateStrip(const unsigned char *data, size_t size, unsigned char *out, int32_t *head, int32_t *prev) {
+    BitWriter writer = { out, 0, 0, 0 };
+
+    for (int i = 0; i < (1 << DEFLATE_HASH_BITS); i++) head[i] = -1;
+
+    PutBits(&writer, 0x2, 3);   // Not final, fixed Huffman
+
+    size_t pos = 0;
+
+    while (pos < size) {
+        int bestLength = 0, bestDistance = 0;
+
+        if (pos + DEFLATE_MIN_MATCH <= size) {
+            int limit = size - pos < DEFLATE_MAX_MATCH ? (int)(size - pos) : DEFLATE_MAX_MATCH;
+            uint32_t hash = Hash3(data + pos);
+            int32_t candidate = head[hash];
+
+            for (int chain = 0; chain < DEFLATE_MAX_CHAIN && candidate >= 0 && pos - (size_t)candidate < DEFLATE_WINDOW; chain++) {
+                // The byte that would lengthen the best match rules most candidates out cheaply
+                if (data[candidate + bestLength] == data[pos + bestLength]) {
+                    int length = MatchLength(data + candidate, data + pos, limit);
+
+                    // A far 3 byte match costs more bits than the literals it replaces
+                    if (length > bestLength && (length > DEFLATE_MIN_MATCH || pos - (size_t)candidate <= DEFLATE_FAR_MIN_MATCH)) {
+                        bestLength = length;
+                        bestDistance = (int)(pos - (size_t)candidate);
+
+                        if (length == limit) break;
+                    }
+                }
+
+                candidate = prev[candidate & (DEFLATE_WINDOW - 1)];
+            }
+
+            prev[pos & (DEFLATE_WINDOW - 1)] = head[hash];
+            head[hash] = (int32_t)pos;
+        }
+
+        if (bestLength >= DEFLATE_MIN_MATCH) {
+            PutMatch(&writer, bestLength, bestDistance);
+
+            for (size_t i = pos + 1; i < pos + bestLength && i + DEFLATE_MIN_MATCH <= size; i++) {
+                uint32_t hash = Hash3(data + i);
+
+                prev[i & (DEFLATE_WINDOW - 1)] = head[hash];
+                head[hash] = (int32_t)i;
+            }
+
+            pos += bestLength;
+        } else {
+            PutLiteral(&writer, data[pos]);
+            pos++;
+        }
+    }
+
+    PutLiteral(&writer, 256);   // End of block
+
+    PutBits(&writer, 0, 3);     // Not final, stored
+    AlignToByte(&writer);
+    PutBits(&writer, 0xFFFF0000u, 32);
+
+    return writer.size;
+}
+
+static int Paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+
+    return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+// Tries all five filters and keeps the one with the smallest sum of signed bytes, like libpng does
+static void FilterRow(const unsigned char *row, const unsigned char *above, int rowBytes, int bpp, unsigned char *out, unsigned char *scratch) {
+    unsigned long bestSum = (unsigned long)-1;
+
+    for (int filter = 0; filter < 5; filter++) {
+        unsigned char *candidate = filter == 0 ? out : scratch;
+        unsigned long sum = 0;
+
+        for (int i = 0; i < rowBytes; i++) {
+            int a = i >= bpp ? row[i - bpp] : 0;
+            int b = above[i];
+            int c = i >= bpp ? above[i - bpp] : 0;
+            int predicted = filter == 0 ? 0 : filter == 1 ? a : filter == 2 ? b : filter == 3 ? (a + b) / 2 : Paeth(a, b, c);
+
+            unsigned char value = (unsigned char)(row[i] - predicted);
+            candidate[i + 1] = value;
+            sum += (unsigned long)abs((signed char)value);
+        }
+
+        candidate[0] = (unsigned char)filter;
+
+        if (sum < bestSum) {
+            bestSum = sum;
+            if (candidate != out) memcpy(out, candidate, rowBytes + 1);
+        }
+    }
+}
+
+static void PackRow(const PngJob *job, int y, unsigned char *out) {
+    const unsigned char *in = job->rgba + (size_t)y * job->width * 4;
+
+    if (job->channels == 4) {
+        memcpy(out, in, (size_t)job->width * 4);
+        return;
+    }
+
+    for (int x = 0; x < job->width; x++) {
+        memcpy(out + x * 3, in + x * 4, 3);
+    }
+}
+
+static void PutBe32(unsigned char *bytes, uint32_t value) {
+    for (int i = 0; i < 4; i++) bytes[i] = (unsigned char)(value >> (24 - 8 * i));
+}
+
+static void *EncodePngStrips(void *arg) {
+    PngJob *job = arg;
+    int rowBytes = job->width * job->channels;
+
+    unsigned char *row = malloc(rowBytes);
+    unsigned char *above = malloc(rowBytes);
+    unsigned char *scratch = malloc(rowBytes + 1);
+    unsigned char *filtered = malloc((size_t)(rowBytes + 1) * job->rowsPerStrip);
+    int32_t *head = malloc(sizeof(int32_t) << DEFLATE_HASH_BITS);
+    int32_t *prev = malloc(sizeof(int32_t) * DEFLATE_WINDOW);
+
+    if (!row || !above || !scratch || !filtered || !head || !prev) {
+        error("Out of memory encoding PNG.");
+    }
+
+    for (;;) {
+        int strip = atomic_fetch_add(&job->nextStrip, 1);
+        if (strip >= job->stripCount) break;
+
+        TimelineZone zone = TimelineBegin("png strip", strip);
+
+        int first = strip * job->rowsPerStrip;
+        int last = first + job->rowsPerStrip < job->height ? first + job->rowsPerStrip : job->height;
+
+        if (first > 0) {
+            PackRow(job, first - 1, above);
+        } else {
+            memset(above, 0, rowBytes);
+        }
+
+        for (int y = first; y < last; y++) {
+            PackRow(job, y, row);
+            FilterRow(row, above, rowBytes, job->channels, filtered + (size_t)(y - first) * (rowBytes + 1), scratch);
+
+            unsigned char *swap = above;
+            above = row;
+            row = swap;
+        }
+
+        size_t size = (size_t)(last - first) * (rowBytes + 1);
+
+        // Fixed Huffman never spends more than 9 bits a byte, plus headers and the flush
+        bool zlibHeader = strip == 0;
+        unsigned char *chunk = malloc(8 + 2 + size + size / 8 + 64 + 4);
+        if (!chunk) {
+            error("Out of memory encoding PNG.");
+        }
+
+        unsigned char *data = chunk + 8;
+        size_t dataSize = 0;
+
+        if (zlibHeader) {
+            data[0] = 0x78;
+            data[1] = 0x01;
+            dataSize = 2;
+        }
+
+        dataSize += DeflateStrip(filtered, size, data + dataSize, head, prev);
+
+        PutBe32(chunk, (uint32_t)dataSize);
+        memcpy(chunk + 4, "IDAT", 4);
+        PutBe32(chunk + 8 + dataSize, Crc32(0, chunk + 4, dataSize + 4));
+
+        job->chunks[strip] = chunk;
+        job->chunkSizes[strip] = dataSize + 12;
+        job->adlers[strip] = Adler32(filtered, size);
+        job->filteredSizes[strip] = size;
+
+        TimelineEnd(zone);
+    }
+
+    free(row);
+    free(above);
+    free(scratch);
+    free(filtered);
+    free(head);
+    free(prev);
+
+    return NULL;
+}
+
+static bool WriteChunk(FILE *file, const char *type, const unsigned char *data, uint32_t size) {
+    unsigned char header[8], crc[4];
+
+    PutBe32(header, size);
+    memcpy(header + 4, type, 4);
+    PutBe32(crc, Crc32(Crc32(0, header + 4, 4), data, size));
+
+    return fwrite(header, 1, 8, file) == 8 && (size == 0 || fwrite(data, 1, size, file) == size) && fwrite(crc, 1, 4, file) == 4;
+}
+
+bool WritePng(const char *path, const unsigned char *rgba, int width, int height, bool alpha, int threads) {
+    pthread_once(&tablesOnce, InitTables);
+
+    int channels = alpha ? 4 : 3;
+    int rowsPerStrip = PNG_STRIP_BYTES / (width * channels + 1);
+    rowsPerStrip = rowsPerStrip > 0 ? rowsPerStrip : 1;
+
+    PngJob job = {
+        .rgba = rgba,
+        .width = width,
+        .height = height,
+        .channels = channels,
+        .rowsPerStrip = rowsPerStrip,
+        .stripCount = (height + rowsPerStrip - 1) / rowsPerStrip
+    };
+
+    job.chunks = calloc(job.stripCount, sizeof(unsigned char *));
+    job.chunkSizes = calloc(job.stripCount, sizeof(size_t));
+    job.adlers = calloc(job.stripCount, sizeof(uint32_t));
+    job.filteredSizes = calloc(job.stripCount, sizeof(size_t));
+    atomic_init(&job.nextStrip, 0);
+
+    if (!job.chunks || !job.chunkSizes || !job.adlers || !job.filteredSizes) {
+        error("Out of memory encoding PNG.");
+    }
+
+    threads = threads < 1 ? 1 : threads > job.stripCount ? job.stripCount : threads;
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+
+    for (int i = 1; i < threads; i++) {
+        pthread_create(&workers[i], NULL, EncodePngStrips, &job);
+    }
+
+    EncodePngStrips(&job);
+
+    for (int i = 1; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    free(workers);
+
+    uint32_t adler = 1;
+    for (int i = 0; i < job.stripCount; i++) {
+        adler = Adler32Combine(adler, job.adlers[i], job.filteredSizes[i]);
+    }
+
+    unsigned char header[13];
+    PutBe32(header, (uint32_t)width);
+    PutBe32(header + 4, (uint32_t)height);
+    header[8] = 8;                  // Bits per channel
+    header[9] = alpha ? 6 : 2;      // RGBA or RGB
+    header[10] = 0;
+    header[11] = 0;
+    header[12] = 0;
+
+    // An empty final fixed Huffman block ends the stream, then the Adler-32
+    unsigned char tail[6] = { 0x03, 0x00 };
+    PutBe32(tail + 2, adler);
+
+    FILE *file = fopen(path, "wb");
+    bool ok = file != NULL;
+
+    if (ok) {
+        ok = fwrite("\x89PNG\r\n\x1a\n", 1, 8, file) == 8 && WriteChunk(file, "IHDR", header, sizeof(header));
+
+        for (int i = 0; ok && i < job.stripCount; i++) {
+            ok = fwrite(job.chunks[i], 1, job.chunkSizes[i], file) == job.chunkSizes[i];
+        }
+
+        ok = ok && WriteChunk(file, "IDAT", tail, sizeof(tail)) && WriteChunk(file, "IEND", NULL, 0);
+        ok = fclose(file) == 0 && ok;
+    }
+
+    for (int i = 0; i < job.stripCount; i++) {
+        free(job.chunks[i]);
+    }
+
+    free(job.chunks);
+    free(job.chunkSizes);
+    free(job.adlers);
+    free(job.filteredSizes);
+
+    return ok;
+}
+
+static long long FileSize(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) return 0;
+
+    fseek(file, 0, SEEK_END);
+    long long size = ftell(file);
+    fclose(file);
+
+    return size;
+}
+
+static void PrintPngRun(const char *name, int threads, double seconds, size_t rawBytes, const char *path) {
+    printf("%-12s %8d %10.2f %10.1f %10.1f\n",
+        name, threads, seconds, rawBytes / seconds / 1e6, FileSize(path) / 1e6);
+}
+
+// A noisy early render at the requested size, so the encoders see real image statistics
+void BenchmarkPngWriter(Scene scene, Camera camera, CliOptions options) {
+    int width = options.width, height = options.height;
+    int maxThreads = options.threads > 0 ? options.threads : CpuCount();
+
+    CpuScene cpuScene = BuildCpuScene(scene);
+    TileRenderer *renderer = TileRendererCreate(&cpuScene, width, height, options.tileSize, maxThreads,
+        TileOrderFromName(options.tileOrder), false, options.seed);
+
+    TileRendererReset(renderer, InitCpuCamera(camera.position, camera.fovy, width, height), true);
+    TileRendererWaitPasses(renderer, BENCH_PNG_PASSES);
+
+    unsigned char *pixels = malloc((size_t)width * height * 4);
+    if (!pixels) {
+        error("Out of memory allocating benchmark image.");
+    }
+
+    TileRendererResolve(renderer, pixels);
+    TileRendererFree(renderer);
+    CpuSceneFree(&cpuScene);
+
+    size_t rawBytes = (size_t)width * height * 3;
+    Image image = { .data = pixels, .width = width, .height = height, .mipmaps = 1, .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8 };
+
+    printf("PNG encoding, %dx%d, %.1f MB of RGB, %d pass render\n", width, height, rawBytes / 1e6, BENCH_PNG_PASSES);
+    printf("%-12s %8s %10s %10s %10s\n", "encoder", "threads", "seconds", "MB/s", "file MB");
+
+    double start = Now();
+    ExportImage(image, "bench_export.png");
+    PrintPngRun("ExportImage", 1, Now() - start, rawBytes, "bench_export.png");
+
+    for (int threads = 1; ; threads = threads * 2 < maxThreads ? threads * 2 : maxThreads) {
+        start = Now();
+
+        if (!WritePng("bench_strips.png", pixels, width, height, false, threads)) {
+            error("Failed to write benchmark PNG.");
+        }
+
+        PrintPngRun("strips", threads, Now() - start, rawBytes, "bench_strips.png");
+
+        if (threads == maxThreads) break;
+    }
+
+    remove("bench_export.png");
+    remove("bench_strips.png");
+    free(pixels);
+}
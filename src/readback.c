@@ -0,0 +1,200 @@
+#include "../include/readback.h"
+#include "../include/glext.h"
+#include "../include/helpers.h"
+#include "../include/timeline.h"
+#include "raylib.h"
+#include "rlgl.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Pixel buffer objects and fences, core in GL 3.3 but not wrapped by rlgl
+#define GL_TEXTURE_2D 0x0DE1
+#define GL_UNSIGNED_BYTE 0x1401
+#define GL_FLOAT 0x1406
+#define GL_RGBA 0x1908
+#define GL_PIXEL_PACK_BUFFER 0x88EB
+#define GL_STREAM_READ 0x88E1
+#define GL_MAP_READ_BIT 0x0001
+#define GL_SYNC_GPU_COMMANDS_COMPLETE 0x9117
+#define GL_SYNC_FLUSH_COMMANDS_BIT 0x00000001
+#define GL_ALREADY_SIGNALED 0x911A
+#define GL_CONDITION_SATISFIED 0x911C
+#define GL_WAIT_FAILED 0x911D
+
+static struct {
+    void (GL_CALL *GenBuffers)(int count, unsigned int *buffers);
+    void (GL_CALL *DeleteBuffers)(int count, const unsigned int *buffers);
+    void (GL_CALL *BindBuffer)(unsigned int target, unsigned int buffer);
+    void (GL_CALL *BufferData)(unsigned int target, ptrdiff_t size, const void *data, unsigned int usage);
+    void *(GL_CALL *MapBufferRange)(unsigned int target, ptrdiff_t offset, ptrdiff_t length, unsigned int access);
+    unsigned char (GL_CALL *UnmapBuffer)(unsigned int target);
+    void *(GL_CALL *FenceSync)(unsigned int condition, unsigned int flags);
+    unsigned int (GL_CALL *ClientWaitSync)(void *sync, unsigned int flags, uint64_t timeout);
+    void (GL_CALL *DeleteSync)(void *sync);
+    void (GL_CALL *BindTexture)(unsigned int target, unsigned int texture);
+    void (GL_CALL *GetTexImage)(unsigned int target, int level, unsigned int format, unsigned int type, void *pixels);
+} gl;
+
+static bool LoadGlFunctions(void) {
+    if (!GlCoreContext()) return false;
+
+    GL_LOAD(gl.GenBuffers, "glGenBuffers");
+    GL_LOAD(gl.DeleteBuffers, "glDeleteBuffers");
+    GL_LOAD(gl.BindBuffer, "glBindBuffer");
+    GL_LOAD(gl.BufferData, "glBufferData");
+    GL_LOAD(gl.MapBufferRange, "glMapBufferRange");
+    GL_LOAD(gl.UnmapBuffer, "glUnmapBuffer");
+    GL_LOAD(gl.FenceSync, "glFenceSync");
+    GL_LOAD(gl.ClientWaitSync, "glClientWaitSync");
+    GL_LOAD(gl.DeleteSync, "glDeleteSync");
+    GL_LOAD(gl.BindTexture, "glBindTexture");
+    GL_LOAD(gl.GetTexImage, "glGetTexImage");
+
+    return gl.GenBuffers && gl.DeleteBuffers && gl.BindBuffer && gl.BufferData && gl.MapBufferRange &&
+        gl.UnmapBuffer && gl.FenceSync && gl.ClientWaitSync && gl.DeleteSync && gl.BindTexture && gl.GetTexImage;
+}
+
+static size_t FrameBytes(const ReadbackRing *ring, int format) {
+    return (size_t)ring->width * ring->height * (format == PIXELFORMAT_UNCOMPRESSED_R32G32B32A32 ? 16 : 4);
+}
+
+static void Deliver(ReadbackRing *ring, const ReadbackFrame *frame) {
+    TimelineZone zone = TimelineBegin("readback deliver", (int)frame->index);
+
+    for (int i = 0; i < ring->sinkCount; i++) {
+        ring->sinks[i].deliver(ring->sinks[i].user, frame);
+    }
+
+    TimelineEnd(zone);
+}
+
+ReadbackRing *ReadbackCreate(int width, int height) {
+    ReadbackRing *ring = calloc(1, sizeof(ReadbackRing));
+    if (!ring) {
+        error("Out of memory allocating readback ring.");
+    }
+
+    ring->width = width;
+    ring->height = height;
+    ring->async = LoadGlFunctions();
+
+    if (ring->async) {
+        gl.GenBuffers(READBACK_BUFFERS, ring->buffers);
+    } else {
+        printf("Readback: no GL 3.3 buffer objects, frames are read synchronously\n");
+    }
+
+    return ring;
+}
+
+void ReadbackAddSink(ReadbackRing *ring, ReadbackSink sink) {
+    if (ring->sinkCount == READBACK_MAX_SINKS) {
+        error("Too many readback sinks.");
+    }
+
+    ring->sinks[ring->sinkCount++] = sink;
+}
+
+// Maps the oldest copy and hands it out, false if its fence has not passed yet. Waiting only returns once it has,
+// the slot is about to be written again and a copy still in flight would land in the next frame's buffer
+static bool FinishOldest(ReadbackRing *ring, bool wait) {
+    int slot = ring->head;
+    unsigned int status;
+
+    do {
+        status = gl.ClientWaitSync(ring->fences[slot], wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0, wait ? 1000000000ULL : 0);
+
+        if (status == GL_WAIT_FAILED) {
+            error("Waiting on a readback fence failed.");
+        }
+    } while (wait && status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED);
+
+    if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) return false;
+
+    gl.DeleteSync(ring->fences[slot]);
+    ring->fences[slot] = NULL;
+
+    size_t size = FrameBytes(ring, ring->formats[slot]);
+
+    gl.BindBuffer(GL_PIXEL_PACK_BUFFER, ring->buffers[slot]);
+    const void *pixels = gl.MapBufferRange(GL_PIXEL_PACK_BUFFER, 0, (ptrdiff_t)size, GL_MAP_READ_BIT);
+
+    if (pixels) {
+        ReadbackFrame frame = { pixels, ring->width, ring->height, ring->formats[slot], ring->indices[slot] };
+        Deliver(ring, &frame);
+
+        gl.UnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+
+    gl.BindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    ring->head = (ring->head + 1) % READBACK_BUFFERS;
+    ring->pending--;
+
+    return true;
+}
+
+void ReadbackQueue(ReadbackRing *ring, Texture2D texture, long long index) {
+    if (texture.format != PIXELFORMAT_UNCOMPRESSED_R8G8B8A8 && texture.format != PIXELFORMAT_UNCOMPRESSED_R32G32B32A32) {
+        error("Unsupported texture format for readback.");
+    }
+
+    if (!ring->async) {
+        Image image = LoadImageFromTexture(texture);
+        ReadbackFrame frame = { image.data, image.width, image.height, image.format, index };
+
+        Deliver(ring, &frame);
+        UnloadImage(image);
+
+        return;
+    }
+
+    TimelineZone zone = TimelineBegin("readback queue", (int)index);
+
+    // Only stalls when the GPU is a whole ring of frames behind
+    if (ring->pending == READBACK_BUFFERS) {
+        FinishOldest(ring, true);
+    }
+
+    int slot = (ring->head + ring->pending) % READBACK_BUFFERS;
+    bool isFloat = texture.format == PIXELFORMAT_UNCOMPRESSED_R32G32B32A32;
+
+    rlDrawRenderBatchActive();
+
+    gl.BindBuffer(GL_PIXEL_PACK_BUFFER, ring->buffers[slot]);
+
+    if (ring->sizes[slot] < FrameBytes(ring, texture.format)) {
+        ring->sizes[slot] = FrameBytes(ring, texture.format);
+        gl.BufferData(GL_PIXEL_PACK_BUFFER, (ptrdiff_t)ring->sizes[slot], NULL, GL_STREAM_READ);
+    }
+
+    gl.BindTexture(GL_TEXTURE_2D, texture.id);
+    gl.GetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, isFloat ? GL_FLOAT : GL_UNSIGNED_BYTE, NULL);   // Offset 0 into the bound buffer
+    gl.BindTexture(GL_TEXTURE_2D, 0);
+    gl.BindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    ring->fences[slot] = gl.FenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    ring->formats[slot] = texture.format;
+    ring->indices[slot] = index;
+    ring->pending++;
+
+    TimelineEnd(zone);
+}
+
+void ReadbackPoll(ReadbackRing *ring, bool wait) {
+    while (ring->async && ring->pending > 0 && FinishOldest(ring, wait));
+}
+
+void ReadbackFree(ReadbackRing *ring) {
+    if (!ring) return;
+
+    ReadbackPoll(ring, true);
+
+    if (ring->async) {
+        gl.DeleteBuffers(READBACK_BUFFERS, ring->buffers);
+    }
+
+    free(ring);
+}
@@ -0,0 +1,58 @@
+#include "../include/rng.h"
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+
+void Philox4x32(const unsigned int counter[4], const unsigned int key[2], unsigned int out[4]) {
+    unsigned int c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+    unsigned int k0 = key[0], k1 = key[1];
+
+    for (int i = 0; i < PHILOX_ROUNDS; i++) {
+        unsigned long long p0 = (unsigned long long)PHILOX_M0 * c0;
+        unsigned long long p1 = (unsigned long long)PHILOX_M1 * c2;
+
+        c0 = (unsigned int)(p1 >> 32) ^ c1 ^ k0;
+        c1 = (unsigned int)p1;
+        c2 = (unsigned int)(p0 >> 32) ^ c3 ^ k1;
+        c3 = (unsigned int)p0;
+
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+}
+
+Rng InitRng(unsigned int seed, unsigned int pixel, unsigned int sample) {
+    Rng rng = {
+        .key = { seed, 0x5EED5EEDu },
+        .counter = { pixel, sample, 0, 0 },
+        .used = 4
+    };
+
+    return rng;
+}
+
+// Restarts the draws for a new bounce, so bounce n never reuses bounce n - 1's numbers
+void RngSetBounce(Rng *rng, unsigned int bounce) {
+    rng->counter[2] = bounce;
+    rng->counter[3] = 0;
+    rng->used = 4;
+}
+
+// 24 random bits in [0, 1), identical to NextRandom() in the shader
+float RngFloat(Rng *rng) {
+    if (rng->used == 4) {
+        Philox4x32(rng->counter, rng->key, rng->block);
+        rng->counter[3]++;
+        rng->used = 0;
+    }
+
+    return (rng->block[rng->used++] >> 8) * (1.0f / 16777216.0f);
+}
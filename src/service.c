@@ -0,0 +1,989 @@
+#include "../include/service.h"
+#include "../include/animation.h"
+#include "../include/cpukernels.h"
+#include "../include/cputracer.h"
+#include "../include/denoise.h"
+#include "../include/hdrwriter.h"
+#include "../include/platform.h"
+#include "raylib.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Everything that decides a render's pixels, hashed into its image key
+typedef struct RenderRequest {
+    uint64_t sceneHash;     // Of the scene text exactly as sent
+    int width;
+    int height;
+    int samples;
+    int denoiseIterations;
+    unsigned int seed;
+
+    int frame;              // Camera keyframe time, used when no camera is given
+    bool cameraGiven;
+    float position[3];
+    float focalLength;
+
+    const char *format;     // png, exr or pfm
+} RenderRequest;
+
+typedef struct CachedScene {
+    bool loaded;
+    uint64_t hash;
+    Scene scene;
+    CpuScene cpuScene;
+    int users;                  // Workers rendering from it, it is only evicted at 0
+    unsigned long long lastUsed;
+} CachedScene;
+
+typedef struct ServiceJob {
+    NetSocket client;
+    RenderRequest request;
+    uint64_t key;
+    char *sceneText;
+    size_t sceneLength;
+
+    // Held while rendering, so an error caught mid render can let go of them
+    CachedScene *scene;
+    CpuFrame frame;
+} ServiceJob;
+
+typedef struct CachedImage {
+    uint64_t key;
+    const char *format;
+    size_t bytes;
+    unsigned long long lastUsed;
+} CachedImage;
+
+typedef struct Service {
+    CliOptions options;
+    const char *cacheDir;
+    int workers;
+
+    pthread_mutex_t lock;
+    pthread_cond_t jobReady;
+    pthread_cond_t renderDone;
+
+    ServiceJob queue[SERVICE_QUEUE];
+    int queueHead;
+    int queueCount;
+    uint64_t *renderingKeys;    // Per worker, 0 while idle, so identical jobs wait for the first
+
+    CachedScene *scenes;        // sceneCapacity plus one spare per worker for scenes in use
+    int sceneSlots;
+    int sceneCapacity;
+
+    CachedImage *images;
+    int imageCount;
+    int imageAllocated;
+    size_t imageBytes;
+    size_t imageBudget;
+
+    unsigned long long clock;   // LRU ticks
+    int connections;            // Requests still being read, each on its own thread
+
+    long long imageHits;
+    long long imageMisses;
+    long long sceneHits;
+    long long sceneMisses;
+    long long rendered;
+    long long failed;
+} Service;
+
+static const char *StatusText(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 411: return "Length Required";
+        case 413: return "Payload Too Large";
+        case 431: return "Request Header Fields Too Large";
+        case 503: return "Service Unavailable";
+        default: return "Internal Server Error";
+    }
+}
+
+// The static name for an output format, NULL when it is not one
+static const char *FormatName(const char *name) {
+    if (strcmp(name, "png") == 0) return "png";
+    if (strcmp(name, "exr") == 0) return "exr";
+    if (strcmp(name, "pfm") == 0) return "pfm";
+
+    return NULL;
+}
+
+static const char *ContentType(const char *format) {
+    if (strcmp(format, "png") == 0) return "image/png";
+    if (strcmp(format, "exr") == 0) return "image/x-exr";
+    if (strcmp(format, "pfm") == 0) return "image/x-portable-floatmap";
+
+    return "application/json";
+}
+
+// One response per connection, the client reads until the close
+static void SendResponse(NetSocket client, int status, const char *contentType, const char *headers, const void *body, size_t size) {
+    char head[512];
+    int length = snprintf(head, sizeof(head),
+        "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n%s\r\n",
+        status, StatusText(status), contentType, size, headers ? headers : "");
+
+    if (NetSend(client, head, (size_t)length) && size > 0) {
+        NetSend(client, body, size);
+    }
+}
+
+static void SendError(NetSocket client, int status, const char *message) {
+    char body[320];
+    int length = snprintf(body, sizeof(body), "%s\n", message);
+
+    SendResponse(client, status, "text/plain", NULL, body, (size_t)length);
+}
+
+static bool HeaderIs(const char *line, const char *name) {
+    for (; *name; line++, name++) {
+        if ((*line | 0x20) != *name) return false;
+    }
+
+    return *line == ':';
+}
+
+typedef struct HttpRequest {
+    char method[8];
+    char path[256];
+    char query[1024];
+    long long contentLength;    // -1 without the header
+} HttpRequest;
+
+// Reads up to the blank line, returns 0 or the status to fail with. The body is left on the socket
+static int ReadHttpHeader(NetSocket client, HttpRequest *request) {
+    char header[SERVICE_MAX_HEADER + 1];
+    size_t size = 0;
+
+    // Byte at a time, headers are a few hundred bytes and nothing past them may be consumed
+    for (;;) {
+        if (size == SERVICE_MAX_HEADER) return 431;
+        if (!NetRecv(client, &header[size], 1)) return -1;
+
+        size++;
+
+        if (size >= 4 && memcmp(&header[size - 4], "\r\n\r\n", 4) == 0) break;
+    }
+
+    header[size] = '\0';
+
+    char target[1280];
+    if (sscanf(header, "%7s %1279s", request->method, target) != 2) return 400;
+
+    char *query = strchr(target, '?');
+    if (query) *query++ = '\0';
+
+    if (strlen(target) >= sizeof(request->path) || (query && strlen(query) >= sizeof(request->query))) return 400;
+
+    strcpy(request->path, target);
+    strcpy(request->query, query ? query : "");
+    request->contentLength = -1;
+
+    for (char *line = strstr(header, "\r\n"); line; line = strstr(line, "\r\n")) {
+        line += 2;
+
+        if (HeaderIs(line, "content-length")) {
+            request->contentLength = strtoll(line + strlen("content-length:"), NULL, 10);
+            if (request->contentLength < 0) return 400;
+        } else if (HeaderIs(line, "transfer-encoding")) {
+            return 411;     // Chunked bodies are not supported
+        }
+    }
+
+    return 0;
+}
+
+static int HexDigit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') return (c | 0x20) - 'a' + 10;
+
+    return -1;
+}
+
+// In place, %xx escapes and + for space
+static void UrlDecode(char *text) {
+    char *out = text;
+
+    for (char *in = text; *in; in++) {
+        if (*in == '%' && HexDigit(in[1]) >= 0 && HexDigit(in[2]) >= 0) {
+            *out++ = (char)(HexDigit(in[1]) * 16 + HexDigit(in[2]));
+            in += 2;
+        } else {
+            *out++ = *in == '+' ? ' ' : *in;
+        }
+    }
+
+    *out = '\0';
+}
+
+static bool QueryInt(const char *value, int min, int max, int *out) {
+    char *end;
+    long parsed = strtol(value, &end, 10);
+
+    if (*value == '\0' || *end != '\0' || parsed < min || parsed > max) return false;
+
+    *out = (int)parsed;
+    return true;
+}
+
+static bool QueryFloat(const char *value, float *out) {
+    char *end;
+    *out = strtof(value, &end);
+
+    return *value != '\0' && *end == '\0';
+}
+
+// Unknown parameters are rejected so a typo does not quietly render the defaults
+static bool ParseRenderQuery(char *query, const CliOptions *options, RenderRequest *request, char *message, size_t messageSize) {
+    *request = (RenderRequest){
+        .width = options->width,
+        .height = options->height,
+        .samples = options->samples,
+        .denoiseIterations = options->denoiseIterations,
+        .seed = options->seed,
+        .format = "png"
+    };
+
+    while (*query) {
+        char *next = strchr(query, '&');
+        if (next) *next++ = '\0';
+
+        char *value = strchr(query, '=');
+        if (value) *value++ = '\0';
+
+        const char *name = query;
+
+        if (value == NULL) {
+            snprintf(message, messageSize, "Missing value for %s", name);
+            return false;
+        }
+
+        UrlDecode(value);
+        bool ok = true;
+
+        if (strcmp(name, "width") == 0) {
+            ok = QueryInt(value, 1, SERVICE_MAX_SIDE, &request->width);
+        } else if (strcmp(name, "height") == 0) {
+            ok = QueryInt(value, 1, SERVICE_MAX_SIDE, &request->height);
+        } else if (strcmp(name, "spp") == 0) {
+            ok = QueryInt(value, 1, SERVICE_MAX_SPP, &request->samples);
+        } else if (strcmp(name, "denoise") == 0) {
+            ok = QueryInt(value, 0, 16, &request->denoiseIterations);
+        } else if (strcmp(name, "seed") == 0) {
+            int seed = 0;
+            ok = QueryInt(value, 0, 0x7fffffff, &seed);
+            request->seed = (unsigned int)seed;
+        } else if (strcmp(name, "frame") == 0) {
+            ok = QueryInt(value, 0, 0x7fffffff, &request->frame);
+        } else if (strcmp(name, "camera") == 0) {
+            float *p = request->position;
+            char extra;
+
+            ok = sscanf(value, "%f,%f,%f%c", &p[0], &p[1], &p[2], &extra) == 3;
+            request->cameraGiven = true;
+        } else if (strcmp(name, "focal") == 0) {
+            ok = QueryFloat(value, &request->focalLength) && request->focalLength > 0.0f;
+        } else if (strcmp(name, "format") == 0) {
+            request->format = FormatName(value);
+            ok = request->format != NULL;
+        } else {
+            snprintf(message, messageSize, "Unknown parameter %s", name);
+            return false;
+        }
+
+        if (!ok) {
+            snprintf(message, messageSize, "Invalid value for %s", name);
+            return false;
+        }
+
+        query = next ? next : "";
+    }
+
+    if (request->focalLength > 0.0f && !request->cameraGiven) {
+        snprintf(message, messageSize, "focal needs a camera position");
+        return false;
+    }
+
+    if (request->cameraGiven && request->focalLength == 0.0f) {
+        request->focalLength = 2.0f;
+    }
+
+    return true;
+}
+
+// Hex floats keep the key exact, the text is never shown to anyone
+static uint64_t ImageKey(const RenderRequest *request) {
+    char canonical[512];
+    int length = snprintf(canonical, sizeof(canonical),
+        "v%d scene=%016llx %dx%d spp=%d denoise=%d seed=%u frame=%d camera=%d,%a,%a,%a,%a %s",
+        SERVICE_CACHE_VERSION, (unsigned long long)request->sceneHash, request->width, request->height,
+        request->samples, request->denoiseIterations, request->seed, request->frame, request->cameraGiven,
+        request->position[0], request->position[1], request->position[2], request->focalLength, request->format);
+
+    uint64_t key = HashBytes(canonical, (size_t)length);
+
+    return key != 0 ? key : 1;  // 0 marks an idle worker
+}
+
+static void ImagePath(const Service *service, uint64_t key, const char *format, char *path, size_t size) {
+    snprintf(path, size, "%s/%016llx.%s", service->cacheDir, (unsigned long long)key, format);
+}
+
+// Where a worker writes an image before renaming it into place
+static void TemporaryImagePath(const Service *service, uint64_t key, int worker, const char *format, char *path, size_t size) {
+    snprintf(path, size, "%s/%016llx.%d.%s", service->cacheDir, (unsigned long long)key, worker, format);
+}
+
+static unsigned char *ReadWholeFile(const char *path, size_t *size) {
+    FILE *file = fopen(path, "rb");
+    if (!file) return NULL;
+
+    unsigned char *data = NULL;
+
+    if (fseek(file, 0, SEEK_END) == 0) {
+        long length = ftell(file);
+
+        if (length >= 0 && fseek(file, 0, SEEK_SET) == 0) {
+            data = malloc(length > 0 ? (size_t)length : 1);
+
+            if (data && fread(data, 1, (size_t)length, file) != (size_t)length) {
+                free(data);
+                data = NULL;
+            }
+
+            *size = (size_t)length;
+        }
+    }
+
+    fclose(file);
+
+    return data;
+}
+
+static void EvictImages(Service *service) {
+    while (service->imageBytes > service->imageBudget && service->imageCount > 0) {
+        int oldest = 0;
+
+        for (int i = 1; i < service->imageCount; i++) {
+            if (service->images[i].lastUsed < service->images[oldest].lastUsed) oldest = i;
+        }
+
+        char path[1024];
+        ImagePath(service, service->images[oldest].key, service->images[oldest].format, path, sizeof(path));
+        remove(path);
+
+        service->imageBytes -= service->images[oldest].bytes;
+        service->images[oldest] = service->images[--service->imageCount];
+    }
+}
+
+// Called with the lock held, so it never calls error(). An image it cannot index stays on disk and is picked up on its next hit
+static void RememberImage(Service *service, uint64_t key, const char *format, size_t bytes) {
+    if (service->imageCount == service->imageAllocated) {
+        int allocated = service->imageAllocated ? service->imageAllocated * 2 : 64;
+        CachedImage *images = realloc(service->images, allocated * sizeof(CachedImage));
+
+        if (!images) return;
+
+        service->images = images;
+        service->imageAllocated = allocated;
+    }
+
+    service->images[service->imageCount++] = (CachedImage){ key, format, bytes, ++service->clock };
+    service->imageBytes += bytes;
+
+    EvictImages(service);
+}
+
+// Call without the lock, the file is read before it is taken. Files left by an earlier run are picked up on first use
+static unsigned char *LoadCachedImage(Service *service, uint64_t key, const char *format, size_t *size) {
+    char path[1024];
+    ImagePath(service, key, format, path, sizeof(path));
+
+    unsigned char *data = ReadWholeFile(path, size);
+
+    pthread_mutex_lock(&service->lock);
+
+    int index = -1;
+    for (int i = 0; i < service->imageCount; i++) {
+        if (service->images[i].key == key && strcmp(service->images[i].format, format) == 0) index = i;
+    }
+
+    if (index >= 0 && data) {
+        service->images[index].lastUsed = ++service->clock;
+    } else if (index >= 0) {
+        // Removed behind our back
+        service->imageBytes -= service->images[index].bytes;
+        service->images[index] = service->images[--service->imageCount];
+    } else if (data) {
+        RememberImage(service, key, format, *size);
+    }
+
+    pthread_mutex_unlock(&service->lock);
+
+    return data;
+}
+
+static void ReplyWithImage(NetSocket client, const char *format, uint64_t key, bool hit, const unsigned char *data, size_t size) {
+    char headers[128];
+    snprintf(headers, sizeof(headers), "X-Cache: %s\r\nX-Image-Key: %016llx\r\n", hit ? "hit" : "miss", (unsigned long long)key);
+
+    SendResponse(client, 200, ContentType(format), headers, data, size);
+}
+
+// Parsing and the BVH build happen outside the lock. A scene that fails to parse comes back NULL with the parser's message
+static CachedScene *AcquireScene(Service *service, const ServiceJob *job, char *message, size_t messageSize) {
+    uint64_t hash = job->request.sceneHash;
+
+    pthread_mutex_lock(&service->lock);
+
+    for (int i = 0; i < service->sceneSlots; i++) {
+        CachedScene *cached = &service->scenes[i];
+
+        if (cached->loaded && cached->hash == hash) {
+            cached->users++;
+            cached->lastUsed = ++service->clock;
+            service->sceneHits++;
+
+            pthread_mutex_unlock(&service->lock);
+            return cached;
+        }
+    }
+
+    service->sceneMisses++;
+    pthread_mutex_unlock(&service->lock);
+
+    // Nested inside the render's trap, so parse errors get a 400 of their own
+    ErrorTrap trap;
+    ErrorTrap *outer = SetErrorTrap(&trap);
+
+    if (setjmp(trap.jump) != 0) {
+        SetErrorTrap(outer);
+        snprintf(message, messageSize, "%s", trap.message);
+
+        return NULL;
+    }
+
+    Scene scene = ParseSceneText(job->sceneText, job->sceneLength);
+    SetErrorTrap(outer);
+
+    CpuScene cpuScene = BuildCpuScene(scene);
+
+    pthread_mutex_lock(&service->lock);
+
+    CachedScene *slot = NULL;
+    int loaded = 0;
+
+    for (int i = 0; i < service->sceneSlots; i++) {
+        CachedScene *cached = &service->scenes[i];
+        loaded += cached->loaded;
+
+        // Another worker built the same scene meanwhile, theirs is kept
+        if (cached->loaded && cached->hash == hash) {
+            cached->users++;
+            cached->lastUsed = ++service->clock;
+
+            pthread_mutex_unlock(&service->lock);
+
+            CpuSceneFree(&cpuScene);
+            SceneFree(&scene);
+
+            return cached;
+        }
+
+        if (!cached->loaded && slot == NULL) slot = cached;
+    }
+
+    // Over capacity the least recently used idle scene goes. Scenes in use never number more than the workers
+    if (loaded >= service->sceneCapacity || slot == NULL) {
+        CachedScene *oldest = NULL;
+
+        for (int i = 0; i < service->sceneSlots; i++) {
+            CachedScene *cached = &service->scenes[i];
+
+            if (cached->loaded && cached->users == 0 && (oldest == NULL || cached->lastUsed < oldest->lastUsed)) {
+                oldest = cached;
+            }
+        }
+
+        if (oldest) {
+            CpuSceneFree(&oldest->cpuScene);
+            SceneFree(&oldest->scene);
+            oldest->loaded = false;
+
+            slot = oldest;
+        }
+    }
+
+    *slot = (CachedScene){
+        .loaded = true,
+        .hash = hash,
+        .scene = scene,
+        .cpuScene = cpuScene,
+        .users = 1,
+        .lastUsed = ++service->clock
+    };
+
+    pthread_mutex_unlock(&service->lock);
+
+    return slot;
+}
+
+static void ReleaseScene(Service *service, CachedScene *cached) {
+    pthread_mutex_lock(&service->lock);
+    cached->users--;
+    pthread_mutex_unlock(&service->lock);
+}
+
+static bool KeyRendering(const Service *service, uint64_t key) {
+    for (int i = 0; i < service->workers; i++) {
+        if (service->renderingKeys[i] == key) return true;
+    }
+
+    return false;
+}
+
+typedef struct ServiceWorker {
+    Service *service;
+    int index;
+} ServiceWorker;
+
+static void RenderJob(Service *service, int worker, ServiceJob *job) {
+    const RenderRequest *request = &job->request;
+    double start = Now();
+
+    char message[256];
+    CachedScene *cached = AcquireScene(service, job, message, sizeof(message));
+    job->scene = cached;
+
+    if (!cached) {
+        SendError(job->client, 400, message);
+
+        pthread_mutex_lock(&service->lock);
+        service->failed++;
+        pthread_mutex_unlock(&service->lock);
+
+        return;
+    }
+
+    Camera camera = {
+        .position = { request->position[0], request->position[1], request->position[2] },
+        .fovy = request->focalLength
+    };
+
+    if (!request->cameraGiven) {
+        camera = CameraAtFrame(&cached->scene, request->frame, (Camera){ .position = { 0.0f, 0.0f, 2.0f }, .fovy = 2.0f });
+    }
+
+    CpuCamera cpuCamera = InitCpuCamera(camera.position, camera.fovy, request->width, request->height);
+    CpuFrame *frame = &job->frame;
+    *frame = AllocCpuFrame(request->width, request->height);
+
+    // Jobs already run one per worker, so each traces and encodes on its own thread
+    TraceFrame(&cached->cpuScene, &cpuCamera, frame, 0, 0, request->samples, request->seed, NULL);
+    ReleaseScene(service, cached);
+    job->scene = NULL;
+
+    AtrousFilter(frame, DefaultAtrousParams(request->denoiseIterations));
+
+    char path[1024], temporary[1024];
+    ImagePath(service, job->key, request->format, path, sizeof(path));
+    TemporaryImagePath(service, job->key, worker, request->format, temporary, sizeof(temporary));
+
+    // The rename means a reader never finds half an image under the final name
+    bool ok = ExportCpuFrame(frame, temporary, EXR_COMPRESSION_ZIP, 1) && ReplaceFileAtomic(temporary, path);
+    CpuFrameFree(frame);
+    *frame = (CpuFrame){ 0 };
+
+    size_t size = 0;
+    unsigned char *data = ok ? ReadWholeFile(path, &size) : NULL;
+
+    pthread_mutex_lock(&service->lock);
+
+    if (data) {
+        RememberImage(service, job->key, request->format, size);
+        service->rendered++;
+    } else {
+        remove(temporary);
+        service->failed++;
+    }
+
+    pthread_mutex_unlock(&service->lock);
+
+    if (data) {
+        ReplyWithImage(job->client, request->format, job->key, false, data, size);
+
+        printf("Rendered %016llx: %dx%d %s at %d spp in %.2fs\n", (unsigned long long)job->key,
+            request->width, request->height, request->format, request->samples, Now() - start);
+    } else {
+        SendError(job->client, 500, "Failed to write the image to the cache directory.");
+    }
+
+    free(data);
+}
+
+// Every error() in the render lands here, so a request that fails anywhere gets a 500 instead of ending the service
+static void RenderJobTrapped(Service *service, int worker, ServiceJob *job) {
+    ErrorTrap trap;
+
+    if (setjmp(trap.jump) != 0) {
+        SetErrorTrap(NULL);
+
+        if (job->scene) {
+            ReleaseScene(service, job->scene);
+        }
+
+        CpuFrameFree(&job->frame);
+
+        char temporary[1024];
+        TemporaryImagePath(service, job->key, worker, job->request.format, temporary, sizeof(temporary));
+        remove(temporary);
+
+        pthread_mutex_lock(&service->lock);
+        service->failed++;
+        pthread_mutex_unlock(&service->lock);
+
+        SendError(job->client, 500, trap.message);
+        return;
+    }
+
+    SetErrorTrap(&trap);
+    RenderJob(service, worker, job);
+    SetErrorTrap(NULL);
+}
+
+static void *ServiceWorkerThread(void *arg) {
+    ServiceWorker *self = arg;
+    Service *service = self->service;
+
+    for (;;) {
+        pthread_mutex_lock(&service->lock);
+
+        while (service->queueCount == 0) {
+            pthread_cond_wait(&service->jobReady, &service->lock);
+        }
+
+        ServiceJob job = service->queue[service->queueHead];
+        service->queueHead = (service->queueHead + 1) % SERVICE_QUEUE;
+        service->queueCount--;
+
+        // A burst of identical requests renders once, the rest wait and read it back. The key is claimed
+        // before looking in the cache, which happens outside the lock
+        while (KeyRendering(service, job.key)) {
+            pthread_cond_wait(&service->renderDone, &service->lock);
+        }
+
+        service->renderingKeys[self->index] = job.key;
+        pthread_mutex_unlock(&service->lock);
+
+        size_t size = 0;
+        unsigned char *data = LoadCachedImage(service, job.key, job.request.format, &size);
+
+        if (!data) {
+            RenderJobTrapped(service, self->index, &job);
+        }
+
+        pthread_mutex_lock(&service->lock);
+
+        // Counted as a miss when it was queued, but it turned out to be a hit
+        if (data) {
+            service->imageHits++;
+            service->imageMisses--;
+        }
+
+        service->renderingKeys[self->index] = 0;
+        pthread_cond_broadcast(&service->renderDone);
+        pthread_mutex_unlock(&service->lock);
+
+        if (data) {
+            ReplyWithImage(job.client, job.request.format, job.key, true, data, size);
+            free(data);
+        }
+
+        NetClose(job.client);
+        free(job.sceneText);
+    }
+
+    return NULL;
+}
+
+static void SendStatus(Service *service, NetSocket client) {
+    char body[768];
+
+    pthread_mutex_lock(&service->lock);
+
+    int scenes = 0, rendering = 0;
+    for (int i = 0; i < service->sceneSlots; i++) scenes += service->scenes[i].loaded;
+    for (int i = 0; i < service->workers; i++) rendering += service->renderingKeys[i] != 0;
+
+    int length = snprintf(body, sizeof(body),
+        "{\"workers\":%d,\"queued\":%d,\"rendering\":%d,\"rendered\":%lld,\"failed\":%lld,"
+        "\"imageHits\":%lld,\"imageMisses\":%lld,\"images\":%d,\"imageBytes\":%zu,\"imageBudget\":%zu,"
+        "\"sceneHits\":%lld,\"sceneMisses\":%lld,\"scenes\":%d,\"sceneCapacity\":%d,\"kernels\":\"%s\"}\n",
+        service->workers, service->queueCount, rendering, service->rendered, service->failed,
+        service->imageHits, service->imageMisses, service->imageCount, service->imageBytes, service->imageBudget,
+        service->sceneHits, service->sceneMisses, scenes, service->sceneCapacity, cpuKernels.name);
+
+    pthread_mutex_unlock(&service->lock);
+
+    SendResponse(client, 200, "application/json", NULL, body, (size_t)length);
+}
+
+// GET /images/<key>.<format>, the key a render answered with
+static void SendStoredImage(Service *service, NetSocket client, const char *name) {
+    char hex[17], extension[4];
+    const char *format = NULL;
+
+    if (strlen(name) == 20 && sscanf(name, "%16[0-9a-f].%3[a-z]", hex, extension) == 2 && strlen(hex) == 16) {
+        format = FormatName(extension);
+    }
+
+    if (format == NULL) {
+        SendError(client, 404, "No such image.");
+        return;
+    }
+
+    uint64_t key = strtoull(hex, NULL, 16);
+
+    size_t size = 0;
+    unsigned char *data = LoadCachedImage(service, key, format, &size);
+
+    if (data) {
+        ReplyWithImage(client, format, key, true, data, size);
+        free(data);
+    } else {
+        SendError(client, 404, "No such image.");
+    }
+}
+
+// Returns true when the connection went to a worker, which then owns it
+static bool HandleConnection(Service *service, NetSocket client) {
+    HttpRequest http;
+    int status = ReadHttpHeader(client, &http);
+
+    if (status < 0) return false;
+
+    if (status > 0) {
+        SendError(client, status, "Malformed request.");
+        return false;
+    }
+
+    if (strcmp(http.path, "/status") == 0 || strncmp(http.path, "/images/", 8) == 0) {
+        if (strcmp(http.method, "GET") != 0) {
+            SendError(client, 405, "Use GET.");
+        } else if (http.path[1] == 's') {
+            SendStatus(service, client);
+        } else {
+            SendStoredImage(service, client, http.path + 8);
+        }
+
+        return false;
+    }
+
+    if (strcmp(http.path, "/render") != 0) {
+        SendError(client, 404, "Try POST /render, GET /status or GET /images/<key>.<format>.");
+        return false;
+    }
+
+    if (strcmp(http.method, "POST") != 0) {
+        SendError(client, 405, "POST the scene TOML to /render.");
+        return false;
+    }
+
+    if (http.contentLength < 0) {
+        SendError(client, 411, "The scene must be sent with a Content-Length.");
+        return false;
+    }
+
+    if (http.contentLength == 0 || http.contentLength > SERVICE_MAX_SCENE) {
+        SendError(client, http.contentLength == 0 ? 400 : 413, "The request body is the scene TOML, up to 1 MiB.");
+        return false;
+    }
+
+    ServiceJob job = {
+        .client = client,
+        .sceneLength = (size_t)http.contentLength,
+        .sceneText = malloc((size_t)http.contentLength + 1)
+    };
+
+    if (!job.sceneText || !NetRecv(client, job.sceneText, job.sceneLength)) {
+        free(job.sceneText);
+        return false;
+    }
+
+    job.sceneText[job.sceneLength] = '\0';
+
+    char message[128];
+
+    if (!ParseRenderQuery(http.query, &service->options, &job.request, message, sizeof(message))) {
+        SendError(client, 400, message);
+        free(job.sceneText);
+
+        return false;
+    }
+
+    job.request.sceneHash = HashBytes(job.sceneText, job.sceneLength);
+    job.key = ImageKey(&job.request);
+
+    // Hits are answered right here without waiting behind renders
+    size_t size = 0;
+    unsigned char *data = LoadCachedImage(service, job.key, job.request.format, &size);
+    bool queued = false;
+
+    pthread_mutex_lock(&service->lock);
+
+    if (data) {
+        service->imageHits++;
+    } else if (service->queueCount < SERVICE_QUEUE) {
+        service->imageMisses++;
+        service->queue[(service->queueHead + service->queueCount) % SERVICE_QUEUE] = job;
+        service->queueCount++;
+
+        pthread_cond_signal(&service->jobReady);
+        queued = true;
+    }
+
+    pthread_mutex_unlock(&service->lock);
+
+    if (data) {
+        ReplyWithImage(client, job.request.format, job.key, true, data, size);
+        free(data);
+    } else if (!queued) {
+        SendError(client, 503, "The render queue is full, try again later.");
+    }
+
+    if (!queued) {
+        free(job.sceneText);
+    }
+
+    return queued;
+}
+
+typedef struct ServiceConnection {
+    Service *service;
+    NetSocket client;
+} ServiceConnection;
+
+static void *ServiceConnectionThread(void *arg) {
+    ServiceConnection *connection = arg;
+    Service *service = connection->service;
+
+    if (!HandleConnection(service, connection->client)) {
+        NetClose(connection->client);
+    }
+
+    pthread_mutex_lock(&service->lock);
+    service->connections--;
+    pthread_mutex_unlock(&service->lock);
+
+    free(connection);
+    return NULL;
+}
+
+// Hands the client to a thread of its own, so a slow sender never holds up the accept loop
+static bool StartConnection(Service *service, NetSocket client) {
+    pthread_mutex_lock(&service->lock);
+
+    bool full = service->connections >= SERVICE_MAX_CONNECTIONS;
+    if (!full) service->connections++;
+
+    pthread_mutex_unlock(&service->lock);
+
+    if (full) return false;
+
+    ServiceConnection *connection = malloc(sizeof(ServiceConnection));
+    pthread_t thread;
+
+    if (connection) {
+        *connection = (ServiceConnection){ service, client };
+
+        if (pthread_create(&thread, NULL, ServiceConnectionThread, connection) == 0) {
+            pthread_detach(thread);
+            return true;
+        }
+
+        free(connection);
+    }
+
+    pthread_mutex_lock(&service->lock);
+    service->connections--;
+    pthread_mutex_unlock(&service->lock);
+
+    return false;
+}
+
+void RunService(CliOptions options) {
+    // Log lines go out as they happen when stdout is a file or a pipe
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    if (!NetInit()) {
+        error("Failed to initialise sockets.");
+    }
+
+    // MakeDirectory also succeeds when the directory is already there
+    if (MakeDirectory(options.cacheDir) != 0) {
+        error("Failed to create the cache directory.");
+    }
+
+    NetSocket server = NetListen(options.servePort, true);
+    if (server == NET_INVALID_SOCKET) {
+        error("Failed to listen on the service port.");
+    }
+
+    Service *service = calloc(1, sizeof(Service));
+    if (!service) {
+        error("Out of memory starting the service.");
+    }
+
+    service->options = options;
+    service->cacheDir = options.cacheDir;
+    service->workers = options.threads > 0 ? options.threads : CpuCount();
+    service->sceneCapacity = options.sceneCacheSize;
+    service->sceneSlots = options.sceneCacheSize + service->workers;
+    service->scenes = calloc(service->sceneSlots, sizeof(CachedScene));
+    service->renderingKeys = calloc(service->workers, sizeof(uint64_t));
+    service->imageBudget = (size_t)options.imageCacheMb << 20;
+
+    if (!service->scenes || !service->renderingKeys) {
+        error("Out of memory starting the service.");
+    }
+
+    pthread_mutex_init(&service->lock, NULL);
+    pthread_cond_init(&service->jobReady, NULL);
+    pthread_cond_init(&service->renderDone, NULL);
+
+    ServiceWorker *workers = malloc(service->workers * sizeof(ServiceWorker));
+
+    for (int i = 0; i < service->workers; i++) {
+        workers[i] = (ServiceWorker){ service, i };
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, ServiceWorkerThread, &workers[i]) != 0) {
+            error("Failed to start a service worker.");
+        }
+
+        pthread_detach(thread);
+    }
+
+    printf("Serving renders on http://127.0.0.1:%d with %d workers, images cached in %s (%d MiB)\n",
+        options.servePort, service->workers, options.cacheDir, options.imageCacheMb);
+
+    // Runs until the process is killed, the cache directory is all that needs to survive it
+    for (;;) {
+        NetSocket client = NetAccept(server);
+        if (client == NET_INVALID_SOCKET) continue;
+
+        NetSetTimeout(client, SERVICE_TIMEOUT_MS);
+
+        if (!StartConnection(service, client)) {
+            SendError(client, 503, "Too many open connections, try again later.");
+            NetClose(client);
+        }
+    }
+}
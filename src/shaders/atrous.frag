@@ -0,0 +1,59 @@
+#version 330
+
+// One iteration of the edge-avoiding a-trous wavelet filter (Dammertz et al. 2010)
+
+uniform vec2 resolution;
+
+uniform sampler2D colourTex;
+uniform sampler2D normalDepthTex;
+uniform sampler2D albedoTex;
+
+uniform int stepWidth;
+
+uniform float colourPhi;
+uniform float normalPhi;
+uniform float depthPhi;
+uniform float albedoPhi;
+
+out vec4 finalColour;
+
+// 1D B3-spline taps indexed by distance from the center
+const float kernel[3] = float[3](3.0 / 8.0, 1.0 / 4.0, 1.0 / 16.0);
+
+void main() {
+    ivec2 p = ivec2(gl_FragCoord.xy);
+    ivec2 maxPixel = ivec2(resolution) - 1;
+
+    vec3 colourP = texelFetch(colourTex, p, 0).rgb;
+    vec4 normalDepthP = texelFetch(normalDepthTex, p, 0);
+    vec3 albedoP = texelFetch(albedoTex, p, 0).rgb;
+
+    vec3 sum = vec3(0.0);
+    float weightSum = 0.0;
+
+    for (int y = -2; y <= 2; y++) {
+        for (int x = -2; x <= 2; x++) {
+            ivec2 q = clamp(p + ivec2(x, y) * stepWidth, ivec2(0), maxPixel);
+
+            vec3 colourQ = texelFetch(colourTex, q, 0).rgb;
+            vec4 normalDepthQ = texelFetch(normalDepthTex, q, 0);
+            vec3 albedoQ = texelFetch(albedoTex, q, 0).rgb;
+
+            vec3 colourDiff = colourQ - colourP;
+            vec3 albedoDiff = albedoQ - albedoP;
+
+            float colourWeight = exp(-dot(colourDiff, colourDiff) / colourPhi);
+            float normalWeight = pow(max(dot(normalDepthP.xyz, normalDepthQ.xyz), 0.0), normalPhi);
+            float depthWeight = exp(-abs(normalDepthQ.w - normalDepthP.w) / (depthPhi * float(stepWidth)));
+            float albedoWeight = exp(-dot(albedoDiff, albedoDiff) / albedoPhi);
+
+            float weight = kernel[abs(x)] * kernel[abs(y)] * colourWeight * normalWeight * depthWeight * albedoWeight;
+
+            sum += colourQ * weight;
+            weightSum += weight;
+        }
+    }
+
+    // The center tap always has full edge weights, so weightSum is never zero
+    finalColour = vec4(sum / weightSum, 1.0);
+}
@@ -9,24 +9,26 @@ uniform sampler2D accRender;
 
 uniform int changed;
 uniform int frame;
+uniform float frameWeight;  // Share of the accumulated samples that this frame carries
 
 out vec4 finalColour;
 
 void main() {
     vec2 uv = gl_FragCoord.xy / resolution;
 
-    vec3 prevTex = texture(prevFrame, uv).rgb;
-    vec3 accTex = texture(accRender, uv).rgb;
+    // All four channels blend, so the same pass averages the RAY_STATS counts for the heatmap
+    vec4 prevTex = texture(prevFrame, uv);
+    vec4 accTex = texture(accRender, uv);
 
-    float factor = 1.0 / float(frame + 1.0);
+    float factor = frameWeight;
 
     if (frame >= DENOISE_MAX_FRAMES && DENOISE_MAX_FRAMES != -1) {
         factor = 0.0;
     }
 
     if (changed == 0 || DENOISE_MAX_FRAMES == -2) {
-        finalColour = vec4(mix(accTex, prevTex, factor), 1.0);
+        finalColour = mix(accTex, prevTex, factor);
     } else {
-        finalColour = vec4(prevTex, 1.0);
+        finalColour = prevTex;
     }
 }
@@ -0,0 +1,32 @@
+#version 330
+
+// Draws the accumulated RAY_STATS counts as a false colour heatmap
+
+in vec2 fragTexCoord;
+
+uniform sampler2D texture0;     // Counts per sample: rays, shadow rays, spheres tested, surfaces hit
+uniform vec4 weights;           // Picks the counts the heatmap mode shows
+uniform float range;            // Cost drawn as full red
+
+out vec4 finalColour;
+
+// Blue, cyan, green, yellow, red, same stops as HeatmapColour() in helpers.c
+vec3 Heat(float t) {
+    vec3 stops[5] = vec3[](
+        vec3(0.0, 0.0, 1.0),
+        vec3(0.0, 1.0, 1.0),
+        vec3(0.0, 1.0, 0.0),
+        vec3(1.0, 1.0, 0.0),
+        vec3(1.0, 0.0, 0.0)
+    );
+
+    float x = clamp(t, 0.0, 1.0) * 4.0;
+    int i = min(int(x), 3);
+
+    return mix(stops[i], stops[i + 1], x - float(i));
+}
+
+void main() {
+    float cost = dot(texture(texture0, fragTexCoord), weights);
+    finalColour = vec4(Heat(cost / range), 1.0);
+}
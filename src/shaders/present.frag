@@ -0,0 +1,17 @@
+#version 330
+
+// Draws a linear float frame to the window
+
+in vec2 fragTexCoord;
+
+uniform sampler2D texture0;
+
+out vec4 finalColour;
+
+vec3 LinearToGamma(vec3 colour) {
+    return sqrt(max(colour, vec3(0.0)));
+}
+
+void main() {
+    finalColour = vec4(LinearToGamma(texture(texture0, fragTexCoord).rgb), 1.0);
+}
@@ -6,29 +6,60 @@
 #define LAMBERTIAN 0
 #define METAL 1
 #define DIELECTRIC 2
+#define EMISSIVE 3
 
 #define MAX_OBJECTS 4
 #define POS_INFINITY 100000000
+#define PI 3.14159265359
 
 #define MAX_DEPTH 5
+#define SKY_DEPTH 10000.0
+
+layout(location = 0) out vec4 finalColour;
+layout(location = 1) out vec4 normalDepth;
+layout(location = 2) out vec4 albedoGuide;
+
+// Debug variant, the host defines RAY_STATS to get per pixel work counts averaged over the frame's samples:
+// x = rays, y = shadow rays, z = spheres tested, w = surfaces hit
+#ifdef RAY_STATS
+layout(location = 3) out vec4 rayStats;
+
+vec4 statCounts = vec4(0.0);
+#define COUNT_STAT(component, amount) statCounts.component += float(amount)
+#else
+#define COUNT_STAT(component, amount)
+#endif
 
-out vec4 finalColour;
 uniform vec2 resolution;
-uniform float time;
+
+// Random numbers are keyed on seed, pixel, sample and bounce (see rng.c)
+uniform int seed;
+uniform int sampleIndex;     // Samples the pixel already holds
 
 uniform sampler2D data;
 uniform int dataSize;
 
+// Indices of the emissive objects, built when the scene is loaded
+uniform int lights[MAX_OBJECTS];
+uniform int lightCount;
+
 uniform float focalLength;
 uniform vec3 cameraCenter;
 
 uniform int aaEnabled;
+uniform int samplesPerPixel;
+
+uvec2 rngKey;
+uvec4 rngCounter;   // pixel, sample, bounce, block
+uvec4 rngBlock;
+int rngUsed;
 
 struct Material {
     int type;
     vec3 albedo;
     float roughness;
     float ior;
+    float emission;
 };
 
 struct HitRecord {
@@ -37,6 +68,14 @@ struct HitRecord {
     Material material;
     float t;
     bool frontFace;
+    int object;
+};
+
+// Denoiser guides taken from the first hit of a path
+struct FirstHit {
+    vec3 normal;
+    float depth;
+    vec3 albedo;
 };
 
 struct Interval {
@@ -50,7 +89,7 @@ Hittable Data Types:
 Sphere:
     data0   xyz = pos, w = radius
     data1   x = scatter type, yzw = albedo
-    data2   x = roughness, y = ior
+    data2   x = roughness, y = ior, z = emission
 
 */
 struct Hittable {
@@ -89,36 +128,64 @@ float LengthSquared(vec3 v) {
     return v.x * v.x + v.y * v.y + v.z * v.z;
 }
 
-float Random(vec2 p)
-{
-    ivec2 i = ivec2(p);
-    uint h = uint(i.x) * 1664525u + uint(i.y) * 1013904223u;
-    h ^= h >> 16;
-    h *= 2246822519u;
-    return float(h) / float(0xffffffffu);
+// High half of the 64 bit product, GLSL 330 has no umulExtended
+uint MulHi(uint a, uint b) {
+    uint aLo = a & 0xFFFFu, aHi = a >> 16;
+    uint bLo = b & 0xFFFFu, bHi = b >> 16;
+
+    uint loHi = aLo * bHi;
+    uint hiLo = aHi * bLo;
+    uint carry = ((aLo * bLo) >> 16) + (loHi & 0xFFFFu) + (hiLo & 0xFFFFu);
+
+    return aHi * bHi + (loHi >> 16) + (hiLo >> 16) + (carry >> 16);
+}
+
+// Philox4x32-10, matches Philox4x32() in rng.c bit for bit
+uvec4 Philox(uvec4 counter, uvec2 key) {
+    for (int i = 0; i < 10; i++) {
+        uint hi0 = MulHi(0xD2511F53u, counter.x);
+        uint lo0 = 0xD2511F53u * counter.x;
+        uint hi1 = MulHi(0xCD9E8D57u, counter.z);
+        uint lo1 = 0xCD9E8D57u * counter.z;
+
+        counter = uvec4(hi1 ^ counter.y ^ key.x, lo1, hi0 ^ counter.w ^ key.y, lo0);
+        key += uvec2(0x9E3779B9u, 0xBB67AE85u);
+    }
+
+    return counter;
 }
 
-float Random(vec2 seed, float min, float max) {
-    return min + (max - min) * Random(seed);
+void InitRng(uint pixel, uint sample) {
+    rngKey = uvec2(uint(seed), 0x5EED5EEDu);
+    rngCounter = uvec4(pixel, sample, 0u, 0u);
+    rngUsed = 4;
 }
 
-vec3 RandomVec3(vec2 seed) {
-    return vec3(
-        Random(seed * vec2(13.0, 17.0)),
-        Random(seed * vec2(31.0, 37.0)),
-        Random(seed * vec2(51.0, 97.0)));
+void RngSetBounce(uint bounce) {
+    rngCounter.z = bounce;
+    rngCounter.w = 0u;
+    rngUsed = 4;
 }
 
-vec3 RandomVec3(vec2 seed, float min, float max) {
-    return vec3(
-        Random(seed * vec2(13.0, 17.0), min, max),
-        Random(seed * vec2(31.0, 37.0), min, max),
-        Random(seed * vec2(51.0, 97.0), min, max));
+float NextRandom() {
+    if (rngUsed == 4) {
+        rngBlock = Philox(rngCounter, rngKey);
+        rngCounter.w++;
+        rngUsed = 0;
+    }
+
+    uint bits = rngBlock[rngUsed++];
+    return float(bits >> 8) * (1.0 / 16777216.0);
 }
 
-vec3 RandomUnitVec3(vec2 seed) {
+vec3 RandomUnitVec3() {
     for (int i = 0; i < 16; i++) {
-        vec3 p = RandomVec3(seed + i * 13.0, -1.0, 1.0);
+        // Drawn one at a time so the order matches the CPU tracer
+        float x = NextRandom() * 2.0 - 1.0;
+        float y = NextRandom() * 2.0 - 1.0;
+        float z = NextRandom() * 2.0 - 1.0;
+
+        vec3 p = vec3(x, y, z);
         float lensq = LengthSquared(p);
 
         if (lensq <= 1 && lensq > 1e-45) {
@@ -129,8 +196,8 @@ vec3 RandomUnitVec3(vec2 seed) {
     return vec3(1.0, 0.0, 0.0);
 }
 
-vec3 RandomOnHemisphere(vec3 normal, vec2 seed) {
-    vec3 onUnitSphere = RandomUnitVec3(seed);
+vec3 RandomOnHemisphere(vec3 normal) {
+    vec3 onUnitSphere = RandomUnitVec3();
     if (dot(onUnitSphere, normal) > 0.0) {
         return onUnitSphere;
     } else {
@@ -179,7 +246,7 @@ bool IntervalSurrounds(Interval interval, float x) {
 }
 
 bool LambertianScatter(Material mat, Ray ray, HitRecord rec, inout vec3 attenuation, inout Ray scattered) {
-    vec3 scatterDirection = rec.normal + RandomUnitVec3(gl_FragCoord.xy * (gl_FragCoord.yx * time));
+    vec3 scatterDirection = rec.normal + RandomUnitVec3();
 
     if (NearZero(scatterDirection)) {
         scatterDirection = rec.normal;
@@ -193,7 +260,7 @@ bool LambertianScatter(Material mat, Ray ray, HitRecord rec, inout vec3 attenuat
 
 bool MetalScatter(Material mat, Ray ray, HitRecord rec, inout vec3 attenuation, inout Ray scattered) {
     vec3 reflected = Reflect(ray.direction, rec.normal);
-    reflected = normalize(reflected) + (mat.roughness * RandomUnitVec3(gl_FragCoord.xy * (gl_FragCoord.yx * time)));
+    reflected = normalize(reflected) + (mat.roughness * RandomUnitVec3());
     scattered = Ray(rec.pos, reflected);
     attenuation = mat.albedo;
 
@@ -211,7 +278,7 @@ bool DielectricScatter(Material mat, Ray ray, HitRecord rec, inout vec3 attenuat
     bool cannotRefract = mat.ior * sinTheta > 1.0;
     vec3 direction = vec3(0.0);
 
-    if (cannotRefract || Reflectance(cosTheta, mat.ior) > Random(gl_FragCoord.xy * (gl_FragCoord.yx * time))) {
+    if (cannotRefract || Reflectance(cosTheta, mat.ior) > NextRandom()) {
         direction = Reflect(unitDirection, rec.normal);
     } else {
         direction = Refract(unitDirection, rec.normal, mat.ior);
@@ -267,7 +334,8 @@ bool HitHittable(Hittable object, Ray ray, Interval rayT, out HitRecord rec) {
                 int(object.data1.x), // Material type
                 object.data1.yzw, // Albedo
                 object.data2.x, // Roughness
-                object.data2.y // IOR
+                object.data2.y, // IOR
+                object.data2.z // Emission
             );
         Sphere sphere = Sphere(object.data0.xyz, object.data0.w, mat);
 
@@ -282,30 +350,189 @@ bool HitWorld(Ray ray, Interval rayT, out HitRecord rec, Hittable objects[MAX_OB
     bool hit = false;
     float closest = rayT.max;
 
+    COUNT_STAT(x, 1);
+    COUNT_STAT(z, min(dataSize, MAX_OBJECTS));
+
     for (int i = 0; i < MAX_OBJECTS; i++) {
         if (HitHittable(objects[i], ray, Interval(rayT.min, closest), temp) && objects[i].isActive) {
             hit = true;
             closest = temp.t;
             rec = temp;
+            rec.object = i;
         }
     }
 
     return hit;
 }
 
-vec3 RayColour(Ray ray, Hittable objects[MAX_OBJECTS]) {
+// Shadow query, stops at the first blocker and skips building a hit record
+bool HitAny(Ray ray, Interval rayT, Hittable objects[MAX_OBJECTS]) {
+    COUNT_STAT(y, 1);
+
+    for (int i = 0; i < min(dataSize, MAX_OBJECTS); i++) {
+        COUNT_STAT(z, 1);
+
+        vec3 oc = objects[i].data0.xyz - ray.origin;
+
+        float a = LengthSquared(ray.direction);
+        float h = dot(ray.direction, oc);
+        float c = LengthSquared(oc) - objects[i].data0.w * objects[i].data0.w;
+
+        float discriminant = h * h - a * c;
+        if (discriminant < 0) {
+            continue;
+        }
+
+        float sqrtd = sqrt(discriminant);
+
+        if (IntervalSurrounds(rayT, (h - sqrtd) / a) || IntervalSurrounds(rayT, (h + sqrtd) / a)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+float PowerHeuristic(float pdf, float otherPdf) {
+    return (pdf * pdf) / (pdf * pdf + otherPdf * otherPdf);
+}
+
+// 1 - cos of the half angle the sphere covers from pos, 0 when pos is inside it
+float SphereCapSize(vec4 sphere, vec3 pos) {
+    vec3 toCenter = sphere.xyz - pos;
+    float sinThetaMaxSq = sphere.w * sphere.w / dot(toCenter, toCenter);
+
+    if (sinThetaMaxSq >= 1.0) {
+        return 0.0;
+    }
+
+    // Same as 1 - sqrt(1 - x), without cancellation for small lights
+    return sinThetaMaxSq / (1.0 + sqrt(1.0 - sinThetaMaxSq));
+}
+
+// Solid angle pdf of picking this light and sampling its spherical cap
+float SphereLightPdf(vec4 sphere, vec3 pos) {
+    float capSize = SphereCapSize(sphere, pos);
+
+    if (capSize <= 0.0) {
+        return 0.0;
+    }
+
+    return 1.0 / (2.0 * PI * capSize * float(lightCount));
+}
+
+// Uniformly samples a direction inside the cone the sphere subtends
+bool SampleSphereLight(vec4 sphere, vec3 pos, vec2 u, out vec3 direction, out float dist) {
+    float capSize = SphereCapSize(sphere, pos);
+
+    if (capSize <= 0.0) {
+        return false;
+    }
+
+    vec3 toCenter = sphere.xyz - pos;
+    float centerDist = length(toCenter);
+    vec3 w = toCenter / centerDist;
+
+    float cosTheta = 1.0 - u.x * capSize;
+    float sinTheta = sqrt(max(0.0, 1.0 - cosTheta * cosTheta));
+    float phi = 2.0 * PI * u.y;
+
+    vec3 helper = abs(w.x) > 0.9 ? vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0);
+    vec3 v = normalize(cross(w, helper));
+    vec3 t = cross(w, v);
+
+    direction = normalize(t * cos(phi) * sinTheta + v * sin(phi) * sinTheta + w * cosTheta);
+
+    // Distance to the near side of the light along the sampled direction
+    float b = dot(direction, toCenter);
+    float c = centerDist * centerDist - sphere.w * sphere.w;
+    dist = b - sqrt(max(b * b - c, 0.0));
+
+    return true;
+}
+
+// Next event estimation for a Lambertian hit, MIS weighted against the BSDF sample
+vec3 SampleLights(HitRecord rec, Hittable objects[MAX_OBJECTS]) {
+    if (lightCount == 0) {
+        return vec3(0.0);
+    }
+
+    float u0 = NextRandom();
+    float u1 = NextRandom();
+    float u2 = NextRandom();
+    vec3 u = vec3(u0, u1, u2);
+    int light = lights[min(int(u.x * float(lightCount)), lightCount - 1)];
+    Hittable emitter = objects[light];
+
+    vec3 direction;
+    float dist;
+
+    if (!SampleSphereLight(emitter.data0, rec.pos, u.yz, direction, dist)) {
+        return vec3(0.0);
+    }
+
+    float cosine = dot(rec.normal, direction);
+    if (cosine <= 0.0) {
+        return vec3(0.0);
+    }
+
+    if (HitAny(Ray(rec.pos, direction), Interval(0.0001, dist * 0.999), objects)) {
+        return vec3(0.0);
+    }
+
+    float lightPdf = SphereLightPdf(emitter.data0, rec.pos);
+    float bsdfPdf = cosine / PI;
+
+    vec3 bsdf = rec.material.albedo / PI;
+    vec3 emitted = emitter.data1.yzw * emitter.data2.z;
+
+    return bsdf * emitted * cosine / lightPdf * PowerHeuristic(lightPdf, bsdfPdf);
+}
+
+vec3 RayColour(Ray ray, Hittable objects[MAX_OBJECTS], out FirstHit firstHit) {
     vec3 attenuationAccum = vec3(1.0);
+    vec3 radiance = vec3(0.0);
     Ray currentRay = ray;
 
+    // BSDF pdf of the last bounce, 0 when it came from the camera or a specular surface
+    float lastBsdfPdf = 0.0;
+    vec3 lastPos = ray.origin;
+
+    // Escaped rays face the camera and sit far away, so the sky filters as one surface
+    firstHit = FirstHit(-normalize(ray.direction), SKY_DEPTH, vec3(1.0));
+
     for (int i = 0; i < MAX_DEPTH; i++) {
         HitRecord rec;
+        RngSetBounce(uint(i + 1));
 
         if (HitWorld(currentRay, Interval(0.0001, POS_INFINITY), rec, objects)) {
+            COUNT_STAT(w, 1);
+
+            if (i == 0) {
+                firstHit.normal = rec.normal;
+                firstHit.depth = rec.t * length(ray.direction);
+                firstHit.albedo = rec.material.type == DIELECTRIC ? vec3(1.0) : rec.material.albedo;
+            }
+
+            if (rec.material.type == EMISSIVE) {
+                float weight = 1.0;
+
+                // Lights were already sampled directly from Lambertian hits
+                if (lastBsdfPdf > 0.0) {
+                    weight = PowerHeuristic(lastBsdfPdf, SphereLightPdf(objects[rec.object].data0, lastPos));
+                }
+
+                return radiance + attenuationAccum * rec.material.albedo * rec.material.emission * weight;
+            }
+
             Ray scattered;
             vec3 attenuation;
             bool didScatter = false;
+            lastBsdfPdf = 0.0;
 
             if (rec.material.type == LAMBERTIAN) {
+                radiance += attenuationAccum * SampleLights(rec, objects);
+
                 didScatter = LambertianScatter(
                         rec.material,
                         currentRay,
@@ -313,6 +540,8 @@ vec3 RayColour(Ray ray, Hittable objects[MAX_OBJECTS]) {
                         attenuation,
                         scattered
                     );
+
+                lastBsdfPdf = max(dot(rec.normal, normalize(scattered.direction)), 0.0) / PI;
             } else if (rec.material.type == METAL) {
                 didScatter = MetalScatter(
                         rec.material,
@@ -334,10 +563,11 @@ vec3 RayColour(Ray ray, Hittable objects[MAX_OBJECTS]) {
             }
 
             if (!didScatter) {
-                return vec3(0.0);
+                return radiance;
             }
 
             attenuationAccum *= attenuation;
+            lastPos = rec.pos;
             currentRay = scattered;
         } else {
             vec3 unitDirection = normalize(ray.direction);
@@ -349,11 +579,11 @@ vec3 RayColour(Ray ray, Hittable objects[MAX_OBJECTS]) {
                     a
                 );
 
-            return attenuationAccum * sky;
+            return radiance + attenuationAccum * sky;
         }
     }
 
-    return vec3(0.0);
+    return radiance;
 }
 
 void InitialiseCamera(inout Camera camera) {
@@ -379,18 +609,15 @@ vec3 CalculateRayDirection(Camera camera, vec2 pixelIndex) {
     return rayDirection;
 }
 
-vec3 SampleSquare(int index) {
-    vec2 seed = gl_FragCoord.xy + vec2(index * 17.0, index * 31.0);
-    return vec3(
-        Random(seed) - 0.5,
-        Random(seed.yx) - 0.5,
-        0.0
-    );
+vec3 SampleSquare() {
+    float x = NextRandom() - 0.5;
+    float y = NextRandom() - 0.5;
+
+    return vec3(x, y, 0.0);
 }
 
-// Index = the current sample index
-Ray GetRay(Camera camera, vec2 pixelIndex, int index) {
-    vec3 offset = SampleSquare(index);
+Ray GetRay(Camera camera, vec2 pixelIndex) {
+    vec3 offset = SampleSquare();
     vec3 pixelSample = camera.pixel00Loc
             + ((pixelIndex.x + offset.x) * camera.pixelDeltaU)
             + ((pixelIndex.y + offset.y) * camera.pixelDeltaV);
@@ -401,23 +628,6 @@ Ray GetRay(Camera camera, vec2 pixelIndex, int index) {
     return Ray(rayOrigin, rayDirection);
 }
 
-vec3 LinearToGamma(vec3 colour) {
-    vec3 result;
-    if (colour.x > 0) {
-        result.x = sqrt(colour.x);
-    }
-
-    if (colour.y > 0) {
-        result.y = sqrt(colour.y);
-    }
-
-    if (colour.z > 0) {
-        result.z = sqrt(colour.z);
-    }
-
-    return result;
-}
-
 Hittable GetHittable(int i) {
     Hittable object;
 
@@ -426,7 +636,7 @@ Hittable GetHittable(int i) {
 
     object.data0 = texelFetch(data, ivec2(1, i), 0);
     object.data1 = texelFetch(data, ivec2(2, i), 0);
-    object.data2 = vec4(texelFetch(data, ivec2(3, i), 0).xy, 0.0, 0.0);
+    object.data2 = texelFetch(data, ivec2(3, i), 0);
 
     return object;
 }
@@ -437,13 +647,13 @@ void main() {
     Camera camera;
     camera.focalLength = focalLength;
     camera.position = cameraCenter;
-    camera.samplesPerPixel = 20;
+    camera.samplesPerPixel = max(samplesPerPixel, 1);
 
     InitialiseCamera(camera);
 
     Hittable objects[MAX_OBJECTS];
 
-    for (int i = 0; i < dataSize; i++) {
+    for (int i = 0; i < min(dataSize, MAX_OBJECTS); i++) {
         objects[i] = GetHittable(i);
     }
 
@@ -454,18 +664,38 @@ void main() {
         }
     }
 
-    if (aaEnabled == 1) {
-        vec3 pixelColour = vec3(0.0, 0.0, 0.0);
-        for (int i = 0; i < camera.samplesPerPixel; i++) {
-            Ray ray = GetRay(camera, pixelIndex, i);
-            pixelColour += RayColour(ray, objects);
+    FirstHit firstHit;
+    vec3 pixelColour = vec3(0.0, 0.0, 0.0);
+
+    // Same pixel numbering as the CPU tracer, row 0 at the top
+    ivec2 coord = ivec2(gl_FragCoord.xy);
+    uint pixel = uint((int(resolution.y) - 1 - coord.y) * int(resolution.x) + coord.x);
+
+    // Without anti-aliasing every sample goes through the pixel center
+    for (int i = 0; i < camera.samplesPerPixel; i++) {
+        FirstHit sampleHit;
+        InitRng(pixel, uint(sampleIndex + i));
+
+        Ray ray = Ray(cameraCenter, CalculateRayDirection(camera, pixelIndex));
+        if (aaEnabled == 1) {
+            ray = GetRay(camera, pixelIndex);
         }
 
-        pixelColour /= camera.samplesPerPixel;
-        finalColour = vec4(LinearToGamma(pixelColour), 1.0);
-    } else {
-        vec3 rayDirection = CalculateRayDirection(camera, pixelIndex);
-        Ray ray = Ray(cameraCenter, rayDirection);
-        finalColour = vec4(LinearToGamma(RayColour(ray, objects)), 1.0);
+        pixelColour += RayColour(ray, objects, sampleHit);
+
+        if (i == 0) {
+            firstHit = sampleHit;
+        }
     }
+
+    // Linear radiance, gamma is applied when the frame is presented
+    pixelColour /= camera.samplesPerPixel;
+    finalColour = vec4(pixelColour, 1.0);
+
+    normalDepth = vec4(firstHit.normal, firstHit.depth);
+    albedoGuide = vec4(firstHit.albedo, 1.0);
+
+#ifdef RAY_STATS
+    rayStats = statCounts / float(camera.samplesPerPixel);
+#endif
 }
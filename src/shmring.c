@@ -0,0 +1,239 @@
+#include "../include/shmring.h"
+#include "../include/helpers.h"
+#include "../include/platform.h"
+#include "raylib.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static size_t AlignUp(size_t value, size_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+static int BytesPerPixel(ShmFormat format) {
+    return format == SHM_FORMAT_RGBA32F ? 16 : 4;
+}
+
+static unsigned char *SlotPixels(const ShmRing *ring, uint64_t frame) {
+    const ShmRingHeader *header = ring->header;
+
+    return (unsigned char *)header + header->firstSlot + (frame % header->slotCount) * header->slotSize;
+}
+
+ShmFormat ShmFormatFromName(const char *name) {
+    if (strcmp(name, "rgba8") == 0) return SHM_FORMAT_RGBA8;
+    if (strcmp(name, "float") == 0) return SHM_FORMAT_RGBA32F;
+
+    error("Unknown shared memory format, expected rgba8 or float.");
+    return SHM_FORMAT_RGBA8;
+}
+
+ShmRing *ShmRingCreate(const char *name, int width, int height, ShmFormat format, int slots) {
+    if (slots < 2 || slots > SHM_RING_MAX_SLOTS) {
+        error("Shared memory ring needs between 2 and 64 slots.");
+    }
+
+    size_t stride = (size_t)width * BytesPerPixel(format);
+    size_t headerSize = AlignUp(sizeof(ShmRingHeader) + slots * sizeof(ShmSlotHeader), SHM_RING_ALIGN);
+    size_t slotSize = AlignUp(stride * height, SHM_RING_ALIGN);
+
+    ShmRing *ring = calloc(1, sizeof(ShmRing));
+
+    if (!ring || !SharedMemoryCreate(&ring->memory, name, headerSize + slots * slotSize)) {
+        error("Failed to create the shared memory ring.");
+    }
+
+    ShmRingHeader *header = ring->memory.data;
+
+    header->version = SHM_RING_VERSION;
+    header->format = format;
+    header->width = (uint32_t)width;
+    header->height = (uint32_t)height;
+    header->stride = (uint32_t)stride;
+    header->slotCount = (uint32_t)slots;
+    header->slotSize = slotSize;
+    header->firstSlot = headerSize;
+
+    atomic_init(&header->published, 0);
+    atomic_init(&header->notify, 0);
+    atomic_init(&header->closed, 0);
+
+    for (int i = 0; i < slots; i++) {
+        atomic_init(&header->slots[i].sequence, 0);
+        header->slots[i].time = 0.0;
+    }
+
+    // Consumers that map early wait for the magic, so it goes in last
+    atomic_thread_fence(memory_order_release);
+    header->magic = SHM_RING_MAGIC;
+
+    ring->header = header;
+    ring->producer = true;
+    ring->created = Now();
+
+    return ring;
+}
+
+void *ShmRingBegin(ShmRing *ring) {
+    ShmRingHeader *header = ring->header;
+    uint64_t frame = atomic_load_explicit(&header->published, memory_order_relaxed);
+
+    ShmSlotHeader *slot = &header->slots[frame % header->slotCount];
+    atomic_store_explicit(&slot->sequence, 2 * frame + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    return SlotPixels(ring, frame);
+}
+
+void ShmRingPublish(ShmRing *ring) {
+    ShmRingHeader *header = ring->header;
+    uint64_t frame = atomic_load_explicit(&header->published, memory_order_relaxed);
+
+    ShmSlotHeader *slot = &header->slots[frame % header->slotCount];
+    slot->time = Now() - ring->created;
+
+    atomic_store_explicit(&slot->sequence, 2 * frame + 2, memory_order_release);
+    atomic_store_explicit(&header->published, frame + 1, memory_order_release);
+
+    atomic_fetch_add_explicit(&header->notify, 1, memory_order_release);
+    FutexWakeAll(&header->notify);
+}
+
+void ShmRingPublishTexture(ShmRing *ring, const void *pixels, int pixelFormat) {
+    const ShmRingHeader *header = ring->header;
+    int width = (int)header->width;
+    int height = (int)header->height;
+
+    if (pixelFormat != PIXELFORMAT_UNCOMPRESSED_R8G8B8A8 && pixelFormat != PIXELFORMAT_UNCOMPRESSED_R32G32B32A32) {
+        error("Unsupported texture format for the shared memory ring.");
+    }
+
+    unsigned char *slot = ShmRingBegin(ring);
+
+    for (int y = 0; y < height; y++) {
+        // GL rows run bottom up
+        size_t row = (size_t)(height - 1 - y) * width;
+        unsigned char *out = slot + (size_t)y * header->stride;
+
+        for (int x = 0; x < width; x++) {
+            float gamma[3];
+
+            if (pixelFormat == PIXELFORMAT_UNCOMPRESSED_R8G8B8A8) {
+                const unsigned char *in = (const unsigned char *)pixels + (row + x) * 4;
+
+                if (header->format == SHM_FORMAT_RGBA8) {
+                    memcpy(out + x * 4, in, 4);
+                    continue;
+                }
+
+                for (int c = 0; c < 3; c++) gamma[c] = in[c] / 255.0f;
+            } else {
+                // Float textures hold linear radiance
+                const float *in = (const float *)pixels + (row + x) * 4;
+
+                if (header->format == SHM_FORMAT_RGBA32F) {
+                    float linear[4] = { in[0], in[1], in[2], 1.0f };
+                    memcpy(out + x * 16, linear, sizeof(linear));
+                    continue;
+                }
+
+                for (int c = 0; c < 3; c++) gamma[c] = sqrtf(Clampf(in[c], 0.0f, 1.0f));
+            }
+
+            if (header->format == SHM_FORMAT_RGBA8) {
+                for (int c = 0; c < 3; c++) out[x * 4 + c] = (unsigned char)(gamma[c] * 255.0f + 0.5f);
+                out[x * 4 + 3] = 255;
+            } else {
+                // The shader's gamma is a square root
+                float linear[4] = { gamma[0] * gamma[0], gamma[1] * gamma[1], gamma[2] * gamma[2], 1.0f };
+                memcpy(out + x * 16, linear, sizeof(linear));
+            }
+        }
+    }
+
+    ShmRingPublish(ring);
+}
+
+void ShmRingDestroy(ShmRing *ring) {
+    if (!ring) return;
+
+    if (ring->producer) {
+        atomic_store(&ring->header->closed, 1);
+        atomic_fetch_add(&ring->header->notify, 1);
+        FutexWakeAll(&ring->header->notify);
+    }
+
+    SharedMemoryClose(&ring->memory, ring->producer);
+    free(ring);
+}
+
+ShmRing *ShmRingOpen(const char *name) {
+    ShmRing *ring = calloc(1, sizeof(ShmRing));
+    if (!ring) return NULL;
+
+    if (!SharedMemoryOpen(&ring->memory, name)) {
+        free(ring);
+        return NULL;
+    }
+
+    ShmRingHeader *header = ring->memory.data;
+    bool valid = ring->memory.size >= sizeof(ShmRingHeader) && header->magic == SHM_RING_MAGIC &&
+        header->version == SHM_RING_VERSION;
+
+    atomic_thread_fence(memory_order_acquire);
+
+    if (valid) {
+        valid = header->slotCount >= 2 && header->slotCount <= SHM_RING_MAX_SLOTS &&
+            header->firstSlot + header->slotCount * header->slotSize <= ring->memory.size;
+    }
+
+    if (!valid) {
+        SharedMemoryClose(&ring->memory, false);
+        free(ring);
+        return NULL;
+    }
+
+    ring->header = header;
+    return ring;
+}
+
+// Oldest frame from next on that is still intact, NULL on timeout or once the producer has gone
+const void *ShmRingAcquire(ShmRing *ring, uint64_t next, uint64_t *frame, int timeoutMs) {
+    ShmRingHeader *header = ring->header;
+    uint64_t slotCount = header->slotCount;
+    double deadline = Now() + timeoutMs / 1000.0;
+
+    for (;;) {
+        unsigned int notify = atomic_load_explicit(&header->notify, memory_order_acquire);
+        uint64_t published = atomic_load_explicit(&header->published, memory_order_acquire);
+
+        if (published > next) {
+            // The producer may already be rewriting the slot after the newest frame
+            uint64_t oldest = published >= slotCount - 1 ? published - (slotCount - 1) : 0;
+
+            for (uint64_t candidate = next > oldest ? next : oldest; candidate < published; candidate++) {
+                if (ShmRingStillValid(ring, candidate)) {
+                    *frame = candidate;
+                    return SlotPixels(ring, candidate);
+                }
+            }
+
+            continue;   // Lapped while looking, try again from the new oldest frame
+        }
+
+        if (atomic_load(&header->closed)) return NULL;
+
+        int remainingMs = (int)((deadline - Now()) * 1000.0);
+        if (remainingMs <= 0) return NULL;
+
+        FutexWait(&header->notify, notify, remainingMs);
+    }
+}
+
+bool ShmRingStillValid(const ShmRing *ring, uint64_t frame) {
+    atomic_thread_fence(memory_order_acquire);
+
+    const ShmSlotHeader *slot = &ring->header->slots[frame % ring->header->slotCount];
+    return atomic_load_explicit((atomic_ullong *)&slot->sequence, memory_order_acquire) == 2 * frame + 2;
+}
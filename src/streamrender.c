@@ -0,0 +1,161 @@
+#include "../include/streamrender.h"
+#include "../include/cpukernels.h"
+#include "../include/cputracer.h"
+#include "../include/denoise.h"
+#include "../include/platform.h"
+#include "../include/tiffwriter.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Each worker owns one frame sized for a tile plus the denoiser's reach on
+ * every side. The border is traced and filtered but thrown away, so tile
+ * seams match a whole-frame render exactly, and memory only grows with the
+ * tile size and worker count.
+ */
+typedef struct StreamJob {
+    const CpuScene *scene;
+    CpuCamera camera;
+    TiffWriter *writer;
+
+    int samples;
+    unsigned int seed;
+    AtrousParams denoise;
+    int apron;
+
+    int tileCount;
+    atomic_int nextTile;
+    atomic_int finishedTiles;
+} StreamJob;
+
+// Pixels the filter reads from, summed over every iteration's 5x5 footprint
+static int DenoiseApron(int iterations) {
+    return iterations > 0 ? 2 * ((1 << iterations) - 1) : 0;
+}
+
+static int MinInt(int a, int b) {
+    return a < b ? a : b;
+}
+
+static int MaxInt(int a, int b) {
+    return a > b ? a : b;
+}
+
+static void *StreamWorker(void *arg) {
+    StreamJob *job = arg;
+    const TiffWriter *writer = job->writer;
+
+    int tileSize = writer->tileSize;
+    int frameSize = tileSize + 2 * job->apron;
+
+    CpuFrame frame = AllocCpuFrame(frameSize, frameSize);
+    unsigned char *rgb = malloc((size_t)tileSize * tileSize * 3);
+
+    if (!rgb) {
+        error("Out of memory allocating stream tile.");
+    }
+
+    for (;;) {
+        int tile = atomic_fetch_add(&job->nextTile, 1);
+        if (tile >= job->tileCount) break;
+
+        int tileX = tile % writer->tilesX;
+        int tileY = tile / writer->tilesX;
+
+        int x0 = tileX * tileSize;
+        int y0 = tileY * tileSize;
+        int x1 = MinInt(x0 + tileSize, writer->width);
+        int y1 = MinInt(y0 + tileSize, writer->height);
+
+        // The apron stops at the image edge, where the filter clamps like it does on a full frame
+        int frameX = MaxInt(x0 - job->apron, 0);
+        int frameY = MaxInt(y0 - job->apron, 0);
+        frame.width = MinInt(x1 + job->apron, writer->width) - frameX;
+        frame.height = MinInt(y1 + job->apron, writer->height) - frameY;
+
+        TraceFrame(job->scene, &job->camera, &frame, frameX, frameY, job->samples, job->seed, NULL);
+        AtrousFilter(&frame, job->denoise);
+
+        // Edge tiles are padded with black past the image
+        memset(rgb, 0, (size_t)tileSize * tileSize * 3);
+
+        for (int y = y0; y < y1; y++) {
+            for (int x = x0; x < x1; x++) {
+                Vector3 c = frame.colour[(y - frameY) * frame.width + (x - frameX)];
+                unsigned char *out = &rgb[((size_t)(y - y0) * tileSize + (x - x0)) * 3];
+
+                out[0] = GammaByte(c.x);
+                out[1] = GammaByte(c.y);
+                out[2] = GammaByte(c.z);
+            }
+        }
+
+        TiffWriteTile(job->writer, tileX, tileY, rgb);
+
+        int finished = atomic_fetch_add(&job->finishedTiles, 1) + 1;
+        if (finished * 100 / job->tileCount != (finished - 1) * 100 / job->tileCount) {
+            printf("\rStreaming tiles: %d%%", finished * 100 / job->tileCount);
+            fflush(stdout);
+        }
+    }
+
+    CpuFrameFree(&frame);
+    free(rgb);
+
+    return NULL;
+}
+
+void RenderStreamed(Scene scene, Camera camera, CliOptions options) {
+    double start = Now();
+
+    int tileSize = MaxInt(options.tileSize, STREAM_MIN_TILE);
+    tileSize = (tileSize + TIFF_TILE_ALIGN - 1) / TIFF_TILE_ALIGN * TIFF_TILE_ALIGN;
+
+    CpuScene cpuScene = BuildCpuScene(scene);
+    TiffWriter *writer = TiffWriterOpen(options.offlineOutput, options.width, options.height, tileSize);
+
+    StreamJob job = {
+        .scene = &cpuScene,
+        .camera = InitCpuCamera(camera.position, camera.fovy, options.width, options.height),
+        .writer = writer,
+        .samples = options.samples,
+        .seed = options.seed,
+        .denoise = DefaultAtrousParams(options.denoiseIterations),
+        .apron = DenoiseApron(options.denoiseIterations),
+        .tileCount = writer->tilesX * writer->tilesY
+    };
+
+    atomic_init(&job.nextTile, 0);
+    atomic_init(&job.finishedTiles, 0);
+
+    int threads = options.threads > 0 ? options.threads : CpuCount();
+
+    // Guides and colour per frame pixel, plus the filter's scratch copy and the output tile
+    size_t frameSize = (size_t)(tileSize + 2 * job.apron) * (tileSize + 2 * job.apron);
+    size_t workerBytes = frameSize * (sizeof(Vector3) * 4 + sizeof(float)) + (size_t)tileSize * tileSize * 3;
+
+    printf("Streaming %dx%d as %d tiles of %d px (%s, apron %d px, ~%.1f MiB per worker, %d workers)\n",
+        options.width, options.height, job.tileCount, tileSize, writer->big ? "BigTIFF" : "TIFF",
+        job.apron, workerBytes / (1024.0 * 1024.0), threads);
+
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&workers[i], NULL, StreamWorker, &job);
+    }
+
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    TiffWriterClose(writer);
+
+    printf("\nRendered %dx%d at %d spp in %.2fs (%s kernels)\n",
+        options.width, options.height, options.samples, Now() - start, cpuKernels.name);
+
+    free(workers);
+    CpuSceneFree(&cpuScene);
+}
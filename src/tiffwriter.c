@@ -0,0 +1,171 @@
+#include "../include/tiffwriter.h"
+#include "../include/helpers.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define TIFF_SHORT 3
+#define TIFF_LONG 4
+#define TIFF_LONG8 16
+
+#define TIFF_ENTRY_COUNT 11
+
+static void WriteBytes(TiffWriter *writer, const void *data, size_t size) {
+    if (fwrite(data, 1, size, writer->file) != size) {
+        error("Failed to write TIFF output.");
+    }
+
+    writer->end += size;
+}
+
+// Little endian, whatever the host is
+static void WriteUint(TiffWriter *writer, unsigned long long value, int size) {
+    unsigned char bytes[8];
+
+    for (int i = 0; i < size; i++) {
+        bytes[i] = (unsigned char)(value >> (8 * i));
+    }
+
+    WriteBytes(writer, bytes, size);
+}
+
+// Offsets are 4 bytes in classic TIFF and 8 in BigTIFF
+static void WriteOffset(TiffWriter *writer, unsigned long long value) {
+    WriteUint(writer, value, writer->big ? 8 : 4);
+}
+
+// Values that fit in the entry are stored inline, left justified
+static void WriteEntry(TiffWriter *writer, int tag, int type, unsigned long long count, unsigned long long value) {
+    WriteUint(writer, tag, 2);
+    WriteUint(writer, type, 2);
+    WriteOffset(writer, count);
+
+    int typeSize = type == TIFF_SHORT ? 2 : (type == TIFF_LONG ? 4 : 8);
+
+    if (count == 1) {
+        WriteUint(writer, value, typeSize);
+        WriteUint(writer, 0, (writer->big ? 8 : 4) - typeSize);
+    } else {
+        WriteOffset(writer, value);
+    }
+}
+
+// Three shorts fit inside a BigTIFF entry but not a classic one
+static void WriteBitsPerSample(TiffWriter *writer, unsigned long long arrayOffset) {
+    if (!writer->big) {
+        WriteEntry(writer, 258, TIFF_SHORT, 3, arrayOffset);
+        return;
+    }
+
+    WriteUint(writer, 258, 2);
+    WriteUint(writer, TIFF_SHORT, 2);
+    WriteUint(writer, 3, 8);
+
+    for (int i = 0; i < 3; i++) WriteUint(writer, 8, 2);
+    WriteUint(writer, 0, 2);
+}
+
+TiffWriter *TiffWriterOpen(const char *path, int width, int height, int tileSize) {
+    if (tileSize % TIFF_TILE_ALIGN != 0) {
+        error("TIFF tile size must be a multiple of 16.");
+    }
+
+    TiffWriter *writer = calloc(1, sizeof(TiffWriter));
+
+    writer->file = fopen(path, "wb");
+    if (!writer->file) {
+        char errMsg[256];
+        snprintf(errMsg, sizeof(errMsg), "Could not open \"%s\" for writing", path);
+
+        error(errMsg);
+    }
+
+    writer->width = width;
+    writer->height = height;
+    writer->tileSize = tileSize;
+    writer->tilesX = (width + tileSize - 1) / tileSize;
+    writer->tilesY = (height + tileSize - 1) / tileSize;
+
+    size_t tileCount = (size_t)writer->tilesX * writer->tilesY;
+    unsigned long long dataSize = (unsigned long long)tileCount * tileSize * tileSize * 3;
+
+    // Leave room for the directory and the two offset tables behind the pixels
+    writer->big = dataSize + tileCount * 8 + 4096 > 0xFFFFFFFFull;
+    writer->offsets = calloc(tileCount, sizeof(unsigned long long));
+
+    if (!writer->offsets) {
+        error("Out of memory allocating TIFF tile table.");
+    }
+
+    if (writer->big) {
+        WriteBytes(writer, "II", 2);
+        WriteUint(writer, 43, 2);
+        WriteUint(writer, 8, 2);
+        WriteUint(writer, 0, 2);
+    } else {
+        WriteBytes(writer, "II", 2);
+        WriteUint(writer, 42, 2);
+    }
+
+    // Directory offset, patched on close
+    WriteOffset(writer, 0);
+
+    pthread_mutex_init(&writer->lock, NULL);
+
+    return writer;
+}
+
+void TiffWriteTile(TiffWriter *writer, int tileX, int tileY, const unsigned char *rgb) {
+    size_t size = (size_t)writer->tileSize * writer->tileSize * 3;
+
+    pthread_mutex_lock(&writer->lock);
+
+    writer->offsets[(size_t)tileY * writer->tilesX + tileX] = writer->end;
+    WriteBytes(writer, rgb, size);
+
+    pthread_mutex_unlock(&writer->lock);
+}
+
+void TiffWriterClose(TiffWriter *writer) {
+    size_t tileCount = (size_t)writer->tilesX * writer->tilesY;
+    unsigned long long tileBytes = (unsigned long long)writer->tileSize * writer->tileSize * 3;
+
+    // Word aligned arrays the directory points at
+    if (writer->end % 2) WriteUint(writer, 0, 1);
+
+    unsigned long long bitsPerSample = writer->end;
+    for (int i = 0; i < 3; i++) WriteUint(writer, 8, 2);
+
+    unsigned long long offsetTable = writer->end;
+    for (size_t i = 0; i < tileCount; i++) WriteOffset(writer, writer->offsets[i]);
+
+    unsigned long long countTable = writer->end;
+    for (size_t i = 0; i < tileCount; i++) WriteOffset(writer, tileBytes);
+
+    int offsetType = writer->big ? TIFF_LONG8 : TIFF_LONG;
+    unsigned long long directory = writer->end;
+
+    WriteUint(writer, TIFF_ENTRY_COUNT, writer->big ? 8 : 2);
+    WriteEntry(writer, 256, TIFF_LONG, 1, writer->width);           // ImageWidth
+    WriteEntry(writer, 257, TIFF_LONG, 1, writer->height);          // ImageLength
+    WriteBitsPerSample(writer, bitsPerSample);
+    WriteEntry(writer, 259, TIFF_SHORT, 1, 1);                      // Compression: none
+    WriteEntry(writer, 262, TIFF_SHORT, 1, 2);                      // Photometric: RGB
+    WriteEntry(writer, 277, TIFF_SHORT, 1, 3);                      // SamplesPerPixel
+    WriteEntry(writer, 284, TIFF_SHORT, 1, 1);                      // PlanarConfiguration: chunky
+    WriteEntry(writer, 322, TIFF_LONG, 1, writer->tileSize);        // TileWidth
+    WriteEntry(writer, 323, TIFF_LONG, 1, writer->tileSize);        // TileLength
+    WriteEntry(writer, 324, offsetType, tileCount, tileCount == 1 ? writer->offsets[0] : offsetTable);
+    WriteEntry(writer, 325, offsetType, tileCount, tileCount == 1 ? tileBytes : countTable);
+    WriteOffset(writer, 0);
+
+    fseek(writer->file, writer->big ? 8 : 4, SEEK_SET);
+    WriteOffset(writer, directory);
+
+    if (fclose(writer->file) != 0) {
+        error("Failed to finish TIFF output.");
+    }
+
+    pthread_mutex_destroy(&writer->lock);
+    free(writer->offsets);
+    free(writer);
+}
@@ -0,0 +1,633 @@
+#include "../include/tilerender.h"
+#include "../include/cpukernels.h"
+#include "../include/cputracer.h"
+#include "../include/helpers.h"
+#include "../include/platform.h"
+#include "../include/timeline.h"
+#include "raylib.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RAYMATH_STATIC_INLINE
+#include "raymath.h"
+
+typedef struct TileKey {
+    float key;
+    int tile;
+} TileKey;
+
+TileOrder TileOrderFromName(const char *name) {
+    if (strcmp(name, "spiral") == 0) return TILE_ORDER_SPIRAL;
+    if (strcmp(name, "hilbert") == 0) return TILE_ORDER_HILBERT;
+    if (strcmp(name, "variance") == 0) return TILE_ORDER_VARIANCE;
+
+    char errMsg[128];
+    snprintf(errMsg, sizeof(errMsg), "Unknown tile order \"%s\" (spiral, hilbert or variance)", name);
+
+    error(errMsg);
+    return TILE_ORDER_SPIRAL;
+}
+
+static int CompareTileKeys(const void *a, const void *b) {
+    float d = ((const TileKey *)a)->key - ((const TileKey *)b)->key;
+    return (d > 0) - (d < 0);
+}
+
+static void SortSchedule(TileRenderer *renderer, TileKey *keys) {
+    qsort(keys, renderer->tileCount, sizeof(TileKey), CompareTileKeys);
+
+    for (int i = 0; i < renderer->tileCount; i++) {
+        renderer->schedule[i] = keys[i].tile;
+    }
+}
+
+// Walks a square spiral out from the center tile, skipping cells off the grid
+static void SpiralSchedule(TileRenderer *renderer) {
+    int x = (renderer->tilesX - 1) / 2;
+    int y = (renderer->tilesY - 1) / 2;
+    int dx = 1, dy = 0;
+    int count = 0;
+
+    for (int legLength = 1; count < renderer->tileCount; legLength++) {
+        for (int leg = 0; leg < 2; leg++) {
+            for (int i = 0; i < legLength; i++) {
+                if (x >= 0 && x < renderer->tilesX && y >= 0 && y < renderer->tilesY) {
+                    renderer->schedule[count++] = y * renderer->tilesX + x;
+                }
+
+                x += dx;
+                y += dy;
+            }
+
+            int turn = dx;
+            dx = -dy;
+            dy = turn;
+        }
+    }
+}
+
+// Distance along the Hilbert curve filling an n x n grid, n a power of two
+static int HilbertIndex(int n, int x, int y) {
+    int d = 0;
+
+    for (int s = n / 2; s > 0; s /= 2) {
+        int rx = (x & s) > 0;
+        int ry = (y & s) > 0;
+        d += s * s * ((3 * rx) ^ ry);
+
+        if (ry == 0) {
+            if (rx == 1) {
+                x = n - 1 - x;
+                y = n - 1 - y;
+            }
+
+            int swap = x;
+            x = y;
+            y = swap;
+        }
+    }
+
+    return d;
+}
+
+static void HilbertSchedule(TileRenderer *renderer, TileKey *keys) {
+    int n = 1;
+    while (n < renderer->tilesX || n < renderer->tilesY) n *= 2;
+
+    for (int i = 0; i < renderer->tileCount; i++) {
+        keys[i] = (TileKey){ (float)HilbertIndex(n, i % renderer->tilesX, i / renderer->tilesX), i };
+    }
+
+    SortSchedule(renderer, keys);
+}
+
+// Orders tiles by the mean variance of their pixel estimates, highest first
+static void VarianceSchedule(TileRenderer *renderer, TileKey *keys) {
+    for (int i = 0; i < renderer->tileCount; i++) {
+        const Tile *tile = &renderer->tiles[i];
+        double error = 0.0;
+
+        for (int y = tile->y; y < tile->y + tile->height; y++) {
+            for (int x = tile->x; x < tile->x + tile->width; x++) {
+                int index = y * renderer->width + x;
+                Vector4 sum = AccumBufferGet(&renderer->accum, index);
+                float n = sum.w;
+                if (n < 2.0f) continue;
+
+                float luma = 0.2126f * sum.x + 0.7152f * sum.y + 0.0722f * sum.z;
+                float mean = luma / n;
+                float variance = renderer->lumaSq[index] / n - mean * mean;
+
+                error += fmaxf(variance, 0.0f) / n;
+            }
+        }
+
+        keys[i] = (TileKey){ -(float)(error / (tile->width * tile->height)), i };
+    }
+
+    SortSchedule(renderer, keys);
+}
+
+static int NodeForTile(const TileRenderer *renderer, int tileIndex) {
+    int row = tileIndex / renderer->tilesX;
+
+    for (int i = renderer->nodeCount - 1; i > 0; i--) {
+        if (row >= renderer->nodes[i].firstRow) return i;
+    }
+
+    return 0;
+}
+
+// Splits the schedule into per-node queues, each keeping the global order
+static void PartitionSchedule(TileRenderer *renderer) {
+    for (int i = 0; i < renderer->nodeCount; i++) {
+        renderer->nodes[i].queueLength = 0;
+        renderer->nodes[i].nextTile = 0;
+    }
+
+    for (int i = 0; i < renderer->tileCount; i++) {
+        TileNode *node = &renderer->nodes[NodeForTile(renderer, renderer->schedule[i])];
+        node->queue[node->queueLength++] = renderer->schedule[i];
+    }
+}
+
+// Own node's band first, then steal from the others so no worker idles at the end of a pass
+static int TakeTile(TileRenderer *renderer, int home) {
+    for (int i = 0; i < renderer->nodeCount; i++) {
+        TileNode *node = &renderer->nodes[(home + i) % renderer->nodeCount];
+
+        if (node->nextTile < node->queueLength) {
+            renderer->nextTile++;
+            return node->queue[node->nextTile++];
+        }
+    }
+
+    return -1;
+}
+
+// Called with the lock held once every tile has finished the previous pass
+static void BeginPass(TileRenderer *renderer) {
+    TileKey *keys = malloc(renderer->tileCount * sizeof(TileKey));
+
+    if (renderer->order == TILE_ORDER_HILBERT) {
+        HilbertSchedule(renderer, keys);
+    } else if (renderer->order == TILE_ORDER_VARIANCE && renderer->pass >= 2) {
+        VarianceSchedule(renderer, keys);
+    } else {
+        SpiralSchedule(renderer);
+    }
+
+    free(keys);
+
+    PartitionSchedule(renderer);
+
+    renderer->nextTile = 0;
+    renderer->finishedTiles = 0;
+}
+
+// Returns false if the camera changed before the tile was done
+static bool RenderTile(TileRenderer *renderer, const CpuScene *scene, Tile *tile, unsigned int generation, RayStats *stats) {
+    for (int y = tile->y; y < tile->y + tile->height; y++) {
+        if (atomic_load_explicit(&renderer->generation, memory_order_relaxed) != generation) {
+            return false;
+        }
+
+        for (int x = tile->x; x < tile->x + tile->width; x++) {
+            int index = y * renderer->width + x;
+            Rng rng = InitRng(renderer->seed, index, tile->passes);
+
+            long long spheresTested = stats->spheresTested;
+            long long nodesVisited = stats->nodesVisited;
+            long long surfacesHit = stats->rays - stats->skyEnds;
+
+            PixelSample sample = TracePixel(scene, &renderer->camera, x, y, renderer->jitter, &rng, stats);
+            float luma = 0.2126f * sample.colour.x + 0.7152f * sample.colour.y + 0.0722f * sample.colour.z;
+
+            AccumBufferAdd(&renderer->accum, index, sample.colour, 1.0f);
+            renderer->lumaSq[index] += luma * luma;
+
+            // The pixel's share of the tile's counts, for the heatmap. Only this tile writes them, the viewer reads them live
+            atomic_uint *cost = &renderer->cost[(size_t)index * COST_CHANNELS];
+            unsigned int counts[COST_CHANNELS] = {
+                (unsigned int)(stats->spheresTested - spheresTested),
+                (unsigned int)(stats->nodesVisited - nodesVisited),
+                (unsigned int)(stats->rays - stats->skyEnds - surfacesHit)
+            };
+
+            for (int c = 0; c < COST_CHANNELS; c++) {
+                unsigned int total = atomic_load_explicit(&cost[c], memory_order_relaxed) + counts[c];
+                atomic_store_explicit(&cost[c], total, memory_order_relaxed);
+            }
+        }
+    }
+
+    atomic_fetch_add(&renderer->samplesTraced, (long long)tile->width * tile->height);
+
+    return true;
+}
+
+static void ClearCost(TileRenderer *renderer, size_t firstPixel, size_t pixelCount) {
+    for (size_t i = firstPixel * COST_CHANNELS; i < (firstPixel + pixelCount) * COST_CHANNELS; i++) {
+        atomic_store_explicit(&renderer->cost[i], 0, memory_order_relaxed);
+    }
+}
+
+// Runs on the node's first pinned worker so the replica and the band's pages are local to it
+static void SetupNode(TileRenderer *renderer, TileNode *node) {
+    node->replica = CloneCpuScene(renderer->scene);
+    node->scene = &node->replica;
+
+    const Tile *first = &renderer->tiles[node->firstRow * renderer->tilesX];
+    const Tile *last = &renderer->tiles[(node->firstRow + node->rowCount - 1) * renderer->tilesX];
+
+    size_t firstPixel = (size_t)first->y * renderer->width;
+    size_t pixelCount = (size_t)(last->y + last->height - first->y) * renderer->width;
+
+    AccumBufferClearRange(&renderer->accum, firstPixel, pixelCount);
+    memset(renderer->lumaSq + firstPixel, 0, pixelCount * sizeof(float));
+    ClearCost(renderer, firstPixel, pixelCount);
+}
+
+static void *TileWorker(void *arg) {
+    TileWorkerContext *context = arg;
+    TileRenderer *renderer = context->renderer;
+    TileNode *node = &renderer->nodes[context->node];
+
+    char name[32];
+    snprintf(name, sizeof(name), "tile worker %d", (int)(context - renderer->contexts));
+    TimelineThreadName(name);
+
+    if (renderer->numa) {
+        PinCurrentThread(node->cpus, node->cpuCount);
+
+        if (context->first) {
+            SetupNode(renderer, node);
+        }
+    }
+
+    pthread_mutex_lock(&renderer->lock);
+
+    if (context->first) {
+        renderer->readyNodes++;
+        pthread_cond_broadcast(&renderer->idle);
+    }
+
+    while (!renderer->quit) {
+        if (renderer->resetting || renderer->paused || renderer->nextTile >= renderer->tileCount) {
+            pthread_cond_wait(&renderer->wake, &renderer->lock);
+            continue;
+        }
+
+        int tileIndex = TakeTile(renderer, context->node);
+        unsigned int generation = atomic_load(&renderer->generation);
+        renderer->activeWorkers++;
+
+        pthread_mutex_unlock(&renderer->lock);
+
+        // Counted apart from the shared totals so the tile's inner loop stays thread local
+        RayStats stats = { 0 };
+
+        TimelineZone zone = TimelineBegin("tile", tileIndex);
+        bool finished = RenderTile(renderer, node->scene, &renderer->tiles[tileIndex], generation, &stats);
+        TimelineEnd(zone);
+
+        pthread_mutex_lock(&renderer->lock);
+
+        renderer->activeWorkers--;
+
+        if (finished && !renderer->resetting) {
+            RayStatsMerge(&renderer->stats, &stats);
+            renderer->tiles[tileIndex].passes++;
+            renderer->finishedTiles++;
+
+            if (renderer->finishedTiles == renderer->tileCount) {
+                renderer->pass++;
+
+                // Without a new pass nextTile stays at tileCount and the workers wait for a reset
+                if (renderer->passLimit == 0 || renderer->pass < renderer->passLimit) {
+                    BeginPass(renderer);
+                    pthread_cond_broadcast(&renderer->wake);
+                }
+            }
+        }
+
+        pthread_cond_broadcast(&renderer->idle);
+    }
+
+    pthread_mutex_unlock(&renderer->lock);
+
+    return NULL;
+}
+
+static void InitNodes(TileRenderer *renderer, int threadCount) {
+    renderer->nodeCount = 1;
+
+    if (renderer->numa) {
+        renderer->nodeCount = NumaNodeCount();
+        if (renderer->nodeCount > threadCount) renderer->nodeCount = threadCount;
+        if (renderer->nodeCount > renderer->tilesY) renderer->nodeCount = renderer->tilesY;
+    }
+
+    renderer->nodes = calloc(renderer->nodeCount, sizeof(TileNode));
+
+    for (int i = 0; i < renderer->nodeCount; i++) {
+        TileNode *node = &renderer->nodes[i];
+
+        // Equal bands of tile rows, so every node owns a contiguous slab of the framebuffer
+        node->firstRow = i * renderer->tilesY / renderer->nodeCount;
+        node->rowCount = (i + 1) * renderer->tilesY / renderer->nodeCount - node->firstRow;
+        node->queue = malloc(node->rowCount * renderer->tilesX * sizeof(int));
+        node->scene = renderer->scene;
+
+        if (renderer->numa) {
+            node->cpus = malloc(NUMA_MAX_CPUS * sizeof(int));
+            node->cpuCount = NumaNodeCpus(i, node->cpus, NUMA_MAX_CPUS);
+        }
+
+        if (!node->queue || (renderer->numa && !node->cpus)) {
+            error("Out of memory allocating tile renderer nodes.");
+        }
+    }
+}
+
+TileRenderer *TileRendererCreate(const CpuScene *scene, int width, int height, int tileSize, int threadCount, TileOrder order, bool numa, unsigned int seed) {
+    TileRenderer *renderer = calloc(1, sizeof(TileRenderer));
+    size_t pixelCount = (size_t)width * height;
+
+    renderer->scene = scene;
+    renderer->width = width;
+    renderer->height = height;
+    renderer->order = order;
+    renderer->numa = numa;
+    renderer->seed = seed;
+
+    renderer->tilesX = (width + tileSize - 1) / tileSize;
+    renderer->tilesY = (height + tileSize - 1) / tileSize;
+    renderer->tileCount = renderer->tilesX * renderer->tilesY;
+
+    renderer->tiles = malloc(renderer->tileCount * sizeof(Tile));
+    renderer->schedule = malloc(renderer->tileCount * sizeof(int));
+
+    for (int ty = 0; ty < renderer->tilesY; ty++) {
+        for (int tx = 0; tx < renderer->tilesX; tx++) {
+            Tile tile = {
+                .x = tx * tileSize,
+                .y = ty * tileSize,
+                .width = tx * tileSize + tileSize > width ? width - tx * tileSize : tileSize,
+                .height = ty * tileSize + tileSize > height ? height - ty * tileSize : tileSize,
+                .passes = 0
+            };
+
+            renderer->tiles[ty * renderer->tilesX + tx] = tile;
+        }
+    }
+
+    renderer->accum = AllocAccumBuffer(width, height, 0);
+    renderer->lumaSq = calloc(pixelCount, sizeof(float));
+    renderer->cost = calloc(pixelCount * COST_CHANNELS, sizeof(atomic_uint));
+    renderer->heatmap = malloc(pixelCount * sizeof(float));
+
+    if (!renderer->tiles || !renderer->schedule || !renderer->lumaSq || !renderer->cost || !renderer->heatmap) {
+        error("Out of memory allocating tile renderer.");
+    }
+
+    pthread_mutex_init(&renderer->lock, NULL);
+    pthread_cond_init(&renderer->wake, NULL);
+    pthread_cond_init(&renderer->idle, NULL);
+
+    atomic_init(&renderer->generation, 0);
+    atomic_init(&renderer->samplesTraced, 0);
+
+    // Workers stay idle until the first reset hands them a camera
+    renderer->nextTile = renderer->tileCount;
+
+    InitNodes(renderer, threadCount);
+
+    renderer->workerCount = threadCount;
+    renderer->workers = malloc(threadCount * sizeof(pthread_t));
+    renderer->contexts = malloc(threadCount * sizeof(TileWorkerContext));
+
+    // Workers are dealt out to nodes round robin
+    for (int i = 0; i < threadCount; i++) {
+        renderer->contexts[i] = (TileWorkerContext){ renderer, i % renderer->nodeCount, i < renderer->nodeCount };
+        pthread_create(&renderer->workers[i], NULL, TileWorker, &renderer->contexts[i]);
+    }
+
+    // Replicas and first touches have to land before anything else writes the framebuffer
+    pthread_mutex_lock(&renderer->lock);
+
+    while (renderer->readyNodes < renderer->nodeCount) {
+        pthread_cond_wait(&renderer->idle, &renderer->lock);
+    }
+
+    pthread_mutex_unlock(&renderer->lock);
+
+    return renderer;
+}
+
+void TileRendererFree(TileRenderer *renderer) {
+    if (!renderer) return;
+
+    pthread_mutex_lock(&renderer->lock);
+    renderer->quit = true;
+    atomic_fetch_add(&renderer->generation, 1);
+    pthread_cond_broadcast(&renderer->wake);
+    pthread_mutex_unlock(&renderer->lock);
+
+    for (int i = 0; i < renderer->workerCount; i++) {
+        pthread_join(renderer->workers[i], NULL);
+    }
+
+    pthread_mutex_destroy(&renderer->lock);
+    pthread_cond_destroy(&renderer->wake);
+    pthread_cond_destroy(&renderer->idle);
+
+    for (int i = 0; i < renderer->nodeCount; i++) {
+        if (renderer->numa) CpuSceneFree(&renderer->nodes[i].replica);
+
+        free(renderer->nodes[i].cpus);
+        free(renderer->nodes[i].queue);
+    }
+
+    free(renderer->nodes);
+    free(renderer->workers);
+    free(renderer->contexts);
+    free(renderer->tiles);
+    free(renderer->schedule);
+    AccumBufferFree(&renderer->accum);
+    free(renderer->lumaSq);
+    free(renderer->cost);
+    free(renderer->heatmap);
+    free(renderer);
+}
+
+// Cancels in-flight tiles and restarts accumulation, waits at most one tile row per worker
+void TileRendererReset(TileRenderer *renderer, CpuCamera camera, bool jitter) {
+    pthread_mutex_lock(&renderer->lock);
+
+    renderer->resetting = true;
+    atomic_fetch_add(&renderer->generation, 1);
+
+    while (renderer->activeWorkers > 0) {
+        pthread_cond_wait(&renderer->idle, &renderer->lock);
+    }
+
+    size_t pixelCount = (size_t)renderer->width * renderer->height;
+
+    AccumBufferClear(&renderer->accum);
+    memset(renderer->lumaSq, 0, pixelCount * sizeof(float));
+    ClearCost(renderer, 0, pixelCount);
+
+    for (int i = 0; i < renderer->tileCount; i++) {
+        renderer->tiles[i].passes = 0;
+    }
+
+    renderer->camera = camera;
+    renderer->jitter = jitter;
+    renderer->pass = 0;
+    renderer->stats = (RayStats){ 0 };
+    BeginPass(renderer);
+
+    renderer->resetting = false;
+    pthread_cond_broadcast(&renderer->wake);
+
+    pthread_mutex_unlock(&renderer->lock);
+}
+
+// Current estimate as RGBA8 with the shader's gamma, untouched pixels stay black
+void TileRendererResolve(TileRenderer *renderer, unsigned char *rgba) {
+    AccumBufferResolve(&renderer->accum, rgba);
+}
+
+float TileRendererResolveHeatmap(TileRenderer *renderer, unsigned char *rgba, HeatmapMode mode) {
+    size_t pixelCount = (size_t)renderer->width * renderer->height;
+    int channel = mode - HEATMAP_TESTS;
+
+    // Mean cost per sample first, so the range is known before colouring
+    float *mean = renderer->heatmap;
+    float range = 0.0f;
+
+    for (size_t i = 0; i < pixelCount; i++) {
+        float samples = AccumBufferGet(&renderer->accum, (int)i).w;
+        unsigned int cost = atomic_load_explicit(&renderer->cost[i * COST_CHANNELS + channel], memory_order_relaxed);
+
+        mean[i] = samples > 0.0f ? (float)cost / samples : 0.0f;
+        range = fmaxf(range, mean[i]);
+    }
+
+    for (size_t i = 0; i < pixelCount; i++) {
+        Color colour = HeatmapColour(range > 0.0f ? mean[i] / range : 0.0f);
+        memcpy(&rgba[i * 4], &colour, 4);
+    }
+
+    return range;
+}
+
+void TileRendererWaitPasses(TileRenderer *renderer, int passes) {
+    pthread_mutex_lock(&renderer->lock);
+
+    while (renderer->pass < passes) {
+        pthread_cond_wait(&renderer->idle, &renderer->lock);
+    }
+
+    pthread_mutex_unlock(&renderer->lock);
+}
+
+RayStats TileRendererStats(TileRenderer *renderer) {
+    pthread_mutex_lock(&renderer->lock);
+    RayStats stats = renderer->stats;
+    pthread_mutex_unlock(&renderer->lock);
+
+    return stats;
+}
+
+int TileRendererPasses(TileRenderer *renderer) {
+    pthread_mutex_lock(&renderer->lock);
+    int passes = renderer->pass;
+    pthread_mutex_unlock(&renderer->lock);
+
+    return passes;
+}
+
+void TileRendererSetPassLimit(TileRenderer *renderer, int passLimit) {
+    pthread_mutex_lock(&renderer->lock);
+
+    renderer->passLimit = passLimit;
+
+    // A render that went idle at the old limit starts its next pass
+    if (renderer->finishedTiles == renderer->tileCount && (passLimit == 0 || renderer->pass < passLimit)) {
+        BeginPass(renderer);
+        pthread_cond_broadcast(&renderer->wake);
+    }
+
+    pthread_mutex_unlock(&renderer->lock);
+}
+
+void TileRendererPause(TileRenderer *renderer, bool paused) {
+    pthread_mutex_lock(&renderer->lock);
+
+    renderer->paused = paused;
+
+    if (paused) {
+        while (renderer->activeWorkers > 0) {
+            pthread_cond_wait(&renderer->idle, &renderer->lock);
+        }
+    } else {
+        pthread_cond_broadcast(&renderer->wake);
+    }
+
+    pthread_mutex_unlock(&renderer->lock);
+}
+
+#define BENCH_TILES_WIDTH 640
+#define BENCH_TILES_HEIGHT 360
+#define BENCH_TILES_PASSES 4
+
+// Samples per second over a few full passes, after one warm up pass
+static double MeasureTileRenderer(const CpuScene *scene, CpuCamera camera, int tileSize, int threads, bool numa) {
+    TileRenderer *renderer = TileRendererCreate(scene, camera.width, camera.height, tileSize, threads, TILE_ORDER_SPIRAL, numa, 0);
+    TileRendererReset(renderer, camera, true);
+    TileRendererWaitPasses(renderer, 1);
+
+    long long startSamples = atomic_load(&renderer->samplesTraced);
+    double start = Now();
+
+    TileRendererWaitPasses(renderer, 1 + BENCH_TILES_PASSES);
+
+    double elapsed = Now() - start;
+    long long samples = atomic_load(&renderer->samplesTraced) - startSamples;
+
+    TileRendererFree(renderer);
+
+    return samples / elapsed;
+}
+
+// Thread scaling with and without NUMA placement, doubling up to every core
+void BenchmarkTileRenderer(Scene scene, Camera camera, CliOptions options) {
+    CpuScene cpuScene = BuildCpuScene(scene);
+    CpuCamera cpuCamera = InitCpuCamera(camera.position, camera.fovy, BENCH_TILES_WIDTH, BENCH_TILES_HEIGHT);
+
+    int maxThreads = options.threads > 0 ? options.threads : CpuCount();
+    double baseline = 0.0;
+
+    printf("Tile renderer scaling, %dx%d, %d passes, %d NUMA node(s), %s kernels\n",
+        BENCH_TILES_WIDTH, BENCH_TILES_HEIGHT, BENCH_TILES_PASSES, NumaNodeCount(), cpuKernels.name);
+    printf("%8s %14s %14s %10s %10s\n", "threads", "Msamples/s", "NUMA Ms/s", "scaling", "NUMA gain");
+
+    for (int threads = 1; ; threads = threads * 2 < maxThreads ? threads * 2 : maxThreads) {
+        double plain = MeasureTileRenderer(&cpuScene, cpuCamera, options.tileSize, threads, false);
+        double numa = MeasureTileRenderer(&cpuScene, cpuCamera, options.tileSize, threads, true);
+
+        if (threads == 1) baseline = plain;
+
+        printf("%8d %14.2f %14.2f %9.2fx %9.2fx\n",
+            threads, plain / 1e6, numa / 1e6, plain / baseline, numa / plain);
+
+        if (threads == maxThreads) break;
+    }
+
+    CpuSceneFree(&cpuScene);
+}
@@ -0,0 +1,520 @@
+#include "../include/tilestream.h"
+#include "../include/cpukernels.h"
+#include "../include/cputracer.h"
+#include "../include/platform.h"
+#include "../include/tilerender.h"
+#include "raylib.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Wire format, server to viewer only, integers little endian:
+ *      header:     u32 type, u32 payload bytes
+ *      HELLO:      u32 protocol version, width, height, passes the render stops at (0 never)
+ *      TILE:       u32 x, y, width, height, passes rendered, encoding (0 raw, 1 deflate),
+ *                  then the tile's RGB rows top to bottom as deltas from the viewer's
+ *                  copy, each byte added modulo 256
+ *      DONE:       empty, the viewer now holds the final image
+ */
+typedef enum StreamMessage {
+    STREAM_HELLO = 1,
+    STREAM_TILE,
+    STREAM_DONE
+} StreamMessage;
+
+typedef enum StreamEncoding {
+    STREAM_RAW,
+    STREAM_DEFLATE
+} StreamEncoding;
+
+#define STREAM_HEADER_SIZE 8
+#define STREAM_HELLO_SIZE 16
+#define STREAM_TILE_HEADER 24
+
+typedef struct StreamServer {
+    TileRenderer *renderer;
+    int width;
+    int height;
+    int tileSize;
+    int passLimit;
+    double bytesPerSecond;  // Per viewer
+    atomic_int viewers;
+} StreamServer;
+
+typedef struct StreamViewer {
+    StreamServer *server;
+    NetSocket socket;
+    int id;
+} StreamViewer;
+
+typedef struct TileChange {
+    int x;
+    int y;
+    int width;
+    int height;
+    long long change;   // Summed absolute difference from the viewer's copy
+} TileChange;
+
+static void PutU32(unsigned char *bytes, uint32_t value) {
+    bytes[0] = (unsigned char)value;
+    bytes[1] = (unsigned char)(value >> 8);
+    bytes[2] = (unsigned char)(value >> 16);
+    bytes[3] = (unsigned char)(value >> 24);
+}
+
+static uint32_t GetU32(const unsigned char *bytes) {
+    return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 | (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+static bool SendStreamMessage(NetSocket socket, StreamMessage type, const void *payload, size_t size) {
+    unsigned char header[STREAM_HEADER_SIZE];
+    PutU32(header, type);
+    PutU32(header + 4, (uint32_t)size);
+
+    return NetSend(socket, header, sizeof(header)) && (size == 0 || NetSend(socket, payload, size));
+}
+
+static long long TileChangeSum(const unsigned char *rgba, const unsigned char *shown, int width, const TileChange *tile) {
+    long long sum = 0;
+
+    for (int y = tile->y; y < tile->y + tile->height; y++) {
+        const unsigned char *current = rgba + ((size_t)y * width + tile->x) * 4;
+        const unsigned char *old = shown + ((size_t)y * width + tile->x) * 3;
+
+        for (int x = 0; x < tile->width; x++) {
+            sum += abs(current[x * 4 + 0] - old[x * 3 + 0]) + abs(current[x * 4 + 1] - old[x * 3 + 1]) +
+                abs(current[x * 4 + 2] - old[x * 3 + 2]);
+        }
+    }
+
+    return sum;
+}
+
+// Most visible change first
+static int CompareChanges(const void *a, const void *b) {
+    long long changeA = ((const TileChange *)a)->change, changeB = ((const TileChange *)b)->change;
+
+    return (changeA < changeB) - (changeA > changeB);
+}
+
+// Fills payload with a TILE message body and moves the viewer's copy up to date, returns the payload size
+static size_t EncodeTile(const unsigned char *rgba, unsigned char *shown, int width, const TileChange *tile, int passes,
+    unsigned char *delta, unsigned char *payload) {
+    size_t size = 0;
+
+    // Pixels that did not change are runs of zeros, which is most of a converging tile
+    for (int y = tile->y; y < tile->y + tile->height; y++) {
+        const unsigned char *current = rgba + ((size_t)y * width + tile->x) * 4;
+        unsigned char *old = shown + ((size_t)y * width + tile->x) * 3;
+
+        for (int x = 0; x < tile->width; x++) {
+            for (int c = 0; c < 3; c++) {
+                delta[size++] = (unsigned char)(current[x * 4 + c] - old[x * 3 + c]);
+                old[x * 3 + c] = current[x * 4 + c];
+            }
+        }
+    }
+
+    int compressedSize = 0;
+    unsigned char *compressed = CompressData(delta, (int)size, &compressedSize);
+    bool deflated = compressed && (size_t)compressedSize < size;
+
+    uint32_t header[6] = { tile->x, tile->y, tile->width, tile->height, passes, deflated ? STREAM_DEFLATE : STREAM_RAW };
+
+    for (int i = 0; i < 6; i++) {
+        PutU32(payload + i * 4, header[i]);
+    }
+
+    memcpy(payload + STREAM_TILE_HEADER, deflated ? compressed : delta, deflated ? (size_t)compressedSize : size);
+
+    if (compressed) MemFree(compressed);
+
+    return STREAM_TILE_HEADER + (deflated ? (size_t)compressedSize : size);
+}
+
+static void *StreamToViewer(void *arg) {
+    StreamViewer *viewer = arg;
+    StreamServer *server = viewer->server;
+
+    int width = server->width, height = server->height, tileSize = server->tileSize;
+    int tilesX = (width + tileSize - 1) / tileSize, tilesY = (height + tileSize - 1) / tileSize;
+    size_t pixels = (size_t)width * height;
+
+    unsigned char *frame = malloc(pixels * 4);
+    unsigned char *shown = calloc(pixels * 3, 1);  // A new viewer starts out black
+    unsigned char *delta = malloc((size_t)tileSize * tileSize * 3);
+    unsigned char *payload = malloc(STREAM_TILE_HEADER + (size_t)tileSize * tileSize * 3);
+    TileChange *changes = malloc((size_t)tilesX * tilesY * sizeof(TileChange));
+
+    if (!frame || !shown || !delta || !payload || !changes) {
+        error("Out of memory streaming to a viewer.");
+    }
+
+    unsigned char hello[STREAM_HELLO_SIZE];
+    PutU32(hello, TILE_STREAM_VERSION);
+    PutU32(hello + 4, (uint32_t)width);
+    PutU32(hello + 8, (uint32_t)height);
+    PutU32(hello + 12, (uint32_t)server->passLimit);
+
+    bool ok = SendStreamMessage(viewer->socket, STREAM_HELLO, hello, sizeof(hello));
+    bool finished = false;
+
+    double tokens = server->bytesPerSecond * TILE_STREAM_BURST;
+    double lastRefill = Now();
+    long long bytesSent = 0, tilesSent = 0, intervals = 0;
+
+    while (ok) {
+        SleepMs(TILE_STREAM_INTERVAL_MS);
+
+        // Passes are read before resolving, so a finished render is never taken for a partial one
+        int passes = TileRendererPasses(server->renderer);
+        finished = server->passLimit > 0 && passes >= server->passLimit;
+
+        TileRendererResolve(server->renderer, frame);
+        intervals++;
+
+        double now = Now();
+        tokens = fmin(tokens + (now - lastRefill) * server->bytesPerSecond, server->bytesPerSecond * TILE_STREAM_BURST);
+        lastRefill = now;
+
+        int count = 0;
+
+        for (int ty = 0; ty < tilesY; ty++) {
+            for (int tx = 0; tx < tilesX; tx++) {
+                TileChange tile = {
+                    .x = tx * tileSize,
+                    .y = ty * tileSize,
+                    .width = tx * tileSize + tileSize > width ? width - tx * tileSize : tileSize,
+                    .height = ty * tileSize + tileSize > height ? height - ty * tileSize : tileSize
+                };
+
+                tile.change = TileChangeSum(frame, shown, width, &tile);
+
+                // Sample noise moves every tile a little each pass, only the final image gets every last difference
+                double threshold = finished ? 1.0 : TILE_STREAM_MIN_CHANGE * tile.width * tile.height * 3;
+
+                if (tile.change >= threshold) {
+                    changes[count++] = tile;
+                }
+            }
+        }
+
+        if (count == 0 && finished) {
+            ok = SendStreamMessage(viewer->socket, STREAM_DONE, NULL, 0);
+            break;
+        }
+
+        qsort(changes, count, sizeof(TileChange), CompareChanges);
+
+        // A tile may overdraw the budget, the next interval pays it back
+        for (int i = 0; i < count && tokens > 0.0 && ok; i++) {
+            size_t size = EncodeTile(frame, shown, width, &changes[i], passes, delta, payload);
+            ok = SendStreamMessage(viewer->socket, STREAM_TILE, payload, size);
+
+            tokens -= (double)(size + STREAM_HEADER_SIZE);
+            bytesSent += (long long)(size + STREAM_HEADER_SIZE);
+            tilesSent++;
+        }
+    }
+
+    double whole = (double)intervals * pixels * 3;
+
+    printf("Viewer %d %s: %lld tiles, %.2f MiB, %.1f%% of sending every frame whole\n", viewer->id,
+        ok && finished ? "has the final image" : "disconnected", tilesSent, bytesSent / (1024.0 * 1024.0),
+        whole > 0.0 ? 100.0 * bytesSent / whole : 0.0);
+
+    NetClose(viewer->socket);
+
+    free(frame);
+    free(shown);
+    free(delta);
+    free(payload);
+    free(changes);
+    free(viewer);
+
+    return NULL;
+}
+
+void RunTileStreamServer(Scene scene, Camera camera, CliOptions options) {
+    // Viewers come and go long after startup, their log lines should show up as they happen
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    if (!NetInit()) {
+        error("Failed to initialise sockets.");
+    }
+
+    NetSocket server = NetListen(options.tileStreamPort, false);
+    if (server == NET_INVALID_SOCKET) {
+        error("Failed to listen on the stream port.");
+    }
+
+    CpuScene cpuScene = BuildCpuScene(scene);
+    int threads = options.threads > 0 ? options.threads : CpuCount();
+
+    TileRenderer *renderer = TileRendererCreate(&cpuScene, options.width, options.height,
+        options.tileSize, threads, TileOrderFromName(options.tileOrder), options.numa, options.seed);
+
+    TileRendererSetPassLimit(renderer, options.samples);
+    TileRendererReset(renderer, InitCpuCamera(camera.position, camera.fovy, options.width, options.height), true);
+
+    StreamServer stream = {
+        .renderer = renderer,
+        .width = options.width,
+        .height = options.height,
+        .tileSize = options.tileSize,
+        .passLimit = options.samples,
+        .bytesPerSecond = options.streamKbps * 1000.0 / 8.0
+    };
+
+    printf("Streaming %dx%d to %d spp on port %d, %d kbit/s per viewer (%s kernels)\n",
+        options.width, options.height, options.samples, options.tileStreamPort, options.streamKbps, cpuKernels.name);
+
+    // Serves until the process is killed, viewers that join after the render finished get the final image
+    for (;;) {
+        NetSocket client = NetAccept(server);
+        if (client == NET_INVALID_SOCKET) continue;
+
+        StreamViewer *viewer = malloc(sizeof(StreamViewer));
+        if (!viewer) {
+            error("Out of memory accepting a viewer.");
+        }
+
+        *viewer = (StreamViewer){ &stream, client, atomic_fetch_add(&stream.viewers, 1) + 1 };
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, StreamToViewer, viewer) != 0) {
+            NetClose(client);
+            free(viewer);
+
+            continue;
+        }
+
+        pthread_detach(thread);
+        printf("Viewer %d connected\n", viewer->id);
+    }
+}
+
+// Shared between the window and the thread reading the stream
+typedef struct StreamView {
+    NetSocket socket;
+    int width;
+    int height;
+    int passLimit;
+
+    pthread_mutex_t lock;
+    unsigned char *pixels;  // RGBA, alpha always 255
+    bool dirty;
+    bool done;
+    bool lost;
+    int passes;
+    long long bytes;
+    long long tiles;
+} StreamView;
+
+static bool ApplyTile(StreamView *view, const unsigned char *payload, size_t size) {
+    if (size < STREAM_TILE_HEADER) return false;
+
+    uint32_t x = GetU32(payload), y = GetU32(payload + 4);
+    uint32_t width = GetU32(payload + 8), height = GetU32(payload + 12);
+    uint32_t passes = GetU32(payload + 16), encoding = GetU32(payload + 20);
+
+    if (width == 0 || height == 0 || x >= (uint32_t)view->width || y >= (uint32_t)view->height ||
+        width > (uint32_t)view->width - x || height > (uint32_t)view->height - y) {
+        return false;
+    }
+
+    size_t rawSize = (size_t)width * height * 3;
+    const unsigned char *data = payload + STREAM_TILE_HEADER;
+    unsigned char *inflated = NULL;
+
+    if (encoding == STREAM_DEFLATE) {
+        int inflatedSize = 0;
+        inflated = DecompressData(data, (int)(size - STREAM_TILE_HEADER), &inflatedSize);
+
+        if (!inflated || (size_t)inflatedSize != rawSize) {
+            if (inflated) MemFree(inflated);
+            return false;
+        }
+
+        data = inflated;
+    } else if (encoding != STREAM_RAW || size - STREAM_TILE_HEADER != rawSize) {
+        return false;
+    }
+
+    pthread_mutex_lock(&view->lock);
+
+    for (uint32_t row = 0; row < height; row++) {
+        unsigned char *out = view->pixels + ((size_t)(y + row) * view->width + x) * 4;
+        const unsigned char *in = data + (size_t)row * width * 3;
+
+        for (uint32_t i = 0; i < width; i++) {
+            out[i * 4 + 0] += in[i * 3 + 0];
+            out[i * 4 + 1] += in[i * 3 + 1];
+            out[i * 4 + 2] += in[i * 3 + 2];
+        }
+    }
+
+    view->dirty = true;
+    view->passes = (int)passes;
+    view->bytes += (long long)(size + STREAM_HEADER_SIZE);
+    view->tiles++;
+
+    pthread_mutex_unlock(&view->lock);
+
+    if (inflated) MemFree(inflated);
+
+    return true;
+}
+
+static void *ReceiveStream(void *arg) {
+    StreamView *view = arg;
+    size_t maxPayload = STREAM_TILE_HEADER + (size_t)view->width * view->height * 3;
+    unsigned char *payload = malloc(maxPayload);
+    bool done = false;
+
+    for (;;) {
+        unsigned char header[STREAM_HEADER_SIZE];
+        if (!payload || !NetRecv(view->socket, header, sizeof(header))) break;
+
+        StreamMessage type = (StreamMessage)GetU32(header);
+        size_t size = GetU32(header + 4);
+
+        if (type == STREAM_DONE) {
+            done = true;
+            break;
+        }
+
+        if (type != STREAM_TILE || size > maxPayload || !NetRecv(view->socket, payload, size) || !ApplyTile(view, payload, size)) {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&view->lock);
+    view->done = done;
+    view->lost = !done;
+    pthread_mutex_unlock(&view->lock);
+
+    free(payload);
+
+    return NULL;
+}
+
+void RunTileStreamViewer(CliOptions options) {
+    if (!NetInit()) {
+        error("Failed to initialise sockets.");
+    }
+
+    char host[256];
+    const char *colon = strrchr(options.viewAddress, ':');
+
+    if (!colon || colon == options.viewAddress || (size_t)(colon - options.viewAddress) >= sizeof(host) || atoi(colon + 1) <= 0) {
+        error("--view expects host:port.");
+    }
+
+    memcpy(host, options.viewAddress, colon - options.viewAddress);
+    host[colon - options.viewAddress] = '\0';
+
+    NetSocket socket = NetConnect(host, atoi(colon + 1));
+    if (socket == NET_INVALID_SOCKET) {
+        error("Could not reach the stream.");
+    }
+
+    unsigned char header[STREAM_HEADER_SIZE], hello[STREAM_HELLO_SIZE];
+
+    if (!NetRecv(socket, header, sizeof(header)) || GetU32(header) != STREAM_HELLO || GetU32(header + 4) != sizeof(hello) ||
+        !NetRecv(socket, hello, sizeof(hello)) || GetU32(hello) != TILE_STREAM_VERSION) {
+        error("The stream did not start with a compatible hello.");
+    }
+
+    StreamView view = {
+        .socket = socket,
+        .width = (int)GetU32(hello + 4),
+        .height = (int)GetU32(hello + 8),
+        .passLimit = (int)GetU32(hello + 12)
+    };
+
+    if (view.width <= 0 || view.height <= 0 || view.width > 65536 || view.height > 65536) {
+        error("The stream announced an impossible image size.");
+    }
+
+    view.pixels = malloc((size_t)view.width * view.height * 4);
+    if (!view.pixels) {
+        error("Out of memory allocating the stream view.");
+    }
+
+    // Black and opaque, which is what the server assumes a new viewer shows
+    for (size_t i = 0; i < (size_t)view.width * view.height; i++) {
+        memcpy(view.pixels + i * 4, (unsigned char[4]){ 0, 0, 0, 255 }, 4);
+    }
+
+    pthread_mutex_init(&view.lock, NULL);
+
+    InitWindow(view.width, view.height, "Simple Raytracer (stream)");
+    SetTargetFPS(60);
+
+    Image image = {
+        .data = view.pixels,
+        .width = view.width,
+        .height = view.height,
+        .mipmaps = 1,
+        .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8
+    };
+
+    Texture2D texture = LoadTextureFromImage(image);
+
+    pthread_t receiver;
+    pthread_create(&receiver, NULL, ReceiveStream, &view);
+
+    long long lastBytes = 0;
+    double lastTime = GetTime();
+    double kbps = 0.0;
+
+    while (!WindowShouldClose()) {
+        pthread_mutex_lock(&view.lock);
+
+        if (view.dirty) {
+            UpdateTexture(texture, view.pixels);
+            view.dirty = false;
+        }
+
+        int passes = view.passes;
+        long long bytes = view.bytes, tiles = view.tiles;
+        bool done = view.done, lost = view.lost;
+
+        pthread_mutex_unlock(&view.lock);
+
+        double now = GetTime();
+        if (now - lastTime >= 0.5) {
+            kbps = (bytes - lastBytes) * 8.0 / 1000.0 / (now - lastTime);
+            lastBytes = bytes;
+            lastTime = now;
+        }
+
+        BeginDrawing();
+            ClearBackground(BLACK);
+            DrawTexture(texture, 0, 0, WHITE);
+
+            DrawFPS(5, 5);
+            DrawText(TextFormat("Passes: %d/%d", passes, view.passLimit), 5, 50, 20, PURPLE);
+            DrawText(TextFormat("Stream: %.0f kbit/s, %lld tiles, %.2f MiB", kbps, tiles, bytes / (1024.0 * 1024.0)), 5, 75, 20, PURPLE);
+
+            if (done) DrawText("Final image", 5, 100, 20, GREEN);
+            if (lost) DrawText("Stream lost", 5, 100, 20, RED);
+        EndDrawing();
+    }
+
+    // Closing the socket wakes the receiver out of its read
+    NetClose(socket);
+    pthread_join(receiver, NULL);
+
+    UnloadTexture(texture);
+    CloseWindow();
+
+    pthread_mutex_destroy(&view.lock);
+    free(view.pixels);
+}
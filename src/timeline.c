@@ -0,0 +1,189 @@
+#include "../include/timeline.h"
+#include "../include/helpers.h"
+#include "../include/platform.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static atomic_bool enabled;
+static const char *outputPath;
+static double epoch;
+
+// Rings of exited threads are handed to the next new thread. Claiming a ring, naming a thread and dumping
+// take the lock, recording never does
+static pthread_mutex_t ringLock = PTHREAD_MUTEX_INITIALIZER;
+static TimelineRing *rings[TIMELINE_MAX_THREADS];
+static int ringCount;
+static int nextTid;
+static pthread_once_t ringKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t ringKey;
+static TimelineRing *freeRings[TIMELINE_MAX_THREADS];
+static int freeCount;
+
+static _Thread_local TimelineRing *threadRing;
+static _Thread_local bool threadDropped;   // Arrived after every ring was taken
+
+static void WriteAtExit(void) {
+    if (!TimelineWrite()) {
+        fprintf(stderr, "Failed to write the timeline to %s\n", outputPath);
+    }
+}
+
+void TimelineStart(const char *path) {
+    outputPath = path;
+    epoch = Now();
+
+    atomic_store(&enabled, true);
+    TimelineThreadName("main");
+
+    atexit(WriteAtExit);
+}
+
+bool TimelineEnabled(void) {
+    return atomic_load_explicit(&enabled, memory_order_relaxed);
+}
+
+static void ReleaseRing(void *ring) {
+    pthread_mutex_lock(&ringLock);
+    freeRings[freeCount++] = ring;
+    pthread_mutex_unlock(&ringLock);
+}
+
+static void CreateRingKey(void) {
+    pthread_key_create(&ringKey, ReleaseRing);
+}
+
+static TimelineLife *CurrentLife(TimelineRing *ring) {
+    return &ring->lives[(ring->lifeCount - 1) % TIMELINE_RING_LIVES];
+}
+
+// Claims a ring on the thread's first zone. Rings are never freed, so the dump can read the zones of
+// threads that are gone, and short lived pool threads reuse them instead of piling up new ones.
+// Each thread starts a new life with a tid of its own, so earlier zones keep their thread's name
+static TimelineRing *ThreadRing(void) {
+    if (threadRing || threadDropped) return threadRing;
+
+    pthread_once(&ringKeyOnce, CreateRingKey);
+    pthread_mutex_lock(&ringLock);
+
+    TimelineRing *ring = freeCount > 0 ? freeRings[--freeCount] : NULL;
+
+    if (!ring && ringCount < TIMELINE_MAX_THREADS && (ring = calloc(1, sizeof(TimelineRing)))) {
+        rings[ringCount++] = ring;
+    }
+
+    if (ring) {
+        TimelineLife *life = &ring->lives[ring->lifeCount++ % TIMELINE_RING_LIVES];
+
+        life->firstEvent = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        life->tid = nextTid++;
+        snprintf(life->threadName, sizeof(life->threadName), "thread %d", life->tid);
+    }
+
+    pthread_mutex_unlock(&ringLock);
+
+    if (!ring) {
+        threadDropped = true;
+        return NULL;
+    }
+
+    pthread_setspecific(ringKey, ring);
+    threadRing = ring;
+
+    return ring;
+}
+
+void TimelineThreadName(const char *name) {
+    if (!TimelineEnabled()) return;
+
+    TimelineRing *ring = ThreadRing();
+    if (!ring) return;
+
+    pthread_mutex_lock(&ringLock);
+    snprintf(CurrentLife(ring)->threadName, sizeof(CurrentLife(ring)->threadName), "%s", name);
+    pthread_mutex_unlock(&ringLock);
+}
+
+TimelineZone TimelineBegin(const char *name, int arg) {
+    TimelineZone zone = { name, 0.0, arg };
+
+    if (TimelineEnabled()) {
+        zone.start = Now();
+    }
+
+    return zone;
+}
+
+void TimelineEnd(TimelineZone zone) {
+    if (!TimelineEnabled() || zone.start == 0.0) return;
+
+    TimelineRing *ring = ThreadRing();
+    if (!ring) return;
+
+    long long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    ring->events[head % TIMELINE_RING_EVENTS] = (TimelineEvent){ zone.name, zone.start, Now(), zone.arg };
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// Call with the ring lock held, the events from firstEvent up to end under one thread's name
+static void WriteLife(FILE *file, TimelineRing *ring, const TimelineLife *life, long long end, bool *first) {
+    fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+        *first ? "" : ",", life->tid, life->threadName);
+    *first = false;
+
+    long long oldest = end > TIMELINE_RING_EVENTS ? end - TIMELINE_RING_EVENTS : 0;
+    if (oldest < life->firstEvent) oldest = life->firstEvent;
+
+    for (long long i = oldest; i < end; i++) {
+        TimelineEvent event = ring->events[i % TIMELINE_RING_EVENTS];
+
+        // The slot is rewritten once the writer records event i + TIMELINE_RING_EVENTS, so the copy may be torn
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&ring->head, memory_order_relaxed) >= i + TIMELINE_RING_EVENTS) continue;
+
+        fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+            event.name, life->tid, (event.start - epoch) * 1e6, (event.end - event.start) * 1e6);
+
+        if (event.arg >= 0) {
+            fprintf(file, ",\"args\":{\"index\":%d}", event.arg);
+        }
+
+        fprintf(file, "}");
+    }
+}
+
+static void WriteRing(FILE *file, TimelineRing *ring, bool *first) {
+    long long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    long long firstLife = ring->lifeCount > TIMELINE_RING_LIVES ? ring->lifeCount - TIMELINE_RING_LIVES : 0;
+
+    for (long long i = firstLife; i < ring->lifeCount; i++) {
+        long long end = i + 1 < ring->lifeCount ? ring->lives[(i + 1) % TIMELINE_RING_LIVES].firstEvent : head;
+        WriteLife(file, ring, &ring->lives[i % TIMELINE_RING_LIVES], end, first);
+    }
+}
+
+bool TimelineWrite(void) {
+    if (!TimelineEnabled()) return true;
+
+    FILE *file = fopen(outputPath, "w");
+    if (!file) return false;
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+    bool first = true;
+
+    pthread_mutex_lock(&ringLock);
+
+    for (int i = 0; i < ringCount; i++) {
+        WriteRing(file, rings[i], &first);
+    }
+
+    pthread_mutex_unlock(&ringLock);
+
+    fprintf(file, "\n]}\n");
+
+    bool ok = !ferror(file);
+    return fclose(file) == 0 && ok;
+}
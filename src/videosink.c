@@ -0,0 +1,232 @@
+#include "../include/videosink.h"
+#include "../include/cpukernels.h"
+#include "../include/helpers.h"
+#include "../include/platform.h"
+#include "../include/timeline.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+VideoFormat VideoFormatFromName(const char *name, const char *path) {
+    if (name == NULL) {
+        return PathHasExtension(path, "rgb") || PathHasExtension(path, "raw") ? VIDEO_FORMAT_RGB : VIDEO_FORMAT_Y4M;
+    }
+
+    if (strcmp(name, "y4m") == 0) return VIDEO_FORMAT_Y4M;
+    if (strcmp(name, "rgb") == 0) return VIDEO_FORMAT_RGB;
+
+    error("Unknown video format, expected y4m or rgb.");
+    return VIDEO_FORMAT_Y4M;
+}
+
+static size_t ConvertedBytes(const VideoSink *sink) {
+    size_t pixels = (size_t)sink->width * sink->height;
+    size_t chroma = (size_t)((sink->width + 1) / 2) * ((sink->height + 1) / 2);
+
+    return sink->format == VIDEO_FORMAT_Y4M ? pixels + 2 * chroma : pixels * 3;
+}
+
+// Runs on the writer thread
+static bool WriteVideoFrame(VideoSink *sink, const unsigned char *rgba) {
+    int width = sink->width, height = sink->height;
+    unsigned char *out = sink->converted;
+
+    if (sink->format == VIDEO_FORMAT_RGB) {
+        for (size_t i = 0; i < (size_t)width * height; i++) {
+            memcpy(out + i * 3, rgba + i * 4, 3);
+        }
+    } else {
+        int chromaWidth = (width + 1) / 2;
+        unsigned char *yPlane = out;
+        unsigned char *uPlane = yPlane + (size_t)width * height;
+        unsigned char *vPlane = uPlane + (size_t)chromaWidth * ((height + 1) / 2);
+
+        // Rows go in pairs, an odd last row pairs with itself
+        for (int y = 0; y < height; y += 2) {
+            int y1 = y + 1 < height ? y + 1 : y;
+
+            cpuKernels.rgbaToYuv420(rgba + (size_t)y * width * 4, rgba + (size_t)y1 * width * 4, width,
+                yPlane + (size_t)y * width, yPlane + (size_t)y1 * width,
+                uPlane + (size_t)(y / 2) * chromaWidth, vPlane + (size_t)(y / 2) * chromaWidth);
+        }
+
+        if (fputs("FRAME\n", sink->file) == EOF) return false;
+    }
+
+    return fwrite(out, 1, ConvertedBytes(sink), sink->file) == ConvertedBytes(sink);
+}
+
+static void *VideoWriter(void *arg) {
+    VideoSink *sink = arg;
+
+    TimelineThreadName("video writer");
+    pthread_mutex_lock(&sink->lock);
+
+    for (;;) {
+        int slot = (int)(sink->next % VIDEO_SINK_SLOTS);
+        bool ready = sink->states[slot] == VIDEO_SLOT_READY && sink->indices[slot] == sink->next;
+
+        if (!ready) {
+            if (sink->closing) break;
+
+            pthread_cond_wait(&sink->cond, &sink->lock);
+            continue;
+        }
+
+        sink->states[slot] = VIDEO_SLOT_WRITING;
+        bool failed = sink->failed;
+
+        pthread_mutex_unlock(&sink->lock);
+
+        // After a failed write the frames are still consumed so submitters never block on a dead sink
+        TimelineZone zone = TimelineBegin("video frame", (int)sink->next);
+        bool ok = failed || WriteVideoFrame(sink, sink->slots[slot]);
+        TimelineEnd(zone);
+
+        pthread_mutex_lock(&sink->lock);
+
+        if (!ok) {
+            fprintf(stderr, "Video: writing to %s failed, recording stopped\n", sink->path);
+            sink->failed = true;
+        }
+
+        sink->written += !failed && ok;
+        sink->states[slot] = VIDEO_SLOT_FREE;
+        sink->next++;
+
+        pthread_cond_broadcast(&sink->cond);
+    }
+
+    pthread_mutex_unlock(&sink->lock);
+
+    return NULL;
+}
+
+VideoSink *VideoSinkOpen(const char *path, VideoFormat format, int width, int height, int fps) {
+    VideoSink *sink = calloc(1, sizeof(VideoSink));
+    if (!sink) {
+        error("Out of memory allocating video sink.");
+    }
+
+    sink->path = path;
+    sink->pipe = path[0] == '|';
+    sink->format = format;
+    sink->width = width;
+    sink->height = height;
+    sink->fps = fps;
+
+    sink->file = sink->pipe ? OpenPipe(path + 1) : fopen(path, "wb");
+    if (!sink->file) {
+        error("Failed to open the video output.");
+    }
+
+    if (format == VIDEO_FORMAT_Y4M) {
+        // C420jpeg is 2x2 averaged chroma, sited between the luma samples
+        fprintf(sink->file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg XCOLORRANGE=LIMITED\n", width, height, fps);
+    }
+
+    for (int i = 0; i < VIDEO_SINK_SLOTS; i++) {
+        sink->slots[i] = malloc((size_t)width * height * 4);
+        sink->states[i] = VIDEO_SLOT_FREE;
+
+        if (!sink->slots[i]) {
+            error("Out of memory allocating video frames.");
+        }
+    }
+
+    sink->converted = malloc(ConvertedBytes(sink));
+    if (!sink->converted) {
+        error("Out of memory allocating video frames.");
+    }
+
+    pthread_mutex_init(&sink->lock, NULL);
+    pthread_cond_init(&sink->cond, NULL);
+    pthread_create(&sink->writer, NULL, VideoWriter, sink);
+
+    printf("Recording %dx%d %s at %d fps to %s\n", width, height,
+        format == VIDEO_FORMAT_Y4M ? "y4m 4:2:0" : "raw rgb24", fps, path);
+
+    return sink;
+}
+
+bool VideoSinkSubmit(VideoSink *sink, long long index, const unsigned char *rgba, bool bottomUp) {
+    pthread_mutex_lock(&sink->lock);
+
+    if (index < 0) {
+        index = sink->submitted;
+
+        if (sink->failed || sink->states[index % VIDEO_SINK_SLOTS] != VIDEO_SLOT_FREE) {
+            sink->dropped += !sink->failed;
+            pthread_mutex_unlock(&sink->lock);
+
+            return false;
+        }
+
+        sink->submitted++;
+    } else {
+        // Later frames wait for the ones before them to be written, in the order the writer needs
+        while (!sink->failed && (sink->states[index % VIDEO_SINK_SLOTS] != VIDEO_SLOT_FREE || index >= sink->next + VIDEO_SINK_SLOTS)) {
+            pthread_cond_wait(&sink->cond, &sink->lock);
+        }
+
+        if (sink->failed) {
+            pthread_mutex_unlock(&sink->lock);
+            return false;
+        }
+    }
+
+    int slot = (int)(index % VIDEO_SINK_SLOTS);
+    sink->states[slot] = VIDEO_SLOT_FILLING;
+    sink->indices[slot] = index;
+
+    pthread_mutex_unlock(&sink->lock);
+
+    // The copy happens outside the lock, only this submitter owns a filling slot
+    size_t stride = (size_t)sink->width * 4;
+
+    if (bottomUp) {
+        for (int y = 0; y < sink->height; y++) {
+            memcpy(sink->slots[slot] + y * stride, rgba + (size_t)(sink->height - 1 - y) * stride, stride);
+        }
+    } else {
+        memcpy(sink->slots[slot], rgba, stride * sink->height);
+    }
+
+    pthread_mutex_lock(&sink->lock);
+
+    sink->states[slot] = VIDEO_SLOT_READY;
+    pthread_cond_broadcast(&sink->cond);
+
+    pthread_mutex_unlock(&sink->lock);
+
+    return true;
+}
+
+void VideoSinkClose(VideoSink *sink) {
+    if (!sink) return;
+
+    pthread_mutex_lock(&sink->lock);
+    sink->closing = true;
+    pthread_cond_broadcast(&sink->cond);
+    pthread_mutex_unlock(&sink->lock);
+
+    pthread_join(sink->writer, NULL);
+
+    int status = sink->pipe ? ClosePipe(sink->file) : fclose(sink->file);
+
+    printf("Wrote %lld video frames to %s, %lld dropped\n", sink->written, sink->path, sink->dropped);
+
+    if (status != 0) {
+        fprintf(stderr, "Video: %s did not finish cleanly\n", sink->path);
+    }
+
+    for (int i = 0; i < VIDEO_SINK_SLOTS; i++) {
+        free(sink->slots[i]);
+    }
+
+    pthread_mutex_destroy(&sink->lock);
+    pthread_cond_destroy(&sink->cond);
+
+    free(sink->converted);
+    free(sink);
+}